@@ -12,6 +12,9 @@
 const AbundanceType kAbundanceNotSet = -1;
 const MetallicityType kMetallicityNotSet = 99;
 
+// Lowest metallicity (log10 relative to solar), given to metal-free particles (e.g. primordial gas)
+const MetallicityType kMinMetallicity = -10;
+
 // Enumerator to clarify the mapping between array index and elements in abundance arrays
 enum Element {
     HYDROGEN,
@@ -28,6 +31,14 @@ enum Element {
     NUM_ELEMENTS
 };
 
+// Chemical symbols of the elements above, in the same order (e.g. to name abundance fields)
+const char *const kElementSymbols[NUM_ELEMENTS] = {"H", "He", "C", "N", "O", "Ne", "Mg", "Si", "S",
+                                                   "Ca", "Fe"};
+
+// Standard atomic weights of the elements above, in atomic mass units (e.g. for thermal broadening)
+const double kElementAtomicWeights[NUM_ELEMENTS] = {1.008, 4.0026, 12.011, 14.007, 15.999, 20.180,
+                                                    24.305, 28.085, 32.06, 40.078, 55.845};
+
 // BaryonicParticle, derived from Particle, is an intermediate class that serves as a base for
 // the GasParticle and StarParticle classes.  It inherits ID, mass, position, velocity and adds a
 // metallicity (abundance of elements heavier than Helium relative to the Sun) and an array of mass
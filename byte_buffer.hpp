@@ -0,0 +1,69 @@
+// Defines functions to pack values into a string of bytes and unpack them again, used to send
+// partial results between processes
+
+#ifndef byte_buffer_hpp
+#define byte_buffer_hpp
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Appends the bytes of [value], a trivially copyable type, to [bytes].  Values are packed in the
+// native byte order, so they can only be unpacked by the same build on the same kind of machine.
+template <typename Type>
+void AppendBytes(std::string &bytes, const Type &value) {
+    static_assert(std::is_trivially_copyable<Type>::value, "AppendBytes: Type can't be copied");
+    bytes.append(reinterpret_cast<const char *>(&value), sizeof(Type));
+}
+
+// As above, for a vector, preceded by its size
+template <typename Type>
+void AppendBytes(std::string &bytes, const std::vector<Type> &values) {
+    static_assert(std::is_trivially_copyable<Type>::value, "AppendBytes: Type can't be copied");
+    AppendBytes(bytes, values.size());
+    bytes.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(Type));
+}
+
+// As above, for a string (e.g. bytes packed by another call), preceded by its size
+inline void AppendBytes(std::string &bytes, const std::string &value) {
+    AppendBytes(bytes, value.size());
+    bytes.append(value);
+}
+
+// Unpacks [value] from [bytes] at [offset], which is advanced past it.  Throws std::runtime_error
+// if [bytes] ends first.
+template <typename Type>
+void ReadBytes(const std::string &bytes, size_t &offset, Type &value) {
+    static_assert(std::is_trivially_copyable<Type>::value, "ReadBytes: Type can't be copied");
+    if (offset > bytes.size() || bytes.size() - offset < sizeof(Type))
+        throw std::runtime_error("ReadBytes: Unexpected end of bytes");
+    std::memcpy(&value, bytes.data() + offset, sizeof(Type));
+    offset += sizeof(Type);
+}
+
+// As above, for a vector packed with its size (resized to fit)
+template <typename Type>
+void ReadBytes(const std::string &bytes, size_t &offset, std::vector<Type> &values) {
+    static_assert(std::is_trivially_copyable<Type>::value, "ReadBytes: Type can't be copied");
+    size_t num_values;
+    ReadBytes(bytes, offset, num_values);
+    if (offset > bytes.size() || (bytes.size() - offset) / sizeof(Type) < num_values)
+        throw std::runtime_error("ReadBytes: Unexpected end of bytes");
+    values.resize(num_values);
+    std::memcpy(values.data(), bytes.data() + offset, num_values * sizeof(Type));
+    offset += num_values * sizeof(Type);
+}
+
+// As above, for a string packed with its size
+inline void ReadBytes(const std::string &bytes, size_t &offset, std::string &value) {
+    size_t num_bytes;
+    ReadBytes(bytes, offset, num_bytes);
+    if (offset > bytes.size() || bytes.size() - offset < num_bytes)
+        throw std::runtime_error("ReadBytes: Unexpected end of bytes");
+    value.assign(bytes, offset, num_bytes);
+    offset += num_bytes;
+}
+
+#endif // byte_buffer_hpp
@@ -0,0 +1,113 @@
+// Implementation of the CellGrid class
+
+#include "cell_grid.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "globals.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Cells are widened if there would be more than this many per particle
+const size_t kMaxCellsPerParticle = 4;
+
+// Number of particles assigned to cells by each task
+const size_t kCellGridBlockSize = 65536;
+
+CellGrid::CellGrid(const ParticleStore &particles, LengthType cell_size, ThreadPool &pool) :
+periodic_box_size_(particles.GetPeriodicBoxSize()) {
+    if (!(cell_size > 0))
+        throw std::invalid_argument("CellGrid: Cell size must be positive");
+    size_t num_particles = particles.size();
+
+    // The grid covers the periodic box, or else the bounding box of the particles
+    PosCoordsType extent;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        origin_[idim] = 0;
+        extent[idim]  = periodic_box_size_;
+        if (periodic_box_size_ <= 0 && num_particles > 0) {
+            const LengthType *positions = particles.position[idim].data();
+            auto bounds   = std::minmax_element(positions, positions + num_particles);
+            origin_[idim] = *bounds.first;
+            extent[idim]  = *bounds.second - *bounds.first;
+        }
+    }
+    size_t max_num_cells = std::max(num_particles, size_t(1)) * kMaxCellsPerParticle;
+    while (true) {
+        double num_cells = 1;
+        for (int idim = 0; idim < kNDims; ++idim) {
+            if (periodic_box_size_ > 0) {
+                num_cells_[idim]   = std::max(1L, long(std::floor(extent[idim] / cell_size)));
+                cell_widths_[idim] = extent[idim] / num_cells_[idim];
+            } else {
+                num_cells_[idim]   = std::max(1L, long(std::ceil(extent[idim] / cell_size)));
+                cell_widths_[idim] = cell_size;
+            }
+            num_cells *= num_cells_[idim];
+        }
+        if (num_cells <= max_num_cells)
+            break;
+        cell_size *= 1.25;
+    }
+    size_t total_num_cells = 1;
+    for (int idim = 0; idim < kNDims; ++idim)
+        total_num_cells *= num_cells_[idim];
+
+    // Find the cell of each particle in parallel
+    std::vector<size_t> particle_cells(num_particles);
+    size_t num_blocks = (num_particles + kCellGridBlockSize - 1) / kCellGridBlockSize;
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t first = iblock * kCellGridBlockSize;
+        size_t last  = std::min(first + kCellGridBlockSize, num_particles);
+        for (size_t ipart = first; ipart < last; ++ipart) {
+            size_t icell = 0;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                LengthType position = WrapPosition(particles.position[idim][ipart],
+                                                   periodic_box_size_);
+                long coord = std::floor((position - origin_[idim]) / cell_widths_[idim]);
+                coord      = std::min(std::max(coord, 0L), num_cells_[idim] - 1);
+                icell      = icell * num_cells_[idim] + coord;
+            }
+            particle_cells[ipart] = icell;
+        }
+    });
+
+    // Sort the particles by cell (a counting sort, which keeps the store's order within each cell)
+    cell_starts_.assign(total_num_cells + 1, 0);
+    for (size_t icell : particle_cells)
+        ++cell_starts_[icell + 1];
+    for (size_t icell = 0; icell < total_num_cells; ++icell)
+        cell_starts_[icell + 1] += cell_starts_[icell];
+    std::vector<size_t> next_slots(cell_starts_.begin(), cell_starts_.end() - 1);
+    order_.resize(num_particles);
+    for (size_t ipart = 0; ipart < num_particles; ++ipart)
+        order_[next_slots[particle_cells[ipart]]++] = ipart;
+
+    // Keep the positions in grid order
+    for (int idim = 0; idim < kNDims; ++idim)
+        positions_[idim].resize(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t first = iblock * kCellGridBlockSize;
+        size_t last  = std::min(first + kCellGridBlockSize, num_particles);
+        for (int idim = 0; idim < kNDims; ++idim) {
+            const LengthType *positions = particles.position[idim].data();
+            for (size_t ipart = first; ipart < last; ++ipart)
+                positions_[idim][ipart] = positions[order_[ipart]];
+        }
+    });
+}
+
+// Returns the particles with a distance from [centre] of at most [radius]
+Selection CellGrid::SelectSphere(const PosCoordsType &centre, LengthType radius) const {
+    std::vector<size_t> indices;
+    ForEachInSphere(centre, radius, [&indices](size_t index) { indices.push_back(index); });
+    std::sort(indices.begin(), indices.end());
+    return Selection::FromIndices(indices, size());
+}
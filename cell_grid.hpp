@@ -0,0 +1,108 @@
+// Interface for the CellGrid class
+
+#ifndef cell_grid_hpp
+#define cell_grid_hpp
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "globals.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Fraction of a cell by which sphere queries are widened, so that rounding never misses a cell
+const double kCellGridTolerance = 1e-6;
+
+// A uniform grid of cells over the particles of one store, with the particles of each cell held
+// contiguously (a cell-linked list, stored as one array sorted by cell).  Finding the particles
+// within a radius of a point only visits the cells the sphere overlaps, so it suits many small
+// neighbour searches.  In a periodic store the grid covers the whole box, and the cells a sphere
+// overlaps are found with their indices wrapped around the box: particles across a face are
+// reached directly, with minimum-image distances, without ghost copies, so searches near the faces
+// cost the same as those inside.  Otherwise the grid covers the particles' bounding box.  Cells are
+// at least [cell_size] wide (larger if needed to tile the box, or to keep the number of cells
+// within a few per particle).  Queries return indices into the store, and can be made from
+// several threads at once.
+// Usage: CellGrid grid(simulation.gas, cell_size); grid.SelectSphere(centre, radius)
+class CellGrid {
+public:
+    CellGrid(const ParticleStore &particles, LengthType cell_size,
+             ThreadPool &pool = ThreadPool::GetShared());
+    LengthType GetCellWidth(int idim) const { return cell_widths_[idim]; }
+    size_t GetNumCells() const { return cell_starts_.size() - 1; }
+    Selection SelectSphere(const PosCoordsType &centre, LengthType radius) const;
+    size_t size() const { return order_.size(); }
+
+    // Calls function(index) for each particle with a distance from [centre] of at most [radius],
+    // in no particular order.  Distances are computed as in ParticleStore::GetDistanceFrom().
+    template <typename FunctionType>
+    void ForEachInSphere(const PosCoordsType &query_centre, LengthType radius,
+                         FunctionType function) const {
+        if (order_.empty() || radius < 0)
+            return;
+        // Range of (unwrapped) cell coordinates the sphere overlaps in each dimension
+        PosCoordsType centre;
+        std::array<long,kNDims> lower, upper;
+        for (int idim = 0; idim < kNDims; ++idim) {
+            centre[idim]     = WrapPosition(query_centre[idim], periodic_box_size_);
+            LengthType reach = radius + kCellGridTolerance * cell_widths_[idim];
+            lower[idim] = std::floor((centre[idim] - reach - origin_[idim]) / cell_widths_[idim]);
+            upper[idim] = std::floor((centre[idim] + reach - origin_[idim]) / cell_widths_[idim]);
+            if (periodic_box_size_ > 0 && upper[idim] - lower[idim] + 1 >= num_cells_[idim]) {
+                lower[idim] = 0;
+                upper[idim] = num_cells_[idim] - 1;
+            } else if (periodic_box_size_ <= 0) {
+                lower[idim] = std::max(lower[idim], 0L);
+                upper[idim] = std::min(upper[idim], num_cells_[idim] - 1);
+                if (lower[idim] > upper[idim])
+                    return;
+            }
+        }
+
+        LengthType radius_squared = radius * radius;
+        std::array<long,kNDims> coords = lower;
+        while (true) {
+            size_t icell = 0;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                long coord = coords[idim] % num_cells_[idim];
+                icell = icell * num_cells_[idim] + (coord < 0 ? coord + num_cells_[idim] : coord);
+            }
+            for (size_t ipart = cell_starts_[icell]; ipart < cell_starts_[icell + 1]; ++ipart)
+                if (GetDistanceSquared_(ipart, centre) <= radius_squared)
+                    function(order_[ipart]);
+            // Move on to the next cell, last dimension fastest
+            int idim = kNDims - 1;
+            while (idim >= 0 && ++coords[idim] > upper[idim]) {
+                coords[idim] = lower[idim];
+                --idim;
+            }
+            if (idim < 0)
+                break;
+        }
+    }
+
+private:
+    CellGrid();
+    LengthType GetDistanceSquared_(size_t ipart, const PosCoordsType &centre) const {
+        LengthType distance_squared = 0;
+        for (int idim = 0; idim < kNDims; ++idim) {
+            LengthType displacement = GetPeriodicDisplacement(
+                positions_[idim][ipart] - centre[idim], periodic_box_size_);
+            distance_squared += displacement * displacement;
+        }
+        return distance_squared;
+    }
+    std::vector<size_t> cell_starts_;                      // First particle of each cell, and end
+    std::array<LengthType,kNDims> cell_widths_;
+    std::array<long,kNDims> num_cells_;
+    std::vector<size_t> order_;                            // Store index of each grid position
+    PosCoordsType origin_;
+    LengthType periodic_box_size_;
+    std::array<std::vector<LengthType>,kNDims> positions_; // Positions in grid order
+};
+
+#endif // cell_grid_hpp
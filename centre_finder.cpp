@@ -0,0 +1,328 @@
+// Implementation of the halo centre finders
+
+#include "centre_finder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compensated_sum.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Guards against spheres which never lose particles, e.g. if they all share one position
+const int kMaxShrinkingSphereIterations = 10000;
+
+// FindShrinkingSphereCentre() uses shells down to this fraction of the radius (and at most
+// kMaxCentreShells of them), with all particles nearer the centre in the innermost shell
+const double kMinCentreShellFraction = 1e-6;
+const size_t kMaxCentreShells        = 4096;
+
+// Fraction of the radius by which the sphere known to hold whole shells is narrowed (and the sphere
+// around a group widened), so that rounding never counts a particle outside the sphere (or leaves a
+// member out)
+const double kCentreShellTolerance = 1e-9;
+
+// Number of particles whose potential is summed by each task of FindPotentialMinimum()
+const size_t kPotentialBlockSize = 64;
+
+// A particle's position and mass, gathered from a store.  Particles are moved between shells as
+// whole records, so that sorting them only writes one array.
+struct SphereParticleType {
+    std::array<LengthType,kNDims> position;
+    double mass;
+};
+
+// The particles of a sphere, and their store indices
+struct SphereParticlesType {
+    std::vector<size_t> indices;
+    std::vector<SphereParticleType> particles;
+};
+
+// Compensated sums of the masses of some particles, and of their mass-weighted displacements from
+// a reference point
+struct MassMomentsType {
+    CompensatedSum mass;
+    std::array<CompensatedSum,kNDims> mass_displacement;
+};
+
+// Gathers the particles within [radius] of [centre], in tree order.  Throws exception if there
+// are none, or if the tree wasn't built from the store.
+static SphereParticlesType GatherSphere(const ParticleStore &particles, const KdTree &tree,
+                                        const PosCoordsType &centre, LengthType radius,
+                                        const std::string &caller) {
+    if (tree.size() != particles.size())
+        throw std::invalid_argument(caller + ": Tree was built from another store");
+    SphereParticlesType sphere;
+    tree.ForEachInSphere(centre, radius, [&sphere](size_t index) {
+        sphere.indices.push_back(index);
+    });
+    if (sphere.indices.empty())
+        throw std::runtime_error(caller + ": No particles within the radius");
+    sphere.particles.resize(sphere.indices.size());
+    for (size_t ipart = 0; ipart < sphere.indices.size(); ++ipart) {
+        size_t index = sphere.indices[ipart];
+        for (int idim = 0; idim < kNDims; ++idim)
+            sphere.particles[ipart].position[idim] = particles.position[idim][index];
+        sphere.particles[ipart].mass = particles.mass[index];
+    }
+    return sphere;
+}
+
+// Returns the squared distance of a particle from [centre]
+static LengthType GetSphereDistanceSquared(const SphereParticleType &particle,
+                                           const PosCoordsType &centre, LengthType box_size) {
+    LengthType distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = GetPeriodicDisplacement(particle.position[idim] - centre[idim],
+                                                          box_size);
+        distance_squared += displacement * displacement;
+    }
+    return distance_squared;
+}
+
+// Adds a particle to [moments], with its displacement from [reference]
+static void AddSphereParticle(const SphereParticleType &particle, const PosCoordsType &reference,
+                              LengthType box_size, MassMomentsType &moments) {
+    moments.mass.Add(particle.mass);
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = GetPeriodicDisplacement(particle.position[idim] - reference[idim],
+                                                          box_size);
+        moments.mass_displacement[idim].Add(particle.mass * displacement);
+    }
+}
+
+// Moves the particles [first, last) of a sphere within [radius] of [centre] to the front of the
+// range (keeping their order), and returns the end of those kept
+static size_t KeepWithinRadius(std::vector<SphereParticleType> &sphere, size_t first,
+                               size_t last, const PosCoordsType &centre, LengthType radius,
+                               LengthType box_size) {
+    LengthType radius_squared = radius * radius;
+    size_t num_kept = first;
+    for (size_t ipart = first; ipart < last; ++ipart)
+        if (GetSphereDistanceSquared(sphere[ipart], centre, box_size) <= radius_squared)
+            sphere[num_kept++] = sphere[ipart];
+    return num_kept;
+}
+
+// Sorts the particles [0, num_particles) of a sphere within [radius] of [reference] into shells,
+// from the centre out, with outer radii [shell_edges] (a counting sort, so particles keep their
+// order within a shell), and drops the rest.  Shell k (counting from the outermost, k = 0) reaches
+// out to radius * shrink_factor^k.  Returns the number of particles kept, the first particle of
+// each shell, and end, in [shell_starts], and the moments of the innermost k shells in
+// cumulative_moments[k].
+static size_t SortIntoShells(std::vector<SphereParticleType> &sphere, size_t num_particles,
+                             const PosCoordsType &reference, LengthType radius,
+                             double shrink_factor, LengthType box_size,
+                             const std::vector<LengthType> &shell_edges,
+                             std::vector<size_t> &shell_starts,
+                             std::vector<MassMomentsType> &cumulative_moments) {
+    size_t num_shells         = shell_edges.size();
+    LengthType radius_squared = radius * radius;
+    double log_step           = 2 * std::log(shrink_factor);
+    std::vector<size_t> particle_shells(num_particles);
+    shell_starts.assign(num_shells + 1, 0);
+    for (size_t ipart = 0; ipart < num_particles; ++ipart) {
+        LengthType distance_squared = GetSphereDistanceSquared(sphere[ipart], reference, box_size);
+        if (!(distance_squared <= radius_squared)) {
+            particle_shells[ipart] = num_shells;
+            continue;
+        }
+        double steps_in        = std::log(distance_squared / radius_squared) / log_step;
+        size_t ishell_in       = steps_in < num_shells ? size_t(steps_in) : num_shells - 1;
+        particle_shells[ipart] = num_shells - 1 - ishell_in;
+        ++shell_starts[particle_shells[ipart] + 1];
+    }
+    for (size_t ishell = 0; ishell < num_shells; ++ishell)
+        shell_starts[ishell + 1] += shell_starts[ishell];
+
+    size_t num_kept = shell_starts[num_shells];
+    std::vector<SphereParticleType> sorted(num_kept);
+    std::vector<size_t> next_slots(shell_starts.begin(), shell_starts.end() - 1);
+    for (size_t ipart = 0; ipart < num_particles; ++ipart)
+        if (particle_shells[ipart] < num_shells)
+            sorted[next_slots[particle_shells[ipart]]++] = sphere[ipart];
+    sphere.swap(sorted);
+
+    cumulative_moments.assign(num_shells + 1, MassMomentsType());
+    for (size_t ishell = 0; ishell < num_shells; ++ishell) {
+        MassMomentsType &moments = cumulative_moments[ishell + 1];
+        moments = cumulative_moments[ishell];
+        for (size_t ipart = shell_starts[ishell]; ipart < shell_starts[ishell + 1]; ++ipart)
+            AddSphereParticle(sphere[ipart], reference, box_size, moments);
+    }
+    return num_kept;
+}
+
+// Each sphere is a subset of the one before, so rather than testing all its particles, they are
+// sorted into shells by distance from a reference centre, each one shrink step thick, with running
+// sums of their moments.  By the triangle inequality, a shell is inside every sphere so far if its
+// outer edge is within the smallest value of (radius - distance of centre from reference).  Those
+// shells are summed from the running sums, and only the particles of the shells beyond them are
+// tested (dropping those outside, as they can't be in later spheres).  Once the particles tested
+// since the shells were built outnumber the sphere twice over (as the centre drifts from the
+// reference), the shells are rebuilt around the current centre.
+ShrinkingSphereResult FindShrinkingSphereCentre(const ParticleStore &particles, const KdTree &tree,
+                                                const PosCoordsType &initial_centre,
+                                                LengthType initial_radius, double shrink_factor,
+                                                size_t min_num_particles) {
+    if (!(shrink_factor > 0 && shrink_factor < 1))
+        throw std::invalid_argument("FindShrinkingSphereCentre: Shrink factor must be in (0, 1)");
+    SphereParticlesType sphere = GatherSphere(particles, tree, initial_centre, initial_radius,
+                                              "FindShrinkingSphereCentre");
+    LengthType box_size = particles.GetPeriodicBoxSize();
+    double num_steps    = std::ceil(std::log(kMinCentreShellFraction) / std::log(shrink_factor));
+    size_t num_shells   = std::max(size_t(2), std::min(size_t(num_steps), kMaxCentreShells));
+
+    PosCoordsType centre;
+    for (int idim = 0; idim < kNDims; ++idim)
+        centre[idim] = WrapPosition(initial_centre[idim], box_size);
+    LengthType radius            = initial_radius;
+    ShrinkingSphereResult result = {centre, radius, 0, 0};
+    size_t num_particles         = sphere.indices.size(); // Particles of the last sphere, in front
+
+    PosCoordsType reference;
+    LengthType inner_radius = 0;  // Radius around reference inside every sphere since the rebuild
+    size_t num_inner_shells = 0;  // Shells within inner_radius
+    size_t num_tested       = 0;  // Particles tested individually since the rebuild
+    std::vector<LengthType> shell_edges(num_shells);
+    std::vector<size_t> shell_starts;
+    std::vector<MassMomentsType> cumulative_moments;
+    for (int iteration = 1; iteration <= kMaxShrinkingSphereIterations; ++iteration) {
+        bool rebuild = (iteration == 1);
+        if (!rebuild) {
+            LengthType shift_squared = 0;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                LengthType displacement = GetPeriodicDisplacement(centre[idim] - reference[idim],
+                                                                  box_size);
+                shift_squared += displacement * displacement;
+            }
+            LengthType limit = (radius - std::sqrt(shift_squared)) * (1 - kCentreShellTolerance);
+            inner_radius     = std::min(inner_radius, limit);
+            while (num_inner_shells > 0 && shell_edges[num_inner_shells - 1] > inner_radius)
+                --num_inner_shells;
+            num_tested += num_particles - shell_starts[num_inner_shells];
+            rebuild     = num_tested > 2 * num_particles;
+        }
+        if (rebuild) {
+            reference        = centre;
+            inner_radius     = radius;
+            num_inner_shells = num_shells;
+            num_tested       = 0;
+            for (size_t ishell = 0; ishell < num_shells; ++ishell)
+                shell_edges[ishell] = radius * std::pow(shrink_factor, num_shells - 1 - ishell);
+            shell_edges[num_shells - 1] = radius;
+            num_particles = SortIntoShells(sphere.particles, num_particles, reference, radius,
+                                           shrink_factor, box_size, shell_edges, shell_starts,
+                                           cumulative_moments);
+        } else {
+            num_particles = KeepWithinRadius(sphere.particles, shell_starts[num_inner_shells],
+                                             num_particles, centre, radius, box_size);
+        }
+        if (num_particles == 0 || (iteration > 1 && num_particles < min_num_particles))
+            break;
+
+        // Move the centre to the centre of mass of the sphere
+        MassMomentsType moments = cumulative_moments[num_inner_shells];
+        for (size_t ipart = shell_starts[num_inner_shells]; ipart < num_particles; ++ipart)
+            AddSphereParticle(sphere.particles[ipart], reference, box_size, moments);
+        for (int idim = 0; idim < kNDims; ++idim)
+            centre[idim] = WrapPosition(reference[idim] +
+                                        moments.mass_displacement[idim].Get() / moments.mass.Get(),
+                                        box_size);
+        result.centre         = centre;
+        result.radius         = radius;
+        result.num_particles  = num_particles;
+        result.num_iterations = iteration;
+        radius *= shrink_factor;
+    }
+    return result;
+}
+
+// The centre of mass of the members is found relative to the first of them (so a group straddling
+// a periodic boundary isn't split), and the initial radius is the distance of the furthest one
+ShrinkingSphereResult FindShrinkingSphereCentre(const ParticleStore &particles, const KdTree &tree,
+                                                const Selection &members, double shrink_factor,
+                                                size_t min_num_particles) {
+    if (members.empty())
+        throw std::invalid_argument("FindShrinkingSphereCentre: No members");
+    if (members.GetUniverseSize() != particles.size())
+        throw std::invalid_argument("FindShrinkingSphereCentre: Members are of another store");
+    LengthType box_size = particles.GetPeriodicBoxSize();
+    std::vector<SphereParticleType> group;
+    members.ForEach([&](size_t index) {
+        SphereParticleType particle;
+        for (int idim = 0; idim < kNDims; ++idim)
+            particle.position[idim] = particles.position[idim][index];
+        particle.mass = particles.mass[index];
+        group.push_back(particle);
+    });
+
+    PosCoordsType reference = group.front().position;
+    MassMomentsType moments;
+    for (const SphereParticleType &particle : group)
+        AddSphereParticle(particle, reference, box_size, moments);
+    PosCoordsType centre;
+    for (int idim = 0; idim < kNDims; ++idim)
+        centre[idim] = WrapPosition(reference[idim] +
+                                    moments.mass_displacement[idim].Get() / moments.mass.Get(),
+                                    box_size);
+    LengthType radius_squared = 0;
+    for (const SphereParticleType &particle : group)
+        radius_squared = std::max(radius_squared,
+                                  GetSphereDistanceSquared(particle, centre, box_size));
+    LengthType radius = std::sqrt(radius_squared) * (1 + kCentreShellTolerance);
+    return FindShrinkingSphereCentre(particles, tree, centre, radius, shrink_factor,
+                                     min_num_particles);
+}
+
+PosCoordsType FindPotentialMinimum(const ParticleStore &particles, const KdTree &tree,
+                                   const PosCoordsType &centre, LengthType radius,
+                                   LengthType softening, ThreadPool &pool) {
+    SphereParticlesType sphere = GatherSphere(particles, tree, centre, radius,
+                                              "FindPotentialMinimum");
+    LengthType box_size          = particles.GetPeriodicBoxSize();
+    LengthType softening_squared = softening * softening;
+    size_t num_particles         = sphere.indices.size();
+
+    // Each block finds its most bound particle, as a (potential, store index) pair so that ties go
+    // to the lowest index, and the result doesn't depend on the number of threads.  The
+    // gravitational constant is left out, since only the ordering matters.
+    typedef std::pair<double,size_t> BoundParticleType;
+    size_t num_blocks = (num_particles + kPotentialBlockSize - 1) / kPotentialBlockSize;
+    std::vector<BoundParticleType> block_minima(num_blocks,
+        BoundParticleType(std::numeric_limits<double>::infinity(), 0));
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t first = iblock * kPotentialBlockSize;
+        size_t last  = std::min(first + kPotentialBlockSize, num_particles);
+        for (size_t ipart = first; ipart < last; ++ipart) {
+            double potential = 0;
+            for (size_t jpart = 0; jpart < num_particles; ++jpart) {
+                if (jpart == ipart)
+                    continue;
+                const SphereParticleType &other = sphere.particles[jpart];
+                LengthType distance_squared = softening_squared;
+                for (int idim = 0; idim < kNDims; ++idim) {
+                    LengthType displacement = GetPeriodicDisplacement(
+                        other.position[idim] - sphere.particles[ipart].position[idim], box_size);
+                    distance_squared += displacement * displacement;
+                }
+                potential -= other.mass / std::sqrt(distance_squared);
+            }
+            block_minima[iblock] = std::min(block_minima[iblock],
+                                            BoundParticleType(potential, sphere.indices[ipart]));
+        }
+    });
+    return particles.GetPosition(std::min_element(block_minima.begin(),
+                                                  block_minima.end())->second);
+}
@@ -0,0 +1,63 @@
+// Defines functions to find the centre of a halo (or any concentration of particles) in a store
+
+#ifndef centre_finder_hpp
+#define centre_finder_hpp
+#include <cstddef>
+
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Defaults for FindShrinkingSphereCentre(): the fraction of the radius kept by each iteration, and
+// the number of particles below which the sphere stops shrinking (as in Power et al. 2003)
+const double kDefaultShrinkFactor       = 0.975;
+const size_t kDefaultMinCentreParticles = 1000;
+
+// Result of FindShrinkingSphereCentre()
+struct ShrinkingSphereResult {
+    PosCoordsType centre;  // Centre of mass of the smallest sphere
+    LengthType radius;     // Radius of the smallest sphere
+    size_t num_particles;  // Number of particles in the smallest sphere
+    int num_iterations;
+};
+
+// Finds the centre of the concentration of particles around [initial_centre] with the shrinking
+// sphere method: the centre of mass of the particles within [initial_radius] is found, the radius
+// is multiplied by [shrink_factor] and the sphere recentred on it, and so on until fewer than
+// [min_num_particles] particles would remain.  Only the initial sphere is found with the tree; each
+// later sphere is selected from the particles of the one before, which are kept sorted into shells
+// with running sums, so an iteration only tests the particles near the edge of the sphere.  Sums
+// are compensated, and in a periodic store positions are measured to the nearest image of the
+// current centre (which is kept inside the box).  Throws exception if there are no particles
+// within [initial_radius].
+ShrinkingSphereResult FindShrinkingSphereCentre(const ParticleStore &particles, const KdTree &tree,
+                                                const PosCoordsType &initial_centre,
+                                                LengthType initial_radius,
+                                                double shrink_factor = kDefaultShrinkFactor,
+                                                size_t min_num_particles =
+                                                kDefaultMinCentreParticles);
+
+// As above, starting from the sphere around the centre of mass of the [members] of a group (e.g.
+// from FofGroups::SelectGroup()) which just holds them all.  Groups of fewer than
+// [min_num_particles] particles stop at that first sphere.  Throws exception if there are no
+// members.
+ShrinkingSphereResult FindShrinkingSphereCentre(const ParticleStore &particles, const KdTree &tree,
+                                                const Selection &members,
+                                                double shrink_factor = kDefaultShrinkFactor,
+                                                size_t min_num_particles =
+                                                kDefaultMinCentreParticles);
+
+// Returns the position of the particle with the lowest gravitational potential (from the other
+// particles within [radius] of [centre], with Plummer softening of length [softening]), a centre
+// which ignores unbound particles and outlying substructure.  The potential is summed directly, so
+// the cost grows as the square of the number of particles in the sphere: it suits the few thousand
+// particles of a sphere from FindShrinkingSphereCentre().  Ties go to the lowest store index.
+// Throws exception if there are no particles within [radius].
+PosCoordsType FindPotentialMinimum(const ParticleStore &particles, const KdTree &tree,
+                                   const PosCoordsType &centre, LengthType radius,
+                                   LengthType softening,
+                                   ThreadPool &pool = ThreadPool::GetShared());
+
+#endif // centre_finder_hpp
@@ -0,0 +1,172 @@
+// Defines the templated Column class used by the particle stores to hold a single particle property
+// for every particle of one type.
+
+#ifndef column_hpp
+#define column_hpp
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A contiguous array of values with a std::vector-like interface.  A column either owns its data,
+// or is a read-only view of memory owned by something else (e.g. a memory-mapped snapshot file,
+// kept alive by a shared pointer), or has a loader function that fills it the first time its data
+// are accessed.  Views and lazy columns are converted into ordinary owned columns by any
+// non-const access, so code that modifies particle data never writes to a mapped file.
+// N.B. Loops over many particles should take data() once rather than index element by element.
+template <typename Type>
+class Column {
+public:
+    typedef std::function<void(std::vector<Type> &)> LoaderType;
+
+    Column() : mode_(OWNED), view_(nullptr), size_(0) {}
+
+    // Copies of views remain views of the same memory, and copies of lazy columns are loaded first.
+    Column(const Column &other) : mode_(other.mode_), view_(other.view_), size_(other.size_),
+                                  keep_alive_(other.keep_alive_) {
+        if (mode_ == LAZY) {
+            other.Load_();
+            owned_ = other.owned_;
+            mode_  = OWNED;
+        } else {
+            owned_ = other.owned_;
+        }
+    }
+
+    Column &operator=(const Column &other) {
+        if (this != &other) {
+            Column copy(other);
+            Swap_(copy);
+        }
+        return *this;
+    }
+
+    Column(Column &&other) : Column() { Swap_(other); }
+
+    Column &operator=(Column &&other) {
+        Swap_(other);
+        return *this;
+    }
+
+    size_t size() const { return mode_ == OWNED ? owned_.size() : size_; }
+    bool empty() const { return size() == 0; }
+
+    const Type *data() const {
+        if (mode_ == VIEW)
+            return view_;
+        if (mode_ == LAZY)
+            Load_();
+        return owned_.data();
+    }
+    Type *data() {
+        MakeOwned_();
+        return owned_.data();
+    }
+
+    const Type &operator[](size_t index) const { return data()[index]; }
+    Type &operator[](size_t index) {
+        if (mode_ != OWNED)
+            MakeOwned_();
+        return owned_[index];
+    }
+
+    const Type *begin() const { return data(); }
+    const Type *end() const { return data() + size(); }
+
+    void clear() {
+        Column empty_column;
+        Swap_(empty_column);
+    }
+    void push_back(const Type &value) {
+        MakeOwned_();
+        owned_.push_back(value);
+    }
+    void reserve(size_t n) {
+        MakeOwned_();
+        owned_.reserve(n);
+    }
+    void resize(size_t n, const Type &value = Type()) {
+        MakeOwned_();
+        owned_.resize(n, value);
+    }
+
+    // Makes this column a read-only view of [n] values at [data].  The memory must remain valid as
+    // long as [keep_alive] (which may be null for memory that outlives the column) is held.
+    void SetView(const Type *data, size_t n, std::shared_ptr<const void> keep_alive) {
+        clear();
+        mode_       = VIEW;
+        view_       = data;
+        size_       = n;
+        keep_alive_ = keep_alive;
+    }
+
+    // Defers filling this column with [n] values until first access, when [loader] is called with
+    // an empty vector to fill.  Loading is thread-safe.
+    void SetLoader(size_t n, LoaderType loader) {
+        clear();
+        mode_       = LAZY;
+        size_       = n;
+        lazy_state_ = std::make_shared<LazyState_>();
+        lazy_state_->loader = loader;
+    }
+
+    // True if the data can be accessed without calling a loader
+    bool IsLoaded() const {
+        return mode_ != LAZY || lazy_state_->loaded;
+    }
+
+    bool IsView() const { return mode_ == VIEW; }
+
+private:
+    enum ModeType {OWNED, VIEW, LAZY};
+    struct LazyState_ {
+        std::once_flag once;
+        std::atomic<bool> loaded{false};
+        LoaderType loader;
+    };
+
+    // Calls the loader exactly once, even if several threads access the column at the same time
+    void Load_() const {
+        LazyState_ &state = *lazy_state_;
+        std::call_once(state.once, [this, &state]() {
+            std::vector<Type> values;
+            values.reserve(size_);
+            state.loader(values);
+            values.resize(size_);
+            owned_.swap(values);
+            state.loaded = true;
+        });
+    }
+
+    void MakeOwned_() {
+        if (mode_ == VIEW) {
+            owned_.assign(view_, view_ + size_);
+            view_ = nullptr;
+            keep_alive_.reset();
+        } else if (mode_ == LAZY) {
+            Load_();
+            lazy_state_.reset();
+        }
+        mode_ = OWNED;
+    }
+
+    void Swap_(Column &other) {
+        std::swap(mode_, other.mode_);
+        std::swap(view_, other.view_);
+        std::swap(size_, other.size_);
+        owned_.swap(other.owned_);
+        keep_alive_.swap(other.keep_alive_);
+        lazy_state_.swap(other.lazy_state_);
+    }
+
+    ModeType mode_;
+    const Type *view_;
+    size_t size_;
+    mutable std::vector<Type> owned_;
+    std::shared_ptr<const void> keep_alive_;
+    std::shared_ptr<LazyState_> lazy_state_;
+};
+
+#endif // column_hpp
@@ -0,0 +1,33 @@
+// Defines the CompensatedSum class, used to accumulate long sums of doubles accurately
+
+#ifndef compensated_sum_hpp
+#define compensated_sum_hpp
+#include <cmath>
+
+// A running sum of doubles which carries the rounding error of each addition in a separate
+// compensation term (Neumaier's variant of Kahan summation), so that the error doesn't grow with
+// the number of terms.  Partial sums of disjoint sets of terms can be merged with Add(other).
+// N.B. Compensation is lost if compiled with -ffast-math.
+// Usage: CompensatedSum sum; sum.Add(value); sum.Get()
+class CompensatedSum {
+public:
+    CompensatedSum() : compensation_(0), sum_(0) {}
+    void Add(double value) {
+        double total = sum_ + value;
+        if (std::abs(sum_) >= std::abs(value))
+            compensation_ += (sum_ - total) + value;
+        else
+            compensation_ += (value - total) + sum_;
+        sum_ = total;
+    }
+    void Add(const CompensatedSum &other) {
+        Add(other.sum_);
+        Add(other.compensation_);
+    }
+    double Get() const { return sum_ + compensation_; }
+private:
+    double compensation_;
+    double sum_;
+};
+
+#endif // compensated_sum_hpp
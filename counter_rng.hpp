@@ -0,0 +1,80 @@
+// Defines the CounterRng class, a counter-based random number generator
+
+#ifndef counter_rng_hpp
+#define counter_rng_hpp
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Random number stream based on the Philox4x32-10 function of Salmon et al. (2011), which maps a
+// 128-bit counter and a 64-bit key to 128 random-looking bits.  Each stream is identified by a
+// seed, a 64-bit index (e.g. a particle index) and a 32-bit substream number (e.g. the group of
+// properties being drawn), and successive draws just increment the last counter word.  So the
+// numbers drawn for one particle depend only on its index and not on which thread drew them, or
+// in what order, which makes parallel generation reproducible with any number of threads.
+// Usage: CounterRng(seed, index, substream).Uniform()
+class CounterRng {
+public:
+    CounterRng(uint64_t seed, uint64_t index, uint32_t substream) : draw_(0), num_buffered_(0) {
+        key_[0]     = static_cast<uint32_t>(seed);
+        key_[1]     = static_cast<uint32_t>(seed >> 32);
+        counter_[0] = static_cast<uint32_t>(index);
+        counter_[1] = static_cast<uint32_t>(index >> 32);
+        counter_[2] = substream;
+    }
+
+    uint32_t NextUint32() {
+        if (num_buffered_ == 0) {
+            counter_[3]   = draw_++;
+            buffer_       = Philox4x32(counter_, key_);
+            num_buffered_ = 4;
+        }
+        return buffer_[--num_buffered_];
+    }
+
+    // Uniformly distributed in [0, 1), with 53 random bits
+    double Uniform() {
+        uint64_t high = NextUint32();
+        uint64_t low  = NextUint32();
+        return ((high << 21) ^ (low >> 11)) * (1.0 / 9007199254740992.0);
+    }
+
+    double Uniform(double low, double high) { return low + (high - low) * Uniform(); }
+
+    // x such that log10(x) is uniformly distributed in [log10(low), log10(high))
+    double LogUniform(double low, double high) {
+        return std::pow(10.0, Uniform(std::log10(low), std::log10(high)));
+    }
+
+    // Standard normal deviate (Box-Muller)
+    double Normal() {
+        double radius = std::sqrt(-2 * std::log(1 - Uniform()));
+        return radius * std::cos(2 * M_PI * Uniform());
+    }
+
+    static std::array<uint32_t,4> Philox4x32(std::array<uint32_t,4> counter,
+                                             std::array<uint32_t,2> key) {
+        const uint64_t kMultiplier[2] = {0xD2511F53, 0xCD9E8D57};
+        const uint32_t kKeyStep[2]    = {0x9E3779B9, 0xBB67AE85};
+        for (int iround = 0; iround < 10; ++iround) {
+            uint64_t product0 = kMultiplier[0] * counter[0];
+            uint64_t product1 = kMultiplier[1] * counter[2];
+            counter = {static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+                       static_cast<uint32_t>(product1),
+                       static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+                       static_cast<uint32_t>(product0)};
+            key[0] += kKeyStep[0];
+            key[1] += kKeyStep[1];
+        }
+        return counter;
+    }
+
+private:
+    std::array<uint32_t,4> counter_;
+    std::array<uint32_t,2> key_;
+    std::array<uint32_t,4> buffer_;
+    uint32_t draw_;
+    int num_buffered_;
+};
+
+#endif // counter_rng_hpp
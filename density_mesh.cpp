@@ -0,0 +1,322 @@
+// Implementation of the DensityMesh class and the PowerSpectrum output
+
+#include "density_mesh.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fft.hpp"
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Returns the number of cells along one axis that [assignment] shares a particle between, sets
+// the first of them for a particle at [u] (in cells, along that axis), and sets their shares of
+// the particle's mass in [weights]
+static int GetAssignmentWeights(MassAssignmentType assignment, double u, long &first_cell,
+                                std::array<double,3> &weights) {
+    switch (assignment) {
+        case NGP_ASSIGNMENT:
+            first_cell = std::floor(u);
+            weights[0] = 1;
+            return 1;
+        case CIC_ASSIGNMENT: {
+            first_cell = std::floor(u - 0.5);
+            double offset = u - 0.5 - first_cell;
+            weights[0] = 1 - offset;
+            weights[1] = offset;
+            return 2;
+        }
+        case TSC_ASSIGNMENT: {
+            long cell     = std::floor(u);
+            double offset = u - (cell + 0.5);
+            first_cell = cell - 1;
+            weights[0] = 0.5 * (0.5 - offset) * (0.5 - offset);
+            weights[1] = 0.75 - offset * offset;
+            weights[2] = 0.5 * (0.5 + offset) * (0.5 + offset);
+            return 3;
+        }
+    }
+    throw std::invalid_argument("DensityMesh: Unknown mass assignment scheme");
+}
+
+// Returns sin(x) / x
+static double Sinc(double x) {
+    return (x == 0) ? 1 : std::sin(x) / x;
+}
+
+DensityMesh::DensityMesh(LengthType box_size, size_t num_cells, MassAssignmentType assignment)
+        : assignment_(assignment), box_size_(box_size), num_cells_(num_cells), total_mass_(0),
+          total_squared_mass_(0), transformed_(false) {
+    if (!(box_size > 0))
+        throw std::invalid_argument("DensityMesh: Box size must be positive");
+    if (num_cells < 2 || (num_cells & (num_cells - 1)) != 0)
+        throw std::invalid_argument("DensityMesh: Number of cells must be a power of 2, not " +
+                                    std::to_string(num_cells));
+    size_t grid_size = GetPaddedFftSize(num_cells);
+    for (int idim = 1; idim < kNDims; ++idim)
+        grid_size *= num_cells;
+    grid_.assign(grid_size, 0);
+}
+
+void DensityMesh::Deposit(const ParticleStore &particles, ThreadPool &pool) {
+    Deposit(particles, Selection::All(particles.size()), pool);
+}
+
+// Deposits the selected particles chunk by chunk.  Each block of a chunk counts its particles in
+// each group of slabs, the counts give each block and group a range of one list of particles
+// (like the CSR layout of FofGroups), the blocks fill in their ranges, and then each group
+// deposits its particles in order of index.
+void DensityMesh::Deposit(const ParticleStore &particles, const Selection &selection,
+                          ThreadPool &pool) {
+    if (transformed_)
+        throw std::logic_error("DensityMesh: Can't deposit particles once the mesh is transformed");
+    if (selection.GetUniverseSize() != particles.size())
+        throw std::invalid_argument("DensityMesh: Selection is of another store");
+
+    // Alternate groups of slabs are far enough apart that their particles' masses never overlap
+    size_t slab_width = kMeshMinSlabWidth;
+    size_t num_groups = num_cells_ / slab_width;
+    if (num_groups < 2) {
+        num_groups = 1;
+        slab_width = num_cells_;
+    }
+    size_t num_phases = (num_groups > 1) ? 2 : 1;
+
+    const MassType *p_mass = particles.mass.data();
+    std::array<const LengthType *,kNDims> p_positions;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_positions[idim] = particles.position[idim].data();
+    double cells_per_length = num_cells_ / box_size_;
+    auto get_cell_coords = [&](size_t index, std::array<double,kNDims> &cell_coords) {
+        for (int idim = 0; idim < kNDims; ++idim) {
+            double u = p_positions[idim][index] * cells_per_length;
+            cell_coords[idim] = u - num_cells_ * std::floor(u / num_cells_);
+        }
+    };
+    auto get_group = [&](const std::array<double,kNDims> &cell_coords) {
+        long first_cell;
+        std::array<double,3> weights;
+        GetAssignmentWeights(assignment_, cell_coords[0], first_cell, weights);
+        long n = num_cells_;
+        return size_t(((first_cell % n) + n) % n) / slab_width;
+    };
+
+    for (size_t chunk_first = 0; chunk_first < particles.size(); chunk_first += kMeshChunkSize) {
+        size_t chunk_last = std::min(chunk_first + kMeshChunkSize, particles.size());
+        size_t num_blocks = (chunk_last - chunk_first + kMeshBlockSize - 1) / kMeshBlockSize;
+        std::vector<size_t> offsets(num_blocks * num_groups, 0); // [iblock * num_groups + igroup]
+        std::vector<double> block_masses(num_blocks, 0);
+        std::vector<double> block_squared_masses(num_blocks, 0);
+        pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+            size_t *p_counts = offsets.data() + iblock * num_groups;
+            size_t first     = chunk_first + iblock * kMeshBlockSize;
+            std::array<double,kNDims> cell_coords;
+            selection.ForEachInRange(first, std::min(first + kMeshBlockSize, chunk_last),
+                                     [&](size_t index) {
+                get_cell_coords(index, cell_coords);
+                ++p_counts[get_group(cell_coords)];
+                block_masses[iblock]         += p_mass[index];
+                block_squared_masses[iblock] += double(p_mass[index]) * p_mass[index];
+            });
+        });
+        std::vector<size_t> group_first(num_groups + 1, 0);
+        size_t num_entries = 0;
+        for (size_t igroup = 0; igroup < num_groups; ++igroup) {
+            group_first[igroup] = num_entries;
+            for (size_t iblock = 0; iblock < num_blocks; ++iblock) {
+                size_t count = offsets[iblock * num_groups + igroup];
+                offsets[iblock * num_groups + igroup] = num_entries;
+                num_entries += count;
+            }
+        }
+        group_first[num_groups] = num_entries;
+        for (size_t iblock = 0; iblock < num_blocks; ++iblock) {
+            total_mass_         += block_masses[iblock];
+            total_squared_mass_ += block_squared_masses[iblock];
+        }
+        std::vector<size_t> entries(num_entries);
+        pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+            size_t *p_offsets = offsets.data() + iblock * num_groups;
+            size_t first      = chunk_first + iblock * kMeshBlockSize;
+            std::array<double,kNDims> cell_coords;
+            selection.ForEachInRange(first, std::min(first + kMeshBlockSize, chunk_last),
+                                     [&](size_t index) {
+                get_cell_coords(index, cell_coords);
+                entries[p_offsets[get_group(cell_coords)]++] = index;
+            });
+        });
+
+        for (size_t iphase = 0; iphase < num_phases; ++iphase)
+            pool.ParallelFor(num_groups / num_phases, [&](size_t itask, int) {
+                size_t igroup = itask * num_phases + iphase;
+                std::array<double,kNDims> cell_coords;
+                for (size_t ientry = group_first[igroup]; ientry < group_first[igroup + 1];
+                     ++ientry) {
+                    size_t index = entries[ientry];
+                    get_cell_coords(index, cell_coords);
+                    DepositParticle_(p_mass[index], cell_coords.data());
+                }
+            });
+    }
+}
+
+// Adds [mass] to the cells around [cell_coords] (the position in cells, inside the mesh)
+void DensityMesh::DepositParticle_(double mass, const double *cell_coords) {
+    std::array<std::array<long,3>,kNDims> cells;
+    std::array<std::array<double,3>,kNDims> weights;
+    int num_shared = 1;
+    long n = num_cells_;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        long first_cell;
+        num_shared = GetAssignmentWeights(assignment_, cell_coords[idim], first_cell,
+                                          weights[idim]);
+        for (int ishared = 0; ishared < num_shared; ++ishared)
+            cells[idim][ishared] = (first_cell + ishared + n) % n;
+    }
+    size_t padded_size = GetPaddedFftSize(num_cells_);
+    if (kNDims == 2) {
+        for (int i = 0; i < num_shared; ++i)
+            for (int j = 0; j < num_shared; ++j)
+                grid_[cells[0][i] * padded_size + cells[kNDims - 1][j]] +=
+                    mass * weights[0][i] * weights[kNDims - 1][j];
+        return;
+    }
+    for (int i = 0; i < num_shared; ++i)
+        for (int j = 0; j < num_shared; ++j) {
+            double *p_line  = grid_.data() + (cells[0][i] * n + cells[1][j]) * padded_size;
+            double weight_ij = mass * weights[0][i] * weights[1][j];
+            for (int k = 0; k < num_shared; ++k)
+                p_line[cells[kNDims - 1][k]] += weight_ij * weights[kNDims - 1][k];
+        }
+}
+
+std::vector<double> DensityMesh::GetDensity() const {
+    if (transformed_)
+        throw std::logic_error("DensityMesh: Density is lost once the mesh is transformed");
+    size_t padded_size = GetPaddedFftSize(num_cells_);
+    size_t num_lines   = grid_.size() / padded_size;
+    double cell_volume = std::pow(GetCellSize(), kNDims);
+    std::vector<double> density(num_lines * num_cells_);
+    for (size_t iline = 0; iline < num_lines; ++iline)
+        for (size_t icell = 0; icell < num_cells_; ++icell)
+            density[iline * num_cells_ + icell] = grid_[iline * padded_size + icell] / cell_volume;
+    return density;
+}
+
+// Transforms the density contrast, mass / mean mass - 1, and then sums the power of the modes in
+// each shell over each plane of constant first wavenumber in parallel, adding the planes' sums in
+// order
+PowerSpectrum DensityMesh::ComputePowerSpectrum(ThreadPool &pool) {
+    if (transformed_)
+        throw std::logic_error("DensityMesh: Power spectrum has already been computed");
+    if (total_mass_ <= 0)
+        throw std::runtime_error("DensityMesh: No mass has been deposited");
+
+    size_t n           = num_cells_;
+    size_t padded_size = GetPaddedFftSize(n);
+    size_t num_lines   = grid_.size() / padded_size;
+    double num_cells   = std::pow(double(n), kNDims);
+    double mean_mass   = total_mass_ / num_cells;
+    pool.ParallelFor(num_lines, [&](size_t iline, int) {
+        double *p_line = grid_.data() + iline * padded_size;
+        for (size_t icell = 0; icell < n; ++icell)
+            p_line[icell] = p_line[icell] / mean_mass - 1;
+    });
+    ForwardRealFft(grid_, n, pool);
+    transformed_ = true;
+
+    // Window of the assignment scheme along one axis: sinc(pi k / n)^(number of cells shared)
+    long first_cell;
+    std::array<double,3> weights;
+    int num_shared = GetAssignmentWeights(assignment_, 0.5, first_cell, weights);
+    std::vector<double> window(n);
+    std::vector<long> wavenumber_indices(n);
+    for (size_t i = 0; i < n; ++i) {
+        wavenumber_indices[i] = (i <= n / 2) ? long(i) : long(i) - long(n);
+        window[i] = std::pow(Sinc(M_PI * wavenumber_indices[i] / n), num_shared);
+    }
+
+    size_t num_bins         = n / 2;
+    size_t last_axis_size   = padded_size / 2;
+    size_t values_per_plane = grid_.size() / 2 / n;
+    const std::complex<double> *p_values =
+        reinterpret_cast<const std::complex<double> *>(grid_.data());
+    double volume = std::pow(box_size_, kNDims);
+    std::vector<double> plane_powers(n * num_bins, 0);      // [iplane * num_bins + ibin]
+    std::vector<double> plane_wavenumbers(n * num_bins, 0);
+    std::vector<size_t> plane_num_modes(n * num_bins, 0);
+    pool.ParallelFor(n, [&](size_t iplane, int) {
+        for (size_t ivalue = 0; ivalue < values_per_plane; ++ivalue) {
+            std::array<size_t,kNDims> indices;
+            indices[0]          = iplane;
+            indices[kNDims - 1] = ivalue % last_axis_size;
+            if (kNDims == 3)
+                indices[1] = ivalue / last_axis_size;
+            double squared_wavenumber = 0;
+            double window_product     = 1;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                double wavenumber_index = (idim == kNDims - 1) ? double(indices[idim]) :
+                                          double(wavenumber_indices[indices[idim]]);
+                squared_wavenumber += wavenumber_index * wavenumber_index;
+                window_product     *= window[indices[idim]];
+            }
+            double wavenumber = std::sqrt(squared_wavenumber);
+            size_t ibin       = std::lround(wavenumber);
+            if (ibin < 1 || ibin > num_bins)
+                continue;
+            // Modes with 0 < k_last < n / 2 stand for themselves and their complex conjugates
+            size_t num_modes = (indices[kNDims - 1] == 0 || indices[kNDims - 1] == n / 2) ? 1 : 2;
+            double amplitude = std::abs(p_values[iplane * values_per_plane + ivalue]) /
+                               window_product;
+            size_t ientry = iplane * num_bins + ibin - 1;
+            plane_powers[ientry]      += num_modes * amplitude * amplitude;
+            plane_wavenumbers[ientry] += num_modes * wavenumber;
+            plane_num_modes[ientry]   += num_modes;
+        }
+    });
+
+    PowerSpectrum spectrum;
+    spectrum.shot_noise = volume * total_squared_mass_ / (total_mass_ * total_mass_);
+    spectrum.wavenumbers.assign(num_bins, 0);
+    spectrum.powers.assign(num_bins, 0);
+    spectrum.num_modes.assign(num_bins, 0);
+    for (size_t iplane = 0; iplane < n; ++iplane)
+        for (size_t ibin = 0; ibin < num_bins; ++ibin) {
+            spectrum.powers[ibin]      += plane_powers[iplane * num_bins + ibin];
+            spectrum.wavenumbers[ibin] += plane_wavenumbers[iplane * num_bins + ibin];
+            spectrum.num_modes[ibin]   += plane_num_modes[iplane * num_bins + ibin];
+        }
+    double fundamental_wavenumber = 2 * M_PI / box_size_;
+    for (size_t ibin = 0; ibin < num_bins; ++ibin) {
+        if (spectrum.num_modes[ibin] == 0)
+            continue;
+        spectrum.wavenumbers[ibin] *= fundamental_wavenumber / spectrum.num_modes[ibin];
+        spectrum.powers[ibin] = spectrum.powers[ibin] * volume /
+                                (num_cells * num_cells * spectrum.num_modes[ibin]) -
+                                spectrum.shot_noise;
+    }
+    return spectrum;
+}
+
+void PowerSpectrum::OutputToTextFile(std::string filepath) const {
+    std::ofstream out_stream (filepath);
+    if (!out_stream.is_open())
+        throw std::runtime_error("Writing power spectrum: Failed to open file " + filepath);
+    out_stream << "# k, P(k), number of modes (shot noise " << shot_noise << " subtracted)"
+               << std::endl;
+    for (size_t ibin = 0; ibin < powers.size(); ++ibin)
+        out_stream << wavenumbers[ibin] << ", " << powers[ibin] << ", " << num_modes[ibin]
+                   << std::endl;
+    out_stream.close();
+    std::cout << "Wrote power spectrum to " + filepath << std::endl;
+}
@@ -0,0 +1,87 @@
+// Interface for the DensityMesh class and the PowerSpectrum it measures
+
+#ifndef density_mesh_hpp
+#define density_mesh_hpp
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Number of particles of a store deposited in each pass, which bounds the memory used to sort
+// them into slabs however large the store
+const size_t kMeshChunkSize = 4194304;
+
+// Number of particles sorted into slabs by each task
+const size_t kMeshBlockSize = 65536;
+
+// Minimum number of cells along the x axis in each group of slabs, at least the width of the
+// widest assignment scheme so that alternate groups never touch the same cells
+const size_t kMeshMinSlabWidth = 4;
+
+// Schemes for assigning each particle's mass to the cells of a mesh: all to its cell (nearest grid
+// point), shared with the 2^kNDims nearest cells as a uniform cube one cell wide (cloud in cell),
+// or with the 3^kNDims nearest cells as a triangle two cells wide (triangular shaped cloud)
+enum MassAssignmentType {
+    NGP_ASSIGNMENT,
+    CIC_ASSIGNMENT,
+    TSC_ASSIGNMENT
+};
+
+// Shell-averaged power spectrum of the density contrast, from DensityMesh::ComputePowerSpectrum()
+struct PowerSpectrum {
+    std::vector<double> wavenumbers;  // Mean |k| of the modes in each shell
+    std::vector<double> powers;       // Mean power in each shell, less the shot noise
+    std::vector<size_t> num_modes;    // Number of modes in each shell
+    double shot_noise;                // Power of a Poisson sample of the particles
+    // Writes wavenumber, power and number of modes for each shell to a text file
+    void OutputToTextFile(std::string filepath) const;
+};
+
+// Mass density on a periodic mesh of [num_cells] cells along each side of a box of [box_size],
+// e.g. Parameters::GetBoxSize(), with the origin at a corner.  The mesh is a power of 2 in size,
+// for the FFT.  Particles are deposited with one of the MassAssignmentType schemes, and positions
+// outside the box are wrapped into it.  Deposits add to the mesh, so several stores can be
+// combined.  The store is deposited in chunks of kMeshChunkSize particles.  The particles of each
+// chunk are sorted by the group of slabs along x that their mass starts in, then the even groups
+// are deposited in parallel, then the odd ones, so no two threads ever write to the same cell, no
+// atomics are needed, and the mesh is identical for any number of threads.  The mesh is held as
+// doubles padded for an in-place real FFT (see fft.hpp), ~8 GB for 1024^3 cells, and the only
+// other memory used is ~16 bytes per particle of a chunk.  ComputePowerSpectrum() transforms the
+// mesh in place, after which no more particles can be deposited.
+// Usage: DensityMesh mesh(box_size, 1024); mesh.Deposit(simulation.dark_matter);
+class DensityMesh {
+public:
+    DensityMesh(LengthType box_size, size_t num_cells,
+                MassAssignmentType assignment = CIC_ASSIGNMENT);
+    void Deposit(const ParticleStore &particles, ThreadPool &pool = ThreadPool::GetShared());
+    void Deposit(const ParticleStore &particles, const Selection &selection,
+                 ThreadPool &pool = ThreadPool::GetShared());
+    // Returns the power spectrum of the density contrast in shells of |k| one fundamental mode
+    // (2 pi / box_size) wide, centred on multiples of it up to the Nyquist wavenumber.  Each mode
+    // is divided by the Fourier transform of the assignment scheme (the window), and the shot
+    // noise, V sum(m^2) / (sum m)^2, is subtracted.
+    PowerSpectrum ComputePowerSpectrum(ThreadPool &pool = ThreadPool::GetShared());
+    MassAssignmentType GetAssignment() const { return assignment_; }
+    LengthType GetBoxSize() const { return box_size_; }
+    LengthType GetCellSize() const { return box_size_ / num_cells_; }
+    // Returns the mass per unit volume in each cell, indexed with the last coordinate fastest
+    std::vector<double> GetDensity() const;
+    size_t GetNumCells() const { return num_cells_; }
+    double GetTotalMass() const { return total_mass_; }
+private:
+    DensityMesh();
+    void DepositParticle_(double mass, const double *cell_coords);
+    MassAssignmentType assignment_;
+    LengthType box_size_;
+    std::vector<double> grid_;        // Padded along the last axis, see GetPaddedFftSize()
+    size_t num_cells_;
+    double total_mass_;
+    double total_squared_mass_;       // Sum of the squares of the particle masses
+    bool transformed_;                // Whether grid_ holds the Fourier transform
+};
+
+#endif // density_mesh_hpp
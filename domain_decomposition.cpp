@@ -0,0 +1,62 @@
+// Implementation of the DomainDecomposition class
+
+#include "domain_decomposition.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "globals.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "process_group.hpp"
+#include "selection.hpp"
+
+DomainDecomposition::DomainDecomposition(LengthType box_size, ProcessGroup &group,
+                                         int domains_per_side) :
+box_size_(box_size), domains_per_side_(domains_per_side), group_(group), num_domains_(1) {
+    if (!(box_size > 0))
+        throw std::invalid_argument("DomainDecomposition: Box size must be positive");
+    if (domains_per_side < 1)
+        throw std::invalid_argument("DomainDecomposition: Need at least one domain per side");
+    for (int idim = 0; idim < kNDims; ++idim)
+        num_domains_ *= domains_per_side;
+    for (size_t idomain = group.GetRank(); idomain < num_domains_; idomain += group.GetSize())
+        local_domains_.push_back(idomain);
+}
+
+// Finds the domain of each particle from its position wrapped into the box, last dimension
+// fastest.  Positions that round to the upper face of the box are put in the last domain.
+std::vector<Selection> DomainDecomposition::SelectLocalDomains(
+        const ParticleStore &particles) const {
+    // Index of each domain among the local domains, or -1 for those of other processes
+    std::vector<int> local_indices(num_domains_, -1);
+    for (size_t ilocal = 0; ilocal < local_domains_.size(); ++ilocal)
+        local_indices[local_domains_[ilocal]] = ilocal;
+
+    std::array<const LengthType *,kNDims> positions;
+    for (int idim = 0; idim < kNDims; ++idim)
+        positions[idim] = particles.position[idim].data();
+    std::vector<std::vector<size_t>> domain_particles(local_domains_.size());
+    double domains_per_length = domains_per_side_ / box_size_;
+    for (size_t ipart = 0; ipart < particles.size(); ++ipart) {
+        size_t idomain = 0;
+        for (int idim = 0; idim < kNDims; ++idim) {
+            LengthType position = WrapPosition(positions[idim][ipart], box_size_);
+            int coord = std::min(static_cast<int>(position * domains_per_length),
+                                 domains_per_side_ - 1);
+            idomain = idomain * domains_per_side_ + coord;
+        }
+        if (local_indices[idomain] >= 0)
+            domain_particles[local_indices[idomain]].push_back(ipart);
+    }
+
+    std::vector<Selection> selections;
+    for (std::vector<size_t> &indices : domain_particles)
+        selections.push_back(Selection::FromIndices(std::move(indices), particles.size()));
+    return selections;
+}
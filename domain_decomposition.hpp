@@ -0,0 +1,66 @@
+// Interface for the DomainDecomposition class, which shares the analysis of a snapshot between
+// the processes of a parallel run
+
+#ifndef domain_decomposition_hpp
+#define domain_decomposition_hpp
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "byte_buffer.hpp"
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "process_group.hpp"
+#include "selection.hpp"
+
+// Number of domains along each side of the box
+const int kDomainsPerSide = 4;
+
+// Splits the simulation box into a fixed grid of domains, dealt out to the processes of a group in
+// turn (domain d belongs to rank d % GetSize()).  Each process analyses the particles of its own
+// domains into partial results, which Reduce() gathers and adds in domain order on every process,
+// so the totals are the same for any number of processes.
+// Usage: DomainDecomposition domains(box_size, ProcessGroup::GetWorld());
+//        domains.Reduce(partial_profiles, total_profile)
+class DomainDecomposition {
+public:
+    DomainDecomposition(LengthType box_size, ProcessGroup &group,
+                        int domains_per_side = kDomainsPerSide);
+    // Returns the domains of this process, in increasing order
+    const std::vector<size_t> &GetLocalDomains() const { return local_domains_; }
+    size_t GetNumDomains() const { return num_domains_; }
+    // Returns the selection of the particles of the store in each local domain
+    std::vector<Selection> SelectLocalDomains(const ParticleStore &particles) const;
+
+    // Adds the partial results of all the domains to [total], in domain order, on every process.
+    // [local_partials] are the results of the local domains, in the order of GetLocalDomains().
+    // PartialType needs Serialise() and AddSerialised() (see RadialProfile).
+    template <typename PartialType>
+    void Reduce(const std::vector<PartialType> &local_partials, PartialType &total) const {
+        if (local_partials.size() != local_domains_.size())
+            throw std::invalid_argument("DomainDecomposition: Need one partial result per local "
+                                        "domain");
+        std::string bytes;
+        for (const PartialType &partial : local_partials)
+            AppendBytes(bytes, partial.Serialise());
+        std::vector<std::string> gathered = group_.AllGather(bytes);
+        std::vector<std::string> domain_bytes(num_domains_);
+        for (int irank = 0; irank < group_.GetSize(); ++irank) {
+            size_t offset = 0;
+            for (size_t idomain = irank; idomain < num_domains_; idomain += group_.GetSize())
+                ReadBytes(gathered[irank], offset, domain_bytes[idomain]);
+        }
+        for (const std::string &partial_bytes : domain_bytes)
+            total.AddSerialised(partial_bytes);
+    }
+private:
+    DomainDecomposition();
+    LengthType box_size_;
+    int domains_per_side_;
+    ProcessGroup &group_;
+    std::vector<size_t> local_domains_;
+    size_t num_domains_;
+};
+
+#endif // domain_decomposition_hpp
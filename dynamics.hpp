@@ -1,78 +1,267 @@
-// Defines various functions to compute spatial and dynamical properties of particle vectors
+// Defines various functions to compute spatial and dynamical properties of particle stores, or of
+// a selection of the particles of a store.  They share one fused, parallel reduction over the
+// mass, position and velocity columns (see ComputeDynamics()).
 
 #ifndef dynamics_hpp
 #define dynamics_hpp
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "byte_buffer.hpp"
+#include "compensated_sum.hpp"
 #include "globals.hpp"
-#include "simulation.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
 
-// Returns the centre of mass of a vector of particles
-template <typename ParticleType>
-PosCoordsType ComputeCentreOfMass (std::vector<ParticleType> &particle_list) {
-    
-    // N.B. Uniform initialisation here would fail when dimensionality is changed.
+// Particles are reduced in chunks of at least kMinDynamicsChunkSize, with at most
+// kMaxDynamicsChunks of them.  Within a chunk, the moments of each block of kDynamicsBlockSize
+// particles are summed directly, and then added to compensated sums.
+const size_t kMinDynamicsChunkSize = 65536;
+const size_t kMaxDynamicsChunks    = 1024;
+const size_t kDynamicsBlockSize    = 256;
+
+// Mass-weighted properties of a set of particles, from ComputeDynamics()
+struct DynamicsSummary {
+    size_t num_particles;
+    MassType total_mass;
     PosCoordsType centre_of_mass;
-    for (int idim = 0; idim < kNDims; ++idim)
-        centre_of_mass[idim] = 0;
-    
-    for (auto p : particle_list) {
-        PosCoordsType p_position = p.GetPosition();
-        MassType p_mass          = p.GetMass();
+    VelCoordsType bulk_velocity;       // Mass-weighted mean velocity
+    VelCoordsType angular_momentum;    // Specific, about the origin (3D only, otherwise zero)
+    VelocityType velocity_dispersion;  // 3D, mass-weighted, about the bulk velocity
+};
+
+// Sums of the mass-weighted moments of a few particles
+struct DynamicsMoments {
+    double mass = 0;
+    std::array<double,kNDims> mass_position    = {};
+    std::array<double,kNDims> mass_velocity    = {};
+    std::array<double,kNDims> angular_momentum = {};
+    double mass_speed_squared = 0;
+    size_t num_particles      = 0;
+};
+
+// Compensated sums of the moments of many particles, which can be serialised to bytes so that
+// the partial sums of several processes can be merged.  Positions are summed as displacements from
+// [reference], which are periodic in a box of [periodic_box_size] if it's positive.
+struct DynamicsAccumulator {
+    PosCoordsType reference = {};
+    LengthType periodic_box_size = 0;
+    CompensatedSum mass;
+    std::array<CompensatedSum,kNDims> mass_position;
+    std::array<CompensatedSum,kNDims> mass_velocity;
+    std::array<CompensatedSum,kNDims> angular_momentum;
+    CompensatedSum mass_speed_squared;
+    size_t num_particles = 0;
+    void Add(const DynamicsMoments &moments) {
+        mass.Add(moments.mass);
+        for (int idim = 0; idim < kNDims; ++idim) {
+            mass_position[idim].Add(moments.mass_position[idim]);
+            mass_velocity[idim].Add(moments.mass_velocity[idim]);
+            angular_momentum[idim].Add(moments.angular_momentum[idim]);
+        }
+        mass_speed_squared.Add(moments.mass_speed_squared);
+        num_particles += moments.num_particles;
+    }
+    // Adds the sums of [other], moving its positions to this reference (an empty accumulator takes
+    // the reference of the first one added)
+    void Add(const DynamicsAccumulator &other) {
+        if (num_particles == 0) {
+            reference         = other.reference;
+            periodic_box_size = other.periodic_box_size;
+        }
+        mass.Add(other.mass);
+        for (int idim = 0; idim < kNDims; ++idim) {
+            mass_position[idim].Add(other.mass_position[idim]);
+            mass_position[idim].Add(other.mass.Get() *
+                                    GetPeriodicDisplacement(other.reference[idim] -
+                                                            reference[idim], periodic_box_size));
+            mass_velocity[idim].Add(other.mass_velocity[idim]);
+            angular_momentum[idim].Add(other.angular_momentum[idim]);
+        }
+        mass_speed_squared.Add(other.mass_speed_squared);
+        num_particles += other.num_particles;
+    }
+    // Returns the sums as bytes, e.g. to send the partial sums of one process to another
+    std::string Serialise() const {
+        std::string bytes;
+        AppendBytes(bytes, *this);
+        return bytes;
+    }
+    // Adds the sums of another accumulator, from the [bytes] its Serialise() returned
+    void AddSerialised(const std::string &bytes) {
+        DynamicsAccumulator other;
+        size_t offset = 0;
+        ReadBytes(bytes, offset, other);
+        if (offset != bytes.size())
+            throw std::invalid_argument("DynamicsAccumulator: Bytes aren't one accumulator's");
+        Add(other);
+    }
+    // Returns the centre of mass, wrapped into the periodic box
+    PosCoordsType GetCentreOfMass() const {
+        PosCoordsType centre_of_mass;
         for (int idim = 0; idim < kNDims; ++idim)
-            centre_of_mass[idim] += p_position[idim] * p_mass;
+            centre_of_mass[idim] = WrapPosition(reference[idim] + mass_position[idim].Get() /
+                                                mass.Get(), periodic_box_size);
+        return centre_of_mass;
+    }
+};
+
+// Sums the moments of the [selection] of particles in a store.  Each fixed-size chunk of the store
+// is summed into its own accumulator on the threads of [pool], and these are merged in chunk order,
+// so the result doesn't depend on the number of threads.  In a periodic store, positions are
+// summed as minimum-image displacements from the first particle of each chunk, so groups
+// straddling a face of the box keep their centre.  Velocity columns are only read if
+// kWithVelocities is set.
+template <bool kWithVelocities, typename StoreType>
+DynamicsAccumulator AccumulateDynamics(const StoreType &particles, const Selection &selection,
+                                       ThreadPool &pool) {
+    size_t num_particles   = selection.GetUniverseSize();
+    size_t even_chunk_size = (num_particles + kMaxDynamicsChunks - 1) / kMaxDynamicsChunks;
+    size_t chunk_size      = std::max(kMinDynamicsChunkSize, even_chunk_size);
+    size_t num_chunks      = (num_particles + chunk_size - 1) / chunk_size;
+    std::vector<DynamicsAccumulator> chunk_sums(num_chunks);
+
+    LengthType box_size    = particles.GetPeriodicBoxSize();
+    const MassType *p_mass = particles.mass.data();
+    std::array<const LengthType *,kNDims> p_position;
+    std::array<const VelocityType *,kNDims> p_velocity;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        p_position[idim] = particles.position[idim].data();
+        p_velocity[idim] = kWithVelocities ? particles.velocity[idim].data() : nullptr;
+    }
+    pool.ParallelFor(num_chunks, [&](size_t ichunk, int) {
+        DynamicsAccumulator &sums = chunk_sums[ichunk];
+        sums.periodic_box_size    = box_size;
+        bool has_reference        = !(box_size > 0);
+        DynamicsMoments block;
+        size_t first = ichunk * chunk_size;
+        selection.ForEachInRange(first, first + chunk_size, [&](size_t ipart) {
+            if (!has_reference) {
+                for (int idim = 0; idim < kNDims; ++idim)
+                    sums.reference[idim] = p_position[idim][ipart];
+                has_reference = true;
+            }
+            double mass = p_mass[ipart];
+            block.mass += mass;
+            for (int idim = 0; idim < kNDims; ++idim)
+                block.mass_position[idim] += mass * GetPeriodicDisplacement(
+                    p_position[idim][ipart] - sums.reference[idim], box_size);
+            if (kWithVelocities) {
+                double speed_squared = 0;
+                for (int idim = 0; idim < kNDims; ++idim) {
+                    block.mass_velocity[idim] += mass * p_velocity[idim][ipart];
+                    speed_squared += p_velocity[idim][ipart] * p_velocity[idim][ipart];
+                }
+                block.mass_speed_squared += mass * speed_squared;
+                if (kNDims == 3) {
+                    // N.B. Indices only valid in 3D, which the condition ensures
+                    const LengthType x[3]   = {p_position[0][ipart], p_position[1][ipart],
+                                               p_position[kNDims - 1][ipart]};
+                    const VelocityType v[3] = {p_velocity[0][ipart], p_velocity[1][ipart],
+                                               p_velocity[kNDims - 1][ipart]};
+                    block.angular_momentum[0] += mass * (x[1] * v[2] - x[2] * v[1]);
+                    block.angular_momentum[1] += mass * (x[2] * v[0] - x[0] * v[2]);
+                    block.angular_momentum[kNDims - 1] += mass * (x[0] * v[1] - x[1] * v[0]);
+                }
+            }
+            if (++block.num_particles == kDynamicsBlockSize) {
+                sums.Add(block);
+                block = DynamicsMoments();
+            }
+        });
+        sums.Add(block);
+    });
+
+    DynamicsAccumulator total;
+    for (const DynamicsAccumulator &sums : chunk_sums)
+        total.Add(sums);
+    return total;
+}
+
+// Returns the properties of the particles whose moments (with velocities) have been summed in
+// [sums], which may have been added up from several stores, e.g. the chunks of a snapshot too
+// large for memory
+inline DynamicsSummary SummariseDynamics(const DynamicsAccumulator &sums) {
+    DynamicsSummary summary;
+    double total_mass     = sums.mass.Get();
+    summary.num_particles = sums.num_particles;
+    summary.total_mass    = total_mass;
+    summary.centre_of_mass    = sums.GetCentreOfMass();
+    double bulk_speed_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        summary.bulk_velocity[idim]    = sums.mass_velocity[idim].Get() / total_mass;
+        summary.angular_momentum[idim] = sums.angular_momentum[idim].Get() / total_mass;
+        bulk_speed_squared += summary.bulk_velocity[idim] * summary.bulk_velocity[idim];
     }
-    for (int idim = 0; idim < kNDims; ++idim)
-        centre_of_mass[idim] /= particle_list.size();
-    
-    return centre_of_mass;
+    // <|v - <v>|^2> = <v^2> - |<v>|^2, which can't be negative other than through rounding
+    double dispersion_squared   = sums.mass_speed_squared.Get() / total_mass - bulk_speed_squared;
+    summary.velocity_dispersion = std::sqrt(std::max(dispersion_squared, 0.));
+    return summary;
+}
+
+// Returns the total mass, centre of mass, bulk velocity, specific angular momentum and velocity
+// dispersion of the [selection] of particles in a store, from a single parallel pass over its
+// mass, position and velocity columns.  Sums are compensated (see CompensatedSum), so they stay
+// accurate for large stores and are identical for any number of threads.
+template <typename StoreType>
+DynamicsSummary ComputeDynamics(const StoreType &particles, const Selection &selection,
+                                ThreadPool &pool = ThreadPool::GetShared()) {
+    return SummariseDynamics(AccumulateDynamics<true>(particles, selection, pool));
+}
+
+// Returns the properties above for a store of particles
+template <typename StoreType>
+DynamicsSummary ComputeDynamics(const StoreType &particles,
+                                ThreadPool &pool = ThreadPool::GetShared()) {
+    return ComputeDynamics(particles, Selection::All(particles.size()), pool);
+}
+
+// Returns the centre of mass of the [selection] of particles in a store (wrapped into the box if
+// it's periodic).  Only the mass and position columns are read.
+template <typename StoreType>
+PosCoordsType ComputeCentreOfMass (const StoreType &particles, const Selection &selection) {
+    return AccumulateDynamics<false>(particles, selection,
+                                     ThreadPool::GetShared()).GetCentreOfMass();
+}
+
+// Returns the centre of mass of a store of particles
+template <typename StoreType>
+PosCoordsType ComputeCentreOfMass (const StoreType &particles) {
+    return ComputeCentreOfMass(particles, Selection::All(particles.size()));
 }
 
-// Returns the *specific* angular momentum vector [L_dot = (r x rho) / m] for a vector of
-// particles.  Throws exception if compiled with NDIMS=2, since angular momentum isn't defined.
-template <typename ParticleType>
-VelCoordsType ComputeAngularMomentum(std::vector<ParticleType> &particle_list) {
+// Returns the *specific* angular momentum vector [L_dot = (r x rho) / m] for the [selection] of
+// particles in a store.  Throws exception if compiled with NDIMS=2, since angular momentum isn't
+// defined.
+template <typename StoreType>
+VelCoordsType ComputeAngularMomentum(const StoreType &particles, const Selection &selection) {
     if (kNDims == 2)
         throw std::logic_error("ComputeAngularMomentum() requires 3D (compile with NDIMS=3)");
-    
-    // N.B. Uniform initialisation here would fail when dimensionality is changed.
-    VelCoordsType ang_mom;
-    for (int idim = 0; idim < kNDims; ++idim)
-        ang_mom[idim] = 0;
-    
-    MassType total_mass = 0;
-    for (auto p : particle_list) {
-        PosCoordsType p_position = p.GetPosition();
-        VelCoordsType p_velocity = p.GetVelocity();
-        MassType p_mass          = p.GetMass();
-        ang_mom[0] += p_mass * (p_position[1] * p_velocity[2] - p_position[2] * p_velocity[1]);
-        ang_mom[1] += p_mass * (p_position[2] * p_velocity[0] - p_position[0] * p_velocity[2]);
-        ang_mom[2] += p_mass * (p_position[0] * p_velocity[1] - p_position[1] * p_velocity[0]);
-        total_mass += p_mass;
-    }
-    // Normalise to total mass
-    for (int idim = 0; idim < kNDims; ++idim)
-        ang_mom[idim] /= total_mass;
-    
-    return ang_mom;
+    return ComputeDynamics(particles, selection).angular_momentum;
 }
 
-// Returns the 3D, mass-weighted velocity dispersion for a vector of particles.
-template <typename ParticleType>
-VelocityType ComputeVelocityDispersion(std::vector<ParticleType> &particle_list) {
-    VelocityType first_term = 0, second_term = 0;
-    MassType total_mass = 0;
-    for (auto p : particle_list) {
-        VelCoordsType p_velocity = p.GetVelocity();
-        MassType p_mass          = p.GetMass();
-        for (int idim = 0; idim < kNDims; idim++) {
-            first_term  += p_mass * p_velocity[idim] * p_velocity[idim];
-            second_term += p_mass * p_mass * p_velocity[idim] * p_velocity[idim];
-        }
-        total_mass += p_mass;
-    }
-    return std::sqrt((first_term / total_mass) - second_term / (total_mass * total_mass));
+// Returns the *specific* angular momentum vector for a store of particles (see above)
+template <typename StoreType>
+VelCoordsType ComputeAngularMomentum(const StoreType &particles) {
+    return ComputeAngularMomentum(particles, Selection::All(particles.size()));
+}
+
+// Returns the 3D, mass-weighted velocity dispersion for the [selection] of particles in a store.
+template <typename StoreType>
+VelocityType ComputeVelocityDispersion(const StoreType &particles, const Selection &selection) {
+    return ComputeDynamics(particles, selection).velocity_dispersion;
+}
+
+// Returns the 3D, mass-weighted velocity dispersion for a store of particles.
+template <typename StoreType>
+VelocityType ComputeVelocityDispersion(const StoreType &particles) {
+    return ComputeVelocityDispersion(particles, Selection::All(particles.size()));
 }
 #endif // dynamics_hpp
@@ -0,0 +1,181 @@
+// Implementation of the fast Fourier transforms
+
+#include "fft.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "globals.hpp"
+#include "thread_pool.hpp"
+
+// Number of lines transformed by each task
+const size_t kFftLinesPerTask = 64;
+
+typedef std::complex<double> ComplexType;
+
+// Returns a * b, without the checks for infinities made by std::complex's operator*
+static inline ComplexType Multiply(const ComplexType &a, const ComplexType &b) {
+    return ComplexType(a.real() * b.real() - a.imag() * b.imag(),
+                       a.real() * b.imag() + a.imag() * b.real());
+}
+
+static void CheckFftSize(size_t n) {
+    if (n < 2 || (n & (n - 1)) != 0)
+        throw std::invalid_argument("FFT: Size must be a power of 2, not " + std::to_string(n));
+}
+
+std::vector<ComplexType> GetFftTwiddles(size_t n) {
+    std::vector<ComplexType> twiddles(n / 2);
+    for (size_t j = 0; j < n / 2; ++j)
+        twiddles[j] = std::polar(1., -2 * M_PI * j / n);
+    return twiddles;
+}
+
+void TransformComplex(ComplexType *values, size_t n, const std::vector<ComplexType> &twiddles,
+                      bool inverse) {
+    // Put the values in bit-reversed order, then combine pairs of transforms of doubling length
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(values[i], values[j]);
+    }
+    for (size_t length = 2; length <= n; length <<= 1) {
+        size_t half_length = length / 2;
+        size_t step        = n / length;
+        for (size_t first = 0; first < n; first += length) {
+            ComplexType *p_even = values + first;
+            ComplexType *p_odd  = p_even + half_length;
+            for (size_t k = 0; k < half_length; ++k) {
+                ComplexType twiddle = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+                ComplexType odd     = Multiply(p_odd[k], twiddle);
+                p_odd[k]  = p_even[k] - odd;
+                p_even[k] += odd;
+            }
+        }
+    }
+}
+
+// Transforms a real line of [n] values in place, as a complex line of n / 2 values (the even and
+// odd values as real and imaginary parts), which is then split into the transforms of the even
+// and odd values, E_k and O_k, and recombined as X_k = E_k + exp(-2 pi i k / n) O_k.  The line
+// must have room for n / 2 + 1 complex values.
+static void ForwardRealLine(double *line, size_t n, const std::vector<ComplexType> &half_twiddles,
+                            const std::vector<ComplexType> &twiddles) {
+    ComplexType *values = reinterpret_cast<ComplexType *>(line);
+    size_t half = n / 2;
+    TransformComplex(values, half, half_twiddles, false);
+    values[half] = values[0];
+    const ComplexType kMinusHalfI(0, -0.5);
+    for (size_t k = 0; k <= half / 2; ++k) {
+        size_t k_mirror    = half - k;
+        ComplexType value  = values[k];
+        ComplexType mirror = values[k_mirror];
+        ComplexType even   = (value + std::conj(mirror)) * 0.5;
+        ComplexType odd    = Multiply(value - std::conj(mirror), kMinusHalfI);
+        ComplexType mirror_even = (mirror + std::conj(value)) * 0.5;
+        ComplexType mirror_odd  = Multiply(mirror - std::conj(value), kMinusHalfI);
+        // exp(-2 pi i (n / 2 - k) / n) = -conj(exp(-2 pi i k / n))
+        values[k]        = even + Multiply(twiddles[k], odd);
+        values[k_mirror] = mirror_even - Multiply(std::conj(twiddles[k]), mirror_odd);
+    }
+}
+
+// Inverts ForwardRealLine(), without dividing by n
+static void InverseRealLine(double *line, size_t n, const std::vector<ComplexType> &half_twiddles,
+                            const std::vector<ComplexType> &twiddles) {
+    ComplexType *values = reinterpret_cast<ComplexType *>(line);
+    size_t half = n / 2;
+    const ComplexType kI(0, 1);
+    for (size_t k = 0; k <= half / 2; ++k) {
+        size_t k_mirror    = half - k;
+        ComplexType value  = values[k];
+        ComplexType mirror = values[k_mirror];
+        ComplexType even   = (value + std::conj(mirror)) * 0.5;
+        ComplexType odd    = Multiply((value - std::conj(mirror)) * 0.5, std::conj(twiddles[k]));
+        ComplexType mirror_even = (mirror + std::conj(value)) * 0.5;
+        ComplexType mirror_odd  = -Multiply((mirror - std::conj(value)) * 0.5, twiddles[k]);
+        values[k]        = even + Multiply(kI, odd);
+        values[k_mirror] = mirror_even + Multiply(kI, mirror_odd);
+    }
+    TransformComplex(values, half, half_twiddles, true);
+    for (size_t i = 0; i < n; ++i)
+        line[i] *= 2;
+    line[n]     = 0;
+    line[n + 1] = 0;
+}
+
+// Transforms each line of the real grid along its last axis
+static void TransformRealLines(std::vector<double> &grid, size_t n, bool inverse,
+                               ThreadPool &pool) {
+    std::vector<ComplexType> half_twiddles = GetFftTwiddles(n / 2);
+    std::vector<ComplexType> twiddles      = GetFftTwiddles(n);
+    size_t padded_size = GetPaddedFftSize(n);
+    size_t num_lines   = grid.size() / padded_size;
+    size_t num_tasks   = (num_lines + kFftLinesPerTask - 1) / kFftLinesPerTask;
+    pool.ParallelFor(num_tasks, [&](size_t itask, int) {
+        size_t last = std::min((itask + 1) * kFftLinesPerTask, num_lines);
+        for (size_t iline = itask * kFftLinesPerTask; iline < last; ++iline) {
+            double *line = grid.data() + iline * padded_size;
+            if (inverse)
+                InverseRealLine(line, n, half_twiddles, twiddles);
+            else
+                ForwardRealLine(line, n, half_twiddles, twiddles);
+        }
+    });
+}
+
+// Transforms the complex lines along axis [iaxis] (< kNDims - 1) of a grid transformed along its
+// last axis.  Each line is copied to a contiguous buffer, transformed and copied back.
+static void TransformComplexLines(std::vector<double> &grid, size_t n, int iaxis, bool inverse,
+                                  ThreadPool &pool) {
+    std::vector<ComplexType> twiddles = GetFftTwiddles(n);
+    ComplexType *values = reinterpret_cast<ComplexType *>(grid.data());
+    size_t stride = GetPaddedFftSize(n) / 2;
+    for (int jaxis = iaxis + 1; jaxis < kNDims - 1; ++jaxis)
+        stride *= n;
+    size_t num_lines = grid.size() / 2 / n;
+    size_t num_tasks = (num_lines + kFftLinesPerTask - 1) / kFftLinesPerTask;
+    pool.ParallelFor(num_tasks, [&](size_t itask, int) {
+        std::vector<ComplexType> buffer(n);
+        size_t last = std::min((itask + 1) * kFftLinesPerTask, num_lines);
+        for (size_t iline = itask * kFftLinesPerTask; iline < last; ++iline) {
+            ComplexType *line = values + (iline / stride) * n * stride + iline % stride;
+            for (size_t i = 0; i < n; ++i)
+                buffer[i] = line[i * stride];
+            TransformComplex(buffer.data(), n, twiddles, inverse);
+            for (size_t i = 0; i < n; ++i)
+                line[i * stride] = buffer[i];
+        }
+    });
+}
+
+static void CheckGridSize(const std::vector<double> &grid, size_t n) {
+    CheckFftSize(n);
+    size_t size = GetPaddedFftSize(n);
+    for (int idim = 1; idim < kNDims; ++idim)
+        size *= n;
+    if (grid.size() != size)
+        throw std::invalid_argument("FFT: Grid has the wrong size for " + std::to_string(n) +
+                                    " cells per side");
+}
+
+void ForwardRealFft(std::vector<double> &grid, size_t n, ThreadPool &pool) {
+    CheckGridSize(grid, n);
+    TransformRealLines(grid, n, false, pool);
+    for (int iaxis = kNDims - 2; iaxis >= 0; --iaxis)
+        TransformComplexLines(grid, n, iaxis, false, pool);
+}
+
+void InverseRealFft(std::vector<double> &grid, size_t n, ThreadPool &pool) {
+    CheckGridSize(grid, n);
+    for (int iaxis = 0; iaxis < kNDims - 1; ++iaxis)
+        TransformComplexLines(grid, n, iaxis, true, pool);
+    TransformRealLines(grid, n, true, pool);
+}
@@ -0,0 +1,39 @@
+// Defines fast Fourier transforms of complex lines and of real grids
+
+#ifndef fft_hpp
+#define fft_hpp
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+#include "globals.hpp"
+#include "thread_pool.hpp"
+
+// Returns the factors exp(-2 pi i j / n) for j < n / 2, used by TransformComplex()
+std::vector<std::complex<double>> GetFftTwiddles(size_t n);
+
+// Transforms [n] complex values in place with the radix-2 Cooley-Tukey algorithm: forward,
+// X_k = sum_j x_j exp(-2 pi i j k / n), or [inverse], with exp(+2 pi i j k / n) and without
+// dividing by n.  [n] must be a power of 2, and [twiddles] from GetFftTwiddles(n).
+void TransformComplex(std::complex<double> *values, size_t n,
+                      const std::vector<std::complex<double>> &twiddles, bool inverse);
+
+// Returns the number of doubles along the last axis of a real grid with [n] cells per side that
+// is to be transformed in place: n + 2, to hold the n / 2 + 1 complex values left by the transform
+inline size_t GetPaddedFftSize(size_t n) { return 2 * (n / 2 + 1); }
+
+// Transforms a real kNDims-dimensional grid of [n] cells per side in place.  The grid is stored
+// with the last index fastest, each line of the last axis padded to GetPaddedFftSize(n) doubles.
+// The result is the complex transform for wavenumbers 0 to n / 2 along the last axis (the others
+// follow from the symmetry of real data), and all wavenumbers along the other axes, in the
+// usual order (0, 1, ..., n / 2, -n / 2 + 1, ..., -1).  Each line of the last axis is transformed
+// as a complex line of half the length, and then the lines of each other axis in turn, shared out
+// between threads.  [n] must be a power of 2.
+void ForwardRealFft(std::vector<double> &grid, size_t n,
+                    ThreadPool &pool = ThreadPool::GetShared());
+
+// Inverts ForwardRealFft(), without dividing by the number of cells, n^kNDims
+void InverseRealFft(std::vector<double> &grid, size_t n,
+                    ThreadPool &pool = ThreadPool::GetShared());
+
+#endif // fft_hpp
@@ -0,0 +1,123 @@
+// Implementation of the vectorised filter kernels.  The AVX2 and AVX-512 versions are compiled for
+// those instruction sets with function attributes, so the rest of the code needn't be, and are
+// only called if the CPU reports support for them.
+
+#include "filter_kernels.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_KERNELS_X86
+#endif
+
+typedef void (*CompareKernelType)(const float *values, size_t num_words, float threshold,
+                                  bool less_than, uint64_t *bits);
+
+// Compares [num_values] < 64 values into one word
+static uint64_t CompareWordScalar(const float *values, size_t num_values, float threshold,
+                                  bool less_than) {
+    uint64_t word = 0;
+    if (less_than) {
+        for (size_t ival = 0; ival < num_values; ++ival)
+            word |= uint64_t(values[ival] < threshold) << ival;
+    } else {
+        for (size_t ival = 0; ival < num_values; ++ival)
+            word |= uint64_t(values[ival] > threshold) << ival;
+    }
+    return word;
+}
+
+// Each kernel fills [num_words] complete words (64 values each)
+static void CompareScalar(const float *values, size_t num_words, float threshold, bool less_than,
+                          uint64_t *bits) {
+    for (size_t iword = 0; iword < num_words; ++iword)
+        bits[iword] = CompareWordScalar(values + 64 * iword, 64, threshold, less_than);
+}
+
+#ifdef FILTER_KERNELS_X86
+__attribute__((target("avx2")))
+static void CompareAvx2(const float *values, size_t num_words, float threshold, bool less_than,
+                        uint64_t *bits) {
+    const __m256 kThreshold = _mm256_set1_ps(threshold);
+    for (size_t iword = 0; iword < num_words; ++iword) {
+        const float *word_values = values + 64 * iword;
+        uint64_t word = 0;
+        for (int iblock = 0; iblock < 8; ++iblock) {
+            __m256 block = _mm256_loadu_ps(word_values + 8 * iblock);
+            __m256 match = less_than ? _mm256_cmp_ps(block, kThreshold, _CMP_LT_OQ) :
+                                       _mm256_cmp_ps(block, kThreshold, _CMP_GT_OQ);
+            word |= uint64_t(_mm256_movemask_ps(match)) << (8 * iblock);
+        }
+        bits[iword] = word;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void CompareAvx512(const float *values, size_t num_words, float threshold, bool less_than,
+                          uint64_t *bits) {
+    const __m512 kThreshold = _mm512_set1_ps(threshold);
+    for (size_t iword = 0; iword < num_words; ++iword) {
+        const float *word_values = values + 64 * iword;
+        uint64_t word = 0;
+        for (int iblock = 0; iblock < 4; ++iblock) {
+            __m512 block    = _mm512_loadu_ps(word_values + 16 * iblock);
+            __mmask16 match = less_than ? _mm512_cmp_ps_mask(block, kThreshold, _CMP_LT_OQ) :
+                                          _mm512_cmp_ps_mask(block, kThreshold, _CMP_GT_OQ);
+            word |= uint64_t(match) << (16 * iblock);
+        }
+        bits[iword] = word;
+    }
+}
+#endif
+
+static std::string &KernelName() {
+    static std::string kernel_name;
+    return kernel_name;
+}
+
+// Picks the widest kernel the CPU supports, unless $PARTICLE_SIM_SIMD asks for a narrower one
+static CompareKernelType SelectKernel() {
+    const char *env_kernel = std::getenv("PARTICLE_SIM_SIMD");
+    std::string requested  = env_kernel != nullptr ? env_kernel : "";
+#ifdef FILTER_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && (requested.empty() || requested == "avx512")) {
+        KernelName() = "avx512";
+        return CompareAvx512;
+    }
+    if (__builtin_cpu_supports("avx2") && requested != "scalar") {
+        KernelName() = "avx2";
+        return CompareAvx2;
+    }
+#endif
+    KernelName() = "scalar";
+    return CompareScalar;
+}
+
+static CompareKernelType GetKernel() {
+    static const CompareKernelType kernel = SelectKernel();
+    return kernel;
+}
+
+size_t CompareToBitmap(const float *values, size_t num_values, float threshold, bool less_than,
+                       uint64_t *bits) {
+    size_t num_full_words = num_values / 64;
+    GetKernel()(values, num_full_words, threshold, less_than, bits);
+    size_t num_remaining = num_values % 64;
+    if (num_remaining > 0)
+        bits[num_full_words] = CompareWordScalar(values + 64 * num_full_words, num_remaining,
+                                                 threshold, less_than);
+    size_t num_set = 0;
+    for (size_t iword = 0; iword < (num_values + 63) / 64; ++iword)
+        num_set += __builtin_popcountll(bits[iword]);
+    return num_set;
+}
+
+std::string GetFilterKernelName() {
+    GetKernel();
+    return KernelName();
+}
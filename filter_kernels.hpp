@@ -0,0 +1,21 @@
+// Declares the vectorised comparison kernels used by the particle filters
+
+#ifndef filter_kernels_hpp
+#define filter_kernels_hpp
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Compares [num_values] floats with [threshold] and packs the results into a bitmap: bit (i % 64)
+// of bits[i / 64] is set if values[i] < threshold (less_than = true) or values[i] > threshold.
+// Writes (num_values + 63) / 64 words, with unused bits of the last word cleared, and returns the
+// number of bits set.  NaNs never match.  Uses AVX-512 (16 values per instruction) or AVX2 (8) when
+// the CPU supports them, otherwise a scalar loop.  The kernel is chosen on first use, and can be
+// forced with $PARTICLE_SIM_SIMD = "avx512", "avx2" or "scalar" (e.g. to compare them).
+size_t CompareToBitmap(const float *values, size_t num_values, float threshold, bool less_than,
+                       uint64_t *bits);
+
+// Name of the kernel CompareToBitmap() uses ("avx512", "avx2" or "scalar")
+std::string GetFilterKernelName();
+
+#endif // filter_kernels_hpp
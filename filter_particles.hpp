@@ -1,14 +1,21 @@
-// Defines template functions to filter vectors of Particle, StarParticle and GasParticle objects.
+// Defines template functions to select particles from ParticleStore, GasStore and StarStore data,
+// either with a single FilterType condition or with an expression combining several of them.
 // Defines an enumerator to describe the available filter types.
 
 #ifndef filter_particles_hpp
 #define filter_particles_hpp
 #include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
-#include "gas_particle.hpp"
-#include "particle.hpp"
-#include "star_particle.hpp"
+#include "column.hpp"
+#include "filter_kernels.hpp"
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
 
 enum FilterType {
     AGE_GT,
@@ -21,90 +28,279 @@ enum FilterType {
     TEMPERATURE_LT
 };
 
-// Returns a new vector<Particle> filtered according to [filter_by].  An appropriate Lambda function
-// is defined and passed to std::copy_if to select elements of the input vector that satisfy the
-// condition.
+// The particle property each FilterType compares
+enum FilterFieldType {
+    FILTER_AGE,
+    FILTER_MASS,
+    FILTER_METALLICITY,
+    FILTER_TEMPERATURE
+};
+
+constexpr FilterFieldType GetFilterField(FilterType filter) {
+    return (filter == AGE_GT || filter == AGE_LT) ? FILTER_AGE :
+           (filter == MASS_GT || filter == MASS_LT) ? FILTER_MASS :
+           (filter == METALLICITY_GT || filter == METALLICITY_LT) ? FILTER_METALLICITY :
+           FILTER_TEMPERATURE;
+}
+
+constexpr bool IsLessThanFilter(FilterType filter) {
+    return filter == AGE_LT || filter == MASS_LT || filter == METALLICITY_LT ||
+           filter == TEMPERATURE_LT;
+}
+
+// Returns the column of a store that a FilterFieldType refers to.  Using a field the store doesn't
+// have (e.g. FILTER_AGE on a GasStore) fails to compile.
+template <FilterFieldType kField>
+struct FilterColumnAccessor;
+
+template <>
+struct FilterColumnAccessor<FILTER_AGE> {
+    template <typename StoreType>
+    static const Column<AgeType> &Get(const StoreType &particles) { return particles.age; }
+};
+
+template <>
+struct FilterColumnAccessor<FILTER_MASS> {
+    template <typename StoreType>
+    static const Column<MassType> &Get(const StoreType &particles) { return particles.mass; }
+};
+
+template <>
+struct FilterColumnAccessor<FILTER_METALLICITY> {
+    template <typename StoreType>
+    static const Column<MetallicityType> &Get(const StoreType &particles) {
+        return particles.metallicity;
+    }
+};
+
+template <>
+struct FilterColumnAccessor<FILTER_TEMPERATURE> {
+    template <typename StoreType>
+    static const Column<TemperatureType> &Get(const StoreType &particles) {
+        return particles.temperature;
+    }
+};
+
+// Number of particles whose conditions are evaluated together by filter expressions
+const size_t kFilterBlockSize = 4096;
+
+// Sets bit (i % 64) of words[i / 64] if values[i] < threshold (less_than = true) or values[i] >
+// threshold, for i in [0, num_values).  Float columns use the vectorised kernel.
+template <typename ValueType>
+void CompareBlock(const ValueType *values, size_t num_values, ValueType threshold, bool less_than,
+                  uint64_t *words) {
+    for (size_t iword = 0; iword < (num_values + 63) / 64; ++iword) {
+        size_t last   = std::min(num_values, (iword + 1) * 64);
+        uint64_t word = 0;
+        for (size_t ival = iword * 64; ival < last; ++ival)
+            word |= uint64_t(less_than ? values[ival] < threshold : values[ival] > threshold) <<
+                    (ival % 64);
+        words[iword] = word;
+    }
+}
+
+inline void CompareBlock(const float *values, size_t num_values, float threshold, bool less_than,
+                         uint64_t *words) {
+    CompareToBitmap(values, num_values, threshold, less_than, words);
+}
+
+//======================================= Filter Expressions =======================================
+// A filter expression is a tree of conditions, e.g.
+//     Where<TEMPERATURE_GT>(1e5) & Where<METALLICITY_LT>(-1) & Where<MASS_LT>(0.5)
+// whose structure, columns and comparisons are all template parameters.  Binding it to a store
+// gives a predicate object in which every condition is an inlined comparison on a column pointer,
+// so FilterParticles() evaluates the whole expression in one pass.  Particles are processed in
+// blocks of kFilterBlockSize: each condition compares its column to its threshold with a SIMD
+// kernel (see filter_kernels.hpp), packing the results into bitmap words, and & and | combine the
+// words of the block while it's still in cache.
+
+// Base of all filter expressions, so that & and | only apply to them
+template <typename DerivedType>
+struct FilterExpression {
+    const DerivedType &Derived() const { return static_cast<const DerivedType &>(*this); }
+};
+
+// A single comparison of one column against a threshold, bound to a store.  EvaluateBlock() fills
+// the bitmap words of particles [first, first + num_values), where first is a multiple of 64, and
+// Evaluate() tests one particle.
+template <typename ValueType, bool kLessThan>
+struct BoundCondition {
+    const ValueType *values;
+    ValueType threshold;
+    void EvaluateBlock(size_t first, size_t num_values, uint64_t *words) const {
+        CompareBlock(values + first, num_values, threshold, kLessThan, words);
+    }
+    bool Evaluate(size_t index) const {
+        return kLessThan ? values[index] < threshold : values[index] > threshold;
+    }
+};
+
+template <typename LeftType, typename RightType, bool kAnd>
+struct BoundCombination {
+    LeftType left;
+    RightType right;
+    void EvaluateBlock(size_t first, size_t num_values, uint64_t *words) const {
+        uint64_t right_words[kFilterBlockSize / 64];
+        left.EvaluateBlock(first, num_values, words);
+        right.EvaluateBlock(first, num_values, right_words);
+        for (size_t iword = 0; iword < (num_values + 63) / 64; ++iword)
+            words[iword] = kAnd ? (words[iword] & right_words[iword]) :
+                                  (words[iword] | right_words[iword]);
+    }
+    bool Evaluate(size_t index) const {
+        return kAnd ? (left.Evaluate(index) && right.Evaluate(index)) :
+                      (left.Evaluate(index) || right.Evaluate(index));
+    }
+};
+
+// A FilterType condition, e.g. Where<AGE_LT>(2.0)
+template <FilterType kFilter>
+class FilterCondition : public FilterExpression<FilterCondition<kFilter>> {
+public:
+    explicit FilterCondition(double threshold) : threshold_(threshold) {}
+    template <typename StoreType>
+    auto Bind(const StoreType &particles) const {
+        const auto &column = FilterColumnAccessor<GetFilterField(kFilter)>::Get(particles);
+        typedef typename std::remove_const<
+            typename std::remove_reference<decltype(column[0])>::type>::type ValueType;
+        return BoundCondition<ValueType,IsLessThanFilter(kFilter)>{
+            column.data(), static_cast<ValueType>(threshold_)};
+    }
+private:
+    double threshold_;
+};
+
+template <typename LeftType, typename RightType, bool kAnd>
+class FilterCombination : public FilterExpression<FilterCombination<LeftType,RightType,kAnd>> {
+public:
+    FilterCombination(const LeftType &left, const RightType &right) : left_(left), right_(right) {}
+    template <typename StoreType>
+    auto Bind(const StoreType &particles) const {
+        auto left  = left_.Bind(particles);
+        auto right = right_.Bind(particles);
+        return BoundCombination<decltype(left),decltype(right),kAnd>{left, right};
+    }
+private:
+    LeftType left_;
+    RightType right_;
+};
+
+template <FilterType kFilter>
+FilterCondition<kFilter> Where(double threshold) {
+    return FilterCondition<kFilter>(threshold);
+}
+
+template <typename LeftType, typename RightType>
+FilterCombination<LeftType,RightType,true> operator&(const FilterExpression<LeftType> &left,
+                                                     const FilterExpression<RightType> &right) {
+    return FilterCombination<LeftType,RightType,true>(left.Derived(), right.Derived());
+}
+
+template <typename LeftType, typename RightType>
+FilterCombination<LeftType,RightType,false> operator|(const FilterExpression<LeftType> &left,
+                                                      const FilterExpression<RightType> &right) {
+    return FilterCombination<LeftType,RightType,false>(left.Derived(), right.Derived());
+}
+
+// Returns the selection of particles in [particles] that satisfy a filter expression, in a single
+// pass over the columns it uses.  Blocks are shared between the threads of the shared pool, each
+// writing its own bitmap words.  The selection is sized from a popcount of the bitmap.  Conditions
+// on fields the store doesn't have fail to compile.
+template <typename StoreType, typename ExpressionType>
+Selection FilterParticles(const StoreType &particles,
+                          const FilterExpression<ExpressionType> &expression) {
+    auto predicate       = expression.Derived().Bind(particles);
+    size_t num_particles = particles.size();
+    size_t num_blocks    = (num_particles + kFilterBlockSize - 1) / kFilterBlockSize;
+    std::vector<uint64_t> bits((num_particles + 63) / 64);
+    ThreadPool::GetShared().ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t first = iblock * kFilterBlockSize;
+        predicate.EvaluateBlock(first, std::min(kFilterBlockSize, num_particles - first),
+                                bits.data() + first / 64);
+    });
+    return Selection::FromBitmap(bits, num_particles);
+}
+
+// As above, but only tests the [candidates], e.g. the particles a KdTree query found in a region,
+// so that the cost scales with the number of candidates rather than the size of the store
+template <typename StoreType, typename ExpressionType>
+Selection FilterParticles(const StoreType &particles, const Selection &candidates,
+                          const FilterExpression<ExpressionType> &expression) {
+    if (candidates.GetUniverseSize() != particles.size())
+        throw std::invalid_argument("FilterParticles: Candidates aren't from this store");
+    if (candidates.IsBitmap())
+        return FilterParticles(particles, expression) & candidates;
+    auto predicate = expression.Derived().Bind(particles);
+    std::vector<size_t> indices;
+    candidates.ForEach([&](size_t index) {
+        if (predicate.Evaluate(index))
+            indices.push_back(index);
+    });
+    return Selection::FromIndices(indices, particles.size());
+}
+
+//======================================= Single Conditions ========================================
+// Returns the selection of particles in [particles] that satisfy [filter_by].  Only the column
+// corresponding to the filter is scanned, and no particle data are copied.  Combine selections with
+// &, | and ~ (see Selection).
 template <typename FilterValueType>
-ParticleVector FilterParticles(ParticleVector &particles, FilterType filter_by,
-                               FilterValueType filter_value) {
-    ParticleVector filtered;
-    std::function<bool(Particle)> predicate_function;
+Selection FilterParticles(const ParticleStore &particles, FilterType filter_by,
+                          FilterValueType filter_value) {
     switch (filter_by) {
         case MASS_LT:
-            predicate_function = [&](Particle p) { return p.GetMass()< filter_value; };
-            break;
+            return FilterParticles(particles, Where<MASS_LT>(filter_value));
         case MASS_GT:
-            predicate_function = [&](Particle p) { return p.GetMass() > filter_value; };
-            break;
+            return FilterParticles(particles, Where<MASS_GT>(filter_value));
         default:
             throw std::invalid_argument("No such filter defined");
-            return particles;
             break;
     }
-    std::copy_if(particles.begin(), particles.end(), std::back_inserter(filtered),
-                 predicate_function);
-    
-    return filtered;
 }
 
-// As above, for vector<GasParticle> inputs
+// As above, for GasStore inputs
 template <typename FilterValueType>
-GasVector FilterParticles(GasVector &particles, FilterType filter_by,
+Selection FilterParticles(const GasStore &particles, FilterType filter_by,
                           FilterValueType filter_value) {
-    GasVector filtered;
-    std::function<bool(GasParticle)> predicate_function;
     switch (filter_by) {
+        case MASS_LT:
+            return FilterParticles(particles, Where<MASS_LT>(filter_value));
+        case MASS_GT:
+            return FilterParticles(particles, Where<MASS_GT>(filter_value));
         case METALLICITY_LT:
-            predicate_function = [&](GasParticle p) { return p.GetMetallicity() < filter_value; };
-            break;
+            return FilterParticles(particles, Where<METALLICITY_LT>(filter_value));
         case METALLICITY_GT:
-            predicate_function = [&](GasParticle p) { return p.GetMetallicity() > filter_value; };
-            break;
+            return FilterParticles(particles, Where<METALLICITY_GT>(filter_value));
         case TEMPERATURE_LT:
-            predicate_function = [&](GasParticle p) { return p.GetTemperature() < filter_value; };
-            break;
+            return FilterParticles(particles, Where<TEMPERATURE_LT>(filter_value));
         case TEMPERATURE_GT:
-            predicate_function = [&](GasParticle p) { return p.GetTemperature() > filter_value; };
-            break;
+            return FilterParticles(particles, Where<TEMPERATURE_GT>(filter_value));
         default:
             throw std::invalid_argument("No such filter defined");
-            return particles;
             break;
     }
-    std::copy_if(particles.begin(), particles.end(), std::back_inserter(filtered),
-                 predicate_function);
-    
-    return filtered;
 }
 
-// As above, for vector<StarParticle> inputs
+// As above, for StarStore inputs
 template <typename FilterValueType>
-StarVector FilterParticles(StarVector &particles, FilterType filter_by,
-                           FilterValueType filter_value)
+Selection FilterParticles(const StarStore &particles, FilterType filter_by,
+                          FilterValueType filter_value)
 {
-    StarVector filtered;
-    std::function<bool(StarParticle)> predicate_function;
     switch (filter_by) {
         case AGE_GT:
-            predicate_function = [&](StarParticle p) { return p.GetAge() > filter_value; };
-            break;
+            return FilterParticles(particles, Where<AGE_GT>(filter_value));
         case AGE_LT:
-            predicate_function = [&](StarParticle p) { return p.GetAge() < filter_value; };
-            break;
+            return FilterParticles(particles, Where<AGE_LT>(filter_value));
+        case MASS_LT:
+            return FilterParticles(particles, Where<MASS_LT>(filter_value));
+        case MASS_GT:
+            return FilterParticles(particles, Where<MASS_GT>(filter_value));
         case METALLICITY_LT:
-            predicate_function = [&](StarParticle p) { return p.GetMetallicity() < filter_value; };
-            break;
+            return FilterParticles(particles, Where<METALLICITY_LT>(filter_value));
         case METALLICITY_GT:
-            predicate_function = [&](StarParticle p) { return p.GetMetallicity()> filter_value; };
-            break;
+            return FilterParticles(particles, Where<METALLICITY_GT>(filter_value));
         default:
             throw std::invalid_argument("No such filter defined");
-            return particles;
             break;
     }
-    std::copy_if(particles.begin(), particles.end(), std::back_inserter(filtered),
-                 predicate_function);
-    
-    return filtered;
 }
-#endif // filter_particles_hpp
\ No newline at end of file
+#endif // filter_particles_hpp
@@ -0,0 +1,207 @@
+// Implementation of the FofGroups class
+
+#include "fof_groups.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "cell_grid.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Number of particles handled by each task
+const size_t kFofBlockSize = 65536;
+
+typedef std::vector<std::atomic<size_t>> ParentsType;
+
+// Returns the root of the set holding [index], halving the path to it on the way (each particle
+// visited is pointed at its grandparent).  Parents are only ever replaced by lower indices, so this
+// is safe while other threads are joining sets.
+static size_t FindRoot(ParentsType &parents, size_t index) {
+    while (true) {
+        size_t parent = parents[index].load();
+        if (parent == index)
+            return index;
+        size_t grandparent = parents[parent].load();
+        if (grandparent != parent)
+            parents[index].compare_exchange_weak(parent, grandparent);
+        index = grandparent;
+    }
+}
+
+// Joins the sets holding [index_a] and [index_b], by linking the higher root beneath the lower
+// one.  If another thread links the higher root first, the roots are found again and it retries.
+static void JoinSets(ParentsType &parents, size_t index_a, size_t index_b) {
+    while (true) {
+        index_a = FindRoot(parents, index_a);
+        index_b = FindRoot(parents, index_b);
+        if (index_a == index_b)
+            return;
+        if (index_a < index_b)
+            std::swap(index_a, index_b);
+        size_t expected = index_a;
+        if (parents[index_a].compare_exchange_strong(expected, index_b))
+            return;
+    }
+}
+
+// Finds the groups of [num_particles] particles, given join_pairs(parents), which calls JoinSets()
+// on every pair within the linking length
+template <typename JoinPairsType>
+void FofGroups::FindGroups_(size_t num_particles, JoinPairsType join_pairs, size_t min_group_size,
+                            ThreadPool &pool) {
+    size_t num_blocks = (num_particles + kFofBlockSize - 1) / kFofBlockSize;
+
+    // Join every pair within the linking length, then point each particle straight at its root
+    ParentsType parents(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kFofBlockSize, num_particles);
+        for (size_t ipart = iblock * kFofBlockSize; ipart < last; ++ipart)
+            parents[ipart].store(ipart);
+    });
+    join_pairs(parents);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kFofBlockSize, num_particles);
+        for (size_t ipart = iblock * kFofBlockSize; ipart < last; ++ipart)
+            parents[ipart].store(FindRoot(parents, ipart));
+    });
+
+    // Number the sets large enough to be groups, largest first, in a table indexed by root
+    std::vector<uint32_t> root_groups(num_particles, 0);
+    for (size_t ipart = 0; ipart < num_particles; ++ipart)
+        ++root_groups[parents[ipart].load()];
+    std::vector<std::pair<size_t,size_t>> groups; // Minus the size, and root, of each group
+    for (size_t ipart = 0; ipart < num_particles; ++ipart) {
+        if (parents[ipart].load() != ipart)
+            continue;
+        if (root_groups[ipart] >= min_group_size)
+            groups.push_back(std::make_pair(-size_t(root_groups[ipart]), ipart));
+        root_groups[ipart] = kNoParticleGroup;
+    }
+    if (groups.size() >= kNoParticleGroup)
+        throw std::runtime_error("FofGroups: Too many groups");
+    std::sort(groups.begin(), groups.end());
+    for (size_t igroup = 0; igroup < groups.size(); ++igroup)
+        root_groups[groups[igroup].second] = uint32_t(igroup);
+
+    particle_groups_.resize(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kFofBlockSize, num_particles);
+        for (size_t ipart = iblock * kFofBlockSize; ipart < last; ++ipart)
+            particle_groups_[ipart] = root_groups[parents[ipart].load()];
+    });
+    ListMembers_(groups.size());
+}
+
+FofGroups::FofGroups(const ParticleStore &particles, const KdTree &tree,
+                     LengthType linking_length, size_t min_group_size, ThreadPool &pool) :
+linking_length_(linking_length) {
+    if (!(linking_length > 0))
+        throw std::invalid_argument("FofGroups: Linking length must be positive");
+    if (tree.size() != particles.size())
+        throw std::invalid_argument("FofGroups: Tree was built from another store");
+    FindGroups_(particles.size(), [&](ParentsType &parents) {
+        tree.ForEachPairWithin(linking_length, [&parents](size_t index_a, size_t index_b) {
+            JoinSets(parents, index_a, index_b);
+        }, pool);
+    }, min_group_size, pool);
+}
+
+// As above, but each particle's friends are found by a search of the cells within the linking
+// length of it, in blocks of particles on all threads.  Each pair is joined once, from its lower
+// index.
+FofGroups::FofGroups(const ParticleStore &particles, const CellGrid &grid,
+                     LengthType linking_length, size_t min_group_size, ThreadPool &pool) :
+linking_length_(linking_length) {
+    if (!(linking_length > 0))
+        throw std::invalid_argument("FofGroups: Linking length must be positive");
+    if (grid.size() != particles.size())
+        throw std::invalid_argument("FofGroups: Grid was built from another store");
+    size_t num_particles = particles.size();
+    size_t num_blocks    = (num_particles + kFofBlockSize - 1) / kFofBlockSize;
+    FindGroups_(num_particles, [&](ParentsType &parents) {
+        pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+            size_t last = std::min((iblock + 1) * kFofBlockSize, num_particles);
+            for (size_t ipart = iblock * kFofBlockSize; ipart < last; ++ipart) {
+                grid.ForEachInSphere(particles.GetPosition(ipart), linking_length,
+                                     [&parents, ipart](size_t jpart) {
+                    if (jpart > ipart)
+                        JoinSets(parents, ipart, jpart);
+                });
+            }
+        });
+    }, min_group_size, pool);
+}
+
+FofGroups::FofGroups(std::vector<uint32_t> particle_groups, size_t num_groups,
+                     LengthType linking_length) :
+linking_length_(linking_length) {
+    particle_groups_.swap(particle_groups);
+    ListMembers_(num_groups);
+}
+
+// Returns the table for the particles of another store, with the same groups: each particle is in
+// the group (if any) of the nearest particle of this store, found with [tree], the k-d tree of this
+// store.  Particles are assigned in parallel.
+FofGroups FofGroups::AttachParticles(const KdTree &tree, const ParticleStore &particles,
+                                     ThreadPool &pool) const {
+    if (tree.size() != size())
+        throw std::invalid_argument("FofGroups: Tree was built from another store");
+    size_t num_particles = particles.size();
+    size_t num_blocks    = (num_particles + kFofBlockSize - 1) / kFofBlockSize;
+    std::vector<uint32_t> particle_groups(num_particles, kNoParticleGroup);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kFofBlockSize, num_particles);
+        for (size_t ipart = iblock * kFofBlockSize; ipart < last; ++ipart) {
+            std::vector<size_t> nearest = tree.FindNearest(particles.GetPosition(ipart), 1);
+            if (!nearest.empty())
+                particle_groups[ipart] = particle_groups_[nearest[0]];
+        }
+    });
+    return FofGroups(particle_groups, GetNumGroups(), linking_length_);
+}
+
+// Returns the group of particle [index], or kNoGroup if it isn't in one
+size_t FofGroups::GetGroup(size_t index) const {
+    uint32_t igroup = particle_groups_.at(index);
+    return igroup == kNoParticleGroup ? kNoGroup : igroup;
+}
+
+size_t FofGroups::GetGroupSize(size_t igroup) const {
+    if (igroup >= GetNumGroups())
+        throw std::out_of_range("FofGroups: No such group");
+    return group_starts_[igroup + 1] - group_starts_[igroup];
+}
+
+// Returns the members of group [igroup]
+Selection FofGroups::SelectGroup(size_t igroup) const {
+    if (igroup >= GetNumGroups())
+        throw std::out_of_range("FofGroups: No such group");
+    std::vector<size_t> indices(members_.begin() + group_starts_[igroup],
+                                members_.begin() + group_starts_[igroup + 1]);
+    return Selection::FromIndices(indices, size());
+}
+
+// Lists the members of each group together (a counting sort of the particles by group, so they
+// stay in index order)
+void FofGroups::ListMembers_(size_t num_groups) {
+    group_starts_.assign(num_groups + 1, 0);
+    for (uint32_t igroup : particle_groups_)
+        if (igroup != kNoParticleGroup)
+            ++group_starts_[igroup + 1];
+    for (size_t igroup = 0; igroup < num_groups; ++igroup)
+        group_starts_[igroup + 1] += group_starts_[igroup];
+    std::vector<size_t> next_slots(group_starts_.begin(), group_starts_.end() - 1);
+    members_.resize(group_starts_[num_groups]);
+    for (size_t ipart = 0; ipart < particle_groups_.size(); ++ipart)
+        if (particle_groups_[ipart] != kNoParticleGroup)
+            members_[next_slots[particle_groups_[ipart]]++] = ipart;
+}
@@ -0,0 +1,67 @@
+// Interface for the FofGroups class
+
+#ifndef fof_groups_hpp
+#define fof_groups_hpp
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cell_grid.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Defaults for FofGroups: the linking length as a fraction of the mean interparticle spacing (see
+// Parameters::GetMeanParticleSpacing()), and the fewest particles a group can have
+const double kDefaultLinkingFraction = 0.2;
+const size_t kDefaultMinGroupSize    = 20;
+
+// Returned by FofGroups::GetGroup() for particles which aren't in a group, and stored as their
+// group in the membership table
+const size_t kNoGroup           = SIZE_MAX;
+const uint32_t kNoParticleGroup = UINT32_MAX;
+
+// Friends-of-friends groups of the particles of one store: two particles are in the same group if
+// they're joined by a chain of particles, each within the linking length of the next.  Pairs within
+// the linking length are found by a dual-tree walk of a k-d tree of the store on all threads (see
+// KdTree::ForEachPairWithin()), or by searching a CellGrid of the store around each particle, and
+// joined in a lock-free union-find.  Each set is rooted at its lowest index, and a root is only
+// ever linked (by compare-and-swap) beneath a lower one, so the groups don't depend on the order in
+// which pairs are found.  Groups with fewer than [min_group_size] particles are dropped, and the
+// rest are numbered from the largest (ties in order of their lowest index).  The result is a
+// membership table: the group of each particle, and the members of each group in index order, which
+// SelectGroup() returns as a Selection to pass to RadialProfile, the dynamics functions or
+// FindShrinkingSphereCentre().  AttachParticles() makes the table for another store (e.g. gas),
+// with each particle in the group of the nearest particle of this one.
+// Usage: FofGroups groups(simulation.dark_matter, tree, linking_length); groups.SelectGroup(0)
+class FofGroups {
+public:
+    FofGroups(const ParticleStore &particles, const KdTree &tree, LengthType linking_length,
+              size_t min_group_size = kDefaultMinGroupSize,
+              ThreadPool &pool = ThreadPool::GetShared());
+    FofGroups(const ParticleStore &particles, const CellGrid &grid, LengthType linking_length,
+              size_t min_group_size = kDefaultMinGroupSize,
+              ThreadPool &pool = ThreadPool::GetShared());
+    FofGroups AttachParticles(const KdTree &tree, const ParticleStore &particles,
+                              ThreadPool &pool = ThreadPool::GetShared()) const;
+    size_t GetGroup(size_t index) const;
+    size_t GetGroupSize(size_t igroup) const;
+    LengthType GetLinkingLength() const { return linking_length_; }
+    size_t GetNumGroups() const { return group_starts_.size() - 1; }
+    Selection SelectGroup(size_t igroup) const;
+    size_t size() const { return particle_groups_.size(); }
+private:
+    FofGroups(std::vector<uint32_t> particle_groups, size_t num_groups, LengthType linking_length);
+    template <typename JoinPairsType>
+    void FindGroups_(size_t num_particles, JoinPairsType join_pairs, size_t min_group_size,
+                     ThreadPool &pool);
+    void ListMembers_(size_t num_groups);
+    std::vector<size_t> group_starts_;      // First member of each group in members_, and end
+    LengthType linking_length_;
+    std::vector<size_t> members_;           // Store indices of the members of each group, in turn
+    std::vector<uint32_t> particle_groups_; // Group of each particle (kNoParticleGroup if none)
+};
+
+#endif // fof_groups_hpp
@@ -0,0 +1,363 @@
+// Implementation of the GadgetLoader class
+
+#include "gadget_loader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "column.hpp"
+#include "gadget_snapshot.hpp"
+#include "globals.hpp"
+#include "parameters.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Maps every file of the snapshot (in parallel, since each may be on a different disk) and
+// computes, for each particle type, the offset of each file's particles in the combined arrays.
+GadgetLoader::GadgetLoader(std::string filepath, const Parameters &parameters) :
+parameters_(parameters), pool_(&ThreadPool::GetShared()), total_file_bytes_(0),
+num_thread_counters_(0) {
+    std::shared_ptr<const GadgetSnapshot> first_file(new GadgetSnapshot(filepath));
+    const GadgetHeader &first_header = first_file->GetHeader();
+    std::vector<std::string> filepaths = GetFilepaths(filepath,
+                                                      std::max(1, first_header.num_files));
+    files_.resize(filepaths.size());
+    files_[0] = first_file;
+    pool_->ParallelFor(filepaths.size() - 1, [&](size_t itask, int) {
+        files_[itask + 1] = std::shared_ptr<const GadgetSnapshot>(
+            new GadgetSnapshot(filepaths[itask + 1]));
+    });
+
+    for (int itype = 0; itype < kGadgetNumTypes; ++itype) {
+        file_offsets_[itype].assign(1, 0);
+        for (size_t ifile = 0; ifile < files_.size(); ++ifile)
+            file_offsets_[itype].push_back(file_offsets_[itype].back() +
+                                           files_[ifile]->GetHeader().npart[itype]);
+        if (file_offsets_[itype].back() != first_header.npart_total[itype])
+            throw std::runtime_error("GadgetLoader: Particle numbers in the files of " + filepath +
+                                     " don't add up to the totals in its header");
+    }
+    for (size_t ifile = 0; ifile < files_.size(); ++ifile)
+        total_file_bytes_ += files_[ifile]->GetFile()->GetSize();
+    ResetStatistics_();
+}
+
+std::shared_ptr<GadgetLoader> GadgetLoader::Open(std::string filepath,
+                                                 const Parameters &parameters) {
+    return std::shared_ptr<GadgetLoader>(new GadgetLoader(filepath, parameters));
+}
+
+// Returns the paths of all [num_files] files of a snapshot, given the first: for multi-file
+// snapshots, "snap_042.0" becomes "snap_042.0", "snap_042.1", ...
+std::vector<std::string> GadgetLoader::GetFilepaths(std::string first_filepath, int num_files) {
+    if (num_files <= 1)
+        return std::vector<std::string>(1, first_filepath);
+    size_t suffix_start = first_filepath.find_last_of('.');
+    if (suffix_start == std::string::npos ||
+        first_filepath.find_first_not_of("0123456789", suffix_start + 1) != std::string::npos)
+        throw std::runtime_error("GadgetLoader: Can't find the other files of multi-file snapshot "
+                                 + first_filepath);
+    std::string base_filepath = first_filepath.substr(0, suffix_start + 1);
+    std::vector<std::string> filepaths;
+    for (int ifile = 0; ifile < num_files; ++ifile)
+        filepaths.push_back(base_filepath + std::to_string(ifile));
+    return filepaths;
+}
+
+// Binds every column of the three stores.  Gadget gas (type 0), halo (type 1) and star (type 4)
+// particles are read as gas, dark matter and stars respectively.
+void GadgetLoader::BindStores(ParticleStore &dark_matter, GasStore &gas, StarStore &stars) {
+    BindRange(dark_matter, 0, file_offsets_[GADGET_HALO].back());
+    BindRange(gas, 0, file_offsets_[GADGET_GAS].back());
+    BindRange(stars, 0, file_offsets_[GADGET_STARS].back());
+}
+
+void GadgetLoader::BindRange(ParticleStore &dark_matter, size_t first, size_t n) {
+    BindParticleFields_(GetRange_(GADGET_HALO, first, n), dark_matter);
+}
+
+void GadgetLoader::BindRange(GasStore &gas, size_t first, size_t n) {
+    BindGasFields_(GetRange_(GADGET_GAS, first, n), gas);
+}
+
+void GadgetLoader::BindRange(StarStore &stars, size_t first, size_t n) {
+    BindStarFields_(GetRange_(GADGET_STARS, first, n), stars);
+}
+
+size_t GadgetLoader::GetNFiles() const {
+    return files_.size();
+}
+
+// Sends the amount of data decoded so far and the decoding rate achieved by each thread to ostream
+void GadgetLoader::PrintStatistics(std::ostream &out) const {
+    const double kBytesPerMB = 1024.0 * 1024.0;
+    unsigned long long total_bytes = 0;
+    for (int ithread = 0; ithread < num_thread_counters_; ++ithread)
+        total_bytes += thread_counters_[ithread].num_bytes;
+    out << " Snapshot loading (" << files_.size() << " file(s)): decoded " << std::fixed <<
+           std::setprecision(1) << total_bytes / kBytesPerMB << " of " <<
+           total_file_bytes_ / kBytesPerMB << " MB" << std::endl;
+    for (int ithread = 0; ithread < num_thread_counters_; ++ithread) {
+        double megabytes = thread_counters_[ithread].num_bytes / kBytesPerMB;
+        double seconds   = thread_counters_[ithread].nanoseconds * 1.0e-9;
+        if (megabytes == 0)
+            continue;
+        out << "  Thread " << std::setw(3) << ithread << " : " << std::setw(10) << megabytes <<
+               " MB, " << std::setw(10) << (seconds > 0 ? megabytes / seconds : 0) << " MB/s" <<
+               std::endl;
+    }
+    out.unsetf(std::ios::fixed);
+    out << std::setprecision(6);
+}
+
+// Uses [pool] rather than the shared pool to decode the files
+void GadgetLoader::SetThreadPool(ThreadPool &pool) {
+    pool_ = &pool;
+    ResetStatistics_();
+}
+
+void GadgetLoader::AddToStatistics_(int ithread, size_t num_bytes, double seconds) {
+    if (ithread >= num_thread_counters_)
+        return;
+    thread_counters_[ithread].num_bytes += num_bytes;
+    thread_counters_[ithread].nanoseconds += static_cast<unsigned long long>(seconds * 1.0e9);
+}
+
+// Binds the metallicity column to the metal mass fractions in the Z block (as log10 relative to
+// solar, no lower than kMinMetallicity), after binding the ID, mass, position and velocity
+// columns.  Gadget writes the block per file, so particles of files without one are left
+// unset.  Standard Gadget snapshots have no individual element abundances, so those columns are
+// never set.
+void GadgetLoader::BindBaryonFields_(const RangeType &range, BaryonicStore &particles) {
+    BindParticleFields_(range, particles);
+    if (range.count == 0)
+        return;
+
+    BindColumn_<MetallicityType>(particles.metallicity, range,
+        [](const GadgetSnapshot &file, GadgetTypeIndex type, size_t first, size_t count,
+           MetallicityType *metallicity) {
+            if (!file.HasField("Z", type)) {
+                std::fill_n(metallicity, count, kMetallicityNotSet);
+                return size_t(0);
+            }
+            GadgetFieldView<double> metal_fraction = file.GetField<double>("Z", type)
+                                                     .Slice(first, count);
+            for (size_t ipart = 0; ipart < metal_fraction.size(); ++ipart) {
+                double fraction  = metal_fraction[ipart];
+                double log_ratio = fraction > 0 ? std::log10(fraction / kSolarMetalFraction) :
+                                                  kMinMetallicity;
+                metallicity[ipart] = std::max<double>(log_ratio, kMinMetallicity);
+            }
+            return metal_fraction.GetNumBytes();
+        });
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        BindColumn_<AbundanceType>(particles.abundances[ielem], range,
+            [](const GadgetSnapshot &, GadgetTypeIndex, size_t, size_t count,
+               AbundanceType *abundance) {
+                std::fill_n(abundance, count, kAbundanceNotSet);
+                return size_t(0);
+            });
+}
+
+// Sets up [column] to be filled with the values of the particles of [range] on first access.  The
+// column is allocated at its full size, then [decoder] is called for each file in parallel, with a
+// pointer to the start of the file's share of the array.
+template <typename Type>
+void GadgetLoader::BindColumn_(Column<Type> &column, const RangeType &range,
+                               DecoderType<Type> decoder) {
+    std::shared_ptr<GadgetLoader> self = shared_from_this();
+    column.SetLoader(range.count, [self, range, decoder](std::vector<Type> &values) {
+        values.resize(range.count);
+        self->DecodeRange_(range, decoder, values.data());
+    });
+}
+
+// Binds the gas smoothing length and temperature columns.  Smoothing lengths are used as they are,
+// but Gadget stores the specific internal energy (or the entropy) of the gas rather than its
+// temperature.  Assumes a fully ionised primordial gas (mean molecular weight 0.59), internal
+// energy in (km/s)^2 and adiabatic index 5/3.
+void GadgetLoader::BindGasFields_(const RangeType &range, GasStore &gas) {
+    BindBaryonFields_(range, gas);
+    if (range.count == 0)
+        return;
+    BindPlainColumn_(gas.smoothing_length, range, "HSML", 0);
+
+    const double kMeanMolecularWeight = 0.59;
+    const double kGammaMinusOne       = 2.0 / 3.0;
+    const double kEnergyToTemperature = kGammaMinusOne * kMeanMolecularWeight * kProtonMassCgs *
+                                        1.0e10 / kBoltzmannConstantCgs;
+    BindColumn_<TemperatureType>(gas.temperature, range,
+        [=](const GadgetSnapshot &file, GadgetTypeIndex type, size_t first, size_t count,
+            TemperatureType *temperature) {
+            GadgetFieldView<double> internal_energy = file.GetField<double>("U", type)
+                                                      .Slice(first, count);
+            size_t num_bytes = internal_energy.GetNumBytes();
+            GadgetFieldView<double> density;
+            bool entropy_instead_u = file.GetHeader().flag_entropy_instead_u;
+            if (entropy_instead_u) {
+                density    = file.GetField<double>("RHO", type).Slice(first, count);
+                num_bytes += density.GetNumBytes();
+            }
+            for (size_t ipart = 0; ipart < internal_energy.size(); ++ipart) {
+                double energy = internal_energy[ipart];
+                if (entropy_instead_u)
+                    energy *= std::pow(density[ipart], kGammaMinusOne) / kGammaMinusOne;
+                temperature[ipart] = energy * kEnergyToTemperature;
+            }
+            return num_bytes;
+        });
+}
+
+// Binds the ID, mass, position and velocity columns of [particles] to the fields of the Gadget
+// particles of [range].  Masses come from the MASS block or, in files where all particles of the
+// type have the same mass, from the file's header.  Velocities are converted from Gadget's internal
+// comoving velocity variable to peculiar velocities.
+void GadgetLoader::BindParticleFields_(const RangeType &range, ParticleStore &particles) {
+    if (range.count == 0)
+        return;
+    BindPlainColumn_(particles.id, range, "ID", 0);
+
+    if (HasFieldInRange_(range, "MASS")) {
+        BindPlainColumn_(particles.mass, range, "MASS", 0);
+    } else {
+        BindColumn_<MassType>(particles.mass, range,
+            [](const GadgetSnapshot &file, GadgetTypeIndex type, size_t first, size_t count,
+               MassType *mass) {
+                if (!file.HasField("MASS", type)) {
+                    std::fill_n(mass, count, file.GetHeader().mass[type]);
+                    return size_t(0);
+                }
+                GadgetFieldView<MassType> file_mass = file.GetField<MassType>("MASS", type)
+                                                      .Slice(first, count);
+                file_mass.CopyTo(mass);
+                return file_mass.GetNumBytes();
+            });
+    }
+
+    const double kVelocityFactor = parameters_.IsComoving() ?
+                                   std::sqrt(parameters_.GetScaleFactor()) : 1.0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        BindPlainColumn_(particles.position[idim], range, "POS", idim);
+        BindColumn_<VelocityType>(particles.velocity[idim], range,
+            [=](const GadgetSnapshot &file, GadgetTypeIndex type, size_t first, size_t count,
+                VelocityType *velocity) {
+                GadgetFieldView<VelocityType> file_velocity = file.GetField<VelocityType>("VEL",
+                                                                                   type, idim)
+                                                              .Slice(first, count);
+                file_velocity.CopyTo(velocity);
+                for (size_t ipart = 0; ipart < file_velocity.size(); ++ipart)
+                    velocity[ipart] *= kVelocityFactor;
+                return file_velocity.GetNumBytes();
+            });
+    }
+}
+
+// Binds [column] to component [component] of field [label], which needs no conversion.  If the
+// range lies within one file (e.g. any range of a single-file snapshot), and the file stores the
+// field in the column's own format, the column views the mapped file directly, otherwise the
+// values are decoded on first access.
+template <typename Type>
+void GadgetLoader::BindPlainColumn_(Column<Type> &column, const RangeType &range,
+                                    std::string label, int component) {
+    const std::vector<size_t> &offsets = file_offsets_[range.type];
+    size_t ifile = std::upper_bound(offsets.begin(), offsets.end(), range.first) -
+                   offsets.begin() - 1;
+    if (range.first + range.count <= offsets[ifile + 1]) {
+        GadgetFieldView<Type> field = files_[ifile]->GetField<Type>(label, range.type, component)
+                                      .Slice(range.first - offsets[ifile], range.count);
+        if (field.IsZeroCopy()) {
+            column.SetView(field.GetRawData(), field.size(), field.GetFile());
+            return;
+        }
+    }
+    BindColumn_<Type>(column, range,
+        [label, component](const GadgetSnapshot &file, GadgetTypeIndex type, size_t first,
+                           size_t count, Type *values) {
+            GadgetFieldView<Type> field = file.GetField<Type>(label, type, component)
+                                          .Slice(first, count);
+            field.CopyTo(values);
+            return field.GetNumBytes();
+        });
+}
+
+// Binds the age column, converting the formation times Gadget stores (in the same form as the
+// snapshot time) to ages, after the ID, mass, position, velocity and metallicity columns.  Stars
+// of files without an AGE block are left unset.
+void GadgetLoader::BindStarFields_(const RangeType &range, StarStore &stars) {
+    BindBaryonFields_(range, stars);
+    if (range.count == 0)
+        return;
+
+    const Parameters parameters = parameters_;
+    BindColumn_<AgeType>(stars.age, range,
+        [parameters](const GadgetSnapshot &file, GadgetTypeIndex type, size_t first,
+                     size_t count, AgeType *age) {
+            if (!file.HasField("AGE", type)) {
+                std::fill_n(age, count, kAgeNotSet);
+                return size_t(0);
+            }
+            GadgetFieldView<double> formation_time = file.GetField<double>("AGE", type)
+                                                     .Slice(first, count);
+            for (size_t ipart = 0; ipart < formation_time.size(); ++ipart)
+                age[ipart] = parameters.GetOutputTime() -
+                             parameters.ConvertGadgetTime(formation_time[ipart]);
+            return formation_time.GetNumBytes();
+        });
+}
+
+// Runs [decoder] on every file that has particles of [range], one file per task, writing each
+// file's values to its own slice of [values].  The slices don't overlap, so no locking is needed.
+template <typename Type>
+void GadgetLoader::DecodeRange_(const RangeType &range, const DecoderType<Type> &decoder,
+                                Type *values) {
+    const std::vector<size_t> &offsets = file_offsets_[range.type];
+    pool_->ParallelFor(files_.size(), [&](size_t ifile, int ithread) {
+        size_t first = std::max(range.first, offsets[ifile]);
+        size_t last  = std::min(range.first + range.count, offsets[ifile + 1]);
+        if (first >= last)
+            return;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t num_bytes = decoder(*files_[ifile], range.type, first - offsets[ifile],
+                                   last - first, values + first - range.first);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        AddToStatistics_(ithread, num_bytes, elapsed.count());
+    });
+}
+
+// Checks that particles [first, first + n) of [type] are in the snapshot
+GadgetLoader::RangeType GadgetLoader::GetRange_(GadgetTypeIndex type, size_t first,
+                                                size_t n) const {
+    if (first + n > file_offsets_[type].back())
+        throw std::invalid_argument("GadgetLoader: Particle range is beyond the end of the "
+                                    "snapshot");
+    RangeType range = {type, first, n};
+    return range;
+}
+
+// True if every file with particles of [range] stores field [label] for them
+bool GadgetLoader::HasFieldInRange_(const RangeType &range, std::string label) const {
+    const std::vector<size_t> &offsets = file_offsets_[range.type];
+    for (size_t ifile = 0; ifile < files_.size(); ++ifile)
+        if (offsets[ifile] < range.first + range.count && offsets[ifile + 1] > range.first &&
+            !files_[ifile]->HasField(label, range.type))
+            return false;
+    return true;
+}
+
+// Allocates one set of counters per thread of the pool
+void GadgetLoader::ResetStatistics_() {
+    num_thread_counters_ = pool_->GetNumThreads();
+    thread_counters_.reset(new ThreadCountersType[num_thread_counters_]);
+    for (int ithread = 0; ithread < num_thread_counters_; ++ithread) {
+        thread_counters_[ithread].num_bytes   = 0;
+        thread_counters_[ithread].nanoseconds = 0;
+    }
+}
@@ -0,0 +1,85 @@
+// Interface for the GadgetLoader class
+
+#ifndef gadget_loader_hpp
+#define gadget_loader_hpp
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "column.hpp"
+#include "gadget_snapshot.hpp"
+#include "parameters.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Binds particle stores to the data in a Gadget snapshot, which may be split over several files
+// (snap_042.0, snap_042.1, ...).  On construction, every file is mapped and its header read, to
+// work out where each file's particles of each type belong in the combined arrays.  No particle
+// data are read until a column is first accessed.  At that point the column is allocated at its
+// full size, and a thread pool decodes each file's share of the field directly into its slice of
+// the array, one file per task.  Fields of single-file snapshots that need no conversion are used
+// in place without copying.  Per-thread counts of the data decoded and the time taken are kept, to
+// monitor loading throughput.  A store can instead be bound to a range of the particles of its
+// type, so that a snapshot too large for memory can be read a chunk at a time: only that range of
+// each field is decoded, and used in place where it lies within one file.  Held by shared pointer,
+// since the column loaders refer back to it.
+// Usage: GadgetLoader::Open(path-to-first-file, parameters)
+class GadgetLoader : public std::enable_shared_from_this<GadgetLoader> {
+public:
+    static std::shared_ptr<GadgetLoader> Open(std::string filepath, const Parameters &parameters);
+    static std::vector<std::string> GetFilepaths(std::string first_filepath, int num_files);
+    void BindStores(ParticleStore &dark_matter, GasStore &gas, StarStore &stars);
+    // Binds the columns of a store to particles [first, first + n) of its type
+    void BindRange(ParticleStore &dark_matter, size_t first, size_t n);
+    void BindRange(GasStore &gas, size_t first, size_t n);
+    void BindRange(StarStore &stars, size_t first, size_t n);
+    size_t GetNFiles() const;
+    void PrintStatistics(std::ostream &out) const;
+    void SetThreadPool(ThreadPool &pool);
+private:
+    // Decodes one file's values of a field for its particles [first, first + count) of type
+    // [type] into [values]. Returns the number of bytes of the file that were read.
+    template <typename Type>
+    using DecoderType = std::function<size_t(const GadgetSnapshot &file, GadgetTypeIndex type,
+                                             size_t first, size_t count, Type *values)>;
+    // Particles [first, first + count) of one type, numbered across all the files
+    struct RangeType {
+        GadgetTypeIndex type;
+        size_t first;
+        size_t count;
+    };
+    struct ThreadCountersType {
+        std::atomic<unsigned long long> num_bytes;
+        std::atomic<unsigned long long> nanoseconds;
+    };
+    GadgetLoader(std::string filepath, const Parameters &parameters);
+    void AddToStatistics_(int ithread, size_t num_bytes, double seconds);
+    void BindBaryonFields_(const RangeType &range, BaryonicStore &particles);
+    template <typename Type>
+    void BindColumn_(Column<Type> &column, const RangeType &range, DecoderType<Type> decoder);
+    void BindGasFields_(const RangeType &range, GasStore &gas);
+    void BindParticleFields_(const RangeType &range, ParticleStore &particles);
+    template <typename Type>
+    void BindPlainColumn_(Column<Type> &column, const RangeType &range, std::string label,
+                          int component);
+    void BindStarFields_(const RangeType &range, StarStore &stars);
+    template <typename Type>
+    void DecodeRange_(const RangeType &range, const DecoderType<Type> &decoder, Type *values);
+    RangeType GetRange_(GadgetTypeIndex type, size_t first, size_t n) const;
+    bool HasFieldInRange_(const RangeType &range, std::string label) const;
+    void ResetStatistics_();
+    std::array<std::vector<size_t>,kGadgetNumTypes> file_offsets_; // [type][ifile], + total
+    std::vector<std::shared_ptr<const GadgetSnapshot>> files_;
+    Parameters parameters_;
+    ThreadPool *pool_;
+    size_t total_file_bytes_;
+    std::unique_ptr<ThreadCountersType[]> thread_counters_;
+    int num_thread_counters_;
+};
+
+#endif // gadget_loader_hpp
@@ -0,0 +1,253 @@
+// Implementation of the GadgetSnapshot class
+
+#include "gadget_snapshot.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// Size of the HEAD block and of the label records that precede each block in format-2 files
+const uint32_t kGadgetHeaderSize = 256;
+const uint32_t kGadgetLabelRecordSize = 8;
+
+// Reverses the byte order of a 32-bit record marker
+static uint32_t SwapBytes(uint32_t value) {
+    return ((value & 0x000000FFu) << 24) | ((value & 0x0000FF00u) << 8) |
+           ((value & 0x00FF0000u) >> 8)  | ((value & 0xFF000000u) >> 24);
+}
+
+// Opens and maps the snapshot, then locates all of its blocks
+GadgetSnapshot::GadgetSnapshot(std::string filepath) : file_(MappedFile::Open(filepath)) {
+    if (file_->GetSize() < sizeof(uint32_t))
+        throw std::runtime_error("GadgetSnapshot: File too short: " + filepath);
+
+    uint32_t first_marker = ReadGadgetValue<uint32_t>(file_->GetData(), false);
+    if (first_marker == kGadgetHeaderSize || first_marker == kGadgetLabelRecordSize) {
+        swap_bytes_ = false;
+    } else if (SwapBytes(first_marker) == kGadgetHeaderSize ||
+               SwapBytes(first_marker) == kGadgetLabelRecordSize) {
+        swap_bytes_ = true;
+        first_marker = SwapBytes(first_marker);
+    } else {
+        throw std::runtime_error("GadgetSnapshot: Not a Gadget snapshot: " + filepath);
+    }
+    format2_ = (first_marker == kGadgetLabelRecordSize);
+    ReadBlocks_();
+}
+
+// Checks the first record marker of a file, without mapping it
+bool GadgetSnapshot::IsGadgetSnapshot(std::string filepath) {
+    std::ifstream in_stream(filepath, std::ios::binary);
+    char bytes[sizeof(uint32_t)];
+    if (!in_stream.read(bytes, sizeof(bytes)))
+        return false;
+    uint32_t first_marker = ReadGadgetValue<uint32_t>(bytes, false);
+    for (uint32_t marker : {first_marker, SwapBytes(first_marker)})
+        if (marker == kGadgetHeaderSize || marker == kGadgetLabelRecordSize)
+            return true;
+    return false;
+}
+
+const GadgetHeader &GadgetSnapshot::GetHeader() const {
+    return header_;
+}
+
+std::shared_ptr<const MappedFile> GadgetSnapshot::GetFile() const {
+    return file_;
+}
+
+bool GadgetSnapshot::HasBlock(std::string label) const {
+    return blocks_.count(label) > 0;
+}
+
+// True if the file contains values of field [label] for particle type [type]
+bool GadgetSnapshot::HasField(std::string label, GadgetTypeIndex type) const {
+    return HasBlock(label) && BlockHasType_(label, type);
+}
+
+size_t GadgetSnapshot::GetNParticles(GadgetTypeIndex type) const {
+    return header_.npart[type];
+}
+
+// Determines whether block [label] holds values for particle type [type] (see Gadget-2 io.c)
+bool GadgetSnapshot::BlockHasType_(std::string label, int type) const {
+    if (label == "MASS")
+        return header_.mass[type] == 0;
+    if (label == "U" || label == "RHO" || label == "NE" || label == "NH" || label == "HSML" ||
+        label == "SFR")
+        return type == GADGET_GAS;
+    if (label == "AGE")
+        return type == GADGET_STARS;
+    if (label == "Z")
+        return type == GADGET_GAS || type == GADGET_STARS;
+    return true;
+}
+
+// Returns the labels of the blocks following HEAD in a format-1 file, in the order that Gadget-2
+// writes them given the header flags and particle numbers.
+std::vector<std::string> GadgetSnapshot::GetFormat1BlockOrder_() const {
+    bool has_mass_block = false;
+    for (int itype = 0; itype < kGadgetNumTypes; ++itype)
+        if (header_.npart[itype] > 0 && header_.mass[itype] == 0)
+            has_mass_block = true;
+    bool has_gas   = header_.npart[GADGET_GAS] > 0;
+    bool has_stars = header_.npart[GADGET_STARS] > 0;
+
+    std::vector<std::string> order = {"POS", "VEL", "ID"};
+    if (has_mass_block)
+        order.push_back("MASS");
+    if (has_gas) {
+        order.push_back("U");
+        order.push_back("RHO");
+        if (header_.flag_cooling) {
+            order.push_back("NE");
+            order.push_back("NH");
+        }
+        order.push_back("HSML");
+        if (header_.flag_sfr)
+            order.push_back("SFR");
+    }
+    if (header_.flag_stellarage && has_stars)
+        order.push_back("AGE");
+    if (header_.flag_metals && (has_gas || has_stars))
+        order.push_back("Z");
+    return order;
+}
+
+int GadgetSnapshot::GetNumComponents_(std::string label) const {
+    if (label == "POS" || label == "VEL" || label == "ACCE")
+        return 3;
+    return 1;
+}
+
+// Finds the values of field [label] for type [type] within its block: blocks hold the values for
+// every type that has the field, one type after another.
+GadgetSnapshot::FieldLocationType GadgetSnapshot::LocateField_(std::string label,
+                                                               GadgetTypeIndex type,
+                                                               int component) const {
+    std::map<std::string,BlockType>::const_iterator block = blocks_.find(label);
+    if (block == blocks_.end())
+        throw std::runtime_error("GadgetSnapshot: No " + label + " block in " +
+                                 file_->GetFilepath());
+    if (!BlockHasType_(label, type))
+        throw std::runtime_error("GadgetSnapshot: " + label + " block has no values for type " +
+                                 std::to_string(type));
+
+    FieldLocationType location;
+    location.num_components = GetNumComponents_(label);
+    if (component < 0 || component >= location.num_components)
+        throw std::invalid_argument("GadgetSnapshot: Invalid component for " + label);
+    location.kind = (label == "ID") ? GADGET_INTEGER : GADGET_FLOAT;
+
+    size_t count_before = 0, count_total = 0;
+    for (int itype = 0; itype < kGadgetNumTypes; ++itype) {
+        if (!BlockHasType_(label, itype))
+            continue;
+        if (itype < type)
+            count_before += header_.npart[itype];
+        count_total += header_.npart[itype];
+    }
+    location.count = header_.npart[type];
+    if (count_total == 0) {
+        location.data         = nullptr;
+        location.element_size = sizeof(float);
+        return location;
+    }
+
+    size_t num_values = count_total * location.num_components;
+    if (block->second.size % num_values != 0)
+        throw std::runtime_error("GadgetSnapshot: Unexpected size of " + label + " block");
+    location.element_size = block->second.size / num_values;
+    if (location.element_size != 4 && location.element_size != 8)
+        throw std::runtime_error("GadgetSnapshot: Unsupported value size in " + label + " block");
+
+    location.data = file_->GetData() + block->second.offset +
+                    count_before * location.num_components * location.element_size;
+    return location;
+}
+
+// Decodes the fixed layout of the HEAD block (see Gadget-2 allvars.h)
+void GadgetSnapshot::ParseHeader_(const char *bytes) {
+    for (int itype = 0; itype < kGadgetNumTypes; ++itype) {
+        header_.npart[itype] = ReadGadgetValue<uint32_t>(bytes + 4 * itype, swap_bytes_);
+        header_.mass[itype]  = ReadGadgetValue<double>(bytes + 24 + 8 * itype, swap_bytes_);
+        uint64_t total_low   = ReadGadgetValue<uint32_t>(bytes + 96 + 4 * itype, swap_bytes_);
+        uint64_t total_high  = ReadGadgetValue<uint32_t>(bytes + 168 + 4 * itype, swap_bytes_);
+        header_.npart_total[itype] = (total_high << 32) + total_low;
+    }
+    header_.time                   = ReadGadgetValue<double>(bytes + 72, swap_bytes_);
+    header_.redshift               = ReadGadgetValue<double>(bytes + 80, swap_bytes_);
+    header_.flag_sfr               = ReadGadgetValue<int32_t>(bytes + 88, swap_bytes_);
+    header_.flag_feedback          = ReadGadgetValue<int32_t>(bytes + 92, swap_bytes_);
+    header_.flag_cooling           = ReadGadgetValue<int32_t>(bytes + 120, swap_bytes_);
+    header_.num_files              = ReadGadgetValue<int32_t>(bytes + 124, swap_bytes_);
+    header_.box_size               = ReadGadgetValue<double>(bytes + 128, swap_bytes_);
+    header_.omega_0                = ReadGadgetValue<double>(bytes + 136, swap_bytes_);
+    header_.omega_lambda           = ReadGadgetValue<double>(bytes + 144, swap_bytes_);
+    header_.hubble_parameter       = ReadGadgetValue<double>(bytes + 152, swap_bytes_);
+    header_.flag_stellarage        = ReadGadgetValue<int32_t>(bytes + 160, swap_bytes_);
+    header_.flag_metals            = ReadGadgetValue<int32_t>(bytes + 164, swap_bytes_);
+    header_.flag_entropy_instead_u = ReadGadgetValue<int32_t>(bytes + 192, swap_bytes_);
+}
+
+// Reads the Fortran record starting at [offset], checking that its leading and trailing size
+// markers agree.  Returns the offset of the next record.
+size_t GadgetSnapshot::ReadRecord_(size_t offset, BlockType &record) const {
+    const size_t kMarkerSize = sizeof(uint32_t);
+    if (offset + kMarkerSize > file_->GetSize())
+        throw std::runtime_error("GadgetSnapshot: Truncated record in " + file_->GetFilepath());
+    record.size   = ReadGadgetValue<uint32_t>(file_->GetData() + offset, swap_bytes_);
+    record.offset = offset + kMarkerSize;
+    size_t next_offset = record.offset + record.size + kMarkerSize;
+    if (next_offset > file_->GetSize() ||
+        ReadGadgetValue<uint32_t>(file_->GetData() + next_offset - kMarkerSize, swap_bytes_) !=
+        record.size)
+        throw std::runtime_error("GadgetSnapshot: Corrupt record at byte " +
+                                 std::to_string(offset) + " of " + file_->GetFilepath());
+    return next_offset;
+}
+
+// Walks the file record by record, recording the location and size of each block
+void GadgetSnapshot::ReadBlocks_() {
+    size_t offset = 0;
+    std::vector<std::string> format1_order;
+    int iblock = 0;
+    while (offset < file_->GetSize()) {
+        std::string label;
+        if (format2_) {
+            BlockType label_record;
+            offset = ReadRecord_(offset, label_record);
+            if (label_record.size != kGadgetLabelRecordSize)
+                throw std::runtime_error("GadgetSnapshot: Bad block label in " +
+                                         file_->GetFilepath());
+            label = std::string(file_->GetData() + label_record.offset, 4);
+            label.erase(label.find_last_not_of(' ') + 1);
+        } else if (iblock == 0) {
+            label = "HEAD";
+        } else if (iblock - 1 < static_cast<int>(format1_order.size())) {
+            label = format1_order[iblock - 1];
+        } else {
+            label = "BLOCK" + std::to_string(iblock);
+        }
+
+        BlockType block;
+        offset = ReadRecord_(offset, block);
+        blocks_[label] = block;
+        if (label == "HEAD") {
+            if (block.size != kGadgetHeaderSize)
+                throw std::runtime_error("GadgetSnapshot: Bad header in " + file_->GetFilepath());
+            ParseHeader_(file_->GetData() + block.offset);
+            if (!format2_)
+                format1_order = GetFormat1BlockOrder_();
+        }
+        ++iblock;
+    }
+    if (!HasBlock("HEAD"))
+        throw std::runtime_error("GadgetSnapshot: No header in " + file_->GetFilepath());
+}
@@ -0,0 +1,225 @@
+// Interface for the GadgetSnapshot class, which reads Gadget format-1 and format-2 binary snapshot
+// files, and for the GadgetFieldView class used to access the particle data they contain.
+
+#ifndef gadget_snapshot_hpp
+#define gadget_snapshot_hpp
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "column.hpp"
+#include "mapped_file.hpp"
+
+// Units of length and mass in a standard Gadget run, in Mpc and 1e10 Msun, to be divided by h:
+// lengths are in (comoving, for cosmological runs) kpc/h, and masses in 1e10 Msun/h
+const double kGadgetLengthUnitInMpc = 1e-3;
+const double kGadgetMassUnit        = 1;
+
+// Gadget stores six particle types, in this order, in every block
+const int kGadgetNumTypes = 6;
+enum GadgetTypeIndex {
+    GADGET_GAS   = 0,
+    GADGET_HALO  = 1,
+    GADGET_DISK  = 2,
+    GADGET_BULGE = 3,
+    GADGET_STARS = 4,
+    GADGET_BNDRY = 5
+};
+
+// Contents of the 256-byte HEAD block.  The per-type totals have their high words (for runs with
+// more than 2^32 particles of a type) already folded in.
+struct GadgetHeader {
+    std::array<unsigned int,kGadgetNumTypes> npart;       // Particles of each type in this file
+    std::array<double,kGadgetNumTypes> mass;              // Mass of each type if constant, else 0
+    double time;                                          // Scale factor (comoving runs) or time
+    double redshift;
+    int flag_sfr;
+    int flag_feedback;
+    std::array<unsigned long long,kGadgetNumTypes> npart_total; // Totals over all files
+    int flag_cooling;
+    int num_files;
+    double box_size;
+    double omega_0;
+    double omega_lambda;
+    double hubble_parameter;
+    int flag_stellarage;
+    int flag_metals;
+    int flag_entropy_instead_u;
+};
+
+// Storage format of the values in a block
+enum GadgetValueKind {
+    GADGET_FLOAT,   // float or double
+    GADGET_INTEGER  // unsigned 32- or 64-bit integer (particle IDs)
+};
+
+// Reads a value of type RawType from (possibly unaligned) memory, reversing its bytes if required
+template <typename RawType>
+inline RawType ReadGadgetValue(const char *bytes, bool swap_bytes) {
+    char buffer[sizeof(RawType)];
+    if (swap_bytes) {
+        for (size_t ibyte = 0; ibyte < sizeof(RawType); ++ibyte)
+            buffer[ibyte] = bytes[sizeof(RawType) - 1 - ibyte];
+    } else {
+        std::memcpy(buffer, bytes, sizeof(RawType));
+    }
+    RawType value;
+    std::memcpy(&value, buffer, sizeof(RawType));
+    return value;
+}
+
+// Zero-copy view of one component (e.g. the y coordinate) of one field of one particle type, in a
+// memory-mapped snapshot.  Nothing is converted when the view is created: values are byte-swapped
+// and widened (e.g. float to double) only when they are read with [] or CopyTo().  Holds a
+// reference to the mapped file, so it remains valid after the GadgetSnapshot is destroyed.
+template <typename Type>
+class GadgetFieldView {
+public:
+    GadgetFieldView() : data_(nullptr), count_(0), num_components_(1), component_(0),
+                        element_size_(sizeof(Type)), kind_(GADGET_FLOAT), swap_bytes_(false) {}
+    GadgetFieldView(std::shared_ptr<const MappedFile> file, const char *data, size_t count,
+                    int num_components, int component, int element_size, GadgetValueKind kind,
+                    bool swap_bytes) :
+    file_(file), data_(data), count_(count), num_components_(num_components),
+    component_(component), element_size_(element_size), kind_(kind), swap_bytes_(swap_bytes) {}
+
+    size_t size() const { return count_; }
+
+    // Returns a view of the [count] values starting at [first]
+    GadgetFieldView Slice(size_t first, size_t count) const {
+        GadgetFieldView slice(*this);
+        slice.data_  = data_ + first * num_components_ * element_size_;
+        slice.count_ = count;
+        return slice;
+    }
+
+    Type operator[](size_t index) const {
+        const char *bytes = data_ + (index * num_components_ + component_) * element_size_;
+        if (kind_ == GADGET_FLOAT) {
+            if (element_size_ == sizeof(float))
+                return static_cast<Type>(ReadGadgetValue<float>(bytes, swap_bytes_));
+            return static_cast<Type>(ReadGadgetValue<double>(bytes, swap_bytes_));
+        }
+        if (element_size_ == sizeof(uint32_t))
+            return static_cast<Type>(ReadGadgetValue<uint32_t>(bytes, swap_bytes_));
+        return static_cast<Type>(ReadGadgetValue<uint64_t>(bytes, swap_bytes_));
+    }
+
+    // Decodes every value in the view into [values] (resized to fit)
+    void CopyTo(std::vector<Type> &values) const {
+        values.resize(count_);
+        CopyTo(values.data());
+    }
+
+    // As above, into an array of at least size() elements
+    void CopyTo(Type *values) const {
+        if (IsZeroCopy()) {
+            std::memcpy(values, data_, count_ * sizeof(Type));
+            return;
+        }
+        for (size_t index = 0; index < count_; ++index)
+            values[index] = (*this)[index];
+    }
+
+    // True if the values in the file can be used directly as an array of Type
+    bool IsZeroCopy() const {
+        bool kind_matches = (kind_ == GADGET_FLOAT) == std::is_floating_point<Type>::value;
+        return num_components_ == 1 && !swap_bytes_ && kind_matches &&
+               element_size_ == static_cast<int>(sizeof(Type)) &&
+               reinterpret_cast<uintptr_t>(data_) % alignof(Type) == 0;
+    }
+
+    // Pointer to the values in the mapped file.  Only meaningful if IsZeroCopy() is true.
+    const Type *GetRawData() const { return reinterpret_cast<const Type *>(data_); }
+
+    // Size of the values in the file (excluding any other components interleaved with them)
+    size_t GetNumBytes() const { return count_ * element_size_; }
+
+    std::shared_ptr<const MappedFile> GetFile() const { return file_; }
+
+private:
+    std::shared_ptr<const MappedFile> file_;
+    const char *data_;
+    size_t count_;
+    int num_components_;
+    int component_;
+    int element_size_;
+    GadgetValueKind kind_;
+    bool swap_bytes_;
+};
+
+// Points [column] at a Gadget field: a zero-copy view of the mapped file where the stored values
+// can be used as they are, otherwise a loader that decodes them when the column is first accessed.
+template <typename Type>
+void BindGadgetField(Column<Type> &column, const GadgetFieldView<Type> &field) {
+    if (field.IsZeroCopy()) {
+        column.SetView(field.GetRawData(), field.size(), field.GetFile());
+    } else {
+        column.SetLoader(field.size(), [field](std::vector<Type> &values) {
+            field.CopyTo(values);
+        });
+    }
+}
+
+// Memory-maps a Gadget snapshot file, parses its header and locates each data block by walking
+// the Fortran record markers, without reading any particle data.  Both byte orders are accepted.
+// Format-2 files label each block (e.g. "POS ", "MASS"); in format-1 files the labels are inferred
+// from the standard Gadget-2 block order and the header flags.  Particle data are accessed through
+// GetField(), e.g. GetField<LengthType>("POS", GADGET_HALO, 0) for the x coordinates of the halo
+// (dark matter) particles.  Throws std::runtime_error for missing or malformed files.
+// Usage: GadgetSnapshot(path-to-snapshot-file)
+class GadgetSnapshot {
+public:
+    GadgetSnapshot(std::string filepath);
+    ~GadgetSnapshot() {}
+    static bool IsGadgetSnapshot(std::string filepath);
+    const GadgetHeader &GetHeader() const;
+    std::shared_ptr<const MappedFile> GetFile() const;
+    bool HasBlock(std::string label) const;
+    bool HasField(std::string label, GadgetTypeIndex type) const;
+    size_t GetNParticles(GadgetTypeIndex type) const;
+
+    // Returns a view of component [component] of field [label] for particles of Gadget type [type]
+    template <typename Type>
+    GadgetFieldView<Type> GetField(std::string label, GadgetTypeIndex type,
+                                   int component = 0) const {
+        FieldLocationType location = LocateField_(label, type, component);
+        return GadgetFieldView<Type>(file_, location.data, location.count,
+                                     location.num_components, component, location.element_size,
+                                     location.kind, swap_bytes_);
+    }
+
+private:
+    GadgetSnapshot();
+    struct BlockType {
+        size_t offset; // Start of the block's data, excluding record markers
+        size_t size;   // Size of the block's data in bytes
+    };
+    struct FieldLocationType {
+        const char *data;
+        size_t count;
+        int num_components;
+        int element_size;
+        GadgetValueKind kind;
+    };
+    bool BlockHasType_(std::string label, int type) const;
+    std::vector<std::string> GetFormat1BlockOrder_() const;
+    int GetNumComponents_(std::string label) const;
+    FieldLocationType LocateField_(std::string label, GadgetTypeIndex type, int component) const;
+    void ParseHeader_(const char *bytes);
+    size_t ReadRecord_(size_t offset, BlockType &record) const;
+    void ReadBlocks_();
+    std::map<std::string,BlockType> blocks_;
+    std::shared_ptr<const MappedFile> file_;
+    bool format2_;
+    GadgetHeader header_;
+    bool swap_bytes_;
+};
+
+#endif // gadget_snapshot_hpp
@@ -28,6 +28,7 @@ const unsigned long kMaxParticleId = ULONG_MAX;
 //========================================== Type aliases ==========================================
 typedef float  AbundanceType;
 typedef float  AgeType;
+typedef long long CountType;
 typedef float  MassType;
 typedef float  MetallicityType;
 typedef double LengthType;
@@ -52,5 +53,11 @@ enum ParticleTypeIndex {
 
 //======================================= Physical Constants =======================================
 const AgeType kAgeOfUniverseInGyr = 13.7;
+const double kAtomicMassUnitCgs     = 1.660539e-24; // g
+const double kBoltzmannConstantCgs  = 1.380649e-16; // erg / K
+const double kGravitationalConstant = 43.0071;      // Mpc (km/s)^2 / (1e10 Msun)
+const double kHubbleTimeInGyr       = 9.777922;     // 1 / (100 km/s/Mpc)
+const double kProtonMassCgs         = 1.672622e-24; // g
+const double kSolarMetalFraction    = 0.0134;       // Asplund et al. (2009)
 
 #endif // globals_hpp
\ No newline at end of file
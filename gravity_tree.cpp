@@ -0,0 +1,175 @@
+// Implementation of the GravityTree class
+
+#include "gravity_tree.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Number of particles (or leaves of nodes) handled by each task
+const size_t kGravityBlockSize = 65536;
+
+// Number of leaves whose potentials are summed by each task
+const size_t kGravityLeavesPerTask = 16;
+
+GravityTree::GravityTree(const ParticleStore &particles, const KdTree &tree, LengthType softening,
+                         double gravitational_constant, double opening_angle, ThreadPool &pool) :
+gravitational_constant_(gravitational_constant), opening_angle_(opening_angle),
+softening_(softening), tree_(tree) {
+    if (!(opening_angle >= 0 && opening_angle < 1))
+        throw std::invalid_argument("GravityTree: Opening angle must be in [0, 1)");
+    if (!(softening >= 0))
+        throw std::invalid_argument("GravityTree: Softening can't be negative");
+    if (!(gravitational_constant > 0))
+        throw std::invalid_argument("GravityTree: Gravitational constant must be positive");
+    if (tree.size() != particles.size())
+        throw std::invalid_argument("GravityTree: Tree was built from another store");
+    if (particles.GetPeriodicBoxSize() > 0)
+        throw std::invalid_argument("GravityTree: Periodic stores aren't supported");
+    size_t num_particles = particles.size();
+    size_t num_blocks    = (num_particles + kGravityBlockSize - 1) / kGravityBlockSize;
+    masses_.resize(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kGravityBlockSize, num_particles);
+        for (size_t ipart = iblock * kGravityBlockSize; ipart < last; ++ipart)
+            masses_[ipart] = particles.mass[tree.order_[ipart]];
+    });
+
+    // Sum the leaves in parallel, then combine each other node from its children, which always
+    // come after it in the array
+    const std::vector<KdTree::NodeType> &nodes = tree.nodes_;
+    size_t num_nodes       = nodes.size();
+    size_t num_node_blocks = (num_nodes + kGravityBlockSize - 1) / kGravityBlockSize;
+    node_masses_.resize(num_nodes);
+    auto set_centre = [&](size_t inode, const std::array<double,kNDims> &mass_position) {
+        NodeMassType &node_mass = node_masses_[inode];
+        for (int idim = 0; idim < kNDims; ++idim)
+            node_mass.centre[idim] = node_mass.mass > 0 ? mass_position[idim] / node_mass.mass :
+                                     (nodes[inode].lower[idim] + nodes[inode].upper[idim]) / 2;
+        node_mass.size_squared = tree.GetMaxDistanceSquared_(nodes[inode], node_mass.centre);
+    };
+    pool.ParallelFor(num_node_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kGravityBlockSize, num_nodes);
+        for (size_t inode = iblock * kGravityBlockSize; inode < last; ++inode) {
+            const KdTree::NodeType &node = nodes[inode];
+            if (node.child != 0)
+                continue;
+            double mass = 0;
+            std::array<double,kNDims> mass_position = {};
+            for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart) {
+                mass += masses_[ipart];
+                for (int idim = 0; idim < kNDims; ++idim)
+                    mass_position[idim] += masses_[ipart] * tree.positions_[idim][ipart];
+            }
+            node_masses_[inode].mass = mass;
+            set_centre(inode, mass_position);
+        }
+    });
+    for (size_t inode = num_nodes; inode-- > 0;) {
+        size_t child = nodes[inode].child;
+        if (child == 0)
+            continue;
+        const NodeMassType &left  = node_masses_[child];
+        const NodeMassType &right = node_masses_[child + 1];
+        std::array<double,kNDims> mass_position;
+        for (int idim = 0; idim < kNDims; ++idim)
+            mass_position[idim] = left.mass * left.centre[idim] + right.mass * right.centre[idim];
+        node_masses_[inode].mass = left.mass + right.mass;
+        set_centre(inode, mass_position);
+    }
+}
+
+// Returns the specific gravitational potential of each particle (its potential energy per unit
+// mass, in (km/s)^2), indexed like the store
+std::vector<double> GravityTree::ComputePotentials(ThreadPool &pool) const {
+    std::vector<double> potentials(tree_.size(), 0);
+    std::vector<size_t> leaves;
+    for (size_t inode = 0; inode < tree_.nodes_.size(); ++inode)
+        if (tree_.nodes_[inode].child == 0)
+            leaves.push_back(inode);
+    size_t num_tasks = (leaves.size() + kGravityLeavesPerTask - 1) / kGravityLeavesPerTask;
+    pool.ParallelFor(num_tasks, [&](size_t itask, int) {
+        InteractionsType interactions;
+        size_t last = std::min((itask + 1) * kGravityLeavesPerTask, leaves.size());
+        for (size_t ileaf = itask * kGravityLeavesPerTask; ileaf < last; ++ileaf)
+            SumLeaf_(leaves[ileaf], interactions, potentials);
+    });
+    return potentials;
+}
+
+// Sets the potentials of the particles of a leaf.  A node can only be accepted if it doesn't hold
+// the leaf: its size is at least the distance from its centre of mass to any of its particles, and
+// the opening angle is less than 1.
+void GravityTree::SumLeaf_(size_t ileaf, InteractionsType &interactions,
+                           std::vector<double> &potentials) const {
+    const KdTree::NodeType &leaf = tree_.nodes_[ileaf];
+    double opening_angle_squared = opening_angle_ * opening_angle_;
+    for (int idim = 0; idim < kNDims; ++idim)
+        interactions.positions[idim].clear();
+    interactions.masses.clear();
+    interactions.stack.assign(1, 0);
+    while (!interactions.stack.empty()) {
+        size_t inode = interactions.stack.back();
+        interactions.stack.pop_back();
+        if (inode == ileaf)
+            continue;
+        const KdTree::NodeType &node  = tree_.nodes_[inode];
+        const NodeMassType &node_mass = node_masses_[inode];
+        if (node_mass.size_squared <
+            opening_angle_squared * tree_.GetMinDistanceSquared_(leaf, node_mass.centre)) {
+            for (int idim = 0; idim < kNDims; ++idim)
+                interactions.positions[idim].push_back(node_mass.centre[idim]);
+            interactions.masses.push_back(node_mass.mass);
+        } else if (node.child == 0) {
+            for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart) {
+                for (int idim = 0; idim < kNDims; ++idim)
+                    interactions.positions[idim].push_back(tree_.positions_[idim][ipart]);
+                interactions.masses.push_back(masses_[ipart]);
+            }
+        } else {
+            interactions.stack.push_back(node.child + 1);
+            interactions.stack.push_back(node.child);
+        }
+    }
+
+    // Sum the interactions, then the other particles of the leaf itself
+    LengthType softening_squared = softening_ * softening_;
+    size_t num_interactions      = interactions.masses.size();
+    const double *p_masses       = interactions.masses.data();
+    std::array<const LengthType *,kNDims> p_positions;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_positions[idim] = interactions.positions[idim].data();
+    for (size_t ipart = leaf.first; ipart < leaf.first + leaf.count; ++ipart) {
+        std::array<LengthType,kNDims> position;
+        for (int idim = 0; idim < kNDims; ++idim)
+            position[idim] = tree_.positions_[idim][ipart];
+        double potential = 0;
+        for (size_t iinteraction = 0; iinteraction < num_interactions; ++iinteraction) {
+            LengthType distance_squared = softening_squared;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                LengthType displacement = p_positions[idim][iinteraction] - position[idim];
+                distance_squared += displacement * displacement;
+            }
+            potential -= p_masses[iinteraction] / std::sqrt(distance_squared);
+        }
+        for (size_t jpart = leaf.first; jpart < leaf.first + leaf.count; ++jpart) {
+            if (jpart == ipart)
+                continue;
+            LengthType distance_squared = softening_squared;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                LengthType displacement = tree_.positions_[idim][jpart] - position[idim];
+                distance_squared += displacement * displacement;
+            }
+            potential -= masses_[jpart] / std::sqrt(distance_squared);
+        }
+        potentials[tree_.order_[ipart]] = gravitational_constant_ * potential;
+    }
+}
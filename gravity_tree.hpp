@@ -0,0 +1,66 @@
+// Interface for the GravityTree class
+
+#ifndef gravity_tree_hpp
+#define gravity_tree_hpp
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Default opening angle of GravityTree: the errors of the potentials are typically ~0.1%
+const double kDefaultOpeningAngle = 0.5;
+
+// Gravitational potentials of the particles of a store by the Barnes-Hut method, in O(N log N)
+// rather than O(N^2).  The nodes of a k-d tree of the store are given their mass and centre of
+// mass, and a node is treated as a point mass at its centre of mass when its size (the distance
+// from the centre of mass to the farthest corner of its bounding box) is less than [opening_angle]
+// times its distance; otherwise its children are opened, down to leaves whose particles are summed
+// directly.  An opening angle of 0 gives the exact sum.  Rather than walking the tree for each
+// particle, it's walked once for each leaf, accepting nodes by their distance from the leaf's
+// bounding box, and the resulting list of interactions is summed for all the leaf's particles in a
+// tight loop.  Leaves are shared out between threads, and the result doesn't depend on the number
+// of threads.  Forces are softened as a Plummer sphere of length [softening].  Potentials are
+// [gravitational_constant] times mass over length in the units of the store, so they're in (km/s)^2
+// with G from Parameters::GetGravitationalConstant().  The store is treated as isolated: a periodic
+// store throws exception, since its particles should be unwrapped around the region of interest
+// first (as FindBoundParticles() does).  The store and tree must outlive the GravityTree.
+// Usage: GravityTree gravity(group, tree, softening, G); gravity.ComputePotentials()
+class GravityTree {
+public:
+    GravityTree(const ParticleStore &particles, const KdTree &tree, LengthType softening,
+                double gravitational_constant, double opening_angle = kDefaultOpeningAngle,
+                ThreadPool &pool = ThreadPool::GetShared());
+    std::vector<double> ComputePotentials(ThreadPool &pool = ThreadPool::GetShared()) const;
+    double GetGravitationalConstant() const { return gravitational_constant_; }
+    double GetOpeningAngle() const { return opening_angle_; }
+    LengthType GetSoftening() const { return softening_; }
+private:
+    // Mass and centre of mass of a node of the tree, and the square of its size
+    struct NodeMassType {
+        std::array<LengthType,kNDims> centre;
+        double mass;
+        LengthType size_squared;
+    };
+    // Point masses (nodes and particles) acting on the particles of a leaf, and the stack of nodes
+    // still to visit, reused from one leaf to the next
+    struct InteractionsType {
+        std::array<std::vector<LengthType>,kNDims> positions;
+        std::vector<double> masses;
+        std::vector<size_t> stack;
+    };
+    GravityTree();
+    void SumLeaf_(size_t ileaf, InteractionsType &interactions,
+                  std::vector<double> &potentials) const;
+    double gravitational_constant_;
+    std::vector<double> masses_;           // Masses in tree order
+    std::vector<NodeMassType> node_masses_;
+    double opening_angle_;
+    LengthType softening_;
+    const KdTree &tree_;
+};
+
+#endif // gravity_tree_hpp
@@ -0,0 +1,306 @@
+// Implementation of the Histogram class and the functions making its axes
+
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "globals.hpp"
+#include "npy_file.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+HistogramAxis MakeHistogramAxis(HistogramFieldType field, std::array<double,2> range,
+                                int num_bins, bool log_bins) {
+    if (field == HIST_ABUNDANCE || field == HIST_RADIUS || field == HIST_VALUES)
+        throw std::invalid_argument("Histogram: Axis of this field needs its own Make function");
+    HistogramAxis axis = {field, range, num_bins, log_bins, HYDROGEN, PosCoordsType(), nullptr};
+    return axis;
+}
+
+HistogramAxis MakeAbundanceAxis(Element element, std::array<double,2> range, int num_bins,
+                                bool log_bins) {
+    HistogramAxis axis = {HIST_ABUNDANCE, range, num_bins, log_bins, element, PosCoordsType(),
+                          nullptr};
+    return axis;
+}
+
+HistogramAxis MakeRadiusAxis(const PosCoordsType &centre, std::array<double,2> range,
+                             int num_bins, bool log_bins) {
+    HistogramAxis axis = {HIST_RADIUS, range, num_bins, log_bins, HYDROGEN, centre, nullptr};
+    return axis;
+}
+
+HistogramAxis MakeValuesAxis(const std::vector<double> &values, std::array<double,2> range,
+                             int num_bins, bool log_bins) {
+    HistogramAxis axis = {HIST_VALUES, range, num_bins, log_bins, HYDROGEN, PosCoordsType(),
+                          &values};
+    return axis;
+}
+
+Histogram::Histogram(const std::vector<HistogramAxis> &axes, HistogramWeightType weight)
+        : axes_(axes), weight_(weight) {
+    if (axes.empty())
+        throw std::invalid_argument("Histogram: Need at least one axis");
+    size_t num_bins = 1;
+    for (const HistogramAxis &axis : axes) {
+        if (axis.num_bins < 1)
+            throw std::invalid_argument("Histogram: Need at least one bin along each axis");
+        if (!(axis.range[1] > axis.range[0]))
+            throw std::invalid_argument("Histogram: Range of an axis must be increasing");
+        if (axis.log_bins && axis.range[0] <= 0)
+            throw std::invalid_argument("Histogram: Can't use log bins with a minimum <= 0");
+        if (axis.field == HIST_VALUES && axis.values == nullptr)
+            throw std::invalid_argument("Histogram: No values given for a values axis");
+        num_bins *= axis.num_bins;
+    }
+    values_.assign(num_bins, 0);
+}
+
+void Histogram::Add(const Histogram &other) {
+    if (other.weight_ != weight_ || other.GetShape() != GetShape())
+        throw std::invalid_argument("Histogram: Can only add histograms of the same shape and "
+                                    "weight");
+    for (size_t ibin = 0; ibin < values_.size(); ++ibin)
+        values_[ibin] += other.values_[ibin];
+}
+
+void Histogram::FillAll(const ParticleStore &particles, const Selection &selection,
+                        const std::vector<Histogram *> &histograms, ThreadPool &pool) {
+    FillAllFrom_(particles, selection, histograms, pool);
+}
+
+void Histogram::FillAll(const GasStore &gas, const Selection &selection,
+                        const std::vector<Histogram *> &histograms, ThreadPool &pool) {
+    FillAllFrom_(gas, selection, histograms, pool);
+}
+
+void Histogram::FillAll(const StarStore &stars, const Selection &selection,
+                        const std::vector<Histogram *> &histograms, ThreadPool &pool) {
+    FillAllFrom_(stars, selection, histograms, pool);
+}
+
+std::vector<double> Histogram::GetBinEdges(int iaxis) const {
+    const HistogramAxis &axis = axes_.at(iaxis);
+    double min_scaled = axis.log_bins ? std::log10(axis.range[0]) : axis.range[0];
+    double max_scaled = axis.log_bins ? std::log10(axis.range[1]) : axis.range[1];
+    double bin_width  = (max_scaled - min_scaled) / axis.num_bins;
+    std::vector<double> bin_edges;
+    for (int iedge = 0; iedge <= axis.num_bins; ++iedge) {
+        double edge_scaled = min_scaled + iedge * bin_width;
+        bin_edges.push_back(axis.log_bins ? std::pow(10, edge_scaled) : edge_scaled);
+    }
+    bin_edges.front() = axis.range[0];
+    bin_edges.back()  = axis.range[1];
+    return bin_edges;
+}
+
+std::vector<size_t> Histogram::GetShape() const {
+    std::vector<size_t> shape;
+    for (const HistogramAxis &axis : axes_)
+        shape.push_back(axis.num_bins);
+    return shape;
+}
+
+void Histogram::WriteToNpyFile(std::string filepath) const {
+    WriteArrayToNpyFile(filepath, values_, GetShape());
+    std::cout << "Wrote histogram to " << filepath << std::endl;
+}
+
+// Returns the column of a field held by every particle store
+const float *Histogram::GetFieldColumn_(const ParticleStore &particles,
+                                        const HistogramAxis &axis) {
+    switch (axis.field) {
+        case HIST_MASS:
+            return particles.mass.data();
+        default:
+            throw std::invalid_argument("Histogram: Field not held by this type of particle");
+    }
+}
+
+// As above, but overloaded for the fields of gas and star particles
+const float *Histogram::GetFieldColumn_(const BaryonicStore &particles,
+                                        const HistogramAxis &axis) {
+    switch (axis.field) {
+        case HIST_ABUNDANCE:
+            return particles.abundances[axis.element].data();
+        case HIST_METALLICITY:
+            return particles.metallicity.data();
+        default:
+            return GetFieldColumn_(static_cast<const ParticleStore &>(particles), axis);
+    }
+}
+
+// As above, but overloaded for GasStore type
+const float *Histogram::GetFieldColumn_(const GasStore &gas, const HistogramAxis &axis) {
+    if (axis.field == HIST_TEMPERATURE)
+        return gas.temperature.data();
+    return GetFieldColumn_(static_cast<const BaryonicStore &>(gas), axis);
+}
+
+// As above, but overloaded for StarStore type
+const float *Histogram::GetFieldColumn_(const StarStore &stars, const HistogramAxis &axis) {
+    if (axis.field == HIST_AGE)
+        return stars.age.data();
+    return GetFieldColumn_(static_cast<const BaryonicStore &>(stars), axis);
+}
+
+// Bins the selected particles of the store into all the histograms, each slice of the store into
+// its own partial histograms, which are then added in slice order
+template <typename StoreType>
+void Histogram::FillAllFrom_(const StoreType &particles, const Selection &selection,
+                             const std::vector<Histogram *> &histograms, ThreadPool &pool) {
+    size_t num_particles = particles.size();
+    if (selection.GetUniverseSize() != num_particles)
+        throw std::invalid_argument("Histogram: Selection doesn't match the particle store");
+
+    // Bind each axis of each histogram to the columns its field is computed from, and lay out
+    // the bins of all the histograms one after another
+    size_t num_histograms = histograms.size();
+    std::vector<std::vector<BoundAxisType>> bound_axes(num_histograms);
+    std::vector<size_t> bin_offsets(num_histograms + 1, 0);
+    for (size_t ihist = 0; ihist < num_histograms; ++ihist) {
+        for (const HistogramAxis &axis : histograms[ihist]->axes_) {
+            BoundAxisType bound_axis = {nullptr, nullptr, {}, axis.centre,
+                                        particles.GetPeriodicBoxSize(), 0, 0};
+            switch (axis.field) {
+                case HIST_RADIUS:
+                    for (int idim = 0; idim < kNDims; ++idim) {
+                        bound_axis.positions[idim] = particles.position[idim].data();
+                        bound_axis.centre[idim]    = WrapPosition(axis.centre[idim],
+                                                                  bound_axis.box_size);
+                    }
+                    break;
+                case HIST_VALUES:
+                    if (axis.values->size() != num_particles)
+                        throw std::invalid_argument("Histogram: Values of an axis don't match "
+                                                    "the particle store");
+                    bound_axis.doubles = axis.values->data();
+                    break;
+                default:
+                    bound_axis.floats = GetFieldColumn_(particles, axis);
+            }
+            double min_scaled = axis.log_bins ? std::log10(axis.range[0]) : axis.range[0];
+            double max_scaled = axis.log_bins ? std::log10(axis.range[1]) : axis.range[1];
+            bound_axis.scaled_min    = min_scaled;
+            bound_axis.bins_per_unit = axis.num_bins / (max_scaled - min_scaled);
+            bound_axes[ihist].push_back(bound_axis);
+        }
+        bin_offsets[ihist + 1] = bin_offsets[ihist] + histograms[ihist]->values_.size();
+    }
+    size_t num_bins = bin_offsets[num_histograms];
+    if (num_bins == 0 || num_particles == 0)
+        return;
+
+    // Split the store into slices, which depend only on its size and the number of bins, never on
+    // the number of threads
+    size_t max_slices      = std::max<size_t>(1, std::min(kMaxHistogramSlices,
+                                                          kMaxHistogramSliceBins / num_bins));
+    size_t even_slice_size = (num_particles + max_slices - 1) / max_slices;
+    size_t slice_size      = std::max(kMinHistogramSliceSize, even_slice_size);
+    size_t num_slices      = (num_particles + slice_size - 1) / slice_size;
+    std::vector<double> slice_values(num_slices * num_bins, 0);
+    const MassType *masses = particles.mass.data();
+    pool.ParallelFor(num_slices, [&](size_t islice, int) {
+        double *values = &slice_values[islice * num_bins];
+        size_t first   = islice * slice_size;
+
+        // Bin the particles of the slice in blocks of kHistogramBlockSize, into each histogram
+        size_t block_indices[kHistogramBlockSize];
+        std::ptrdiff_t block_bins[kHistogramBlockSize];
+        size_t num_block_particles = 0;
+        auto bin_block = [&]() {
+            for (size_t ihist = 0; ihist < num_histograms; ++ihist) {
+                const Histogram &histogram = *histograms[ihist];
+                histogram.BinBlock_(bound_axes[ihist], block_indices, num_block_particles,
+                                    block_bins);
+                double *hist_values = &values[bin_offsets[ihist]];
+                bool mass_weighted  = (histogram.weight_ == MASS_WEIGHT);
+                for (size_t iblock = 0; iblock < num_block_particles; ++iblock) {
+                    std::ptrdiff_t ibin = block_bins[iblock];
+                    // Ignore particles outside the histogram's ranges
+                    if (ibin < 0)
+                        continue;
+                    hist_values[ibin] += mass_weighted ? masses[block_indices[iblock]] : 1;
+                }
+            }
+            num_block_particles = 0;
+        };
+        selection.ForEachInRange(first, std::min(first + slice_size, num_particles),
+                                 [&](size_t ipart) {
+            block_indices[num_block_particles++] = ipart;
+            if (num_block_particles == kHistogramBlockSize)
+                bin_block();
+        });
+        bin_block();
+    });
+
+    // Merge the partial histograms in slice order
+    for (size_t ihist = 0; ihist < num_histograms; ++ihist) {
+        std::vector<double> &hist_values = histograms[ihist]->values_;
+        for (size_t islice = 0; islice < num_slices; ++islice) {
+            const double *values = &slice_values[islice * num_bins + bin_offsets[ihist]];
+            for (size_t ibin = 0; ibin < hist_values.size(); ++ibin)
+                hist_values[ibin] += values[ibin];
+        }
+    }
+}
+
+// Sets the index of the bin of each particle of the block, axis by axis (last axis fastest), or
+// -1 if any of its fields is outside the range of its axis
+void Histogram::BinBlock_(const std::vector<BoundAxisType> &bound_axes,
+                          const size_t *block_indices, size_t num_block_particles,
+                          std::ptrdiff_t *block_bins) const {
+    for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+        block_bins[iblock] = 0;
+    double block_values[kHistogramBlockSize];
+    for (size_t iaxis = 0; iaxis < axes_.size(); ++iaxis) {
+        const HistogramAxis &axis  = axes_[iaxis];
+        const BoundAxisType &bound = bound_axes[iaxis];
+
+        // Gather the field of the block's particles
+        if (bound.floats) {
+            for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+                block_values[iblock] = bound.floats[block_indices[iblock]];
+        } else if (bound.doubles) {
+            for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+                block_values[iblock] = bound.doubles[block_indices[iblock]];
+        } else {
+            for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+                block_values[iblock] = 0;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                const LengthType *positions = bound.positions[idim];
+                for (size_t iblock = 0; iblock < num_block_particles; ++iblock) {
+                    LengthType displacement = GetPeriodicDisplacement(
+                        positions[block_indices[iblock]] - bound.centre[idim], bound.box_size);
+                    block_values[iblock] += displacement * displacement;
+                }
+            }
+            for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+                block_values[iblock] = std::sqrt(block_values[iblock]);
+        }
+
+        // Bin it, in the log if the bins are logarithmic.  The comparisons are written so that
+        // NaNs, and the logs of values <= 0, are outside the range.
+        for (size_t iblock = 0; iblock < num_block_particles; ++iblock) {
+            double value   = block_values[iblock];
+            double scaled  = axis.log_bins ? (value > 0 ? std::log10(value) : -HUGE_VAL) : value;
+            double bin_pos = (scaled - bound.scaled_min) * bound.bins_per_unit;
+            if (block_bins[iblock] < 0 || !(bin_pos >= 0 && bin_pos < axis.num_bins)) {
+                block_bins[iblock] = -1;
+                continue;
+            }
+            block_bins[iblock] = block_bins[iblock] * axis.num_bins +
+                                 static_cast<std::ptrdiff_t>(bin_pos);
+        }
+    }
+}
@@ -0,0 +1,139 @@
+// Interface for the Histogram class, N-dimensional histograms of particle properties
+
+#ifndef histogram_hpp
+#define histogram_hpp
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Number of particles whose bins are computed together, a field at a time
+const size_t kHistogramBlockSize = 256;
+
+// Particles are binned in slices of the store of at least kMinHistogramSliceSize, each into its
+// own partial histograms, with at most kMaxHistogramSlices slices and at most
+// kMaxHistogramSliceBins partial bins in all, which bounds the memory they use
+const size_t kMinHistogramSliceSize = 65536;
+const size_t kMaxHistogramSlices    = 256;
+const size_t kMaxHistogramSliceBins = 1 << 24;
+
+// The particle property along a histogram axis
+enum HistogramFieldType {
+    HIST_ABUNDANCE,   // Mass fraction of an element (gas, star particles)
+    HIST_AGE,         // Age (star particles)
+    HIST_MASS,        // Mass
+    HIST_METALLICITY, // Metallicity (gas, star particles)
+    HIST_RADIUS,      // Distance from a centre
+    HIST_TEMPERATURE, // Temperature (gas particles)
+    HIST_VALUES       // Any values given for each particle, e.g. SPH densities
+};
+
+// What each particle adds to its bin
+enum HistogramWeightType {
+    COUNT_WEIGHT,     // 1, so the histogram counts particles
+    MASS_WEIGHT       // Its mass
+};
+
+// One axis of a Histogram: [num_bins] bins between [range][0] and [range][1] of a field, evenly
+// spaced in the field or, if [log_bins], in its log.  A value v is in bin i if edge i <= v < edge
+// i + 1, and values outside the range (or not positive, for log bins) aren't binned.  Made with
+// the MakeXxxAxis() functions.
+struct HistogramAxis {
+    HistogramFieldType field;
+    std::array<double,2> range;
+    int num_bins;
+    bool log_bins;
+    Element element;                    // Element of HIST_ABUNDANCE
+    PosCoordsType centre;               // Centre of HIST_RADIUS
+    const std::vector<double> *values;  // Values of HIST_VALUES, indexed like the store
+};
+
+// Axis of a field with no further parameters: HIST_AGE, HIST_MASS, HIST_METALLICITY or
+// HIST_TEMPERATURE
+HistogramAxis MakeHistogramAxis(HistogramFieldType field, std::array<double,2> range,
+                                int num_bins, bool log_bins = false);
+HistogramAxis MakeAbundanceAxis(Element element, std::array<double,2> range, int num_bins,
+                                bool log_bins = false);
+HistogramAxis MakeRadiusAxis(const PosCoordsType &centre, std::array<double,2> range,
+                             int num_bins, bool log_bins = false);
+// [values] must outlive the histogram's filling
+HistogramAxis MakeValuesAxis(const std::vector<double> &values, std::array<double,2> range,
+                             int num_bins, bool log_bins = false);
+
+// A histogram of the particles of a store over one or more axes, each a particle property (e.g.
+// temperature against density, for a phase diagram), with each particle adding 1 or its mass to
+// its bin.  Any number of histograms of the same store, on any axes, are filled together by
+// FillAll() in one pass over the selected particles: the store is split into slices, which depend
+// only on its size and the number of bins, never on the number of threads, and each slice is
+// binned by one thread into its own partial histograms, a block of particles and an axis at a
+// time.  The partial histograms are then added in slice order, so the result is identical for any
+// number of threads.  Filling adds to the histogram, and histograms on the same axes can be added
+// together, so several stores or snapshots can be combined.  Fields the store doesn't hold (e.g.
+// HIST_AGE for gas) throw.  In a periodic store, radii are to the nearest periodic image of the
+// centre.
+// Usage: Histogram phases({density_axis, temperature_axis}); phases.Fill(gas, hot_gas)
+class Histogram {
+public:
+    Histogram(const std::vector<HistogramAxis> &axes, HistogramWeightType weight = MASS_WEIGHT);
+    // Adds the values of [other], a histogram on the same axes with the same weight
+    void Add(const Histogram &other);
+    // Fills [histograms] together, in one pass over the selected particles
+    static void FillAll(const ParticleStore &particles, const Selection &selection,
+                        const std::vector<Histogram *> &histograms,
+                        ThreadPool &pool = ThreadPool::GetShared());
+    static void FillAll(const GasStore &gas, const Selection &selection,
+                        const std::vector<Histogram *> &histograms,
+                        ThreadPool &pool = ThreadPool::GetShared());
+    static void FillAll(const StarStore &stars, const Selection &selection,
+                        const std::vector<Histogram *> &histograms,
+                        ThreadPool &pool = ThreadPool::GetShared());
+    template <typename StoreType>
+    void Fill(const StoreType &particles, const Selection &selection,
+              ThreadPool &pool = ThreadPool::GetShared()) {
+        FillAll(particles, selection, {this}, pool);
+    }
+    const std::vector<HistogramAxis> &GetAxes() const { return axes_; }
+    // Returns the num_bins + 1 edges of the bins along axis [iaxis]
+    std::vector<double> GetBinEdges(int iaxis) const;
+    size_t GetNumBins() const { return values_.size(); }
+    // Returns the number of bins along each axis
+    std::vector<size_t> GetShape() const;
+    // Returns the sum of the weights in each bin, indexed with the last axis fastest
+    const std::vector<double> &GetValues() const { return values_; }
+    HistogramWeightType GetWeight() const { return weight_; }
+    // Writes the values to a NumPy .npy file, with one dimension per axis
+    void WriteToNpyFile(std::string filepath) const;
+private:
+    // An axis bound to the columns of a store that its field is computed from
+    struct BoundAxisType {
+        const float *floats;          // Column of the field, if a float column of the store
+        const double *doubles;        // Values of HIST_VALUES
+        std::array<const LengthType *,kNDims> positions;
+        PosCoordsType centre;
+        LengthType box_size;
+        double scaled_min;            // range[0], or its log10 for log bins
+        double bins_per_unit;         // Bins per unit of the field, or of its log10
+    };
+    Histogram();
+    static const float *GetFieldColumn_(const ParticleStore &particles, const HistogramAxis &axis);
+    static const float *GetFieldColumn_(const BaryonicStore &particles,
+                                        const HistogramAxis &axis);
+    static const float *GetFieldColumn_(const GasStore &gas, const HistogramAxis &axis);
+    static const float *GetFieldColumn_(const StarStore &stars, const HistogramAxis &axis);
+    template <typename StoreType>
+    static void FillAllFrom_(const StoreType &particles, const Selection &selection,
+                             const std::vector<Histogram *> &histograms, ThreadPool &pool);
+    void BinBlock_(const std::vector<BoundAxisType> &bound_axes, const size_t *block_indices,
+                   size_t num_block_particles, std::ptrdiff_t *block_bins) const;
+    std::vector<HistogramAxis> axes_;
+    std::vector<double> values_;
+    HistogramWeightType weight_;
+};
+
+#endif // histogram_hpp
@@ -0,0 +1,291 @@
+// Implementation of the KdTree class
+
+#include "kd_tree.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Nodes with more particles than this are split
+const size_t kKdTreeLeafSize = 32;
+
+// Number of particles copied by each task
+const size_t kKdTreeCopyBlockSize = 65536;
+
+KdTree::KdTree(const ParticleStore &particles, ThreadPool &pool) :
+periodic_box_size_(particles.GetPeriodicBoxSize()) {
+    size_t num_particles = particles.size();
+    if (num_particles == 0)
+        return;
+
+    // Particles are partitioned as (position, index) records, so that splitting a node only reads
+    // and writes its own contiguous range
+    std::vector<TreeParticleType> tree_particles(num_particles);
+    size_t num_blocks = (num_particles + kKdTreeCopyBlockSize - 1) / kKdTreeCopyBlockSize;
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t first = iblock * kKdTreeCopyBlockSize;
+        size_t last  = std::min(first + kKdTreeCopyBlockSize, num_particles);
+        for (size_t ipart = first; ipart < last; ++ipart) {
+            for (int idim = 0; idim < kNDims; ++idim)
+                tree_particles[ipart].position[idim] = particles.position[idim][ipart];
+            tree_particles[ipart].index = ipart;
+        }
+    });
+
+    NodeType root;
+    root.first = 0;
+    root.count = num_particles;
+    root.child = 0;
+    ComputeBounds_(tree_particles, root);
+    nodes_.push_back(root);
+
+    // Split the nodes of each level in parallel.  The children of the nodes being split are placed
+    // in order at the end of the array before the split, so the layout is fixed.
+    size_t level_start = 0;
+    while (level_start < nodes_.size()) {
+        size_t level_end = nodes_.size();
+        std::vector<size_t> split_nodes;
+        for (size_t inode = level_start; inode < level_end; ++inode) {
+            if (nodes_[inode].count > kKdTreeLeafSize) {
+                nodes_[inode].child = nodes_.size() + 2 * split_nodes.size();
+                split_nodes.push_back(inode);
+            }
+        }
+        nodes_.resize(level_end + 2 * split_nodes.size());
+        pool.ParallelFor(split_nodes.size(), [&](size_t isplit, int) {
+            NodeType &node = nodes_[split_nodes[isplit]];
+            SplitNode_(tree_particles, node, nodes_[node.child], nodes_[node.child + 1]);
+        });
+        level_start = level_end;
+    }
+
+    // Keep the positions and store indices in tree order
+    order_.resize(num_particles);
+    for (int idim = 0; idim < kNDims; ++idim)
+        positions_[idim].resize(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t first = iblock * kKdTreeCopyBlockSize;
+        size_t last  = std::min(first + kKdTreeCopyBlockSize, num_particles);
+        for (size_t ipart = first; ipart < last; ++ipart) {
+            for (int idim = 0; idim < kNDims; ++idim)
+                positions_[idim][ipart] = tree_particles[ipart].position[idim];
+            order_[ipart] = tree_particles[ipart].index;
+        }
+    });
+}
+
+// Returns the [num_neighbours] particles closest to [centre] (or all of them, if there are fewer),
+// nearest first.  Particles at the same distance are ordered by index.
+std::vector<size_t> KdTree::FindNearest(const PosCoordsType &query_centre,
+                                        size_t num_neighbours) const {
+    PosCoordsType centre = WrapCentre_(query_centre);
+    typedef std::pair<LengthType,size_t> NeighbourType; // Squared distance and store index
+    std::priority_queue<NeighbourType> nearest;         // Farthest neighbour found on top
+    if (!nodes_.empty() && num_neighbours > 0) {
+        std::vector<size_t> stack(1, 0);
+        while (!stack.empty()) {
+            const NodeType &node = nodes_[stack.back()];
+            stack.pop_back();
+            if (nearest.size() == num_neighbours &&
+                GetMinDistanceSquared_(node, centre) > nearest.top().first)
+                continue;
+            if (node.child == 0) {
+                for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart) {
+                    NeighbourType neighbour(GetDistanceSquared_(ipart, centre), order_[ipart]);
+                    if (nearest.size() < num_neighbours) {
+                        nearest.push(neighbour);
+                    } else if (neighbour < nearest.top()) {
+                        nearest.pop();
+                        nearest.push(neighbour);
+                    }
+                }
+                continue;
+            }
+            // Visit the nearer child first, so that the farther one is more likely to be pruned
+            size_t near_child = node.child;
+            size_t far_child  = node.child + 1;
+            if (GetMinDistanceSquared_(nodes_[far_child], centre) <
+                GetMinDistanceSquared_(nodes_[near_child], centre))
+                std::swap(near_child, far_child);
+            stack.push_back(far_child);
+            stack.push_back(near_child);
+        }
+    }
+    std::vector<size_t> indices(nearest.size());
+    for (size_t ineighbour = indices.size(); ineighbour > 0; --ineighbour) {
+        indices[ineighbour - 1] = nearest.top().second;
+        nearest.pop();
+    }
+    return indices;
+}
+
+// Returns the particles inside the box [lower, upper], including its faces
+Selection KdTree::SelectBox(const PosCoordsType &lower, const PosCoordsType &upper) const {
+    std::vector<size_t> indices;
+    ForEachInBox(lower, upper, [&indices](size_t index) { indices.push_back(index); });
+    std::sort(indices.begin(), indices.end());
+    return Selection::FromIndices(indices, size());
+}
+
+// Returns the particles with a distance from [centre] of at most [radius]
+Selection KdTree::SelectSphere(const PosCoordsType &centre, LengthType radius) const {
+    std::vector<size_t> indices;
+    ForEachInSphere(centre, radius, [&indices](size_t index) { indices.push_back(index); });
+    std::sort(indices.begin(), indices.end());
+    return Selection::FromIndices(indices, size());
+}
+
+// Sets the bounding box of the node's particles
+void KdTree::ComputeBounds_(const std::vector<TreeParticleType> &tree_particles,
+                            NodeType &node) const {
+    node.lower = tree_particles[node.first].position;
+    node.upper = node.lower;
+    for (size_t ipart = node.first + 1; ipart < node.first + node.count; ++ipart) {
+        for (int idim = 0; idim < kNDims; ++idim) {
+            node.lower[idim] = std::min(node.lower[idim], tree_particles[ipart].position[idim]);
+            node.upper[idim] = std::max(node.upper[idim], tree_particles[ipart].position[idim]);
+        }
+    }
+}
+
+LengthType KdTree::GetDistanceSquared_(size_t ipart, const PosCoordsType &centre) const {
+    LengthType distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = GetPeriodicDisplacement(positions_[idim][ipart] - centre[idim],
+                                                          periodic_box_size_);
+        distance_squared += displacement * displacement;
+    }
+    return distance_squared;
+}
+
+// Squared distance from [centre] to the farthest corner of the node's bounding box, which is never
+// less than the minimum-image distance of any of its particles
+LengthType KdTree::GetMaxDistanceSquared_(const NodeType &node,
+                                          const PosCoordsType &centre) const {
+    LengthType distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = std::max(std::abs(node.lower[idim] - centre[idim]),
+                                           std::abs(node.upper[idim] - centre[idim]));
+        distance_squared += displacement * displacement;
+    }
+    return distance_squared;
+}
+
+// Squared distance from [centre] to the nearest point of the node's bounding box (zero inside it),
+// either directly or, in a periodic box, the other way around the box.  Never more than the
+// squared distance of any of its particles, as each term is rounded like theirs.
+LengthType KdTree::GetMinDistanceSquared_(const NodeType &node,
+                                          const PosCoordsType &centre) const {
+    LengthType distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = 0;
+        if (centre[idim] < node.lower[idim])
+            displacement = std::min(node.lower[idim] - centre[idim],
+                                    std::abs(node.upper[idim] - centre[idim] - periodic_box_size_));
+        else if (centre[idim] > node.upper[idim])
+            displacement = std::min(centre[idim] - node.upper[idim],
+                                    std::abs(node.lower[idim] - centre[idim] + periodic_box_size_));
+        distance_squared += displacement * displacement;
+    }
+    return distance_squared;
+}
+
+// Squared distance between the nearest points of two nodes' bounding boxes (zero if they overlap),
+// either directly or, in a periodic box, the other way around the box.  Never more than the squared
+// distance of any pair of their particles.
+LengthType KdTree::GetMinDistanceSquared_(const NodeType &node_a, const NodeType &node_b) const {
+    LengthType distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = 0;
+        if (node_a.upper[idim] < node_b.lower[idim])
+            displacement = std::min(node_b.lower[idim] - node_a.upper[idim],
+                                    std::abs(node_b.upper[idim] - node_a.lower[idim] -
+                                             periodic_box_size_));
+        else if (node_b.upper[idim] < node_a.lower[idim])
+            displacement = std::min(node_a.lower[idim] - node_b.upper[idim],
+                                    std::abs(node_a.upper[idim] - node_b.lower[idim] -
+                                             periodic_box_size_));
+        distance_squared += displacement * displacement;
+    }
+    return distance_squared;
+}
+
+bool KdTree::IsInBox_(size_t ipart, const PosCoordsType &lower,
+                      const PosCoordsType &upper) const {
+    bool inside = true;
+    for (int idim = 0; idim < kNDims; ++idim)
+        inside = inside && positions_[idim][ipart] >= lower[idim] &&
+                 positions_[idim][ipart] <= upper[idim];
+    return inside;
+}
+
+// Periodic queries are made from the image of the centre inside the box
+PosCoordsType KdTree::WrapCentre_(const PosCoordsType &centre) const {
+    PosCoordsType wrapped_centre;
+    for (int idim = 0; idim < kNDims; ++idim)
+        wrapped_centre[idim] = WrapPosition(centre[idim], periodic_box_size_);
+    return wrapped_centre;
+}
+
+// Appends to [node_pairs] the pairs of children to visit in place of [node_pair] in
+// ForEachPairWithin(), leaving out those further apart than the radius, and returns true, or
+// returns false if both nodes are leaves.  A node paired with itself gives each of its children
+// paired with itself and the two children paired together; otherwise the node with more particles
+// is split.
+bool KdTree::SplitNodePair_(const NodePairType &node_pair, LengthType radius_squared,
+                            std::vector<NodePairType> &node_pairs) const {
+    const NodeType &node_a = nodes_[node_pair.first];
+    const NodeType &node_b = nodes_[node_pair.second];
+    if (node_pair.first == node_pair.second) {
+        if (node_a.child == 0)
+            return false;
+        node_pairs.push_back(NodePairType(node_a.child, node_a.child));
+        node_pairs.push_back(NodePairType(node_a.child + 1, node_a.child + 1));
+        if (GetMinDistanceSquared_(nodes_[node_a.child], nodes_[node_a.child + 1]) <=
+            radius_squared)
+            node_pairs.push_back(NodePairType(node_a.child, node_a.child + 1));
+        return true;
+    }
+    if (node_a.child == 0 && node_b.child == 0)
+        return false;
+    bool split_a = node_b.child == 0 || (node_a.child != 0 && node_a.count >= node_b.count);
+    size_t split_node = split_a ? node_pair.first : node_pair.second;
+    size_t other_node = split_a ? node_pair.second : node_pair.first;
+    for (size_t child = nodes_[split_node].child; child < nodes_[split_node].child + 2; ++child)
+        if (GetMinDistanceSquared_(nodes_[child], nodes_[other_node]) <= radius_squared)
+            node_pairs.push_back(NodePairType(child, other_node));
+    return true;
+}
+
+// Divides the node's particles at the median of its widest dimension between its two children
+void KdTree::SplitNode_(std::vector<TreeParticleType> &tree_particles, NodeType &node,
+                        NodeType &left, NodeType &right) const {
+    int split_dim = 0;
+    for (int idim = 1; idim < kNDims; ++idim)
+        if (node.upper[idim] - node.lower[idim] > node.upper[split_dim] - node.lower[split_dim])
+            split_dim = idim;
+    auto first  = tree_particles.begin() + node.first;
+    auto middle = first + node.count / 2;
+    std::nth_element(first, middle, first + node.count,
+                     [split_dim](const TreeParticleType &a, const TreeParticleType &b) {
+        return a.position[split_dim] < b.position[split_dim];
+    });
+
+    left.first  = node.first;
+    left.count  = node.count / 2;
+    left.child  = 0;
+    right.first = node.first + left.count;
+    right.count = node.count - left.count;
+    right.child = 0;
+    ComputeBounds_(tree_particles, left);
+    ComputeBounds_(tree_particles, right);
+}
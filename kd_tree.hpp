@@ -0,0 +1,191 @@
+// Interface for the KdTree class
+
+#ifndef kd_tree_hpp
+#define kd_tree_hpp
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// ForEachPairWithin() splits its traversal into at least this many pairs of nodes (where the tree
+// is deep enough), which are shared out between threads
+const size_t kKdTreeMinPairTasks = 1024;
+
+// A k-d tree over the positions of the particles of one store, for finding the particles in a
+// region without scanning the whole store.  Queries return indices into the store, can be made from
+// several threads at once and, in a periodic store, use minimum-image distances (except box
+// queries).  The tree must be rebuilt if the positions change.
+// Usage: KdTree tree(simulation.stars); tree.SelectSphere(centre, radius)
+class KdTree {
+public:
+    KdTree(const ParticleStore &particles, ThreadPool &pool = ThreadPool::GetShared());
+    std::vector<size_t> FindNearest(const PosCoordsType &centre, size_t num_neighbours) const;
+    size_t GetNumNodes() const { return nodes_.size(); }
+    Selection SelectBox(const PosCoordsType &lower, const PosCoordsType &upper) const;
+    Selection SelectSphere(const PosCoordsType &centre, LengthType radius) const;
+    size_t size() const { return order_.size(); }
+    friend class GravityTree;
+    friend class PairCounter;
+    friend class SightlineCaster;
+    friend class SphInterpolator;
+
+    // Calls function(index) for each particle with a distance from [centre] of at most [radius],
+    // in no particular order.  Squared distances are computed as in
+    // ParticleStore::GetDistanceFrom(), and nodes entirely inside the sphere are visited without
+    // testing their particles.
+    template <typename FunctionType>
+    void ForEachInSphere(const PosCoordsType &query_centre, LengthType radius,
+                         FunctionType function) const {
+        if (nodes_.empty() || radius < 0)
+            return;
+        PosCoordsType centre      = WrapCentre_(query_centre);
+        LengthType radius_squared = radius * radius;
+        std::vector<size_t> stack(1, 0);
+        while (!stack.empty()) {
+            const NodeType &node = nodes_[stack.back()];
+            stack.pop_back();
+            if (GetMinDistanceSquared_(node, centre) > radius_squared)
+                continue;
+            if (GetMaxDistanceSquared_(node, centre) <= radius_squared) {
+                for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart)
+                    function(order_[ipart]);
+            } else if (node.child == 0) {
+                for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart)
+                    if (GetDistanceSquared_(ipart, centre) <= radius_squared)
+                        function(order_[ipart]);
+            } else {
+                stack.push_back(node.child + 1);
+                stack.push_back(node.child);
+            }
+        }
+    }
+
+    // Calls function(index) for each particle inside the box [lower, upper] (including its faces),
+    // in no particular order
+    template <typename FunctionType>
+    void ForEachInBox(const PosCoordsType &lower, const PosCoordsType &upper,
+                      FunctionType function) const {
+        if (nodes_.empty())
+            return;
+        std::vector<size_t> stack(1, 0);
+        while (!stack.empty()) {
+            const NodeType &node = nodes_[stack.back()];
+            stack.pop_back();
+            bool overlaps = true;
+            bool inside   = true;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                overlaps = overlaps && node.lower[idim] <= upper[idim] &&
+                           node.upper[idim] >= lower[idim];
+                inside   = inside && node.lower[idim] >= lower[idim] &&
+                           node.upper[idim] <= upper[idim];
+            }
+            if (!overlaps)
+                continue;
+            if (inside) {
+                for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart)
+                    function(order_[ipart]);
+            } else if (node.child == 0) {
+                for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart)
+                    if (IsInBox_(ipart, lower, upper))
+                        function(order_[ipart]);
+            } else {
+                stack.push_back(node.child + 1);
+                stack.push_back(node.child);
+            }
+        }
+    }
+
+    // Calls function(index_a, index_b) once for each pair of particles with a distance of at most
+    // [radius] between them, in no particular order and from several threads of [pool] at once.
+    // Pairs of nodes are traversed together (a dual-tree walk), so nodes further apart than
+    // [radius] are skipped whole and only the particles of nearby leaves are compared.
+    template <typename FunctionType>
+    void ForEachPairWithin(LengthType radius, FunctionType function,
+                           ThreadPool &pool = ThreadPool::GetShared()) const {
+        if (nodes_.empty() || radius < 0)
+            return;
+        LengthType radius_squared = radius * radius;
+
+        // Split the walk breadth-first until there are enough node pairs to share out
+        std::vector<NodePairType> tasks(1, NodePairType(0, 0));
+        bool split_any = true;
+        while (split_any && tasks.size() < kKdTreeMinPairTasks) {
+            std::vector<NodePairType> next_tasks;
+            split_any = false;
+            for (const NodePairType &task : tasks) {
+                if (SplitNodePair_(task, radius_squared, next_tasks))
+                    split_any = true;
+                else
+                    next_tasks.push_back(task);
+            }
+            tasks.swap(next_tasks);
+        }
+
+        pool.ParallelFor(tasks.size(), [&](size_t itask, int) {
+            std::vector<NodePairType> stack(1, tasks[itask]);
+            while (!stack.empty()) {
+                NodePairType node_pair = stack.back();
+                stack.pop_back();
+                if (SplitNodePair_(node_pair, radius_squared, stack))
+                    continue;
+                // Both nodes are leaves: compare their particles, skipping those of the first
+                // which are too far from the second's bounding box
+                const NodeType &node_a = nodes_[node_pair.first];
+                const NodeType &node_b = nodes_[node_pair.second];
+                bool same_node = (node_pair.first == node_pair.second);
+                for (size_t ipart = node_a.first; ipart < node_a.first + node_a.count; ++ipart) {
+                    PosCoordsType position;
+                    for (int idim = 0; idim < kNDims; ++idim)
+                        position[idim] = positions_[idim][ipart];
+                    if (!same_node && GetMinDistanceSquared_(node_b, position) > radius_squared)
+                        continue;
+                    size_t first_b = same_node ? ipart + 1 : node_b.first;
+                    for (size_t jpart = first_b; jpart < node_b.first + node_b.count; ++jpart)
+                        if (GetDistanceSquared_(jpart, position) <= radius_squared)
+                            function(order_[ipart], order_[jpart]);
+                }
+            }
+        });
+    }
+
+private:
+    // A node holds particles [first, first + count) in tree order.  Leaves have child = 0 (the
+    // root is never a child), other nodes have children [child, child + 1).
+    struct NodeType {
+        std::array<LengthType,kNDims> lower;
+        std::array<LengthType,kNDims> upper;
+        size_t first;
+        size_t count;
+        size_t child;
+    };
+    // A particle's position and store index, while the tree is being built
+    struct TreeParticleType {
+        std::array<LengthType,kNDims> position;
+        size_t index;
+    };
+    typedef std::pair<size_t,size_t> NodePairType;
+    KdTree();
+    void ComputeBounds_(const std::vector<TreeParticleType> &tree_particles,
+                        NodeType &node) const;
+    LengthType GetDistanceSquared_(size_t ipart, const PosCoordsType &centre) const;
+    LengthType GetMaxDistanceSquared_(const NodeType &node, const PosCoordsType &centre) const;
+    LengthType GetMinDistanceSquared_(const NodeType &node, const PosCoordsType &centre) const;
+    LengthType GetMinDistanceSquared_(const NodeType &node_a, const NodeType &node_b) const;
+    bool IsInBox_(size_t ipart, const PosCoordsType &lower, const PosCoordsType &upper) const;
+    PosCoordsType WrapCentre_(const PosCoordsType &centre) const;
+    void SplitNode_(std::vector<TreeParticleType> &tree_particles, NodeType &node,
+                    NodeType &left, NodeType &right) const;
+    bool SplitNodePair_(const NodePairType &node_pair, LengthType radius_squared,
+                        std::vector<NodePairType> &node_pairs) const;
+    std::vector<NodeType> nodes_;
+    LengthType periodic_box_size_;
+    std::vector<size_t> order_;                            // Store index of each tree position
+    std::array<std::vector<LengthType>,kNDims> positions_; // Positions in tree order
+};
+
+#endif // kd_tree_hpp
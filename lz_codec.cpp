@@ -0,0 +1,154 @@
+// Implementation of the LZ4-style block codec and byte shuffle
+
+#include "lz_codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Format constants of the LZ4 block format: matches are at least 4 bytes long, the last match must
+// start at least 12 bytes before the end of the input, and the last 5 bytes are always literals.
+const size_t kMinMatch         = 4;
+const size_t kMatchSearchLimit = 12;
+const size_t kLastLiterals     = 5;
+const size_t kMaxOffset        = 65535;
+const int kHashBits            = 12;
+
+static uint32_t Read32(const char *bytes) {
+    uint32_t value;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t HashSequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+// Appends a length that didn't fit in its 4-bit token field, as a run of 255s plus a remainder
+static void WriteLengthExtension(size_t length, std::vector<char> &out) {
+    for (; length >= 255; length -= 255)
+        out.push_back(static_cast<char>(255));
+    out.push_back(static_cast<char>(length));
+}
+
+// Appends one sequence: a token, the literals source[anchor, anchor + num_literals), and (unless
+// this is the final sequence) the offset and length of the match that follows them.
+static void WriteSequence(const char *source, size_t anchor, size_t num_literals,
+                          size_t match_offset, size_t match_length, bool has_match,
+                          std::vector<char> &out) {
+    size_t token_position = out.size();
+    size_t literals_code  = num_literals < 15 ? num_literals : 15;
+    unsigned char token   = static_cast<unsigned char>(literals_code << 4);
+    out.push_back(0);
+    if (num_literals >= 15)
+        WriteLengthExtension(num_literals - 15, out);
+    out.insert(out.end(), source + anchor, source + anchor + num_literals);
+    if (has_match) {
+        out.push_back(static_cast<char>(match_offset & 0xFF));
+        out.push_back(static_cast<char>(match_offset >> 8));
+        size_t length_code = match_length - kMinMatch;
+        token |= static_cast<unsigned char>(length_code < 15 ? length_code : 15);
+        if (length_code >= 15)
+            WriteLengthExtension(length_code - 15, out);
+    }
+    out[token_position] = static_cast<char>(token);
+}
+
+std::vector<char> LZCompress(const char *source, size_t size) {
+    std::vector<char> out;
+    out.reserve(size / 2 + 16);
+    std::vector<int64_t> hash_table(1 << kHashBits, -1);
+
+    size_t anchor = 0, position = 0;
+    if (size > kMatchSearchLimit) {
+        const size_t kSearchEnd = size - kMatchSearchLimit;
+        const size_t kMatchEnd  = size - kLastLiterals;
+        while (position < kSearchEnd) {
+            uint32_t sequence  = Read32(source + position);
+            uint32_t hash      = HashSequence(sequence);
+            int64_t candidate  = hash_table[hash];
+            hash_table[hash]   = position;
+            if (candidate < 0 || position - candidate > kMaxOffset ||
+                Read32(source + candidate) != sequence) {
+                ++position;
+                continue;
+            }
+            size_t match_length = kMinMatch;
+            while (position + match_length < kMatchEnd &&
+                   source[candidate + match_length] == source[position + match_length])
+                ++match_length;
+            WriteSequence(source, anchor, position - anchor, position - candidate, match_length,
+                          true, out);
+            position += match_length;
+            anchor    = position;
+        }
+    }
+    WriteSequence(source, anchor, size - anchor, 0, 0, false, out);
+    return out;
+}
+
+// Reads a length extension (a run of 255s plus a remainder) starting at [position]
+static size_t ReadLengthExtension(const unsigned char *compressed, size_t compressed_size,
+                                  size_t &position) {
+    size_t length = 0;
+    unsigned char byte;
+    do {
+        if (position >= compressed_size)
+            throw std::runtime_error("LZDecompress: Truncated length");
+        byte    = compressed[position++];
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+void LZDecompress(const char *compressed, size_t compressed_size, char *destination,
+                  size_t size) {
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(compressed);
+    size_t in_position = 0, out_position = 0;
+    while (in_position < compressed_size) {
+        unsigned char token = in[in_position++];
+        size_t num_literals = token >> 4;
+        if (num_literals == 15)
+            num_literals += ReadLengthExtension(in, compressed_size, in_position);
+        if (in_position + num_literals > compressed_size || out_position + num_literals > size)
+            throw std::runtime_error("LZDecompress: Literals overrun buffer");
+        std::memcpy(destination + out_position, compressed + in_position, num_literals);
+        in_position  += num_literals;
+        out_position += num_literals;
+        if (in_position == compressed_size)
+            break;
+
+        if (in_position + 2 > compressed_size)
+            throw std::runtime_error("LZDecompress: Truncated match offset");
+        size_t match_offset = in[in_position] | (in[in_position + 1] << 8);
+        in_position += 2;
+        size_t match_length = (token & 15);
+        if (match_length == 15)
+            match_length += ReadLengthExtension(in, compressed_size, in_position);
+        match_length += kMinMatch;
+        if (match_offset == 0 || match_offset > out_position || out_position + match_length > size)
+            throw std::runtime_error("LZDecompress: Invalid match");
+        // Matches may overlap their own output (e.g. runs), so copy forwards byte by byte
+        const char *match = destination + out_position - match_offset;
+        for (size_t ibyte = 0; ibyte < match_length; ++ibyte)
+            destination[out_position + ibyte] = match[ibyte];
+        out_position += match_length;
+    }
+    if (out_position != size)
+        throw std::runtime_error("LZDecompress: Decompressed size doesn't match");
+}
+
+void ShuffleBytes(const char *source, size_t num_elements, size_t element_size,
+                  char *destination) {
+    for (size_t ielem = 0; ielem < num_elements; ++ielem)
+        for (size_t ibyte = 0; ibyte < element_size; ++ibyte)
+            destination[ibyte * num_elements + ielem] = source[ielem * element_size + ibyte];
+}
+
+void UnshuffleBytes(const char *source, size_t num_elements, size_t element_size,
+                    char *destination) {
+    for (size_t ibyte = 0; ibyte < element_size; ++ibyte)
+        for (size_t ielem = 0; ielem < num_elements; ++ielem)
+            destination[ielem * element_size + ibyte] = source[ibyte * num_elements + ielem];
+}
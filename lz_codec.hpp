@@ -0,0 +1,27 @@
+// Declares the lightweight compression functions used for particle data blocks: an LZ4-style
+// byte-oriented LZ77 codec, and a byte shuffle that makes arrays of numbers more compressible.
+
+#ifndef lz_codec_hpp
+#define lz_codec_hpp
+#include <cstddef>
+#include <vector>
+
+// Compresses [size] bytes at [source] into an LZ4 block-format byte stream (literal runs and
+// back-references of up to 64 kB, found with a single-probe hash table).  Compression is fast
+// rather than tight, and decompression is little more than a memory copy.
+std::vector<char> LZCompress(const char *source, size_t size);
+
+// Decompresses an LZ4 block of [compressed_size] bytes into exactly [size] bytes at [destination].
+// Throws std::runtime_error if the stream is corrupt or doesn't decode to [size] bytes.
+void LZDecompress(const char *compressed, size_t compressed_size, char *destination, size_t size);
+
+// Regroups an array of [num_elements] values of [element_size] bytes so that the first byte of
+// every value comes first, then every second byte and so on.  Neighbouring particles often share
+// exponent and high mantissa bytes, which then form long repeats that the LZ codec can exploit.
+void ShuffleBytes(const char *source, size_t num_elements, size_t element_size, char *destination);
+
+// Reverses ShuffleBytes()
+void UnshuffleBytes(const char *source, size_t num_elements, size_t element_size,
+                    char *destination);
+
+#endif // lz_codec_hpp
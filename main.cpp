@@ -1,59 +1,328 @@
 #include <array>
 #include <iostream>
+#include <set>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
+#include "cell_grid.hpp"
+#include "centre_finder.hpp"
+#include "density_mesh.hpp"
+#include "domain_decomposition.hpp"
 #include "dynamics.hpp"
 #include "filter_particles.hpp"
+#include "fof_groups.hpp"
 #include "gas_particle.hpp"
 #include "globals.hpp"
+#include "histogram.hpp"
+#include "kd_tree.hpp"
+#include "pair_counter.hpp"
 #include "particle.hpp"
+#include "particle_store.hpp"
+#include "process_group.hpp"
+#include "projected_map.hpp"
 #include "radial_profile.hpp"
+#include "selection.hpp"
+#include "sightline_caster.hpp"
 #include "simulation.hpp"
+#include "snapshot_stream.hpp"
+#include "sph_interpolator.hpp"
 #include "star_particle.hpp"
+#include "thread_pool.hpp"
+#include "unbinding.hpp"
+
+// Computes the stellar profiles about the centre of mass of the dark matter, and the dynamics of
+// the hot gas, over a decomposition of the box into domains shared between the processes of the
+// run (see DomainDecomposition).  Each process streams the snapshot, and analyses the particles of
+// its own domains into a partial result per domain, which are then reduced over all processes.
+// The root process writes the profiles and reports the dynamics, which are the same for any
+// number of processes.
+static void RunDomainAnalyses(std::string filepath, std::array<LengthType,2> profile_range,
+                              int profile_num_bins) {
+    ProcessGroup &world = ProcessGroup::GetWorld();
+    SnapshotStream stream(filepath);
+    DomainDecomposition domains(stream.GetParameters().GetBoxSize(), world);
+    size_t num_local_domains = domains.GetLocalDomains().size();
+
+    // Find the centre of mass of the dark matter
+    std::vector<DynamicsAccumulator> dark_matter_sums(num_local_domains);
+    stream.ForEachDarkMatterChunk([&](const ParticleStore &dark_matter_chunk, size_t) {
+        std::vector<Selection> chunk_domains = domains.SelectLocalDomains(dark_matter_chunk);
+        for (size_t ilocal = 0; ilocal < num_local_domains; ++ilocal)
+            dark_matter_sums[ilocal].Add(AccumulateDynamics<false>(dark_matter_chunk,
+                                                                   chunk_domains[ilocal],
+                                                                   ThreadPool::GetShared()));
+    });
+    DynamicsAccumulator dark_matter_total;
+    domains.Reduce(dark_matter_sums, dark_matter_total);
+    PosCoordsType centre = SummariseDynamics(dark_matter_total).centre_of_mass;
+
+    // Compute all the stellar profiles about it
+    const std::vector<ProfileKindType> kStellarProfileKinds = {DENSITY, CUMU_MASS,
+                                                               AVG_METALLICITY, AVG_AGE,
+                                                               AVG_CARBON_FRAC};
+    RadialProfile<StarStore> stellar_profiles(centre, kStellarProfileKinds, profile_range,
+                                              profile_num_bins);
+    std::vector<RadialProfile<StarStore>> stellar_partials(num_local_domains, stellar_profiles);
+    stream.ForEachStarChunk([&](const StarStore &star_chunk, size_t) {
+        std::vector<Selection> chunk_domains = domains.SelectLocalDomains(star_chunk);
+        for (size_t ilocal = 0; ilocal < num_local_domains; ++ilocal)
+            stellar_partials[ilocal].Add(star_chunk, chunk_domains[ilocal]);
+    });
+    domains.Reduce(stellar_partials, stellar_profiles);
+
+    // Compute the dynamics of the gas hotter than 10^5 K
+    const TemperatureType kMinTemperature = 1e5;
+    std::vector<DynamicsAccumulator> hot_gas_sums(num_local_domains);
+    stream.ForEachGasChunk([&](const GasStore &gas_chunk, size_t) {
+        Selection hot_gas_chunk = FilterParticles(gas_chunk, TEMPERATURE_GT, kMinTemperature);
+        std::vector<Selection> chunk_domains = domains.SelectLocalDomains(gas_chunk);
+        for (size_t ilocal = 0; ilocal < num_local_domains; ++ilocal)
+            hot_gas_sums[ilocal].Add(AccumulateDynamics<true>(gas_chunk,
+                                                              chunk_domains[ilocal] &
+                                                              hot_gas_chunk,
+                                                              ThreadPool::GetShared()));
+    });
+    DynamicsAccumulator hot_gas_total;
+    domains.Reduce(hot_gas_sums, hot_gas_total);
+
+    if (world.IsRoot()) {
+        std::cout << std::endl << "[Domains] " << domains.GetNumDomains() << " domains on " <<
+                     world.GetSize() << " process(es)" << std::endl;
+        stellar_profiles.OutputToTextFile("domain_stellar_profiles.txt");
+        std::cout << " Hot gas velocity dispersion: " <<
+                     SummariseDynamics(hot_gas_total).velocity_dispersion << std::endl;
+    }
+}
 
 int main(int argc, const char * argv[]) {
     try {
-        // Instantiate a simulation and report its properties
-        Simulation simulation("example_parameter_filename.txt");
-        std::cout << simulation << std::endl;
+        std::string filepath = (argc > 1) ? argv[1] : "example_parameter_filename.txt";
 
-        std::cout << "Properties of the first gas particle:" << simulation.gas[0] << std::endl;
-        
         // Settings for radial profiles
         const std::array<LengthType,2> kProfileRange    = {0, 5};
         const std::array<LengthType,2> kProfileLogRange = {0.03, 3};
         const int kProfileNumBins = 20;
-        
-        // Use CoM of dark matter particles as centre for all profiles
-        PosCoordsType centre_of_mass = ComputeCentreOfMass(simulation.dark_matter);
+
+        // If started by mpirun with several processes, only run the analyses shared between them
+        if (ProcessGroup::GetWorld().GetSize() > 1) {
+            RunDomainAnalyses(filepath, kProfileRange, kProfileNumBins);
+            return 0;
+        }
+
+        // Instantiate a simulation (from a Gadget snapshot or snapshot cache, if one is given) and
+        // report its properties
+        Simulation simulation(filepath);
+        std::cout << simulation << std::endl;
+
+        std::cout << "Properties of the first gas particle:" << simulation.gas[0] << std::endl;
+
+        // Find friends-of-friends groups of dark matter, with a k-d tree to find the linked pairs
+        KdTree dark_matter_tree(simulation.dark_matter);
+        LengthType mean_spacing = simulation.GetParameters().GetMeanParticleSpacing(DM_TYPE_IDX);
+        LengthType linking_length = kDefaultLinkingFraction * mean_spacing;
+        FofGroups dark_matter_groups(simulation.dark_matter, dark_matter_tree, linking_length);
+        std::cout << "Friends-of-friends groups: " << dark_matter_groups.GetNumGroups();
+        if (dark_matter_groups.GetNumGroups() > 0)
+            std::cout << " (largest " << dark_matter_groups.GetGroupSize(0) << " particles)";
+        std::cout << std::endl;
+
+        // Check them against the groups linked with a cell grid as wide as the linking length,
+        // which must be the same (the numbering of the groups doesn't depend on the pair search)
+        CellGrid dark_matter_grid(simulation.dark_matter, linking_length);
+        FofGroups grid_groups(simulation.dark_matter, dark_matter_grid, linking_length);
+        for (size_t ipart = 0; ipart < simulation.dark_matter.size(); ++ipart)
+            if (grid_groups.GetGroup(ipart) != dark_matter_groups.GetGroup(ipart))
+                throw std::runtime_error("Groups linked with the cell grid and the k-d tree "
+                                         "differ");
+        std::cout << "Groups linked with a cell grid of " << dark_matter_grid.GetNumCells() <<
+                     " cells match" << std::endl;
+
+        // Remove the particles of each group which aren't bound to it, with potentials from a
+        // Barnes-Hut tree softened over a small fraction of the mean interparticle spacing, and G
+        // in the units of the snapshot
+        const double kSofteningFraction = 0.025;
+        double gravitational_constant = simulation.GetParameters().GetGravitationalConstant();
+        std::vector<Selection> bound_dark_matter = FindBoundParticles(simulation.dark_matter,
+                                                                      dark_matter_groups,
+                                                                      kSofteningFraction *
+                                                                      mean_spacing,
+                                                                      gravitational_constant);
+        if (!bound_dark_matter.empty())
+            std::cout << "Bound particles in the largest group: " << bound_dark_matter[0].size() <<
+                         std::endl;
+
+        // Centre all profiles on the dark matter halo, found by shrinking a sphere from the largest
+        // group (or, without one, from the CoM of all dark matter particles), using the tree so
+        // that only the particles within a sphere are visited
+        ShrinkingSphereResult halo_centre;
+        if (dark_matter_groups.GetNumGroups() > 0) {
+            halo_centre = FindShrinkingSphereCentre(simulation.dark_matter, dark_matter_tree,
+                                                    dark_matter_groups.SelectGroup(0));
+        } else {
+            PosCoordsType centre_of_mass = ComputeCentreOfMass(simulation.dark_matter);
+            halo_centre = FindShrinkingSphereCentre(simulation.dark_matter, dark_matter_tree,
+                                                    centre_of_mass, kProfileRange[1]);
+        }
+        PosCoordsType centre = halo_centre.centre;
+        std::cout << "Halo centre: " << centre << " (from " << halo_centre.num_particles <<
+                     " particles after " << halo_centre.num_iterations << " iterations)" <<
+                     std::endl;
         
         // Compute and output the spherically averaged density profile of dark matter
-        RadialProfile<Particle> density_profile(simulation.dark_matter, centre_of_mass, DENSITY,
-                                                kProfileLogRange, kProfileNumBins, true);
+        RadialProfile<ParticleStore> density_profile(simulation.dark_matter, dark_matter_tree,
+                                                     centre, {DENSITY}, kProfileLogRange,
+                                                     kProfileNumBins, true);
         density_profile.OutputToTextFile("dark_matter_density_profile.txt");
         
         // Compute and output the spherically averaged metallicity (content of elements heavier than
         // Hydrogen) profile for young stars
         const AgeType kMaxAge = 2.;
-        StarVector young_stars = FilterParticles(simulation.stars, AGE_LT, kMaxAge);
-        RadialProfile<StarParticle> metals_profile(young_stars, centre_of_mass, AVG_METALLICITY,
-                                                   kProfileRange, kProfileNumBins);
+        Selection young_stars = FilterParticles(simulation.stars, AGE_LT, kMaxAge);
+        RadialProfile<StarStore> metals_profile(simulation.stars, young_stars, centre,
+                                                AVG_METALLICITY, kProfileRange, kProfileNumBins);
         metals_profile.OutputToTextFile("stellar_metallicity_profile.txt");
-        
+
+        // Compute all the stellar profiles together, binning each star once, and output them as
+        // columns of one file
+        RadialProfile<StarStore> stellar_profiles(simulation.stars, centre,
+                                                  {DENSITY, CUMU_MASS, AVG_METALLICITY, AVG_AGE,
+                                                   AVG_CARBON_FRAC},
+                                                  kProfileRange, kProfileNumBins);
+        stellar_profiles.OutputToTextFile("stellar_profiles.txt");
+
         // Compute and output the spherically averaged carbon fraction for gas hotter than 10^4 K
         const TemperatureType kMinTemperature = 1e5;
-        GasVector hot_gas = FilterParticles(simulation.gas, TEMPERATURE_GT, kMinTemperature);
-        RadialProfile<GasParticle> carbon_profile(hot_gas, centre_of_mass, AVG_CARBON_FRAC,
-                                                  kProfileRange, kProfileNumBins);
+        Selection hot_gas = FilterParticles(simulation.gas, TEMPERATURE_GT, kMinTemperature);
+        RadialProfile<GasStore> carbon_profile(simulation.gas, hot_gas, centre,
+                                               AVG_CARBON_FRAC, kProfileRange, kProfileNumBins);
         carbon_profile.OutputToTextFile("hot_gas_carbon_profile.txt");
+
+        // Report the SPH density and kernel-smoothed temperature of the gas at the halo centre,
+        // using each gas particle's smoothing length
+        KdTree gas_tree(simulation.gas);
+        SphInterpolator gas_sph(simulation.gas, gas_tree);
+        std::vector<PosCoordsType> centre_point(1, centre);
+        std::cout << "Gas density at the halo centre: " <<
+                     gas_sph.GetDensitiesAt(centre_point)[0] << ", temperature: " <<
+                     gas_sph.SmoothFieldAt(simulation.gas.temperature, centre_point)[0] <<
+                     std::endl;
+
+        // Fill mass-weighted phase diagrams of the gas, temperature against SPH density and
+        // against metallicity, in one pass over the gas, and write them as NumPy arrays
+        const int kPhaseNumBins = 64;
+        std::vector<double> gas_densities = gas_sph.GetDensities();
+        HistogramAxis temperature_axis = MakeHistogramAxis(HIST_TEMPERATURE, {1e3, 1e9},
+                                                           kPhaseNumBins, true);
+        Histogram density_temperature({MakeValuesAxis(gas_densities, {1e-3, 1e9}, kPhaseNumBins,
+                                                      true), temperature_axis});
+        Histogram metallicity_temperature({MakeHistogramAxis(HIST_METALLICITY, {-6, 2},
+                                                             kPhaseNumBins), temperature_axis});
+        Histogram::FillAll(simulation.gas, Selection::All(simulation.gas.size()),
+                           {&density_temperature, &metallicity_temperature});
+        density_temperature.WriteToNpyFile("gas_density_temperature.npy");
+        metallicity_temperature.WriteToNpyFile("gas_metallicity_temperature.npy");
+
+        // Project the gas about the halo centre onto maps of surface density and mass-weighted
+        // temperature, and the dark matter onto a surface density map with smoothing lengths
+        // adapted to its local density
+        const size_t kMapNumPixels = 256;
+        const LengthType kMapWidth = 2 * kProfileRange[1];
+        ProjectedMap gas_map(centre, kMapWidth, kMapNumPixels);
+        gas_map.AddGas(simulation.gas, Selection::All(simulation.gas.size()),
+                       &simulation.gas.temperature);
+        WriteImageToNpyFile("gas_surface_density_map.npy", gas_map.GetSurfaceDensity(),
+                            kMapNumPixels);
+        WriteImageToNpyFile("gas_temperature_map.npy", gas_map.GetMeanField(), kMapNumPixels);
+        ProjectedMap dark_matter_map(centre, kMapWidth, kMapNumPixels);
+        dark_matter_map.AddParticles(simulation.dark_matter,
+                                     Selection::All(simulation.dark_matter.size()),
+                                     ComputeAdaptiveSmoothingLengths(simulation.dark_matter,
+                                                                     dark_matter_tree));
+        WriteImageToNpyFile("dark_matter_surface_density_map.npy",
+                            dark_matter_map.GetSurfaceDensity(), kMapNumPixels);
+
+        // Report the column densities of gas and hydrogen along a sightline through the halo
+        // centre, parallel to the last axis and spanning the profiles
+        Sightline centre_sightline = {centre, PosCoordsType(), 2 * kProfileRange[1]};
+        centre_sightline.start[kNDims - 1]    -= kProfileRange[1];
+        centre_sightline.direction[kNDims - 1] = 1;
+        SightlineCaster gas_caster(simulation.gas, gas_tree);
+        SightlineColumns centre_columns = gas_caster.ComputeColumns({centre_sightline})[0];
+        std::cout << "Gas column density through the halo centre: " << centre_columns.mass <<
+                     ", of hydrogen: " << centre_columns.element_masses[HYDROGEN] <<
+                     ", mean temperature: " << centre_columns.temperature << std::endl;
+
+        // Deposit all the matter onto a periodic mesh spanning the box, and write its power
+        // spectrum
+        const size_t kMeshNumCells = 64;
+        DensityMesh matter_mesh(simulation.GetParameters().GetBoxSize(), kMeshNumCells);
+        matter_mesh.Deposit(simulation.dark_matter);
+        matter_mesh.Deposit(simulation.gas);
+        matter_mesh.Deposit(simulation.stars);
+        matter_mesh.ComputePowerSpectrum().OutputToTextFile("matter_power_spectrum.txt");
+
+        // Compute the two-point correlation function of the dark matter, and the cross-correlation
+        // of the young stars with it, in logarithmic bins
+        PairCounter pair_counter(kProfileLogRange, kProfileNumBins, true);
+        pair_counter.ComputeCorrelation(simulation.dark_matter, dark_matter_tree)
+            .OutputToTextFile("dark_matter_correlation.txt");
+        StarStore young_star_store = simulation.stars.Subset(young_stars.GetIndices());
+        KdTree young_star_tree(young_star_store);
+        pair_counter.ComputeCrossCorrelation(young_star_store, young_star_tree,
+                                             simulation.dark_matter, dark_matter_tree)
+            .OutputToTextFile("young_star_dark_matter_correlation.txt");
         
         // Compute and report the angular momentum vector and velocity dispersion of the hot gas
-        // subset
-        VelCoordsType angular_momentum   = ComputeAngularMomentum(hot_gas);
-        VelocityType velocity_dispersion = ComputeVelocityDispersion(hot_gas);
+        // subset, in one pass
+        DynamicsSummary hot_gas_dynamics = ComputeDynamics(simulation.gas, hot_gas);
         std::cout << std::endl << "[Hot gas]" << std::endl;
-        std::cout << " Specific angular momentum vector: " << angular_momentum << std::endl;
-        std::cout << " Velocity dispersion: " << velocity_dispersion << std::endl;
+        std::cout << " Specific angular momentum vector: " << hot_gas_dynamics.angular_momentum <<
+                     std::endl;
+        std::cout << " Velocity dispersion: " << hot_gas_dynamics.velocity_dispersion << std::endl;
+        
+        // Count the hot gas that is also metal-poor and of low mass, in a single pass
+        const MetallicityType kMaxMetallicity = -1;
+        const MassType kMaxMass               = 0.5;
+        Selection hot_metal_poor_gas = FilterParticles(simulation.gas,
+                                                       Where<TEMPERATURE_GT>(kMinTemperature) &
+                                                       Where<METALLICITY_LT>(kMaxMetallicity) &
+                                                       Where<MASS_LT>(kMaxMass));
+        std::cout << " Of which metal-poor, low mass: " << hot_metal_poor_gas.size() << " of " <<
+                     hot_gas.size() << std::endl;
+
+        // Repeat the hot gas dynamics out of core, as for a snapshot too large to load: the gas is
+        // streamed from the snapshot in chunks that fit in a small memory budget, and each chunk's
+        // hot gas is filtered and its moments added to the running sums
+        const size_t kStreamMemoryBudget = 1 << 16;
+        SnapshotStream stream(filepath, kStreamMemoryBudget);
+        DynamicsAccumulator streamed_hot_gas_sums;
+        size_t num_gas_chunks = 0;
+        stream.ForEachGasChunk([&](const GasStore &gas_chunk, size_t) {
+            Selection hot_gas_chunk = FilterParticles(gas_chunk, TEMPERATURE_GT, kMinTemperature);
+            streamed_hot_gas_sums.Add(AccumulateDynamics<true>(gas_chunk, hot_gas_chunk,
+                                                               ThreadPool::GetShared()));
+            ++num_gas_chunks;
+        });
+        std::cout << " Velocity dispersion, streamed in " << num_gas_chunks << " chunk(s): " <<
+                     SummariseDynamics(streamed_hot_gas_sums).velocity_dispersion << std::endl;
+
+        // Repeat the stellar profiles and hot gas dynamics over domains of the box, as they're
+        // shared between the processes of a parallel run, whose results are the same
+        // (domain_stellar_profiles.txt) however many processes share them
+        RunDomainAnalyses(filepath, kProfileRange, kProfileNumBins);
+        
+        simulation.PrintLoadStatistics(std::cout);
+        
+        // Optionally save the data as a snapshot cache, which later runs can read much faster than
+        // the original snapshot.  The rarely used abundances are compressed.
+        if (argc > 2) {
+            std::set<std::string> compressed_fields;
+            for (int ielement = 0; ielement < NUM_ELEMENTS; ++ielement)
+                compressed_fields.insert("abundance_" + std::string(kElementSymbols[ielement]));
+            simulation.WriteCache(argv[2], compressed_fields);
+            std::cout << "Saved snapshot cache to " << argv[2] << std::endl;
+        }
         
     }
     catch(std::logic_error error) {
@@ -0,0 +1,64 @@
+// Implementation of the MappedFile class
+
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+MappedFile::MappedFile(std::string filepath) : filepath_(filepath), data_(nullptr), size_(0) {
+    int file_descriptor = open(filepath.c_str(), O_RDONLY);
+    if (file_descriptor < 0)
+        throw std::runtime_error("MappedFile: Failed to open file " + filepath);
+
+    struct stat file_status;
+    if (fstat(file_descriptor, &file_status) != 0) {
+        close(file_descriptor);
+        throw std::runtime_error("MappedFile: Failed to stat file " + filepath);
+    }
+    size_ = file_status.st_size;
+
+    // mmap() rejects zero-length mappings, so empty files are represented by a null pointer
+    if (size_ > 0) {
+        void *mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, file_descriptor, 0);
+        if (mapping == MAP_FAILED) {
+            close(file_descriptor);
+            throw std::runtime_error("MappedFile: Failed to map file " + filepath);
+        }
+        data_ = static_cast<const char *>(mapping);
+    }
+    // The mapping remains valid after the descriptor is closed
+    close(file_descriptor);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr)
+        munmap(const_cast<char *>(data_), size_);
+}
+
+std::shared_ptr<const MappedFile> MappedFile::Open(std::string filepath) {
+    return std::shared_ptr<const MappedFile>(new MappedFile(filepath));
+}
+
+const char *MappedFile::GetData() const {
+    return data_;
+}
+
+std::string MappedFile::GetFilepath() const {
+    return filepath_;
+}
+
+size_t MappedFile::GetSize() const {
+    return size_;
+}
+
+// Hints to the kernel that the file will be read front to back, so it can read ahead aggressively
+void MappedFile::AdviseSequential() const {
+    if (data_ != nullptr)
+        madvise(const_cast<char *>(data_), size_, MADV_SEQUENTIAL);
+}
@@ -0,0 +1,31 @@
+// Interface for the MappedFile class
+
+#ifndef mapped_file_hpp
+#define mapped_file_hpp
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Read-only memory mapping of a whole file (POSIX mmap).  Pages are only read from disk when they
+// are first touched, so opening a large snapshot costs almost nothing until its data are used.
+// Usually held through a shared pointer (see Open) so that views into the mapping can keep it
+// alive.  Throws std::runtime_error if the file can't be opened or mapped.
+class MappedFile {
+public:
+    MappedFile(std::string filepath);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    static std::shared_ptr<const MappedFile> Open(std::string filepath);
+    const char *GetData() const;
+    std::string GetFilepath() const;
+    size_t GetSize() const;
+    void AdviseSequential() const;
+private:
+    MappedFile();
+    std::string filepath_;
+    const char *data_;
+    size_t size_;
+};
+
+#endif // mapped_file_hpp
@@ -0,0 +1,47 @@
+// Implementation of the NumPy .npy file writer
+
+#include "npy_file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+void WriteArrayToNpyFile(std::string filepath, const std::vector<double> &values,
+                         const std::vector<size_t> &shape) {
+    size_t size = 1;
+    std::string shape_text;
+    for (size_t length : shape) {
+        size       *= length;
+        shape_text += std::to_string(length) + ", ";
+    }
+    if (values.size() != size)
+        throw std::invalid_argument("Writing NumPy array: " + std::to_string(values.size()) +
+                                    " values don't fill shape (" + shape_text + ")");
+    // Version 1.0 header: magic string, header length, then a Python dict padded with spaces and
+    // ending in a newline, so that the data start on a multiple of 64 bytes
+    const uint16_t kByteOrderTest = 1;
+    bool little_endian = *reinterpret_cast<const char *>(&kByteOrderTest) == 1;
+    std::string header = std::string("{'descr': '") + (little_endian ? "<" : ">") +
+                         "f8', 'fortran_order': False, 'shape': (" + shape_text + "), }";
+    const std::string kMagic("\x93NUMPY\x01\x00", 8);
+    size_t header_length = header.size() + 1;
+    header_length += (64 - (kMagic.size() + 2 + header_length) % 64) % 64;
+    header.resize(header_length - 1, ' ');
+    header += '\n';
+
+    std::ofstream out_stream(filepath, std::ios::binary | std::ios::trunc);
+    if (!out_stream.is_open())
+        throw std::runtime_error("Writing NumPy array: Failed to open file " + filepath);
+    unsigned char length_bytes[2] = {static_cast<unsigned char>(header_length & 0xff),
+                                     static_cast<unsigned char>(header_length >> 8)};
+    out_stream.write(kMagic.data(), kMagic.size());
+    out_stream.write(reinterpret_cast<const char *>(length_bytes), 2);
+    out_stream.write(header.data(), header.size());
+    out_stream.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(double));
+    out_stream.close();
+    if (!out_stream)
+        throw std::runtime_error("Writing NumPy array: Error writing " + filepath);
+}
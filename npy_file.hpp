@@ -0,0 +1,15 @@
+// Declares the writer of NumPy .npy files
+
+#ifndef npy_file_hpp
+#define npy_file_hpp
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Writes [values] to a NumPy .npy file (format version 1.0) of doubles in native byte order, with
+// dimensions [shape] (last index fastest), which numpy.load() reads directly.  Throws if the
+// values don't fill the shape or the file can't be written.
+void WriteArrayToNpyFile(std::string filepath, const std::vector<double> &values,
+                         const std::vector<size_t> &shape);
+
+#endif // npy_file_hpp
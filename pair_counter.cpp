@@ -0,0 +1,424 @@
+// Implementation of the PairCounter class and the CorrelationFunction output
+
+#include "pair_counter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compensated_sum.hpp"
+#include "counter_rng.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Number of random points drawn by each task
+const size_t kRandomsBlockSize = 65536;
+
+// Sets the smallest and largest squared distances between the points of two boxes, [lower_a,
+// upper_a] and [lower_b, upper_b], to the nearest periodic image if [box_size] isn't 0.  Along
+// each axis the separations of the points span [lower_a - upper_b, upper_a - lower_b], and the
+// minimum-image distance is smallest at multiples of box_size and largest half way between them.
+static void GetDistanceBoundsSquared(const PosCoordsType &lower_a, const PosCoordsType &upper_a,
+                                     const PosCoordsType &lower_b, const PosCoordsType &upper_b,
+                                     LengthType box_size, LengthType &min_distance_squared,
+                                     LengthType &max_distance_squared) {
+    min_distance_squared = 0;
+    max_distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType lowest  = lower_a[idim] - upper_b[idim];
+        LengthType highest = upper_a[idim] - lower_b[idim];
+        LengthType at_lowest  = std::abs(GetPeriodicDisplacement(lowest, box_size));
+        LengthType at_highest = std::abs(GetPeriodicDisplacement(highest, box_size));
+        LengthType min_distance = std::min(at_lowest, at_highest);
+        LengthType max_distance = std::max(at_lowest, at_highest);
+        if (box_size == 0) {
+            if (lowest <= 0 && highest >= 0)
+                min_distance = 0;
+        } else {
+            for (int image = -1; image <= 1; ++image) {
+                if (lowest <= image * box_size && highest >= image * box_size)
+                    min_distance = 0;
+                if (lowest <= (image + 0.5) * box_size && highest >= (image + 0.5) * box_size)
+                    max_distance = box_size / 2;
+            }
+        }
+        min_distance_squared += min_distance * min_distance;
+        max_distance_squared += max_distance * max_distance;
+    }
+}
+
+PairCounter::PairCounter(std::array<LengthType,2> rad_range, int num_bins, bool log_bins)
+        : log_bins_(log_bins) {
+    if (num_bins < 1)
+        throw std::invalid_argument("PairCounter: Need at least one bin");
+    if (!(rad_range[0] >= 0 && rad_range[1] > rad_range[0]))
+        throw std::invalid_argument("PairCounter: Radial range must be increasing from >= 0");
+    if (log_bins && rad_range[0] <= 0)
+        throw std::invalid_argument("PairCounter: Can't use log bins with Rmin = 0");
+    LengthType rmin_scaled = log_bins ? std::log10(rad_range[0]) : rad_range[0];
+    LengthType rmax_scaled = log_bins ? std::log10(rad_range[1]) : rad_range[1];
+    LengthType dr_scaled   = (rmax_scaled - rmin_scaled) / num_bins;
+    for (int iedge = 0; iedge <= num_bins; ++iedge) {
+        LengthType edge_scaled = rmin_scaled + iedge * dr_scaled;
+        bin_edges_.push_back(log_bins ? std::pow(10, edge_scaled) : edge_scaled);
+    }
+    bin_edges_.front() = rad_range[0];
+    bin_edges_.back()  = rad_range[1];
+    for (LengthType edge : bin_edges_)
+        squared_edges_.push_back(edge * edge);
+}
+
+PairCounts PairCounter::CountPairs(const ParticleStore &particles, const KdTree &tree,
+                                   bool mass_weighted, ThreadPool &pool) const {
+    return Count_(particles, tree, particles, tree, true, mass_weighted, pool);
+}
+
+PairCounts PairCounter::CountPairs(const ParticleStore &particles_a, const KdTree &tree_a,
+                                   const ParticleStore &particles_b, const KdTree &tree_b,
+                                   bool mass_weighted, ThreadPool &pool) const {
+    return Count_(particles_a, tree_a, particles_b, tree_b, false, mass_weighted, pool);
+}
+
+CorrelationFunction PairCounter::ComputeCorrelation(const ParticleStore &particles,
+                                                    const KdTree &tree, bool mass_weighted,
+                                                    size_t num_randoms, uint64_t seed,
+                                                    ThreadPool &pool) const {
+    if (num_randoms == 0)
+        num_randoms = kCorrelationRandomsFactor * particles.size();
+    ParticleStore randoms = MakeRandoms_({&tree}, num_randoms, seed, pool);
+    KdTree random_tree(randoms, pool);
+    PairCounts data_data     = CountPairs(particles, tree, mass_weighted, pool);
+    PairCounts data_random   = CountPairs(particles, tree, randoms, random_tree, mass_weighted,
+                                          pool);
+    PairCounts random_random = CountPairs(randoms, random_tree, mass_weighted, pool);
+
+    CorrelationFunction correlation;
+    correlation.radii          = GetRadii_();
+    correlation.num_data_pairs = data_data.counts;
+    correlation.values.assign(GetNumBins(), 0);
+    for (int ibin = 0; ibin < GetNumBins(); ++ibin) {
+        double dd = data_data.weights[ibin] / data_data.total_weight;
+        double dr = data_random.weights[ibin] / data_random.total_weight;
+        double rr = random_random.weights[ibin] / random_random.total_weight;
+        if (rr > 0)
+            correlation.values[ibin] = (dd - 2 * dr + rr) / rr;
+    }
+    return correlation;
+}
+
+CorrelationFunction PairCounter::ComputeCrossCorrelation(const ParticleStore &particles_a,
+                                                         const KdTree &tree_a,
+                                                         const ParticleStore &particles_b,
+                                                         const KdTree &tree_b,
+                                                         bool mass_weighted, size_t num_randoms,
+                                                         uint64_t seed, ThreadPool &pool) const {
+    if (num_randoms == 0)
+        num_randoms = kCorrelationRandomsFactor * std::max(particles_a.size(), particles_b.size());
+    ParticleStore randoms = MakeRandoms_({&tree_a, &tree_b}, num_randoms, seed, pool);
+    KdTree random_tree(randoms, pool);
+    PairCounts data_data     = CountPairs(particles_a, tree_a, particles_b, tree_b,
+                                          mass_weighted, pool);
+    PairCounts data_a_random = CountPairs(particles_a, tree_a, randoms, random_tree,
+                                          mass_weighted, pool);
+    PairCounts data_b_random = CountPairs(particles_b, tree_b, randoms, random_tree,
+                                          mass_weighted, pool);
+    PairCounts random_random = CountPairs(randoms, random_tree, mass_weighted, pool);
+
+    CorrelationFunction correlation;
+    correlation.radii          = GetRadii_();
+    correlation.num_data_pairs = data_data.counts;
+    correlation.values.assign(GetNumBins(), 0);
+    for (int ibin = 0; ibin < GetNumBins(); ++ibin) {
+        double d1d2 = data_data.weights[ibin] / data_data.total_weight;
+        double d1r  = data_a_random.weights[ibin] / data_a_random.total_weight;
+        double d2r  = data_b_random.weights[ibin] / data_b_random.total_weight;
+        double rr   = random_random.weights[ibin] / random_random.total_weight;
+        if (rr > 0)
+            correlation.values[ibin] = (d1d2 - d1r - d2r + rr) / rr;
+    }
+    return correlation;
+}
+
+// Counts the pairs of a particle of store a and one of store b, or, if [same_tree], the distinct
+// pairs of store a.  Pairs of nodes are visited as in KdTree::ForEachPairWithin(), a pair of the
+// same node splitting into the pairs of its children with themselves and each other, and any other
+// pair splitting the node with more particles.
+PairCounts PairCounter::Count_(const ParticleStore &particles_a, const KdTree &tree_a,
+                               const ParticleStore &particles_b, const KdTree &tree_b,
+                               bool same_tree, bool mass_weighted, ThreadPool &pool) const {
+    if (tree_a.size() != particles_a.size() || tree_b.size() != particles_b.size())
+        throw std::invalid_argument("PairCounter: KdTree wasn't built from this store");
+    if (tree_a.periodic_box_size_ != tree_b.periodic_box_size_)
+        throw std::invalid_argument("PairCounter: Stores have different periodic boxes");
+    int num_bins = GetNumBins();
+    PairCounts pair_counts;
+    pair_counts.counts.assign(num_bins, 0);
+    pair_counts.weights.assign(num_bins, 0);
+    pair_counts.total_weight = 0;
+    if (tree_a.nodes_.empty() || tree_b.nodes_.empty())
+        return pair_counts;
+
+    // Weights of the particles in tree order, and the sums of the weights and of their squares
+    // over each node, filled from the last node back since children follow their parents
+    auto get_weights = [&](const ParticleStore &particles, const KdTree &tree,
+                           std::vector<double> &weights,
+                           std::vector<std::array<double,2>> &node_sums) {
+        weights.assign(tree.size(), 1);
+        if (mass_weighted) {
+            const MassType *p_mass = particles.mass.data();
+            for (size_t ipart = 0; ipart < tree.size(); ++ipart)
+                weights[ipart] = p_mass[tree.order_[ipart]];
+        }
+        node_sums.assign(tree.nodes_.size(), {{0, 0}});
+        for (size_t inode = tree.nodes_.size(); inode > 0; --inode) {
+            const KdTree::NodeType &node = tree.nodes_[inode - 1];
+            std::array<double,2> &sums   = node_sums[inode - 1];
+            if (node.child == 0) {
+                for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart) {
+                    sums[0] += weights[ipart];
+                    sums[1] += weights[ipart] * weights[ipart];
+                }
+            } else {
+                for (int ichild = 0; ichild < 2; ++ichild) {
+                    sums[0] += node_sums[node.child + ichild][0];
+                    sums[1] += node_sums[node.child + ichild][1];
+                }
+            }
+        }
+    };
+    std::vector<double> weights_a, weights_b;
+    std::vector<std::array<double,2>> node_sums_a, node_sums_b;
+    get_weights(particles_a, tree_a, weights_a, node_sums_a);
+    if (same_tree) {
+        weights_b   = weights_a;
+        node_sums_b = node_sums_a;
+        pair_counts.total_weight = (node_sums_a[0][0] * node_sums_a[0][0] - node_sums_a[0][1]) / 2;
+    } else {
+        get_weights(particles_b, tree_b, weights_b, node_sums_b);
+        pair_counts.total_weight = node_sums_a[0][0] * node_sums_b[0][0];
+    }
+
+    // Returns the bin of a squared separation: -1 below the bins, num_bins above them
+    auto get_bin = [&](LengthType distance_squared) {
+        return int(std::upper_bound(squared_edges_.begin(), squared_edges_.end(),
+                                    distance_squared) - squared_edges_.begin()) - 1;
+    };
+    typedef std::pair<size_t,size_t> NodePairType;
+    auto split_node_pair = [&](const NodePairType &node_pair,
+                               std::vector<NodePairType> &node_pairs) {
+        const KdTree::NodeType &node_a = tree_a.nodes_[node_pair.first];
+        const KdTree::NodeType &node_b = tree_b.nodes_[node_pair.second];
+        if (same_tree && node_pair.first == node_pair.second) {
+            if (node_a.child == 0)
+                return false;
+            node_pairs.push_back(NodePairType(node_a.child, node_a.child));
+            node_pairs.push_back(NodePairType(node_a.child + 1, node_a.child + 1));
+            node_pairs.push_back(NodePairType(node_a.child, node_a.child + 1));
+            return true;
+        }
+        if (node_a.child == 0 && node_b.child == 0)
+            return false;
+        bool split_a = node_b.child == 0 || (node_a.child != 0 && node_a.count >= node_b.count);
+        for (size_t ichild = 0; ichild < 2; ++ichild)
+            node_pairs.push_back(split_a ? NodePairType(node_a.child + ichild, node_pair.second) :
+                                 NodePairType(node_pair.first, node_b.child + ichild));
+        return true;
+    };
+
+    // Split the walk breadth-first until there are enough node pairs to share out
+    std::vector<NodePairType> tasks(1, NodePairType(0, 0));
+    bool split_any = true;
+    while (split_any && tasks.size() < kPairCountMinTasks) {
+        std::vector<NodePairType> next_tasks;
+        split_any = false;
+        for (const NodePairType &task : tasks) {
+            if (split_node_pair(task, next_tasks))
+                split_any = true;
+            else
+                next_tasks.push_back(task);
+        }
+        tasks.swap(next_tasks);
+    }
+
+    LengthType box_size = tree_a.periodic_box_size_;
+    std::array<const LengthType *,kNDims> p_positions_b;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_positions_b[idim] = tree_b.positions_[idim].data();
+    int num_threads     = pool.GetNumThreads();
+    std::vector<std::vector<CountType>> thread_counts(num_threads,
+                                                      std::vector<CountType>(num_bins, 0));
+    std::vector<std::vector<CompensatedSum>> thread_weights(num_threads,
+                                                            std::vector<CompensatedSum>(num_bins));
+    pool.ParallelFor(tasks.size(), [&](size_t itask, int ithread) {
+        std::vector<CountType> &counts     = thread_counts[ithread];
+        std::vector<CompensatedSum> &sums  = thread_weights[ithread];
+        std::vector<CountType> leaf_counts(num_bins + 2, 0);
+        std::vector<LengthType> distances_squared;
+        std::vector<double> leaf_weights(num_bins + 2, 0);
+        std::vector<NodePairType> stack(1, tasks[itask]);
+        while (!stack.empty()) {
+            NodePairType node_pair = stack.back();
+            stack.pop_back();
+            const KdTree::NodeType &node_a = tree_a.nodes_[node_pair.first];
+            const KdTree::NodeType &node_b = tree_b.nodes_[node_pair.second];
+            bool same_node = same_tree && node_pair.first == node_pair.second;
+            LengthType min_distance_squared, max_distance_squared;
+            GetDistanceBoundsSquared(node_a.lower, node_a.upper, node_b.lower, node_b.upper,
+                                     box_size, min_distance_squared, max_distance_squared);
+            if (min_distance_squared >= squared_edges_.back() ||
+                max_distance_squared < squared_edges_.front())
+                continue;
+
+            // Count the pair of nodes whole if all its separations are in one bin
+            int ibin = get_bin(min_distance_squared);
+            if (ibin >= 0 && ibin == get_bin(max_distance_squared)) {
+                const std::array<double,2> &sums_a = node_sums_a[node_pair.first];
+                const std::array<double,2> &sums_b = node_sums_b[node_pair.second];
+                if (same_node) {
+                    counts[ibin] += CountType(node_a.count) * (node_a.count - 1) / 2;
+                    sums[ibin].Add((sums_a[0] * sums_a[0] - sums_a[1]) / 2);
+                } else {
+                    counts[ibin] += CountType(node_a.count) * node_b.count;
+                    sums[ibin].Add(sums_a[0] * sums_b[0]);
+                }
+                continue;
+            }
+            if (split_node_pair(node_pair, stack))
+                continue;
+
+            // Both nodes are leaves: compare their particles, skipping those of the first which
+            // are outside the bins from everywhere in the second's bounding box.  Each pair's bin
+            // is found without branching by comparing its separation with the edges from the lower
+            // edge of the bin of the box's nearest point to the upper edge of the bin of its
+            // farthest, and counted in a histogram with a bin each side for the separations out of
+            // range, which is added to the thread's once the leaves are done.
+            for (size_t ipart = node_a.first; ipart < node_a.first + node_a.count; ++ipart) {
+                PosCoordsType position;
+                for (int idim = 0; idim < kNDims; ++idim)
+                    position[idim] = tree_a.positions_[idim][ipart];
+                GetDistanceBoundsSquared(position, position, node_b.lower, node_b.upper, box_size,
+                                         min_distance_squared, max_distance_squared);
+                if (min_distance_squared >= squared_edges_.back() ||
+                    max_distance_squared < squared_edges_.front())
+                    continue;
+                int first_edge = std::max(get_bin(min_distance_squared), 0);
+                int last_edge  = std::min(get_bin(max_distance_squared) + 1, num_bins);
+                size_t first_b = same_node ? ipart + 1 : node_b.first;
+                size_t num_b   = node_b.first + node_b.count - first_b;
+                distances_squared.assign(num_b, 0);
+                for (int idim = 0; idim < kNDims; ++idim) {
+                    const LengthType *p_position_b = p_positions_b[idim] + first_b;
+                    for (size_t jpart = 0; jpart < num_b; ++jpart) {
+                        LengthType displacement = GetPeriodicDisplacement(
+                            position[idim] - p_position_b[jpart], box_size);
+                        distances_squared[jpart] += displacement * displacement;
+                    }
+                }
+                for (size_t jpart = 0; jpart < num_b; ++jpart) {
+                    int jbin = first_edge;
+                    for (int iedge = first_edge; iedge <= last_edge; ++iedge)
+                        jbin += (distances_squared[jpart] >= squared_edges_[iedge]);
+                    ++leaf_counts[jbin];
+                    if (mass_weighted)
+                        leaf_weights[jbin] += weights_a[ipart] * weights_b[first_b + jpart];
+                }
+            }
+            for (int jbin = 0; jbin < num_bins; ++jbin) {
+                counts[jbin] += leaf_counts[jbin + 1];
+                if (leaf_weights[jbin + 1] != 0)
+                    sums[jbin].Add(leaf_weights[jbin + 1]);
+            }
+            std::fill(leaf_counts.begin(), leaf_counts.end(), 0);
+            std::fill(leaf_weights.begin(), leaf_weights.end(), 0);
+        }
+    });
+
+    for (int ithread = 0; ithread < num_threads; ++ithread)
+        for (int ibin = 0; ibin < num_bins; ++ibin)
+            pair_counts.counts[ibin] += thread_counts[ithread][ibin];
+    for (int ibin = 0; ibin < num_bins; ++ibin) {
+        CompensatedSum sum;
+        for (int ithread = 0; ithread < num_threads; ++ithread)
+            sum.Add(thread_weights[ithread][ibin]);
+        pair_counts.weights[ibin] = mass_weighted ? sum.Get() : pair_counts.counts[ibin];
+    }
+    return pair_counts;
+}
+
+// Mid-point radius of each bin, as in RadialProfile
+std::vector<LengthType> PairCounter::GetRadii_() const {
+    std::vector<LengthType> radii(GetNumBins());
+    for (int ibin = 0; ibin < GetNumBins(); ++ibin)
+        radii[ibin] = (bin_edges_[ibin] + bin_edges_[ibin + 1]) / 2;
+    return radii;
+}
+
+// Returns a store of [num_randoms] points of unit mass, uniformly distributed over the periodic
+// box of the trees or the box bounding all their particles.  Each point is drawn from its own
+// CounterRng stream, so the catalogue doesn't depend on the number of threads.
+ParticleStore PairCounter::MakeRandoms_(const std::vector<const KdTree *> &trees,
+                                        size_t num_randoms, uint64_t seed,
+                                        ThreadPool &pool) const {
+    LengthType box_size = trees[0]->periodic_box_size_;
+    PosCoordsType lower, upper;
+    bool have_bounds = false;
+    for (const KdTree *p_tree : trees) {
+        if (p_tree->nodes_.empty())
+            continue;
+        for (int idim = 0; idim < kNDims; ++idim) {
+            lower[idim] = have_bounds ? std::min(lower[idim], p_tree->nodes_[0].lower[idim]) :
+                          p_tree->nodes_[0].lower[idim];
+            upper[idim] = have_bounds ? std::max(upper[idim], p_tree->nodes_[0].upper[idim]) :
+                          p_tree->nodes_[0].upper[idim];
+        }
+        have_bounds = true;
+    }
+    if (box_size > 0) {
+        lower.fill(0);
+        upper.fill(box_size);
+    } else if (!have_bounds) {
+        throw std::invalid_argument("PairCounter: No particles to bound the random catalogue");
+    }
+
+    ParticleStore randoms;
+    randoms.resize(num_randoms);
+    randoms.SetPeriodicBoxSize(box_size);
+    MassType *p_mass = randoms.mass.data();
+    std::array<LengthType *,kNDims> p_positions;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_positions[idim] = randoms.position[idim].data();
+    size_t num_blocks = (num_randoms + kRandomsBlockSize - 1) / kRandomsBlockSize;
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kRandomsBlockSize, num_randoms);
+        for (size_t index = iblock * kRandomsBlockSize; index < last; ++index) {
+            CounterRng rng(seed, index, 0);
+            p_mass[index] = 1;
+            for (int idim = 0; idim < kNDims; ++idim)
+                p_positions[idim][index] = rng.Uniform(lower[idim], upper[idim]);
+        }
+    });
+    return randoms;
+}
+
+void CorrelationFunction::OutputToTextFile(std::string filepath) const {
+    std::ofstream out_stream (filepath);
+    if (!out_stream.is_open())
+        throw std::runtime_error("Writing correlation function: Failed to open file " + filepath);
+    out_stream << "# radius, xi, number of data pairs" << std::endl;
+    for (size_t ibin = 0; ibin < values.size(); ++ibin)
+        out_stream << radii[ibin] << ", " << values[ibin] << ", " << num_data_pairs[ibin]
+                   << std::endl;
+    out_stream.close();
+    std::cout << "Wrote correlation function to " + filepath << std::endl;
+}
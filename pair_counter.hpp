@@ -0,0 +1,92 @@
+// Interface for the PairCounter class and the two-point correlation functions it estimates
+
+#ifndef pair_counter_hpp
+#define pair_counter_hpp
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// The dual-tree walk is split into at least this many pairs of nodes (where the trees are deep
+// enough), which are shared out between threads
+const size_t kPairCountMinTasks = 1024;
+
+// Default number of random points per data particle in the catalogues of the Landy-Szalay
+// estimator
+const size_t kCorrelationRandomsFactor = 4;
+
+// Default seed for the random catalogues
+const uint64_t kCorrelationSeed = 1;
+
+// Numbers of pairs in each radial bin, from PairCounter::CountPairs()
+struct PairCounts {
+    std::vector<CountType> counts;  // Number of pairs in each bin
+    std::vector<double> weights;    // Sum of the products of the pairs' weights in each bin
+    double total_weight;            // Same sum over all the pairs, in the bins or not
+};
+
+// Two-point correlation function, from PairCounter::ComputeCorrelation() or
+// ComputeCrossCorrelation()
+struct CorrelationFunction {
+    std::vector<LengthType> radii;  // Mid-point of each bin
+    std::vector<double> values;     // xi(r) in each bin
+    std::vector<CountType> num_data_pairs;
+    // Writes radius, xi and number of data pairs for each bin to a text file
+    void OutputToTextFile(std::string filepath) const;
+};
+
+// Counts the pairs of particles with separations in radial bins between rad_range[0] and
+// rad_range[1] ([num_bins] bins, spaced as in RadialProfile), within one store or between two,
+// optionally weighting each pair by the product of the particles' masses, with a parallel dual-tree
+// walk of their k-d trees.  Separations are periodic in periodic stores, and counts don't depend on
+// the number of threads.  ComputeCorrelation() estimates xi(r) with the Landy-Szalay estimator.
+// Usage: PairCounter counter({0.03, 3}, 20, true); counter.ComputeCorrelation(stars, star_tree)
+class PairCounter {
+public:
+    PairCounter(std::array<LengthType,2> rad_range, int num_bins, bool log_bins = false);
+    PairCounts CountPairs(const ParticleStore &particles, const KdTree &tree,
+                          bool mass_weighted = false,
+                          ThreadPool &pool = ThreadPool::GetShared()) const;
+    PairCounts CountPairs(const ParticleStore &particles_a, const KdTree &tree_a,
+                          const ParticleStore &particles_b, const KdTree &tree_b,
+                          bool mass_weighted = false,
+                          ThreadPool &pool = ThreadPool::GetShared()) const;
+    // Estimates xi = (DD - 2 DR + RR) / RR with [num_randoms] random points (0 =
+    // kCorrelationRandomsFactor per particle)
+    CorrelationFunction ComputeCorrelation(const ParticleStore &particles, const KdTree &tree,
+                                           bool mass_weighted = false, size_t num_randoms = 0,
+                                           uint64_t seed = kCorrelationSeed,
+                                           ThreadPool &pool = ThreadPool::GetShared()) const;
+    // Estimates xi = (D1 D2 - D1 R - D2 R + RR) / RR with one random catalogue covering both
+    // stores, of [num_randoms] points (0 = kCorrelationRandomsFactor per particle of the larger)
+    CorrelationFunction ComputeCrossCorrelation(const ParticleStore &particles_a,
+                                                const KdTree &tree_a,
+                                                const ParticleStore &particles_b,
+                                                const KdTree &tree_b, bool mass_weighted = false,
+                                                size_t num_randoms = 0,
+                                                uint64_t seed = kCorrelationSeed,
+                                                ThreadPool &pool = ThreadPool::GetShared()) const;
+    // Returns the num_bins + 1 edges of the bins; a pair's separation r is in bin i if
+    // edges[i] <= r < edges[i + 1]
+    const std::vector<LengthType> &GetBinEdges() const { return bin_edges_; }
+    int GetNumBins() const { return bin_edges_.size() - 1; }
+private:
+    PairCounter();
+    PairCounts Count_(const ParticleStore &particles_a, const KdTree &tree_a,
+                      const ParticleStore &particles_b, const KdTree &tree_b, bool same_tree,
+                      bool mass_weighted, ThreadPool &pool) const;
+    std::vector<LengthType> GetRadii_() const;
+    ParticleStore MakeRandoms_(const std::vector<const KdTree *> &trees, size_t num_randoms,
+                               uint64_t seed, ThreadPool &pool) const;
+    std::vector<LengthType> bin_edges_;
+    bool log_bins_;
+    std::vector<LengthType> squared_edges_;
+};
+
+#endif // pair_counter_hpp
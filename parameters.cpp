@@ -2,12 +2,18 @@
 
 #include "parameters.hpp"
 
+#include <cmath>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <sstream>
 #include <stdexcept>
+#include <string>
 
+#include "gadget_snapshot.hpp"
 #include "globals.hpp"
+#include "snapshot_cache.hpp"
+#include "synthetic_generator.hpp"
 
 // Attempts to read parameter file on instantiation
 Parameters::Parameters(std::string filepath) {
@@ -15,12 +21,124 @@ Parameters::Parameters(std::string filepath) {
 }
 
 // Reads and parses parameter files in various formats (.usedparameters for Gadget, .dph for CART).
-// N.B. Read routine removed here for brevity.
+// N.B. Parameter file routines removed here for brevity.  Gadget snapshots are read directly.
 void Parameters::ReadFromFile_(std::string filepath) {
     FillWithDefaultValues_();
+    const std::string kSyntheticPrefix = "synthetic:";
+    if (filepath.compare(0, kSyntheticPrefix.size(), kSyntheticPrefix) == 0)
+        ReadSyntheticSpecification_(filepath.substr(kSyntheticPrefix.size()));
+    else if (SnapshotCache::IsSnapshotCache(filepath))
+        ReadCacheHeader_(filepath);
+    else if (GadgetSnapshot::IsGadgetSnapshot(filepath))
+        ReadGadgetHeader_(filepath);
+    else if (GadgetSnapshot::IsGadgetSnapshot(filepath + ".0"))
+        ReadGadgetHeader_(filepath + ".0");
     initialised_ = true;
 }
 
+// Takes the box size, cosmology, particle totals and output time from the header of a Gadget
+// snapshot (the first file, for multi-file snapshots), whose data are taken to be in the standard
+// Gadget units of kpc/h and 1e10 Msun/h.  Gadget gas (type 0), halo (type 1) and star
+// (type 4) particles are read as gas, dark matter and stars respectively.
+void Parameters::ReadGadgetHeader_(std::string filepath) {
+    GadgetSnapshot snapshot(filepath);
+    const GadgetHeader &header = snapshot.GetHeader();
+    
+    double h = header.hubble_parameter > 0 ? header.hubble_parameter : 1;
+    box_size_                   = header.box_size;
+    length_unit_                = kGadgetLengthUnitInMpc / h;
+    mass_unit_                  = kGadgetMassUnit / h;
+    cosmology_.hubble_parameter = header.hubble_parameter;
+    cosmology_.omega_0          = header.omega_0;
+    cosmology_.omega_baryon     = 0;
+    cosmology_.omega_lambda     = header.omega_lambda;
+    comoving_                   = header.omega_0 > 0;
+    label_                      = filepath;
+    n_particles_[DM_TYPE_IDX]   = header.npart_total[GADGET_HALO];
+    n_particles_[GAS_TYPE_IDX]  = header.npart_total[GADGET_GAS];
+    n_particles_[STAR_TYPE_IDX] = header.npart_total[GADGET_STARS];
+    n_particles_[ALL_TYPE_IDX]  = n_particles_[DM_TYPE_IDX] + n_particles_[STAR_TYPE_IDX] +
+                                  n_particles_[GAS_TYPE_IDX];
+    output_redshift_            = header.redshift;
+    output_time_                = ConvertGadgetTime(header.time);
+    snapshot_format_            = GADGET_SNAPSHOT;
+    snapshot_path_              = filepath;
+}
+
+// Takes the parameters saved in the header of a snapshot cache
+void Parameters::ReadCacheHeader_(std::string filepath) {
+    SnapshotCache cache(filepath);
+    const SnapshotCacheHeader &header = cache.GetHeader();
+
+    box_size_                   = header.box_size;
+    length_unit_                = header.length_unit;
+    mass_unit_                  = header.mass_unit;
+    cosmology_.hubble_parameter = header.hubble_parameter;
+    cosmology_.omega_0          = header.omega_0;
+    cosmology_.omega_baryon     = header.omega_baryon;
+    cosmology_.omega_lambda     = header.omega_lambda;
+    comoving_                   = header.comoving != 0;
+    label_                      = header.label;
+    for (int itype = 0; itype < NUM_PARTICLE_TYPES; ++itype)
+        n_particles_[itype] = header.n_particles[itype];
+    n_particles_[ALL_TYPE_IDX]  = n_particles_[DM_TYPE_IDX] + n_particles_[STAR_TYPE_IDX] +
+                                  n_particles_[GAS_TYPE_IDX];
+    output_redshift_            = header.output_redshift;
+    output_time_                = header.output_time;
+    snapshot_format_            = CACHE_SNAPSHOT;
+    snapshot_path_              = filepath;
+}
+
+// Sets up synthetic data from a specification "<distribution>[:<particles per type>[:<seed>]]",
+// e.g. "clumpy:100000000:7".  Throws std::invalid_argument if it can't be parsed.
+void Parameters::ReadSyntheticSpecification_(std::string specification) {
+    std::istringstream fields(specification);
+    std::string distribution, n_per_type, seed;
+    std::getline(fields, distribution, ':');
+    std::getline(fields, n_per_type, ':');
+    std::getline(fields, seed, ':');
+    SyntheticGenerator::ParseDistribution(distribution);
+    synthetic_distribution_ = distribution;
+    label_                  = "Synthetic " + distribution + " distribution";
+    try {
+        if (!n_per_type.empty()) {
+            n_particles_[DM_TYPE_IDX]   = std::stoll(n_per_type);
+            n_particles_[GAS_TYPE_IDX]  = n_particles_[DM_TYPE_IDX];
+            n_particles_[STAR_TYPE_IDX] = n_particles_[DM_TYPE_IDX];
+            n_particles_[ALL_TYPE_IDX]  = 3 * n_particles_[DM_TYPE_IDX];
+        }
+        if (!seed.empty())
+            synthetic_seed_ = std::stoull(seed);
+    }
+    catch (std::logic_error &error) {
+        throw std::invalid_argument("Parameters: Can't parse synthetic data specification '" +
+                                    specification + "'");
+    }
+    if (n_particles_[DM_TYPE_IDX] < 0)
+        throw std::invalid_argument("Parameters: Negative particle number in '" + specification +
+                                    "'");
+}
+
+// Converts a Gadget time variable (the scale factor in comoving runs, otherwise in the internal
+// time unit of one length unit per km/s, i.e. 0.978 Gyr/h for kpc/h) to the time since the Big Bang
+// in Gyr.  For comoving runs this uses the analytic solution for a flat universe with matter and a
+// cosmological constant.
+TimeType Parameters::ConvertGadgetTime(double gadget_time) const {
+    // N.B. 1 Mpc per km/s is 100 Hubble times for h = 1
+    if (!comoving_)
+        return gadget_time * length_unit_ * 100 * kHubbleTimeInGyr;
+    double hubble_time = kHubbleTimeInGyr / cosmology_.hubble_parameter;
+    if (gadget_time <= 0)
+        return 0;
+    double a_cubed_sqrt = std::pow(gadget_time, 1.5);
+    if (cosmology_.omega_lambda > 0) {
+        double lambda_root = std::sqrt(cosmology_.omega_lambda);
+        return 2 * hubble_time / (3 * lambda_root) *
+               std::asinh(lambda_root / std::sqrt(cosmology_.omega_0) * a_cubed_sqrt);
+    }
+    return 2 * hubble_time / (3 * std::sqrt(cosmology_.omega_0)) * a_cubed_sqrt;
+}
+
 // Populates the object with default values for demo purposes.
 void Parameters::FillWithDefaultValues_() {
     box_size_                   = 10.0;
@@ -42,10 +160,83 @@ LengthType Parameters::GetBoxSize() const {
         return box_size_;
 }
 
-int Parameters::GetNParticles(ParticleTypeIndex type_idx) const {
+// Returns the gravitational constant in the units of the particle data, in (km/s)^2 length unit
+// per mass unit.  In comoving simulations it's divided by the scale factor at the output time, so
+// potentials found from comoving positions are those of the physical separations, and can be added
+// to the specific kinetic energies of peculiar velocities in km/s.
+double Parameters::GetGravitationalConstant() const {
+    double scale_factor = comoving_ ? GetScaleFactor() : 1;
+    return kGravitationalConstant * mass_unit_ / (length_unit_ * scale_factor);
+}
+
+// Returns the mean spacing of particles of a type if spread evenly through the box, the usual unit
+// of friends-of-friends linking lengths (see FofGroups)
+LengthType Parameters::GetMeanParticleSpacing(ParticleTypeIndex type_idx) const {
+    if (n_particles_[type_idx] <= 0)
+        throw std::invalid_argument("Parameters: No particles of this type");
+    return box_size_ / std::pow(double(n_particles_[type_idx]), 1. / kNDims);
+}
+
+// Returns the rate of the Hubble flow at the output time, in km/s per (comoving) length unit, i.e.
+// a H(a) times the length unit, or 0 for simulations that aren't comoving
+double Parameters::GetHubbleRate() const {
+    if (!comoving_)
+        return 0;
+    double a = GetScaleFactor();
+    double omega_curvature = 1 - cosmology_.omega_0 - cosmology_.omega_lambda;
+    double hubble = 100 * cosmology_.hubble_parameter *
+                    std::sqrt(cosmology_.omega_0 / (a * a * a) + omega_curvature / (a * a) +
+                              cosmology_.omega_lambda);
+    return a * hubble * length_unit_;
+}
+
+// Returns the unit of lengths (positions, smoothing lengths and the box size), in Mpc.  Lengths
+// are comoving in comoving simulations.
+double Parameters::GetLengthUnit() const {
+    return length_unit_;
+}
+
+// Returns the unit of masses, in 1e10 Msun
+double Parameters::GetMassUnit() const {
+    return mass_unit_;
+}
+
+CountType Parameters::GetNParticles(ParticleTypeIndex type_idx) const {
     return n_particles_[type_idx];
 }
 
+TimeType Parameters::GetOutputTime() const {
+    return output_time_;
+}
+
+double Parameters::GetScaleFactor() const {
+    return 1 / (1 + output_redshift_);
+}
+
+SnapshotFormat Parameters::GetSnapshotFormat() const {
+    return snapshot_format_;
+}
+
+// Returns the path of the snapshot to read particle data from, or an empty string if there isn't
+// one (i.e. dummy data should be used)
+std::string Parameters::GetSnapshotPath() const {
+    return snapshot_path_;
+}
+
+// Name of the SyntheticGenerator distribution used when there is no snapshot
+std::string Parameters::GetSyntheticDistribution() const {
+    return synthetic_distribution_;
+}
+
+unsigned long long Parameters::GetSyntheticSeed() const {
+    return synthetic_seed_;
+}
+
+// True for simulations in comoving coordinates (i.e. cosmological simulations)
+bool Parameters::IsComoving() const {
+    return comoving_;
+}
+
 bool Parameters::IsInitialised() const {
     return initialised_;
 }
@@ -57,8 +248,12 @@ std::ostream& operator<< (std::ostream &out, const Parameters &parameters) {
     
     out << std::setw(kParamFieldWidth) << "Label" << " = '" << parameters.label_ << "'" <<
            std::endl;
-    out << std::setw(kParamFieldWidth) << "Boxsize [Mpc]" << " = " << parameters.box_size_ <<
-           std::endl;
+    out << std::setw(kParamFieldWidth) << "Boxsize [Mpc]" << " = " <<
+           parameters.box_size_ * parameters.length_unit_ << std::endl;
+    out << std::setw(kParamFieldWidth) << "Length unit" << " = " << parameters.length_unit_ <<
+           " Mpc" << std::endl;
+    out << std::setw(kParamFieldWidth) << "Mass unit" << " = " << parameters.mass_unit_ <<
+           " x 1e10 Msun" << std::endl;
     out << std::setw(kParamFieldWidth) << "Redshift" << " = " << parameters.output_redshift_ <<
            std::endl;
     out << std::setw(kParamFieldWidth) << "Time [Gyr]" << " = " << parameters.output_time_ <<
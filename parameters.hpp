@@ -8,24 +8,57 @@
 
 #include "globals.hpp"
 
+// Kinds of file that Simulation can read particle data from
+enum SnapshotFormat {
+    NO_SNAPSHOT, // dummy data are used instead
+    GADGET_SNAPSHOT,
+    CACHE_SNAPSHOT // see SnapshotCache
+};
+
 // Reads standard format Gadget and CART particle header files and extracts simulation parameters.
 // Stores (among other things), the simulation box size, cosmological parameters, array of particle
-// totals for each type and the output time and redshift of this simulation snapshot.
+// totals for each type and the output time and redshift of this simulation snapshot, and the
+// units of length and mass of its particle data, which are used as they are stored (e.g. kpc/h in
+// a Gadget snapshot, Mpc for synthetic data), with velocities in km/s.  If the file
+// is a Gadget snapshot or a snapshot cache, the parameters are taken from its header and it becomes
+// the snapshot that Simulation reads particle data from.  A path of the form
+// "synthetic:<distribution>[:<particles per type>[:<seed>]]" (e.g. "synthetic:nfw:1000000") asks
+// for synthetic data instead (see SyntheticGenerator).  Otherwise default values are used.
 // Usage: Parameters(path-to-param-file)
 class Parameters {
 public:
     Parameters(std::string filepath);
     ~Parameters() {};
+    TimeType ConvertGadgetTime(double gadget_time) const;
     LengthType GetBoxSize() const;
-    int GetNParticles(ParticleTypeIndex type_idx) const;
+    double GetGravitationalConstant() const;
+    LengthType GetMeanParticleSpacing(ParticleTypeIndex type_idx) const;
+    double GetHubbleRate() const;
+    double GetLengthUnit() const;
+    double GetMassUnit() const;
+    CountType GetNParticles(ParticleTypeIndex type_idx) const;
+    TimeType GetOutputTime() const;
+    double GetScaleFactor() const;
+    SnapshotFormat GetSnapshotFormat() const;
+    std::string GetSnapshotPath() const;
+    std::string GetSyntheticDistribution() const;
+    unsigned long long GetSyntheticSeed() const;
+    bool IsComoving() const;
     bool IsInitialised() const;
     friend std::ostream& operator<< (std::ostream &out, const Parameters &parameters);
+    friend class SnapshotCache;
 private:
     Parameters();
     void FillWithDefaultValues_();
+    void ReadCacheHeader_(std::string filepath);
     void ReadFromFile_(std::string filepath);
+    void ReadGadgetHeader_(std::string filepath);
+    void ReadSyntheticSpecification_(std::string specification);
     bool initialised_ = false;
     LengthType box_size_;
+    double length_unit_ = 1;    // Unit of lengths (comoving, if comoving_), in Mpc
+    double mass_unit_   = 1;    // Unit of masses, in 1e10 Msun
+    bool comoving_ = false;
     struct CosmologyParametersType {
         float omega_0;
         float omega_baryon;
@@ -33,8 +66,12 @@ private:
         float hubble_parameter;
     } cosmology_;
     std::string label_;
-    std::array<int,NUM_PARTICLE_TYPES> n_particles_;
+    std::array<CountType,NUM_PARTICLE_TYPES> n_particles_;
     float output_redshift_;
     TimeType output_time_;
+    SnapshotFormat snapshot_format_ = NO_SNAPSHOT;
+    std::string snapshot_path_;
+    std::string synthetic_distribution_ = "uniform";
+    unsigned long long synthetic_seed_ = 0;
 };
 #endif // parameters_hpp
\ No newline at end of file
@@ -43,16 +43,22 @@ void Particle::AssignRandomProperties() {
     }
 }
 
-// Computes the distance of this particle from a given point
-LengthType Particle::GetDistanceFrom(PosCoordsType &location) const {
+// Computes the distance of this particle from a given point, to its nearest periodic image if a
+// [periodic_box_size] is given
+LengthType Particle::GetDistanceFrom(PosCoordsType &location, LengthType periodic_box_size) const {
     LengthType distance_squared = 0;
     for (int idim = 0;idim < kNDims; ++idim) {
-        LengthType displacement = (position_[idim] - location[idim]);
+        LengthType displacement = GetPeriodicDisplacement(position_[idim] - location[idim],
+                                                          periodic_box_size);
         distance_squared += displacement * displacement;
     }
     return std::sqrt(distance_squared);
 }
 
+IdType Particle::GetId() const {
+    return id_;
+}
+
 MassType Particle::GetMass() const {
     return mass_;
 }
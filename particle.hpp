@@ -28,12 +28,14 @@ public:
     Particle();
     Particle(const MassType &mass, const PosCoordsType &position, const VelCoordsType &velocity);
     ~Particle() {}
-    LengthType GetDistanceFrom(PosCoordsType &location) const;
+    LengthType GetDistanceFrom(PosCoordsType &location, LengthType periodic_box_size = 0) const;
+    IdType GetId() const;
     MassType GetMass() const;
     PosCoordsType GetPosition() const;
     VelCoordsType GetVelocity() const;
     void Translate(PosCoordsType displacement);
     friend std::ostream& operator<< (std::ostream &out, const Particle &particle);
+    friend class ParticleStore;
     friend class Simulation;    
 protected:
     virtual void AssignRandomProperties();
@@ -57,6 +59,26 @@ inline std::ostream& operator<< (std::ostream &out, const Particle &particle) {
 }
 
 //======================================== Helper Functions ========================================
+// Returns the displacement along one axis of a periodic box with sides of [box_size] to the nearest
+// periodic image, i.e. the minimum-image convention.  Assumes |displacement| < 1.5 * box_size, as
+// for any two points in the box.  A box_size of 0 means the box isn't periodic: the displacement is
+// returned unchanged.
+inline LengthType GetPeriodicDisplacement(LengthType displacement, LengthType box_size) {
+    if (displacement > box_size / 2)
+        return displacement - box_size;
+    if (displacement < -box_size / 2)
+        return displacement + box_size;
+    return displacement;
+}
+
+// Returns the coordinate of the periodic image of [position] inside [0, box_size], or [position]
+// itself if box_size is 0
+inline LengthType WrapPosition(LengthType position, LengthType box_size) {
+    if (box_size <= 0)
+        return position;
+    return position - box_size * std::floor(position / box_size);
+}
+
 // Chooses a random numbers uniformly distributed in the specified range.  N.B. Seeding using
 // <ctime> not necessary for our purposes.
 template <typename Type>
@@ -0,0 +1,211 @@
+// Implementation of the ParticleStore classes
+
+#include "particle_store.hpp"
+
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "column.hpp"
+#include "gas_particle.hpp"
+#include "globals.hpp"
+#include "particle.hpp"
+#include "star_particle.hpp"
+
+// Copies elements [indices] of a column into the (empty) destination column
+template <typename Type>
+static void GatherColumn(const Column<Type> &column, const std::vector<size_t> &indices,
+                         Column<Type> &destination) {
+    destination.resize(indices.size());
+    const Type *source = column.data();
+    Type *gathered     = destination.data();
+    for (size_t i = 0; i < indices.size(); ++i)
+        gathered[i] = source[indices[i]];
+}
+
+//========================================== ParticleStore =========================================
+void ParticleStore::reserve(size_t n) {
+    id.reserve(n);
+    mass.reserve(n);
+    for (int idim = 0; idim < kNDims; ++idim) {
+        position[idim].reserve(n);
+        velocity[idim].reserve(n);
+    }
+}
+
+void ParticleStore::resize(size_t n) {
+    id.resize(n, IdNotSet);
+    mass.resize(n, kMassNotSet);
+    for (int idim = 0; idim < kNDims; ++idim) {
+        position[idim].resize(n, kPositionNotSet);
+        velocity[idim].resize(n, kVelocityNotSet);
+    }
+}
+
+// Appends a copy of the particle's data to the end of each column
+void ParticleStore::push_back(const Particle &particle) {
+    PosCoordsType p_position = particle.GetPosition();
+    VelCoordsType p_velocity = particle.GetVelocity();
+    id.push_back(particle.GetId());
+    mass.push_back(particle.GetMass());
+    for (int idim = 0; idim < kNDims; ++idim) {
+        position[idim].push_back(p_position[idim]);
+        velocity[idim].push_back(p_velocity[idim]);
+    }
+}
+
+// Computes the distance of particle [index] from a given point (to its nearest image, if the store
+// is periodic)
+LengthType ParticleStore::GetDistanceFrom(size_t index, const PosCoordsType &location) const {
+    LengthType distance_squared = 0;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = GetPeriodicDisplacement(position[idim][index] - location[idim],
+                                                          periodic_box_size_);
+        distance_squared += displacement * displacement;
+    }
+    return std::sqrt(distance_squared);
+}
+
+PosCoordsType ParticleStore::GetPosition(size_t index) const {
+    PosCoordsType p_position;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_position[idim] = position[idim][index];
+    return p_position;
+}
+
+VelCoordsType ParticleStore::GetVelocity(size_t index) const {
+    VelCoordsType p_velocity;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_velocity[idim] = velocity[idim][index];
+    return p_velocity;
+}
+
+Particle ParticleStore::GetParticle(size_t index) const {
+    Particle particle(mass[index], GetPosition(index), GetVelocity(index));
+    CopyParticleFields_(index, particle);
+    return particle;
+}
+
+// Returns a new store containing copies of particles [indices]
+ParticleStore ParticleStore::Subset(const std::vector<size_t> &indices) const {
+    ParticleStore subset;
+    GatherInto_(indices, subset);
+    return subset;
+}
+
+// Restores the stored ID of a particle materialised by GetParticle(), overwriting the new one
+// assigned by its constructor
+void ParticleStore::CopyParticleFields_(size_t index, Particle &particle) const {
+    particle.id_ = id[index];
+}
+
+void ParticleStore::GatherInto_(const std::vector<size_t> &indices, ParticleStore &subset) const {
+    subset.periodic_box_size_ = periodic_box_size_;
+    GatherColumn(id, indices, subset.id);
+    GatherColumn(mass, indices, subset.mass);
+    for (int idim = 0; idim < kNDims; ++idim) {
+        GatherColumn(position[idim], indices, subset.position[idim]);
+        GatherColumn(velocity[idim], indices, subset.velocity[idim]);
+    }
+}
+
+//========================================== BaryonicStore =========================================
+void BaryonicStore::reserve(size_t n) {
+    ParticleStore::reserve(n);
+    metallicity.reserve(n);
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        abundances[ielem].reserve(n);
+}
+
+void BaryonicStore::resize(size_t n) {
+    ParticleStore::resize(n);
+    metallicity.resize(n, kMetallicityNotSet);
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        abundances[ielem].resize(n, kAbundanceNotSet);
+}
+
+void BaryonicStore::push_back(const BaryonicParticle &particle) {
+    ParticleStore::push_back(particle);
+    metallicity.push_back(particle.GetMetallicity());
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        abundances[ielem].push_back(particle.GetAbundance(static_cast<Element>(ielem)));
+}
+
+std::array<AbundanceType,NUM_ELEMENTS> BaryonicStore::GetAbundances_(size_t index) const {
+    std::array<AbundanceType,NUM_ELEMENTS> p_abundances;
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        p_abundances[ielem] = abundances[ielem][index];
+    return p_abundances;
+}
+
+void BaryonicStore::GatherInto_(const std::vector<size_t> &indices, BaryonicStore &subset) const {
+    ParticleStore::GatherInto_(indices, subset);
+    GatherColumn(metallicity, indices, subset.metallicity);
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        GatherColumn(abundances[ielem], indices, subset.abundances[ielem]);
+}
+
+//============================================ GasStore ============================================
+void GasStore::reserve(size_t n) {
+    BaryonicStore::reserve(n);
+    smoothing_length.reserve(n);
+    temperature.reserve(n);
+}
+
+void GasStore::resize(size_t n) {
+    BaryonicStore::resize(n);
+    smoothing_length.resize(n, kSmoothingLengthNotSet);
+    temperature.resize(n, kTemperatureNotSet);
+}
+
+void GasStore::push_back(const GasParticle &particle) {
+    BaryonicStore::push_back(particle);
+    smoothing_length.push_back(particle.GetSmoothingLength());
+    temperature.push_back(particle.GetTemperature());
+}
+
+GasParticle GasStore::GetParticle(size_t index) const {
+    GasParticle particle(mass[index], GetPosition(index), GetVelocity(index), metallicity[index],
+                         GetAbundances_(index), smoothing_length[index], temperature[index]);
+    CopyParticleFields_(index, particle);
+    return particle;
+}
+
+GasStore GasStore::Subset(const std::vector<size_t> &indices) const {
+    GasStore subset;
+    BaryonicStore::GatherInto_(indices, subset);
+    GatherColumn(smoothing_length, indices, subset.smoothing_length);
+    GatherColumn(temperature, indices, subset.temperature);
+    return subset;
+}
+
+//============================================ StarStore ===========================================
+void StarStore::reserve(size_t n) {
+    BaryonicStore::reserve(n);
+    age.reserve(n);
+}
+
+void StarStore::resize(size_t n) {
+    BaryonicStore::resize(n);
+    age.resize(n, kAgeNotSet);
+}
+
+void StarStore::push_back(const StarParticle &particle) {
+    BaryonicStore::push_back(particle);
+    age.push_back(particle.GetAge());
+}
+
+StarParticle StarStore::GetParticle(size_t index) const {
+    StarParticle particle(mass[index], GetPosition(index), GetVelocity(index), metallicity[index],
+                          GetAbundances_(index), age[index]);
+    CopyParticleFields_(index, particle);
+    return particle;
+}
+
+StarStore StarStore::Subset(const std::vector<size_t> &indices) const {
+    StarStore subset;
+    BaryonicStore::GatherInto_(indices, subset);
+    GatherColumn(age, indices, subset.age);
+    return subset;
+}
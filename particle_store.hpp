@@ -0,0 +1,190 @@
+// Interface for the ParticleStore classes, which hold the particle data of a simulation as a
+// structure of arrays, and for the ParticleRef proxy used to access a single stored particle.
+
+#ifndef particle_store_hpp
+#define particle_store_hpp
+#include <array>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "column.hpp"
+#include "gas_particle.hpp"
+#include "globals.hpp"
+#include "particle.hpp"
+#include "star_particle.hpp"
+
+// Lightweight handle to particle [index] of a store.  Provides the same accessors as the
+// corresponding Particle class, each of which reads a single element of one column, so code
+// written against Particle objects (e.g. simulation.gas[0].GetMass()) keeps working.  Accessors
+// for fields the store doesn't hold (e.g. GetAge() on dark matter) fail to compile.
+template <typename StoreType>
+class ParticleRef {
+public:
+    ParticleRef(const StoreType &store, size_t index) : store_(&store), index_(index) {}
+    IdType GetId() const { return store_->id[index_]; }
+    MassType GetMass() const { return store_->mass[index_]; }
+    PosCoordsType GetPosition() const { return store_->GetPosition(index_); }
+    VelCoordsType GetVelocity() const { return store_->GetVelocity(index_); }
+    LengthType GetDistanceFrom(const PosCoordsType &location) const {
+        return store_->GetDistanceFrom(index_, location);
+    }
+    AbundanceType GetAbundance(Element element) const {
+        return store_->abundances[element][index_];
+    }
+    MetallicityType GetMetallicity() const { return store_->metallicity[index_]; }
+    LengthType GetSmoothingLength() const { return store_->smoothing_length[index_]; }
+    TemperatureType GetTemperature() const { return store_->temperature[index_]; }
+    AgeType GetAge() const { return store_->age[index_]; }
+    // Copies the particle's data out of the store into a stand-alone particle object
+    typename StoreType::ParticleType ToParticle() const { return store_->GetParticle(index_); }
+private:
+    const StoreType *store_;
+    size_t index_;
+};
+
+// Overloads << to print the referenced particle in the same format as the particle classes
+template <typename StoreType>
+std::ostream& operator<< (std::ostream &out, const ParticleRef<StoreType> &particle) {
+    out << particle.ToParticle();
+    return out;
+}
+
+// Base store for all particle data types.  Each particle property is held in its own contiguous
+// Column (one per coordinate for positions and velocities), so that loops over many particles only
+// stream the fields they actually use through the cache.  The derived stores mirror the Particle
+// class hierarchy.  Filled with push_back(particle), by resizing and writing to the columns
+// directly, or by binding the columns to data in a snapshot file (see Column::SetView/SetLoader).
+// If a periodic box size is set, distances are measured to the nearest periodic image of each
+// particle (the minimum-image convention), here and in the code that bins or searches positions.
+// Positions, and the points they're measured from, should then be inside the box.
+class ParticleStore {
+public:
+    typedef Particle ParticleType;
+    ParticleStore() {}
+    virtual ~ParticleStore() {}
+    ParticleRef<ParticleStore> operator[](size_t index) const {
+        return ParticleRef<ParticleStore>(*this, index);
+    }
+    size_t size() const { return mass.size(); }
+    bool empty() const { return mass.empty(); }
+    virtual void reserve(size_t n);
+    virtual void resize(size_t n);
+    void push_back(const Particle &particle);
+    LengthType GetDistanceFrom(size_t index, const PosCoordsType &location) const;
+    LengthType GetPeriodicBoxSize() const { return periodic_box_size_; }
+    PosCoordsType GetPosition(size_t index) const;
+    VelCoordsType GetVelocity(size_t index) const;
+    Particle GetParticle(size_t index) const;
+    // Makes distances periodic in a box with sides of [box_size] (0 = not periodic, the default)
+    void SetPeriodicBoxSize(LengthType box_size) { periodic_box_size_ = box_size; }
+    ParticleStore Subset(const std::vector<size_t> &indices) const;
+    // Calls visitor(name, column) for every column, e.g. to save them all to a file
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) { VisitColumns_(*this, visitor); }
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) const { VisitColumns_(*this, visitor); }
+    Column<IdType> id;
+    Column<MassType> mass;
+    std::array<Column<LengthType>,kNDims> position;
+    std::array<Column<VelocityType>,kNDims> velocity;
+protected:
+    template <typename StoreType, typename VisitorType>
+    static void VisitColumns_(StoreType &store, VisitorType &visitor) {
+        const std::string kAxisNames = "xyz";
+        visitor(std::string("id"), store.id);
+        visitor(std::string("mass"), store.mass);
+        for (int idim = 0; idim < kNDims; ++idim)
+            visitor("position_" + kAxisNames.substr(idim, 1), store.position[idim]);
+        for (int idim = 0; idim < kNDims; ++idim)
+            visitor("velocity_" + kAxisNames.substr(idim, 1), store.velocity[idim]);
+    }
+    void CopyParticleFields_(size_t index, Particle &particle) const;
+    void GatherInto_(const std::vector<size_t> &indices, ParticleStore &subset) const;
+    LengthType periodic_box_size_ = 0;
+};
+
+// Adds the metallicity and abundance columns shared by gas and star particles.  Not intended to be
+// instantiated itself (see BaryonicParticle).
+class BaryonicStore : public ParticleStore {
+public:
+    virtual void reserve(size_t n) override;
+    virtual void resize(size_t n) override;
+    void push_back(const BaryonicParticle &particle);
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) { VisitColumns_(*this, visitor); }
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) const { VisitColumns_(*this, visitor); }
+    Column<MetallicityType> metallicity;
+    std::array<Column<AbundanceType>,NUM_ELEMENTS> abundances;
+protected:
+    BaryonicStore() {}
+    template <typename StoreType, typename VisitorType>
+    static void VisitColumns_(StoreType &store, VisitorType &visitor) {
+        ParticleStore::VisitColumns_(store, visitor);
+        visitor(std::string("metallicity"), store.metallicity);
+        for (int ielement = 0; ielement < NUM_ELEMENTS; ++ielement)
+            visitor("abundance_" + std::string(kElementSymbols[ielement]),
+                    store.abundances[ielement]);
+    }
+    std::array<AbundanceType,NUM_ELEMENTS> GetAbundances_(size_t index) const;
+    void GatherInto_(const std::vector<size_t> &indices, BaryonicStore &subset) const;
+};
+
+// Store for gas particles: adds smoothing length and temperature columns.
+class GasStore : public BaryonicStore {
+public:
+    typedef GasParticle ParticleType;
+    GasStore() {}
+    ParticleRef<GasStore> operator[](size_t index) const {
+        return ParticleRef<GasStore>(*this, index);
+    }
+    virtual void reserve(size_t n) override;
+    virtual void resize(size_t n) override;
+    void push_back(const GasParticle &particle);
+    GasParticle GetParticle(size_t index) const;
+    GasStore Subset(const std::vector<size_t> &indices) const;
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) { VisitColumns_(*this, visitor); }
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) const { VisitColumns_(*this, visitor); }
+    Column<LengthType> smoothing_length;
+    Column<TemperatureType> temperature;
+protected:
+    template <typename StoreType, typename VisitorType>
+    static void VisitColumns_(StoreType &store, VisitorType &visitor) {
+        BaryonicStore::VisitColumns_(store, visitor);
+        visitor(std::string("smoothing_length"), store.smoothing_length);
+        visitor(std::string("temperature"), store.temperature);
+    }
+};
+
+// Store for star particles: adds an age column.
+class StarStore : public BaryonicStore {
+public:
+    typedef StarParticle ParticleType;
+    StarStore() {}
+    ParticleRef<StarStore> operator[](size_t index) const {
+        return ParticleRef<StarStore>(*this, index);
+    }
+    virtual void reserve(size_t n) override;
+    virtual void resize(size_t n) override;
+    void push_back(const StarParticle &particle);
+    StarParticle GetParticle(size_t index) const;
+    StarStore Subset(const std::vector<size_t> &indices) const;
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) { VisitColumns_(*this, visitor); }
+    template <typename VisitorType>
+    void ForEachColumn(VisitorType &&visitor) const { VisitColumns_(*this, visitor); }
+    Column<AgeType> age;
+protected:
+    template <typename StoreType, typename VisitorType>
+    static void VisitColumns_(StoreType &store, VisitorType &visitor) {
+        BaryonicStore::VisitColumns_(store, visitor);
+        visitor(std::string("age"), store.age);
+    }
+};
+
+#endif // particle_store_hpp
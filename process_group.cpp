@@ -0,0 +1,171 @@
+// Implementation of the ProcessGroup class
+
+#include "process_group.hpp"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef USE_MPI
+#include <mpi.h>
+
+ProcessGroup::ProcessGroup() : num_rounds_(0), rank_(0), size_(1) {
+    int initialised;
+    MPI_Initialized(&initialised);
+    if (!initialised)
+        MPI_Init(nullptr, nullptr);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
+    MPI_Comm_size(MPI_COMM_WORLD, &size_);
+}
+
+ProcessGroup::~ProcessGroup() {
+    int finalised;
+    MPI_Finalized(&finalised);
+    if (!finalised)
+        MPI_Finalize();
+}
+
+// Returns the [bytes] given by each process, in rank order
+std::vector<std::string> ProcessGroup::AllGather(const std::string &bytes) {
+    if (bytes.size() > INT_MAX)
+        throw std::invalid_argument("ProcessGroup: Can't send more than INT_MAX bytes");
+    int num_bytes = bytes.size();
+    std::vector<int> counts(size_);
+    MPI_Allgather(&num_bytes, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    std::vector<int> offsets(size_, 0);
+    long long total_bytes = 0;
+    for (int irank = 0; irank < size_; ++irank) {
+        offsets[irank] = total_bytes;
+        total_bytes   += counts[irank];
+        if (total_bytes > INT_MAX)
+            throw std::runtime_error("ProcessGroup: Can't receive more than INT_MAX bytes");
+    }
+    std::vector<char> received(total_bytes);
+    MPI_Allgatherv(bytes.data(), num_bytes, MPI_CHAR, received.data(), counts.data(),
+                   offsets.data(), MPI_CHAR, MPI_COMM_WORLD);
+    std::vector<std::string> gathered;
+    for (int irank = 0; irank < size_; ++irank)
+        gathered.emplace_back(received.data() + offsets[irank], counts[irank]);
+    ++num_rounds_;
+    return gathered;
+}
+
+#else
+
+// Returns the value of the first of [names] that is set in the environment, or an empty string
+static std::string GetFirstEnvironmentVariable(const std::vector<std::string> &names) {
+    for (const std::string &name : names) {
+        const char *value = std::getenv(name.c_str());
+        if (value != nullptr && value[0] != '\0')
+            return value;
+    }
+    return "";
+}
+
+// Reads the rank and number of processes set by the launcher, if any.  The files of a run are
+// identified by the launcher's job ($PMIX_NAMESPACE) or, failing that, by the process that
+// launched it, which is the same for all the processes mpirun starts on one machine.
+ProcessGroup::ProcessGroup() : num_rounds_(0), rank_(0), size_(1) {
+    std::string rank = GetFirstEnvironmentVariable({"OMPI_COMM_WORLD_RANK", "PMI_RANK"});
+    std::string size = GetFirstEnvironmentVariable({"OMPI_COMM_WORLD_SIZE", "PMI_SIZE"});
+    if (!rank.empty() && !size.empty()) {
+        rank_ = std::atoi(rank.c_str());
+        size_ = std::atoi(size.c_str());
+    }
+    if (size_ < 1 || rank_ < 0 || rank_ >= size_)
+        throw std::runtime_error("ProcessGroup: Invalid rank " + rank + " of " + size +
+                                 " processes");
+    exchange_dir_ = GetFirstEnvironmentVariable({"PARTICLE_SIM_EXCHANGE_DIR", "TMPDIR"});
+    if (exchange_dir_.empty())
+        exchange_dir_ = "/tmp";
+    exchange_key_ = GetFirstEnvironmentVariable({"PMIX_NAMESPACE"});
+    if (exchange_key_.empty())
+        exchange_key_ = std::to_string(getppid());
+    for (char &character : exchange_key_)
+        if (character == '/')
+            character = '_';
+}
+
+// Marks this process as done with the exchange files.  The root then waits for every process to
+// be done, and removes all the files.  Nothing is thrown if a process never finishes: its files
+// are just left behind.
+ProcessGroup::~ProcessGroup() {
+    if (size_ == 1 || num_rounds_ == 0)
+        return;
+    try {
+        WriteExchangeFile_(GetExchangePath_("done", rank_), "");
+        if (!IsRoot())
+            return;
+        for (int irank = 0; irank < size_; ++irank)
+            ReadExchangeFile_(GetExchangePath_("done", irank));
+        for (int irank = 0; irank < size_; ++irank) {
+            for (int iround = 0; iround < num_rounds_; ++iround)
+                std::remove(GetExchangePath_(std::to_string(iround), irank).c_str());
+            std::remove(GetExchangePath_("done", irank).c_str());
+        }
+    }
+    catch (...) {}
+}
+
+// Returns the [bytes] given by each process, in rank order.  Each process writes its bytes to a
+// file of its own for this round of the exchange, then reads those of the others.
+std::vector<std::string> ProcessGroup::AllGather(const std::string &bytes) {
+    if (size_ == 1)
+        return std::vector<std::string>(1, bytes);
+    std::string round = std::to_string(num_rounds_++);
+    WriteExchangeFile_(GetExchangePath_(round, rank_), bytes);
+    std::vector<std::string> gathered;
+    for (int irank = 0; irank < size_; ++irank)
+        gathered.push_back(irank == rank_ ? bytes :
+                           ReadExchangeFile_(GetExchangePath_(round, irank)));
+    return gathered;
+}
+
+#endif
+
+// Returns the process group of the whole run, set up on first use
+ProcessGroup &ProcessGroup::GetWorld() {
+    static ProcessGroup world;
+    return world;
+}
+
+std::string ProcessGroup::GetExchangePath_(std::string name, int rank) const {
+    return exchange_dir_ + "/particle_sim_" + exchange_key_ + "_" + name + "_" +
+           std::to_string(rank);
+}
+
+// Waits for another process to write the exchange file at [filepath], and returns its contents.
+// Throws std::runtime_error if it hasn't appeared after kExchangeTimeout seconds.
+std::string ProcessGroup::ReadExchangeFile_(std::string filepath) const {
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        std::ifstream in_stream(filepath, std::ios::binary);
+        if (in_stream.is_open())
+            return std::string(std::istreambuf_iterator<char>(in_stream),
+                               std::istreambuf_iterator<char>());
+        std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+        if (waited.count() > kExchangeTimeout)
+            throw std::runtime_error("ProcessGroup: Timed out waiting for " + filepath);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Writes an exchange file under a temporary name and then renames it, so that other processes
+// never read it half-written
+void ProcessGroup::WriteExchangeFile_(std::string filepath, const std::string &bytes) const {
+    std::string temporary_filepath = filepath + ".tmp";
+    std::ofstream out_stream(temporary_filepath, std::ios::binary | std::ios::trunc);
+    out_stream.write(bytes.data(), bytes.size());
+    out_stream.close();
+    if (!out_stream || std::rename(temporary_filepath.c_str(), filepath.c_str()) != 0)
+        throw std::runtime_error("ProcessGroup: Error writing " + filepath);
+}
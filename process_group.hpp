@@ -0,0 +1,43 @@
+// Interface for the ProcessGroup class, which exchanges data between the processes of a parallel
+// run
+
+#ifndef process_group_hpp
+#define process_group_hpp
+#include <string>
+#include <vector>
+
+// Time after which a process waiting for the data of the others gives up, in seconds
+const double kExchangeTimeout = 600;
+
+// The processes of a run started by mpirun (or srun, etc.), each with a rank in [0, GetSize()).
+// If compiled with -DUSE_MPI, the group is MPI_COMM_WORLD.  Otherwise the run may still be started
+// by mpirun on a single machine: the rank and number of processes are then read from the variables
+// the launcher sets (OMPI_COMM_WORLD_RANK and OMPI_COMM_WORLD_SIZE, or PMI_RANK and PMI_SIZE), and
+// data are exchanged through files in $PARTICLE_SIM_EXCHANGE_DIR (or $TMPDIR, or /tmp).  Every
+// process must make the same sequence of AllGather() calls, and the files of a run that failed
+// must be removed before another is started from the same shell.  Without a launcher, the group is
+// just this process.
+// Usage: ProcessGroup &world = ProcessGroup::GetWorld(); world.AllGather(bytes)
+class ProcessGroup {
+public:
+    ~ProcessGroup();
+    ProcessGroup(const ProcessGroup &) = delete;
+    ProcessGroup &operator=(const ProcessGroup &) = delete;
+    static ProcessGroup &GetWorld();
+    int GetRank() const { return rank_; }
+    int GetSize() const { return size_; }
+    bool IsRoot() const { return rank_ == 0; }
+    std::vector<std::string> AllGather(const std::string &bytes);
+private:
+    ProcessGroup();
+    std::string GetExchangePath_(std::string name, int rank) const;
+    std::string ReadExchangeFile_(std::string filepath) const;
+    void WriteExchangeFile_(std::string filepath, const std::string &bytes) const;
+    std::string exchange_dir_;
+    std::string exchange_key_;
+    int num_rounds_;
+    int rank_;
+    int size_;
+};
+
+#endif // process_group_hpp
@@ -0,0 +1,377 @@
+// Implementation of the ProjectedMap class and the image output functions
+
+#include "projected_map.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "column.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "npy_file.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "sph_kernel.hpp"
+#include "thread_pool.hpp"
+
+// Number of intervals of q^2 in the table of the projected kernel
+const size_t kProjectedKernelTableSize = 1024;
+
+// Returns a table of the kernel integrated along the line of sight, times h^2, at q^2 = R^2 / h^2
+// = itable / kProjectedKernelTableSize for projected distance R.  In 2D the kernel is already in
+// the plane of the image.  The table is rescaled so that its own interpolation integrates exactly
+// to 1 over the disc q < 1, since sampled kernels are otherwise normalised by their sum.
+static std::vector<double> GetProjectedKernelTable(SphKernelType kernel) {
+    std::vector<double> table(kProjectedKernelTableSize + 1, 0);
+    for (size_t itable = 0; itable < kProjectedKernelTableSize; ++itable) {
+        double q_squared = double(itable) / kProjectedKernelTableSize;
+        table[itable]    = (kNDims == 2) ? EvaluateSphKernel(kernel, std::sqrt(q_squared)) :
+                           IntegrateSphKernelAlongLine(kernel, q_squared);
+    }
+    // The integral over the disc is pi times the integral over q^2, by the trapezium rule
+    double integral = 0;
+    for (size_t itable = 0; itable < kProjectedKernelTableSize; ++itable)
+        integral += (table[itable] + table[itable + 1]) / 2;
+    integral *= M_PI / kProjectedKernelTableSize;
+    for (double &value : table)
+        value /= integral;
+    return table;
+}
+
+// Returns the projected kernel at [q_squared] < 1, interpolating linearly in the table
+static double LookUpProjectedKernel(const std::vector<double> &table, double q_squared) {
+    double position = q_squared * kProjectedKernelTableSize;
+    size_t itable   = std::min(size_t(position), kProjectedKernelTableSize - 1);
+    double fraction = position - itable;
+    return table[itable] + fraction * (table[itable + 1] - table[itable]);
+}
+
+// Calls function(ix, iy, kernel) for each pixel in [first, last] whose centre is inside the kernel
+// of a particle at (x, y) with [radius] (all in pixels), with the projected kernel times h^2 there.
+// The pixels of each row inside the kernel are found from its chord, so the inner loop has no test.
+template <typename FunctionType>
+static void ForEachKernelPixel(const std::vector<double> &table, double x, double y,
+                               double radius, const std::array<long,2> &first,
+                               const std::array<long,2> &last, FunctionType function) {
+    double radius_squared = radius * radius;
+    for (long iy = first[1]; iy <= last[1]; ++iy) {
+        double dy_squared    = (iy + 0.5 - y) * (iy + 0.5 - y);
+        double chord_squared = radius_squared - dy_squared;
+        if (chord_squared <= 0)
+            continue;
+        double half_chord = std::sqrt(chord_squared);
+        long row_first    = std::max(first[0], long(std::ceil(x - half_chord - 0.5)));
+        long row_last     = std::min(last[0], long(std::floor(x + half_chord - 0.5)));
+        for (long ix = row_first; ix <= row_last; ++ix) {
+            double dx        = ix + 0.5 - x;
+            double q_squared = std::min((dx * dx + dy_squared) / radius_squared, 1.);
+            function(ix, iy, LookUpProjectedKernel(table, q_squared));
+        }
+    }
+}
+
+ProjectedMap::ProjectedMap(const PosCoordsType &centre, LengthType width, size_t num_pixels,
+                           int axis, LengthType depth) :
+centre_(centre), depth_(depth), num_pixels_(num_pixels), width_(width) {
+    if (axis < 0 || axis > 2)
+        throw std::invalid_argument("ProjectedMap: Axis must be 0, 1 or 2");
+    std::array<double,3> direction = {0, 0, 0};
+    direction[axis] = 1;
+    SetAxes_(direction);
+    masses_.assign(num_pixels_ * num_pixels_, 0);
+}
+
+ProjectedMap::ProjectedMap(const PosCoordsType &centre, LengthType width, size_t num_pixels,
+                           const std::array<double,3> &direction, LengthType depth) :
+centre_(centre), depth_(depth), num_pixels_(num_pixels), width_(width) {
+    SetAxes_(direction);
+    masses_.assign(num_pixels_ * num_pixels_, 0);
+}
+
+void ProjectedMap::AddGas(const GasStore &gas, const Selection &selection,
+                          const Column<float> *field, SphKernelType kernel, ThreadPool &pool) {
+    Deposit_(gas, selection, gas.smoothing_length.data(), 0, field, kernel, pool);
+}
+
+void ProjectedMap::AddParticles(const ParticleStore &particles, const Selection &selection,
+                                LengthType smoothing_length, const Column<float> *field,
+                                SphKernelType kernel, ThreadPool &pool) {
+    if (smoothing_length < 0)
+        throw std::invalid_argument("ProjectedMap: Smoothing length must not be negative");
+    Deposit_(particles, selection, nullptr, smoothing_length, field, kernel, pool);
+}
+
+void ProjectedMap::AddParticles(const ParticleStore &particles, const Selection &selection,
+                                const std::vector<LengthType> &smoothing_lengths,
+                                const Column<float> *field, SphKernelType kernel,
+                                ThreadPool &pool) {
+    if (smoothing_lengths.size() != particles.size())
+        throw std::invalid_argument("ProjectedMap: Need one smoothing length per particle");
+    Deposit_(particles, selection, smoothing_lengths.data(), 0, field, kernel, pool);
+}
+
+std::vector<double> ProjectedMap::GetMeanField() const {
+    std::vector<double> means(masses_.size(), 0);
+    for (size_t ipixel = 0; ipixel < weighted_fields_.size(); ++ipixel)
+        if (masses_[ipixel] > 0)
+            means[ipixel] = weighted_fields_[ipixel] / masses_[ipixel];
+    return means;
+}
+
+std::vector<double> ProjectedMap::GetSurfaceDensity() const {
+    LengthType pixel_size = GetPixelSize();
+    std::vector<double> densities(masses_);
+    for (double &density : densities)
+        density /= pixel_size * pixel_size;
+    return densities;
+}
+
+// Deposits the selected particles, with smoothing lengths [smoothing_lengths] (indexed like the
+// store) if given, otherwise [smoothing_length].  Each block of the store counts the particles
+// overlapping each tile, the counts give each block and tile a range of one list of particles
+// (like the CSR layout of FofGroups), the blocks fill in their ranges, and then each tile deposits
+// its particles in order of index.
+void ProjectedMap::Deposit_(const ParticleStore &particles, const Selection &selection,
+                            const LengthType *smoothing_lengths, LengthType smoothing_length,
+                            const Column<float> *field, SphKernelType kernel, ThreadPool &pool) {
+    if (selection.GetUniverseSize() != particles.size())
+        throw std::invalid_argument("ProjectedMap: Selection is of another store");
+    if (field && field->size() != particles.size())
+        throw std::invalid_argument("ProjectedMap: Field is of another store");
+    if (field && weighted_fields_.empty())
+        weighted_fields_.assign(num_pixels_ * num_pixels_, 0);
+
+    size_t num_tiles_across = (num_pixels_ + kMapTileSize - 1) / kMapTileSize;
+    size_t num_tiles        = num_tiles_across * num_tiles_across;
+    size_t num_blocks       = (particles.size() + kMapBlockSize - 1) / kMapBlockSize;
+    auto get_smoothing_length = [&](size_t index) {
+        return smoothing_lengths ? smoothing_lengths[index] : smoothing_length;
+    };
+    auto for_each_tile = [&](const FootprintType &footprint, auto function) {
+        std::array<size_t,2> first_tile;
+        std::array<size_t,2> last_tile;
+        for (int iaxis = 0; iaxis < 2; ++iaxis) {
+            first_tile[iaxis] = std::max(footprint.first[iaxis], 0L) / kMapTileSize;
+            last_tile[iaxis]  = std::min(footprint.last[iaxis], long(num_pixels_) - 1) /
+                                kMapTileSize;
+        }
+        for (size_t jtile = first_tile[1]; jtile <= last_tile[1]; ++jtile)
+            for (size_t itile = first_tile[0]; itile <= last_tile[0]; ++itile)
+                function(jtile * num_tiles_across + itile);
+    };
+
+    std::vector<size_t> offsets(num_blocks * num_tiles, 0); // [iblock * num_tiles + itile]
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t *p_counts = offsets.data() + iblock * num_tiles;
+        FootprintType footprint;
+        selection.ForEachInRange(iblock * kMapBlockSize, (iblock + 1) * kMapBlockSize,
+                                 [&](size_t index) {
+            if (GetFootprint_(particles, index, get_smoothing_length(index), footprint))
+                for_each_tile(footprint, [&](size_t itile) { ++p_counts[itile]; });
+        });
+    });
+    std::vector<size_t> tile_first(num_tiles + 1, 0);
+    size_t num_entries = 0;
+    for (size_t itile = 0; itile < num_tiles; ++itile) {
+        tile_first[itile] = num_entries;
+        for (size_t iblock = 0; iblock < num_blocks; ++iblock) {
+            size_t count = offsets[iblock * num_tiles + itile];
+            offsets[iblock * num_tiles + itile] = num_entries;
+            num_entries += count;
+        }
+    }
+    tile_first[num_tiles] = num_entries;
+    std::vector<size_t> entries(num_entries);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t *p_offsets = offsets.data() + iblock * num_tiles;
+        FootprintType footprint;
+        selection.ForEachInRange(iblock * kMapBlockSize, (iblock + 1) * kMapBlockSize,
+                                 [&](size_t index) {
+            if (GetFootprint_(particles, index, get_smoothing_length(index), footprint))
+                for_each_tile(footprint, [&](size_t itile) {
+                    entries[p_offsets[itile]++] = index;
+                });
+        });
+    });
+
+    std::vector<double> table = GetProjectedKernelTable(kernel);
+    const MassType *p_mass    = particles.mass.data();
+    const float *p_field      = field ? field->data() : nullptr;
+    pool.ParallelFor(num_tiles, [&](size_t itile, int) {
+        std::array<long,2> tile_first_pixel = {long(itile % num_tiles_across * kMapTileSize),
+                                               long(itile / num_tiles_across * kMapTileSize)};
+        std::array<long,2> tile_last_pixel;
+        for (int iaxis = 0; iaxis < 2; ++iaxis)
+            tile_last_pixel[iaxis] = std::min(tile_first_pixel[iaxis] + long(kMapTileSize),
+                                              long(num_pixels_)) - 1;
+        FootprintType footprint;
+        for (size_t ientry = tile_first[itile]; ientry < tile_first[itile + 1]; ++ientry) {
+            size_t index = entries[ientry];
+            GetFootprint_(particles, index, get_smoothing_length(index), footprint);
+
+            // Kernels too small for their samples to integrate to 1 are normalised by their sum,
+            // or deposited in the particle's pixel if no pixel centre is inside them
+            double norm = 1 / (footprint.radius * footprint.radius);
+            if (footprint.radius < kMapResolvedRadius) {
+                double sum = 0;
+                ForEachKernelPixel(table, footprint.x, footprint.y, footprint.radius,
+                                   footprint.first, footprint.last,
+                                   [&](long, long, double kernel) { sum += kernel; });
+                if (sum == 0) {
+                    long ix = std::floor(footprint.x);
+                    long iy = std::floor(footprint.y);
+                    if (ix < tile_first_pixel[0] || ix > tile_last_pixel[0] ||
+                        iy < tile_first_pixel[1] || iy > tile_last_pixel[1])
+                        continue;
+                    masses_[iy * num_pixels_ + ix] += p_mass[index];
+                    if (p_field)
+                        weighted_fields_[iy * num_pixels_ + ix] += p_mass[index] * p_field[index];
+                    continue;
+                }
+                norm = 1 / sum;
+            }
+            std::array<long,2> first;
+            std::array<long,2> last;
+            for (int iaxis = 0; iaxis < 2; ++iaxis) {
+                first[iaxis] = std::max(footprint.first[iaxis], tile_first_pixel[iaxis]);
+                last[iaxis]  = std::min(footprint.last[iaxis], tile_last_pixel[iaxis]);
+            }
+            double mass_norm     = p_mass[index] * norm;
+            double weighted_norm = p_field ? mass_norm * p_field[index] : 0;
+            ForEachKernelPixel(table, footprint.x, footprint.y, footprint.radius, first, last,
+                               [&](long ix, long iy, double kernel) {
+                size_t ipixel = iy * num_pixels_ + ix;
+                masses_[ipixel] += mass_norm * kernel;
+                if (p_field)
+                    weighted_fields_[ipixel] += weighted_norm * kernel;
+            });
+        }
+    });
+}
+
+// Finds where a particle falls on the image, in pixels, and the range of pixels its kernel
+// overlaps.  The range is clipped to the image if the kernel is resolved, but not otherwise, since
+// it's then normalised over all its pixels.  Returns false if the kernel misses the image, or the
+// particle is outside the depth of the map.
+bool ProjectedMap::GetFootprint_(const ParticleStore &particles, size_t index,
+                                 LengthType smoothing_length, FootprintType &footprint) const {
+    LengthType box_size = particles.GetPeriodicBoxSize();
+    std::array<double,3> projected = {0, 0, 0};
+    for (int idim = 0; idim < kNDims; ++idim) {
+        LengthType displacement = particles.position[idim][index] - centre_[idim];
+        if (box_size > 0)
+            displacement = GetPeriodicDisplacement(displacement, box_size);
+        for (int iaxis = 0; iaxis < 3; ++iaxis)
+            projected[iaxis] += displacement * axes_[iaxis][idim];
+    }
+    if (depth_ > 0 && std::abs(projected[2]) > depth_ / 2)
+        return false;
+    double pixels_per_length = num_pixels_ / width_;
+    footprint.x      = projected[0] * pixels_per_length + num_pixels_ / 2.;
+    footprint.y      = projected[1] * pixels_per_length + num_pixels_ / 2.;
+    footprint.radius = std::max(smoothing_length, 0.) * pixels_per_length;
+    std::array<double,2> position = {footprint.x, footprint.y};
+    for (int iaxis = 0; iaxis < 2; ++iaxis) {
+        double first = std::floor(position[iaxis] - footprint.radius);
+        double last  = std::floor(position[iaxis] + footprint.radius);
+        if (!(last >= 0 && first < num_pixels_))
+            return false;
+        if (footprint.radius >= kMapResolvedRadius) {
+            first = std::max(first, 0.);
+            last  = std::min(last, num_pixels_ - 1.);
+        }
+        footprint.first[iaxis] = first;
+        footprint.last[iaxis]  = last;
+    }
+    return true;
+}
+
+// Sets the line of sight to [direction], and the image axes perpendicular to it.  For a
+// coordinate axis, the image x axis is the next axis in cyclic order.  Otherwise it's the
+// coordinate axis least aligned with the line of sight, made perpendicular to it.
+void ProjectedMap::SetAxes_(const std::array<double,3> &direction) {
+    if (!(width_ > 0) || num_pixels_ == 0)
+        throw std::invalid_argument("ProjectedMap: Map must have a positive width and pixels");
+    if (!(depth_ >= 0))
+        throw std::invalid_argument("ProjectedMap: Depth must not be negative");
+    double norm = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] +
+                            direction[2] * direction[2]);
+    if (!(norm > 0))
+        throw std::invalid_argument("ProjectedMap: Line of sight has no direction");
+    if (kNDims == 2 && (direction[0] != 0 || direction[1] != 0))
+        throw std::invalid_argument("ProjectedMap: Line of sight must be along z in 2D");
+    std::array<double,3> &line_of_sight = axes_[2];
+    for (int iaxis = 0; iaxis < 3; ++iaxis)
+        line_of_sight[iaxis] = direction[iaxis] / norm;
+
+    int image_axis = 0;
+    for (int iaxis = 1; iaxis < 3; ++iaxis)
+        if (std::abs(line_of_sight[iaxis]) < std::abs(line_of_sight[image_axis]))
+            image_axis = iaxis;
+    for (int iaxis = 0; iaxis < 3; ++iaxis)
+        if (std::abs(line_of_sight[iaxis]) == 1)
+            image_axis = (iaxis + 1) % 3;
+    std::array<double,3> &x_axis = axes_[0];
+    x_axis = {0, 0, 0};
+    x_axis[image_axis] = 1;
+    double dot = line_of_sight[image_axis];
+    for (int iaxis = 0; iaxis < 3; ++iaxis)
+        x_axis[iaxis] -= dot * line_of_sight[iaxis];
+    norm = std::sqrt(x_axis[0] * x_axis[0] + x_axis[1] * x_axis[1] + x_axis[2] * x_axis[2]);
+    for (int iaxis = 0; iaxis < 3; ++iaxis)
+        x_axis[iaxis] /= norm;
+    // y = line of sight x x, so that x, y and the line of sight are right-handed
+    axes_[1] = {line_of_sight[1] * x_axis[2] - line_of_sight[2] * x_axis[1],
+                line_of_sight[2] * x_axis[0] - line_of_sight[0] * x_axis[2],
+                line_of_sight[0] * x_axis[1] - line_of_sight[1] * x_axis[0]};
+}
+
+std::vector<LengthType> ComputeAdaptiveSmoothingLengths(const ParticleStore &particles,
+                                                        const KdTree &tree,
+                                                        size_t num_neighbours,
+                                                        ThreadPool &pool) {
+    if (tree.size() != particles.size())
+        throw std::invalid_argument("ComputeAdaptiveSmoothingLengths: Tree was built from "
+                                    "another store");
+    size_t num_particles = particles.size();
+    size_t num_blocks    = (num_particles + kMapBlockSize - 1) / kMapBlockSize;
+    std::vector<LengthType> smoothing_lengths(num_particles, 0);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kMapBlockSize, num_particles);
+        for (size_t ipart = iblock * kMapBlockSize; ipart < last; ++ipart) {
+            PosCoordsType position = particles.GetPosition(ipart);
+            for (size_t index : tree.FindNearest(position, num_neighbours))
+                smoothing_lengths[ipart] = std::max(smoothing_lengths[ipart],
+                                                    particles.GetDistanceFrom(index, position));
+        }
+    });
+    return smoothing_lengths;
+}
+
+void WriteImageToNpyFile(std::string filepath, const std::vector<double> &image,
+                         size_t num_pixels) {
+    if (image.size() != num_pixels * num_pixels)
+        throw std::invalid_argument("Writing map: Image isn't " + std::to_string(num_pixels) +
+                                    " pixels square");
+    WriteArrayToNpyFile(filepath, image, {num_pixels, num_pixels});
+    std::cout << "Wrote map to " + filepath << std::endl;
+}
+
+void WriteImageToRawFile(std::string filepath, const std::vector<double> &image) {
+    std::ofstream out_stream(filepath, std::ios::binary | std::ios::trunc);
+    if (!out_stream.is_open())
+        throw std::runtime_error("Writing map: Failed to open file " + filepath);
+    out_stream.write(reinterpret_cast<const char *>(image.data()), image.size() * sizeof(double));
+    out_stream.close();
+    if (!out_stream)
+        throw std::runtime_error("Writing map: Error writing " + filepath);
+    std::cout << "Wrote map to " + filepath << std::endl;
+}
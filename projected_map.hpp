@@ -0,0 +1,114 @@
+// Interface for the ProjectedMap class
+
+#ifndef projected_map_hpp
+#define projected_map_hpp
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "column.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "sph_kernel.hpp"
+#include "thread_pool.hpp"
+
+// Default number of neighbours whose distance sets an adaptive smoothing length
+const size_t kMapNumNeighbours = 32;
+
+// Number of particles binned into tiles by each task
+const size_t kMapBlockSize = 65536;
+
+// Particles whose kernels are at least this many pixels in radius are deposited with the kernel's
+// analytic normalisation.  Smaller kernels are normalised by their sum over the pixels, so that
+// each particle deposits exactly its mass however coarsely its kernel is sampled.
+const double kMapResolvedRadius = 8;
+
+// Side, in pixels, of the square tiles of the image, each of which is deposited by one thread
+const size_t kMapTileSize = 128;
+
+// A square image of particles projected along a line of sight, with [num_pixels] pixels along each
+// side spanning [width] about [centre].  The line of sight is a coordinate axis (0, 1 or 2) or any
+// [direction], and only particles within [depth] / 2 of the centre along it are projected (0 = no
+// limit).  In 2D the line of sight must be the z axis, i.e. the image is of the plane.  Each
+// particle deposits its mass with the kernel projected along the line of sight: gas with its SPH
+// smoothing length, other particles with a fixed or per-particle (adaptive) smoothing length, or
+// into the single pixel containing them (a smoothing length of 0).  If a [field] (e.g.
+// temperature) is given, mass times field is also deposited, for the mass-weighted mean.  The
+// image is split into tiles, and the particles overlapping each tile are deposited into it by one
+// thread, so threads never write to the same pixels and the image is identical for any number of
+// threads.  Deposits add to the image, so several stores can be combined.  In a periodic store the
+// particles nearest to the centre are projected (the image shouldn't be wider than the box).
+// Images are indexed [iy * num_pixels + ix], starting from the lowest coordinates, where x and y
+// are the image axes: for a line of sight along z they're x and y, along x they're y and z, and
+// along y they're z and x.
+// Usage: ProjectedMap map(centre, 1., 4096); map.AddGas(gas, Selection::All(gas.size()))
+class ProjectedMap {
+public:
+    ProjectedMap(const PosCoordsType &centre, LengthType width, size_t num_pixels, int axis = 2,
+                 LengthType depth = 0);
+    ProjectedMap(const PosCoordsType &centre, LengthType width, size_t num_pixels,
+                 const std::array<double,3> &direction, LengthType depth = 0);
+    void AddGas(const GasStore &gas, const Selection &selection,
+                const Column<float> *field = nullptr, SphKernelType kernel = CUBIC_SPLINE_KERNEL,
+                ThreadPool &pool = ThreadPool::GetShared());
+    void AddParticles(const ParticleStore &particles, const Selection &selection,
+                      LengthType smoothing_length = 0, const Column<float> *field = nullptr,
+                      SphKernelType kernel = CUBIC_SPLINE_KERNEL,
+                      ThreadPool &pool = ThreadPool::GetShared());
+    void AddParticles(const ParticleStore &particles, const Selection &selection,
+                      const std::vector<LengthType> &smoothing_lengths,
+                      const Column<float> *field = nullptr,
+                      SphKernelType kernel = CUBIC_SPLINE_KERNEL,
+                      ThreadPool &pool = ThreadPool::GetShared());
+    // Returns the mass-weighted mean of the deposited field in each pixel (0 where there's no mass)
+    std::vector<double> GetMeanField() const;
+    size_t GetNumPixels() const { return num_pixels_; }
+    LengthType GetPixelSize() const { return width_ / num_pixels_; }
+    // Returns the mass per unit area in each pixel
+    std::vector<double> GetSurfaceDensity() const;
+    LengthType GetWidth() const { return width_; }
+private:
+    // A particle's position and kernel radius in pixels, and the pixels its kernel overlaps
+    struct FootprintType {
+        double x;
+        double y;
+        double radius;
+        std::array<long,2> first;
+        std::array<long,2> last;
+    };
+    ProjectedMap();
+    void Deposit_(const ParticleStore &particles, const Selection &selection,
+                  const LengthType *smoothing_lengths, LengthType smoothing_length,
+                  const Column<float> *field, SphKernelType kernel, ThreadPool &pool);
+    bool GetFootprint_(const ParticleStore &particles, size_t index, LengthType smoothing_length,
+                       FootprintType &footprint) const;
+    void SetAxes_(const std::array<double,3> &direction);
+    std::array<std::array<double,3>,3> axes_; // Image x and y axes and line of sight
+    PosCoordsType centre_;
+    LengthType depth_;
+    std::vector<double> masses_;              // [iy * num_pixels_ + ix]
+    size_t num_pixels_;
+    std::vector<double> weighted_fields_;     // Mass times field, [iy * num_pixels_ + ix]
+    LengthType width_;
+};
+
+// Returns the distance of each particle of a store from its [num_neighbours]th nearest neighbour
+// (counting itself), found with a k-d tree of the store, as smoothing lengths for
+// ProjectedMap::AddParticles() that adapt to the local density
+std::vector<LengthType> ComputeAdaptiveSmoothingLengths(const ParticleStore &particles,
+                                                        const KdTree &tree,
+                                                        size_t num_neighbours = kMapNumNeighbours,
+                                                        ThreadPool &pool = ThreadPool::GetShared());
+
+// Writes a square [image] (e.g. from ProjectedMap) to a NumPy .npy file of doubles, with shape
+// (num_pixels, num_pixels), which numpy.load() reads directly
+void WriteImageToNpyFile(std::string filepath, const std::vector<double> &image,
+                         size_t num_pixels);
+
+// Writes a square [image] to a file as raw doubles in native byte order, row after row
+void WriteImageToRawFile(std::string filepath, const std::vector<double> &image);
+
+#endif // projected_map_hpp
@@ -1,23 +1,30 @@
-// Defines a templated class, RadialProfile which, given a vector of Particle, GasParticle or
-// StarParticle types, can be used to calculate the radial variation of various physical quantities.
+// Defines a templated class, RadialProfile which, given a ParticleStore, GasStore or StarStore,
+// can be used to calculate the radial variation of various physical quantities.
 // The ProfileKindType enumerator is used to keep track of the quantity being calculated.
 
 #ifndef radial_profile_hpp
 #define radial_profile_hpp
+#include <algorithm>
 #include <array>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "baryonic_particle.hpp"
-#include "gas_particle.hpp"
+#include "byte_buffer.hpp"
+#include "column.hpp"
 #include "globals.hpp"
-#include "particle.hpp"
-#include "star_particle.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
 
 enum ProfileKindType {
     AVG_AGE,         // Average age of each radial shell (star particles)
@@ -27,48 +34,195 @@ enum ProfileKindType {
     DENSITY          // Density profile
 };
 
-// Instantiating constructs a radial profile by calling DistanceFrom(centre) for each particle in
-// the vector, determining the corresponding radial bin, and adding the particle's contribution to
-// it. The form of the contribution depends on the profile_kind.  The profile is stored as an array
-// of bins, which each record a radius, volume (area in 2D), value of the binned quantity and number
-// of particles assigned to the bin.
-template <typename ParticleType>
+// Returns the name used for a profile kind in column headers
+inline std::string GetProfileKindName(ProfileKindType profile_kind) {
+    switch (profile_kind) {
+        case AVG_AGE:
+            return "avg_age";
+        case AVG_CARBON_FRAC:
+            return "avg_carbon_frac";
+        case AVG_METALLICITY:
+            return "avg_metallicity";
+        case CUMU_MASS:
+            return "cumu_mass";
+        case DENSITY:
+            return "density";
+    }
+    return "unknown";
+}
+
+// Particles are binned in chunks of at least kMinProfileChunkSize, with at most kMaxProfileChunks
+// of them, which bounds the memory used by partial bins
+const size_t kMinProfileChunkSize = 65536;
+const size_t kMaxProfileChunks    = 1024;
+
+// Number of particles whose squared distances and bins are computed together
+const size_t kProfileBlockSize = 256;
+
+// Instantiating constructs a radial profile by calling GetDistanceFrom(centre) for each particle in
+// the store (or a Selection of it), determining the corresponding radial bin, and adding the
+// particle's contribution to it. The form of the contribution depends on the profile_kind.  The
+// profile is stored as an array of bins, which each record a radius, volume (area in 2D), value of
+// the binned quantity and number of particles assigned to the bin.  Several kinds can be profiled
+// in one pass, and more particles, or other profiles on the same bins, can be added later.
+template <typename StoreType>
 class RadialProfile {
     struct BinType {
         LengthType radius; // Mid-point radius
         LengthType volume; // This is actually an area if NDIMS=2 chosen at compile-time
-        double value;
-        int num_particles;
+        CountType num_particles;
     };
     
 public:
     // Constructs a [profile_kind] profile centred at [centre], between radii rad_range[0] and
     // rad_range[1], with [num_bins] bins.
-    RadialProfile(std::vector<ParticleType> &particle_list, PosCoordsType centre,
+    RadialProfile(const StoreType &particles, PosCoordsType centre,
                   ProfileKindType profile_kind, std::array<LengthType,2> rad_range, int num_bins) :
-    centre_(centre), profile_kind_(profile_kind), rad_range_(rad_range), num_bins_(num_bins),
-    log_bins_(false) {
-        SetupBins();
-        MakeProfile(particle_list);
-    }
+    RadialProfile(particles, centre, profile_kind, rad_range, num_bins, false) {}
     
     // As above, but allows user to specify logarithmically spaced bins with a boolean parameter.
-    RadialProfile(std::vector<ParticleType> &particle_list, PosCoordsType centre,
+    RadialProfile(const StoreType &particles, PosCoordsType centre,
                   ProfileKindType profile_kind, std::array<LengthType,2> rad_range, int num_bins,
-                  bool log_bins) : centre_(centre), profile_kind_(profile_kind),
-    rad_range_(rad_range), num_bins_(num_bins), log_bins_(log_bins) {
+                  bool log_bins) : RadialProfile(particles, Selection::All(particles.size()),
+                                                 centre, profile_kind, rad_range, num_bins,
+                                                 log_bins) {}
+    
+    // As above, but only includes the [selection] of particles in the store, and the particles
+    // can be binned on a given [pool] of threads
+    RadialProfile(const StoreType &particles, const Selection &selection, PosCoordsType centre,
+                  ProfileKindType profile_kind, std::array<LengthType,2> rad_range, int num_bins,
+                  bool log_bins = false, ThreadPool &pool = ThreadPool::GetShared()) :
+    RadialProfile(particles, selection, centre, std::vector<ProfileKindType>(1, profile_kind),
+                  rad_range, num_bins, log_bins, pool) {}
+    
+    // Constructs profiles of all of [profile_kinds] in a single pass over the particles
+    RadialProfile(const StoreType &particles, PosCoordsType centre,
+                  const std::vector<ProfileKindType> &profile_kinds,
+                  std::array<LengthType,2> rad_range, int num_bins, bool log_bins = false,
+                  ThreadPool &pool = ThreadPool::GetShared()) :
+    RadialProfile(particles, Selection::All(particles.size()), centre, profile_kinds, rad_range,
+                  num_bins, log_bins, pool) {}
+    
+    // As above, but only visits the particles that a query of the [tree] built from the store
+    // finds within the profile range, rather than all of them
+    RadialProfile(const StoreType &particles, const KdTree &tree, PosCoordsType centre,
+                  const std::vector<ProfileKindType> &profile_kinds,
+                  std::array<LengthType,2> rad_range, int num_bins, bool log_bins = false,
+                  ThreadPool &pool = ThreadPool::GetShared()) :
+    RadialProfile(particles, GetCandidates_(particles, tree, centre, rad_range[1]), centre,
+                  profile_kinds, rad_range, num_bins, log_bins, pool) {}
+    
+    // As above, but only includes the [selection] of particles in the store
+    RadialProfile(const StoreType &particles, const Selection &selection, PosCoordsType centre,
+                  const std::vector<ProfileKindType> &profile_kinds,
+                  std::array<LengthType,2> rad_range, int num_bins, bool log_bins = false,
+                  ThreadPool &pool = ThreadPool::GetShared()) :
+    RadialProfile(centre, profile_kinds, rad_range, num_bins, log_bins) {
+        MakeProfile(particles, selection, pool);
+    }
+    
+    // Constructs empty profiles of all of [profile_kinds], for particles to be added to
+    RadialProfile(PosCoordsType centre, const std::vector<ProfileKindType> &profile_kinds,
+                  std::array<LengthType,2> rad_range, int num_bins, bool log_bins = false) :
+    centre_(centre), log_bins_(log_bins), num_bins_(num_bins), profile_kinds_(profile_kinds),
+    rad_range_(rad_range) {
+        if (profile_kinds_.empty())
+            throw std::invalid_argument("RadialProfile: No profile kinds requested");
         SetupBins();
-        MakeProfile(particle_list);
     }
     
     ~RadialProfile() {};
     
-    // Outputs profile to a CSV file
+    // Adds the [selection] of particles in a store to the profile
+    void Add(const StoreType &particles, const Selection &selection,
+             ThreadPool &pool = ThreadPool::GetShared()) {
+        MakeProfile(particles, selection, pool);
+    }
+    
+    // Adds the particles of [other], a profile of the same kinds on the same bins about the same
+    // centre (compared after wrapping both into the periodic box, if either was made in one)
+    void Add(const RadialProfile &other) {
+        if (other.profile_kinds_ != profile_kinds_ || other.num_bins_ != num_bins_ ||
+            other.rad_range_ != rad_range_ || other.log_bins_ != log_bins_ ||
+            !HasSameCentre_(other.centre_, other.periodic_box_size_))
+            throw std::invalid_argument("RadialProfile: Can only add profiles on the same bins "
+                                        "and centre");
+        for (size_t ibin = 0; ibin < profile_.size(); ++ibin)
+            profile_[ibin].num_particles += other.profile_[ibin].num_particles;
+        for (size_t isum = 0; isum < sums_.size(); ++isum)
+            sums_[isum] += other.sums_[isum];
+        UpdateValues_();
+    }
+
+    // Returns the bins' particle counts and sums as bytes (with the centre, kinds and bins they're
+    // for), e.g. to send the partial profile of one process to another (see DomainDecomposition)
+    std::string Serialise() const {
+        std::string bytes;
+        AppendBytes(bytes, centre_);
+        AppendBytes(bytes, periodic_box_size_);
+        AppendBytes(bytes, profile_kinds_);
+        AppendBytes(bytes, num_bins_);
+        AppendBytes(bytes, rad_range_);
+        AppendBytes(bytes, log_bins_);
+        std::vector<CountType> counts;
+        for (const BinType &bin : profile_)
+            counts.push_back(bin.num_particles);
+        AppendBytes(bytes, counts);
+        AppendBytes(bytes, sums_);
+        return bytes;
+    }
+
+    // Adds the particles of a profile of the same kinds on the same bins about the same centre,
+    // from the [bytes] its Serialise() returned.  The result is identical to Add() of that profile.
+    void AddSerialised(const std::string &bytes) {
+        PosCoordsType centre;
+        LengthType periodic_box_size;
+        std::vector<ProfileKindType> profile_kinds;
+        int num_bins;
+        std::array<LengthType,2> rad_range;
+        bool log_bins;
+        std::vector<CountType> counts;
+        std::vector<double> sums;
+        size_t offset = 0;
+        ReadBytes(bytes, offset, centre);
+        ReadBytes(bytes, offset, periodic_box_size);
+        ReadBytes(bytes, offset, profile_kinds);
+        ReadBytes(bytes, offset, num_bins);
+        ReadBytes(bytes, offset, rad_range);
+        ReadBytes(bytes, offset, log_bins);
+        ReadBytes(bytes, offset, counts);
+        ReadBytes(bytes, offset, sums);
+        if (profile_kinds != profile_kinds_ || num_bins != num_bins_ || rad_range != rad_range_ ||
+            log_bins != log_bins_ || counts.size() != profile_.size() ||
+            sums.size() != sums_.size() || offset != bytes.size() ||
+            !HasSameCentre_(centre, periodic_box_size))
+            throw std::invalid_argument("RadialProfile: Can only add profiles on the same bins "
+                                        "and centre");
+        for (size_t ibin = 0; ibin < profile_.size(); ++ibin)
+            profile_[ibin].num_particles += counts[ibin];
+        for (size_t isum = 0; isum < sums_.size(); ++isum)
+            sums_[isum] += sums[isum];
+        UpdateValues_();
+    }
+
+    // Outputs profile to a CSV file, with one column of values per profile kind.  Files with more
+    // than one kind start with a '#' line naming the columns.
     void OutputToTextFile(std::string filepath) {
         std::ofstream out_stream (filepath);
         if (out_stream.is_open()) {
-            for (auto bin : profile_)
-                out_stream << bin.radius << ", " << bin.value << std::endl;
+            size_t num_kinds = profile_kinds_.size();
+            if (num_kinds > 1) {
+                out_stream << "# radius";
+                for (ProfileKindType profile_kind : profile_kinds_)
+                    out_stream << ", " << GetProfileKindName(profile_kind);
+                out_stream << std::endl;
+            }
+            for (size_t ibin = 0; ibin < profile_.size(); ++ibin) {
+                out_stream << profile_[ibin].radius;
+                for (size_t ikind = 0; ikind < num_kinds; ++ikind)
+                    out_stream << ", " << values_[ibin * num_kinds + ikind];
+                out_stream << std::endl;
+            }
             out_stream.close();
         }
         else
@@ -79,101 +233,219 @@ public:
 private:
     RadialProfile();
     PosCoordsType centre_;
+    LengthType periodic_box_size_ = 0; // Box that centre_ has been wrapped into (0 if none)
     bool log_bins_;
     int num_bins_;
     std::vector<BinType> profile_;
-    ProfileKindType profile_kind_;
+    std::vector<ProfileKindType> profile_kinds_;
     std::array<LengthType,2> rad_range_;
+    std::vector<double> sums_;   // [ibin * number of kinds + ikind], summed over the particles
+    std::vector<double> values_; // As above, as output
+    // Squared distances of the range limits, and of the inner edge of each bin after the first,
+    // padded with infinities to (search_step_ * 2 - 1) entries
+    LengthType min_distance_squared_;
+    LengthType max_distance_squared_;
+    std::vector<LengthType> squared_edges_;
+    int search_step_;
+    
+    // Returns the particles the tree finds within [max_radius] of [centre].  The query radius is
+    // one ulp larger, so that it includes every particle that sqrt() rounds to max_radius.
+    static Selection GetCandidates_(const StoreType &particles, const KdTree &tree,
+                                    const PosCoordsType &centre, LengthType max_radius) {
+        if (tree.size() != particles.size())
+            throw std::invalid_argument("RadialProfile: KdTree wasn't built from this store");
+        return tree.SelectSphere(centre, std::nextafter(max_radius,
+                                                        std::numeric_limits<LengthType>::max()));
+    }
+    
+    // Returns whether [centre] is the centre of this profile, once both are wrapped into the box
+    // of whichever was made from a periodic store ([periodic_box_size] is that of [centre]).
+    // Profiles made in different periodic boxes never have the same centre.
+    bool HasSameCentre_(const PosCoordsType &centre, LengthType periodic_box_size) const {
+        if (periodic_box_size > 0 && periodic_box_size_ > 0 &&
+            periodic_box_size != periodic_box_size_)
+            return false;
+        LengthType box_size = std::max(periodic_box_size, periodic_box_size_);
+        for (int idim = 0; idim < kNDims; ++idim)
+            if (WrapPosition(centre[idim], box_size) != WrapPosition(centre_[idim], box_size))
+                return false;
+        return true;
+    }
     
-    // Adds Particle contribution to bin [ibin], according to profile_kind_
-    void AddParticleToBin_(Particle &p, int ibin) {
-        switch (profile_kind_) {
+    // Returns the column holding the quantity binned for [profile_kind] (dark matter only has
+    // mass).  N.B. All binnable quantities are single precision (see globals.hpp).
+    const Column<float> &GetValueColumn_(const ParticleStore &particles,
+                                         ProfileKindType profile_kind) {
+        switch (profile_kind) {
             case CUMU_MASS:
             case DENSITY:
-                profile_[ibin].value += p.GetMass();
-                break;
+                return particles.mass;
             default:
-                break;
                 std::string ErrorMsg = "RadialProfile: Binning not defined for this profile type";
                 throw(std::runtime_error(ErrorMsg));
         }
     }
     
-    // As above, but overloaded for GasParticle type
-    void AddParticleToBin_(GasParticle &p, int ibin) {
-        switch (profile_kind_) {
+    // As above, but overloaded for GasStore type
+    const Column<float> &GetValueColumn_(const GasStore &particles, ProfileKindType profile_kind) {
+        switch (profile_kind) {
             case AVG_CARBON_FRAC:
-                profile_[ibin].value += p.GetAbundance(CARBON);
-                break;
+                return particles.abundances[CARBON];
             case AVG_METALLICITY:
-                profile_[ibin].value += p.GetMetallicity();
-                break;
-            case CUMU_MASS:
-            case DENSITY:
-                profile_[ibin].value += p.GetMass();
-                break;
+                return particles.metallicity;
             default:
-                break;
+                return GetValueColumn_(static_cast<const ParticleStore &>(particles), profile_kind);
         }
     }
     
-    // As above, but overloaded for StarParticle type
-    void AddParticleToBin_(StarParticle &p, int ibin) {
-        switch (profile_kind_) {
+    // As above, but overloaded for StarStore type
+    const Column<float> &GetValueColumn_(const StarStore &particles, ProfileKindType profile_kind) {
+        switch (profile_kind) {
             case AVG_AGE:
-                profile_[ibin].value += p.GetAge();
-                break;
+                return particles.age;
             case AVG_CARBON_FRAC:
-                profile_[ibin].value += p.GetAbundance(CARBON);
-                break;
+                return particles.abundances[CARBON];
             case AVG_METALLICITY:
-                profile_[ibin].value += p.GetMetallicity();
-                break;
-            case CUMU_MASS:
-            case DENSITY:
-                profile_[ibin].value += p.GetMass();
-                break;
+                return particles.metallicity;
             default:
-                break;
+                return GetValueColumn_(static_cast<const ParticleStore &>(particles), profile_kind);
         }
     }
     
-    // Loops over all particles in the input vector, assigning each a bin, (ignoring those outside
+    // Loops over all particles in the input store, assigning each a bin, (ignoring those outside
     // the profile range) and adding its contribution to the profile.
-    void MakeProfile(std::vector<ParticleType> &particle_list) {
+    void MakeProfile(const StoreType &particles) {
+        MakeProfile(particles, Selection::All(particles.size()), ThreadPool::GetShared());
+    }
+    
+    // As above, for the [selection] of particles in the input store, binned on the threads of
+    // [pool].  Only the position columns and the columns of the binned quantities are read.
+    void MakeProfile(const StoreType &particles, const Selection &selection, ThreadPool &pool) {
+        if (particles.GetPeriodicBoxSize() > 0)
+            periodic_box_size_ = particles.GetPeriodicBoxSize();
+        for (int idim = 0; idim < kNDims; ++idim)
+            centre_[idim] = WrapPosition(centre_[idim], particles.GetPeriodicBoxSize());
+        size_t num_kinds = profile_kinds_.size();
+        std::vector<const float *> value_columns;
+        for (ProfileKindType profile_kind : profile_kinds_)
+            value_columns.push_back(GetValueColumn_(particles, profile_kind).data());
         
-        // Bin particles
-        for (int iPart = 0; iPart < particle_list.size(); ++iPart) {
-            int ibin = GetBinIndex_(particle_list[iPart].GetDistanceFrom(centre_));
-            // Ignore particles outside the profile radius range
-            if (ibin < 0)
-                continue;
-            AddParticleToBin_(particle_list[iPart], ibin);
-            profile_[ibin].num_particles++;
-        }
+        // Bin each chunk of particles into its own partial bins.  The chunks depend only on the
+        // size of the store, never on the number of threads.
+        size_t num_particles   = selection.GetUniverseSize();
+        size_t even_chunk_size = (num_particles + kMaxProfileChunks - 1) / kMaxProfileChunks;
+        size_t chunk_size      = std::max(kMinProfileChunkSize, even_chunk_size);
+        size_t num_chunks      = (num_particles + chunk_size - 1) / chunk_size;
+        size_t num_bins        = profile_.size();
+        std::vector<double> chunk_values(num_chunks * num_bins * num_kinds, 0);
+        std::vector<int> chunk_counts(num_chunks * num_bins, 0);
+        pool.ParallelFor(num_chunks, [&](size_t ichunk, int) {
+            double *values = &chunk_values[ichunk * num_bins * num_kinds];
+            int *counts    = &chunk_counts[ichunk * num_bins];
+            size_t first   = ichunk * chunk_size;
+            
+            // Bin the particles of the chunk in blocks of kProfileBlockSize
+            size_t block_indices[kProfileBlockSize];
+            int block_bins[kProfileBlockSize];
+            size_t num_block_particles = 0;
+            auto bin_block = [&]() {
+                GetBinIndices_(particles, block_indices, num_block_particles, block_bins);
+                for (size_t iblock = 0; iblock < num_block_particles; ++iblock) {
+                    int ibin = block_bins[iblock];
+                    // Ignore particles outside the profile radius range
+                    if (ibin < 0)
+                        continue;
+                    double *bin_values = &values[ibin * num_kinds];
+                    for (size_t ikind = 0; ikind < num_kinds; ++ikind)
+                        bin_values[ikind] += value_columns[ikind][block_indices[iblock]];
+                    counts[ibin]++;
+                }
+                num_block_particles = 0;
+            };
+            selection.ForEachInRange(first, first + chunk_size, [&](size_t ipart) {
+                block_indices[num_block_particles++] = ipart;
+                if (num_block_particles == kProfileBlockSize)
+                    bin_block();
+            });
+            bin_block();
+        });
         
-        // Do additional profile_kind-dependent processing of bins
-        for (int ibin = 0; ibin < profile_.size(); ++ibin) {
-            switch (profile_kind_) {
-                case AVG_AGE:
-                case AVG_CARBON_FRAC:
-                case AVG_METALLICITY:
-                    if (profile_[ibin].num_particles > 0)
-                        profile_[ibin].value /= profile_[ibin].num_particles;
-                    break;
-                case CUMU_MASS:
-                    if (ibin>0)
-                        profile_[ibin].value += profile_[ibin - 1].value;
-                    break;
-                case DENSITY:
-                    profile_[ibin].value /= profile_[ibin].volume;
-                    break;
+        // Merge the partial bins in chunk order
+        for (size_t ichunk = 0; ichunk < num_chunks; ++ichunk) {
+            for (size_t ibin = 0; ibin < num_bins; ++ibin) {
+                profile_[ibin].num_particles += chunk_counts[ichunk * num_bins + ibin];
+                for (size_t ikind = 0; ikind < num_kinds; ++ikind)
+                    sums_[ibin * num_kinds + ikind] +=
+                        chunk_values[(ichunk * num_bins + ibin) * num_kinds + ikind];
+            }
+        }
+        UpdateValues_();
+    }
+    
+    // Derives the values output from the sums, with additional profile_kind-dependent processing
+    // of bins
+    void UpdateValues_() {
+        size_t num_kinds = profile_kinds_.size();
+        for (size_t ikind = 0; ikind < num_kinds; ++ikind) {
+            for (size_t ibin = 0; ibin < profile_.size(); ++ibin) {
+                double &value = values_[ibin * num_kinds + ikind];
+                value = sums_[ibin * num_kinds + ikind];
+                switch (profile_kinds_[ikind]) {
+                    case AVG_AGE:
+                    case AVG_CARBON_FRAC:
+                    case AVG_METALLICITY:
+                        if (profile_[ibin].num_particles > 0)
+                            value /= profile_[ibin].num_particles;
+                        break;
+                    case CUMU_MASS:
+                        if (ibin>0)
+                            value += values_[(ibin - 1) * num_kinds + ikind];
+                        break;
+                    case DENSITY:
+                        value /= profile_[ibin].volume;
+                        break;
+                }
             }
         }
     }
 
-    // Determine which bin a radius corresponds to subtracting Rmin and dividing by dR
-    int GetBinIndex_(LengthType radius) {
+    // Sets block_bins[i] to the bin of particle block_indices[i], or -1 if it's outside the
+    // profile range.  Squared distances are accumulated a dimension at a time from the position
+    // columns, in the same order and with the same periodic wrapping as
+    // ParticleStore::GetDistanceFrom(), so they're identical to the squares that function takes the
+    // root of.  Neither loop branches, so both vectorise.
+    void GetBinIndices_(const StoreType &particles, const size_t *block_indices,
+                        size_t num_block_particles, int *block_bins) const {
+        LengthType box_size = particles.GetPeriodicBoxSize();
+        LengthType distances_squared[kProfileBlockSize];
+        for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+            distances_squared[iblock] = 0;
+        for (int idim = 0; idim < kNDims; ++idim) {
+            const LengthType *positions = particles.position[idim].data();
+            for (size_t iblock = 0; iblock < num_block_particles; ++iblock) {
+                LengthType displacement = GetPeriodicDisplacement(
+                    positions[block_indices[iblock]] - centre_[idim], box_size);
+                distances_squared[iblock] += displacement * displacement;
+            }
+        }
+        for (size_t iblock = 0; iblock < num_block_particles; ++iblock)
+            block_bins[iblock] = GetBinIndex_(distances_squared[iblock]);
+    }
+    
+    // Determine which bin a squared distance corresponds to by a binary search of the squared bin
+    // edges, which always takes log2(search_step_) + 1 steps
+    int GetBinIndex_(LengthType distance_squared) const {
+        int ibin = 0;
+        for (int step = search_step_; step > 0; step /= 2)
+            ibin += (squared_edges_[ibin + step - 1] <= distance_squared) ? step : 0;
+        bool in_range = distance_squared >= min_distance_squared_ &&
+                        distance_squared <= max_distance_squared_;
+        return in_range ? ibin : -1;
+    }
+    
+    // Determine which bin a radius corresponds to subtracting Rmin and dividing by dR.  Only used
+    // to set up the bin edges, as it's slow: it recomputes the logs for every call.
+    int GetBinIndexFromRadius_(LengthType radius) const {
         if (radius < rad_range_[0] || radius > rad_range_[1])
             return -1;
         
@@ -190,6 +462,60 @@ private:
         return std::floor((r_scaled - rmin_scaled) / dr_scaled);
     }
     
+    // Returns the smallest non-negative double for which [predicate] is true, given that it's
+    // false below some value and true above it, or infinity if it's never true.  Non-negative
+    // doubles are ordered like their bit patterns, so this is a binary search over those.
+    template <typename PredicateType>
+    static LengthType FindSmallestDouble_(PredicateType predicate) {
+        const LengthType kInfinity = std::numeric_limits<LengthType>::infinity();
+        uint64_t lower_bits, upper_bits;
+        LengthType zero = 0;
+        std::memcpy(&lower_bits, &zero, sizeof(LengthType));
+        std::memcpy(&upper_bits, &kInfinity, sizeof(LengthType));
+        // Invariant: predicate is false below lower_bits, and true at upper_bits (or it's infinity)
+        while (lower_bits < upper_bits) {
+            uint64_t middle_bits = lower_bits + (upper_bits - lower_bits) / 2;
+            LengthType middle;
+            std::memcpy(&middle, &middle_bits, sizeof(LengthType));
+            if (predicate(middle))
+                upper_bits = middle_bits;
+            else
+                lower_bits = middle_bits + 1;
+        }
+        LengthType smallest;
+        std::memcpy(&smallest, &lower_bits, sizeof(LengthType));
+        return smallest;
+    }
+    
+    // Sets up the squared distances at which GetBinIndexFromRadius_(std::sqrt(distance_squared))
+    // changes, so that GetBinIndex_() reproduces it exactly, apart from putting a radius of
+    // rad_range_[1] in the last bin (the formula would give num_bins_).  Each edge is found by a
+    // binary search over doubles, which is exact provided the formula never decreases with radius.
+    void SetupBinEdges_() {
+        min_distance_squared_ = FindSmallestDouble_([this](LengthType distance_squared) {
+            return std::sqrt(distance_squared) >= rad_range_[0];
+        });
+        LengthType beyond_max = FindSmallestDouble_([this](LengthType distance_squared) {
+            return std::sqrt(distance_squared) > rad_range_[1];
+        });
+        max_distance_squared_ = std::nextafter(beyond_max, LengthType(0));
+        
+        search_step_ = 1;
+        while (search_step_ < num_bins_)
+            search_step_ *= 2;
+        search_step_ /= 2;
+        squared_edges_.assign(std::max(2 * search_step_ - 1, 0),
+                              std::numeric_limits<LengthType>::infinity());
+        for (int ibin = 1; ibin < num_bins_; ++ibin) {
+            squared_edges_[ibin - 1] = FindSmallestDouble_([&](LengthType distance_squared) {
+                if (distance_squared < min_distance_squared_)
+                    return false;
+                return distance_squared > max_distance_squared_ ||
+                       GetBinIndexFromRadius_(std::sqrt(distance_squared)) >= ibin;
+            });
+        }
+    }
+    
     // Sets up the profile bins, zeroing the value and number of particles and computing the
     // mid-point radius and area (2D) or volume (3D).
     void SetupBins() {
@@ -219,10 +545,12 @@ private:
                 new_bin.volume = M_PI * (std::pow(rbin_outer, 2) - std::pow(rbin_inner, 2));
             }
             new_bin.num_particles = 0;
-            new_bin.value      = 0;
             
             profile_.push_back(new_bin);
         }
+        sums_.assign(profile_.size() * profile_kinds_.size(), 0);
+        values_.assign(sums_.size(), 0);
+        SetupBinEdges_();
     }
 };
 #endif // radial_profile_hpp
\ No newline at end of file
@@ -0,0 +1,149 @@
+// Implementation of the Selection class
+
+#include "selection.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+// A bitmap is used when it's smaller than the index list, i.e. when more than one particle in
+// every (8 * sizeof(size_t)) is selected
+const size_t kBitmapDensityThreshold = 8 * sizeof(size_t);
+
+static size_t NumBitmapWords(size_t universe_size) {
+    return (universe_size + 63) / 64;
+}
+
+Selection Selection::All(size_t universe_size) {
+    std::vector<uint64_t> bits(NumBitmapWords(universe_size), ~uint64_t(0));
+    return FromBitmap(bits, universe_size);
+}
+
+// Takes one bit per particle, with particle i in bit (i % 64) of word (i / 64).  Bits beyond the
+// end of the universe are ignored.
+Selection Selection::FromBitmap(std::vector<uint64_t> bits, size_t universe_size) {
+    if (bits.size() != NumBitmapWords(universe_size))
+        throw std::invalid_argument("Selection: Bitmap size doesn't match the number of particles");
+    Selection selection;
+    selection.universe_size_ = universe_size;
+    selection.is_bitmap_     = true;
+    selection.bits_.swap(bits);
+    if (universe_size % 64 != 0)
+        selection.bits_.back() &= (uint64_t(1) << (universe_size % 64)) - 1;
+    for (uint64_t word : selection.bits_)
+        selection.count_ += __builtin_popcountll(word);
+    selection.Compact_();
+    return selection;
+}
+
+// Takes a list of indices, which must be sorted and unique
+Selection Selection::FromIndices(std::vector<size_t> indices, size_t universe_size) {
+    if (!indices.empty() && indices.back() >= universe_size)
+        throw std::out_of_range("Selection: Index beyond the end of the store");
+    Selection selection;
+    selection.universe_size_ = universe_size;
+    selection.count_         = indices.size();
+    selection.indices_.swap(indices);
+    selection.Compact_();
+    return selection;
+}
+
+bool Selection::Contains(size_t index) const {
+    if (index >= universe_size_)
+        return false;
+    if (is_bitmap_)
+        return (bits_[index / 64] >> (index % 64)) & 1;
+    return std::binary_search(indices_.begin(), indices_.end(), index);
+}
+
+std::vector<size_t> Selection::GetIndices() const {
+    if (!is_bitmap_)
+        return indices_;
+    std::vector<size_t> indices;
+    indices.reserve(count_);
+    ForEach([&indices](size_t index) { indices.push_back(index); });
+    return indices;
+}
+
+Selection Selection::operator&(const Selection &other) const {
+    CheckSameUniverse_(other);
+    if (is_bitmap_ && other.is_bitmap_) {
+        std::vector<uint64_t> bits(bits_);
+        for (size_t iword = 0; iword < bits.size(); ++iword)
+            bits[iword] &= other.bits_[iword];
+        return FromBitmap(bits, universe_size_);
+    }
+    std::vector<size_t> indices;
+    if (!is_bitmap_ && !other.is_bitmap_) {
+        std::set_intersection(indices_.begin(), indices_.end(), other.indices_.begin(),
+                              other.indices_.end(), std::back_inserter(indices));
+    } else {
+        // Keep the entries of the index list that are set in the bitmap
+        const Selection &list   = is_bitmap_ ? other : *this;
+        const Selection &bitmap = is_bitmap_ ? *this : other;
+        indices.reserve(list.count_);
+        for (size_t index : list.indices_)
+            if (bitmap.Contains(index))
+                indices.push_back(index);
+    }
+    return FromIndices(indices, universe_size_);
+}
+
+Selection Selection::operator|(const Selection &other) const {
+    CheckSameUniverse_(other);
+    if (!is_bitmap_ && !other.is_bitmap_) {
+        std::vector<size_t> indices;
+        indices.reserve(count_ + other.count_);
+        std::set_union(indices_.begin(), indices_.end(), other.indices_.begin(),
+                       other.indices_.end(), std::back_inserter(indices));
+        return FromIndices(indices, universe_size_);
+    }
+    std::vector<uint64_t> bits = ToBitmap_();
+    if (other.is_bitmap_) {
+        for (size_t iword = 0; iword < bits.size(); ++iword)
+            bits[iword] |= other.bits_[iword];
+    } else {
+        for (size_t index : other.indices_)
+            bits[index / 64] |= uint64_t(1) << (index % 64);
+    }
+    return FromBitmap(bits, universe_size_);
+}
+
+// Returns the particles of the store that are not selected
+Selection Selection::operator~() const {
+    std::vector<uint64_t> bits = ToBitmap_();
+    for (uint64_t &word : bits)
+        word = ~word;
+    return FromBitmap(bits, universe_size_);
+}
+
+void Selection::CheckSameUniverse_(const Selection &other) const {
+    if (universe_size_ != other.universe_size_)
+        throw std::invalid_argument("Selection: Can't combine selections of different stores");
+}
+
+// Switches to whichever representation is smaller
+void Selection::Compact_() {
+    bool use_bitmap = count_ * kBitmapDensityThreshold > universe_size_;
+    if (use_bitmap == is_bitmap_)
+        return;
+    if (use_bitmap) {
+        bits_ = ToBitmap_();
+        std::vector<size_t>().swap(indices_);
+    } else {
+        indices_ = GetIndices();
+        std::vector<uint64_t>().swap(bits_);
+    }
+    is_bitmap_ = use_bitmap;
+}
+
+std::vector<uint64_t> Selection::ToBitmap_() const {
+    if (is_bitmap_)
+        return bits_;
+    std::vector<uint64_t> bits(NumBitmapWords(universe_size_), 0);
+    for (size_t index : indices_)
+        bits[index / 64] |= uint64_t(1) << (index % 64);
+    return bits;
+}
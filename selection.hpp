@@ -0,0 +1,84 @@
+// Interface for the Selection class
+
+#ifndef selection_hpp
+#define selection_hpp
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A subset of the particles of one store, identified by index, so that filtering never copies
+// particle data.  Sparse selections are held as a sorted list of indices, and dense ones as a
+// bitmap with one bit per particle of the store (the "universe"), whichever is smaller.  Selections
+// of the same store can be combined with & (and), | (or) and ~ (not), without touching the
+// particle data.  Pass a selection together with its store to RadialProfile or the dynamics
+// functions, or use store.Subset(selection.GetIndices()) to copy the selected particles.
+// Usage: Selection young = FilterParticles(stars, AGE_LT, 2.); young & ~metal_poor
+class Selection {
+public:
+    Selection() : count_(0), is_bitmap_(false), universe_size_(0) {}
+    static Selection All(size_t universe_size);
+    static Selection FromBitmap(std::vector<uint64_t> bits, size_t universe_size);
+    static Selection FromIndices(std::vector<size_t> indices, size_t universe_size);
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    bool Contains(size_t index) const;
+    std::vector<size_t> GetIndices() const;
+    size_t GetUniverseSize() const { return universe_size_; }
+    bool IsBitmap() const { return is_bitmap_; }
+    Selection operator&(const Selection &other) const;
+    Selection operator|(const Selection &other) const;
+    Selection operator~() const;
+    Selection &operator&=(const Selection &other) { return *this = *this & other; }
+    Selection &operator|=(const Selection &other) { return *this = *this | other; }
+
+    // Calls function(index) for each selected index, in increasing order
+    template <typename FunctionType>
+    void ForEach(FunctionType function) const {
+        ForEachInRange(0, universe_size_, function);
+    }
+
+    // As above, for the selected indices in [first, last), so that disjoint ranges of the store can
+    // be processed in parallel
+    template <typename FunctionType>
+    void ForEachInRange(size_t first, size_t last, FunctionType function) const {
+        last = std::min(last, universe_size_);
+        if (first >= last)
+            return;
+        if (!is_bitmap_) {
+            auto index_it = std::lower_bound(indices_.begin(), indices_.end(), first);
+            for (; index_it != indices_.end() && *index_it < last; ++index_it)
+                function(*index_it);
+            return;
+        }
+        for (size_t iword = first / 64; iword < (last + 63) / 64; ++iword) {
+            uint64_t word     = bits_[iword];
+            size_t word_first = iword * 64;
+            if (word_first < first)
+                word &= ~uint64_t(0) << (first - word_first);
+            if (last - word_first < 64)
+                word &= (uint64_t(1) << (last - word_first)) - 1;
+            if (word == ~uint64_t(0)) {
+                for (size_t index = word_first; index < word_first + 64; ++index)
+                    function(index);
+                continue;
+            }
+            while (word != 0) {
+                function(word_first + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+private:
+    void CheckSameUniverse_(const Selection &other) const;
+    void Compact_();
+    std::vector<uint64_t> ToBitmap_() const;
+    std::vector<uint64_t> bits_;
+    size_t count_;
+    std::vector<size_t> indices_;
+    bool is_bitmap_;
+    size_t universe_size_;
+};
+
+#endif // selection_hpp
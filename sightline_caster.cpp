@@ -0,0 +1,296 @@
+// Implementation of the SightlineCaster class
+
+#include "sightline_caster.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "sph_kernel.hpp"
+#include "thread_pool.hpp"
+
+// Number of particles handled by each task
+const size_t kSightlineBlockSize = 65536;
+
+SightlineCaster::SightlineCaster(const GasStore &gas, const KdTree &tree, SphKernelType kernel,
+                                 ThreadPool &pool) :
+gas_(gas), kernel_(kernel), tree_(tree) {
+    if (tree.size() != gas.size())
+        throw std::invalid_argument("SightlineCaster: Tree was built from another store");
+    kernel_table_.assign(kSightlineKernelTableSize + 1, 0);
+    for (size_t itable = 0; itable < kSightlineKernelTableSize; ++itable)
+        kernel_table_[itable] = IntegrateSphKernelAlongLine(kernel,
+                                                            double(itable) /
+                                                            kSightlineKernelTableSize);
+
+    size_t num_particles = gas.size();
+    smoothing_lengths_.resize(num_particles);
+    const LengthType *p_smoothing_length = gas.smoothing_length.data();
+    size_t num_blocks = (num_particles + kSightlineBlockSize - 1) / kSightlineBlockSize;
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kSightlineBlockSize, num_particles);
+        for (size_t ipart = iblock * kSightlineBlockSize; ipart < last; ++ipart)
+            smoothing_lengths_[ipart] = std::max(p_smoothing_length[tree.order_[ipart]], 0.);
+    });
+
+    // Bound the kernels of each node, from its children's (which come after it) or its particles'
+    const std::vector<KdTree::NodeType> &nodes = tree.nodes_;
+    node_lower_.resize(nodes.size());
+    node_upper_.resize(nodes.size());
+    for (size_t inode = nodes.size(); inode-- > 0;) {
+        const KdTree::NodeType &node = nodes[inode];
+        PosCoordsType &lower = node_lower_[inode];
+        PosCoordsType &upper = node_upper_[inode];
+        if (node.child != 0) {
+            for (int idim = 0; idim < kNDims; ++idim) {
+                lower[idim] = std::min(node_lower_[node.child][idim],
+                                       node_lower_[node.child + 1][idim]);
+                upper[idim] = std::max(node_upper_[node.child][idim],
+                                       node_upper_[node.child + 1][idim]);
+            }
+            continue;
+        }
+        lower = node.lower;
+        upper = node.upper;
+        for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart) {
+            for (int idim = 0; idim < kNDims; ++idim) {
+                LengthType position = tree.positions_[idim][ipart];
+                lower[idim] = std::min(lower[idim], position - smoothing_lengths_[ipart]);
+                upper[idim] = std::max(upper[idim], position + smoothing_lengths_[ipart]);
+            }
+        }
+    }
+}
+
+// Returns the column densities of gas and of each element, and the mass-weighted temperature,
+// along each of [sightlines]
+std::vector<SightlineColumns>
+SightlineCaster::ComputeColumns(const std::vector<Sightline> &sightlines, ThreadPool &pool) const {
+    const MassType *p_mass               = gas_.mass.data();
+    const TemperatureType *p_temperature = gas_.temperature.data();
+    std::array<const AbundanceType *,NUM_ELEMENTS> p_abundances;
+    for (int ielement = 0; ielement < NUM_ELEMENTS; ++ielement)
+        p_abundances[ielement] = gas_.abundances[ielement].data();
+
+    std::vector<SightlineColumns> columns(sightlines.size());
+    size_t num_tasks = (sightlines.size() + kSightlinesPerTask - 1) / kSightlinesPerTask;
+    pool.ParallelFor(num_tasks, [&](size_t itask, int) {
+        std::vector<size_t> stack;
+        size_t last = std::min((itask + 1) * kSightlinesPerTask, sightlines.size());
+        for (size_t isightline = itask * kSightlinesPerTask; isightline < last; ++isightline) {
+            SightlineColumns &column = columns[isightline];
+            column.mass = 0;
+            column.element_masses.fill(0);
+            column.temperature   = 0;
+            column.num_particles = 0;
+            ForEachCrossing_(sightlines[isightline], stack,
+                             [&](size_t ipart, LengthType, double kernel) {
+                size_t index = tree_.order_[ipart];
+                double mass  = p_mass[index] * kernel;
+                column.mass        += mass;
+                column.temperature += mass * p_temperature[index];
+                for (int ielement = 0; ielement < NUM_ELEMENTS; ++ielement)
+                    column.element_masses[ielement] += mass * p_abundances[ielement][index];
+                ++column.num_particles;
+            });
+            if (column.mass > 0)
+                column.temperature /= column.mass;
+        }
+    });
+    return columns;
+}
+
+// Returns the column density of [element] per unit velocity along each of [sightlines], in
+// [num_bins] equal bins of line-of-sight velocity over [velocity_range] (in km/s).  Each particle's
+// column is spread over a Gaussian line profile centred on its velocity along the sightline plus
+// [hubble_rate] (in km/s per unit length, e.g. Parameters::GetHubbleRate() for a cosmological
+// snapshot) times its distance along the sightline, with the thermal Doppler parameter
+// b = sqrt(2 k T / m) of the element at the particle's temperature.  Multiplying by the
+// cross-section of a transition per unit mass of the element gives the optical depth, tau,
+// and the transmitted flux is exp(-tau).  Column outside the velocity range is lost.
+std::vector<SightlineCaster::SpectrumType>
+SightlineCaster::ComputeSpectra(const std::vector<Sightline> &sightlines, Element element,
+                                const std::array<VelocityType,2> &velocity_range, int num_bins,
+                                double hubble_rate, ThreadPool &pool) const {
+    if (num_bins < 1 || !(velocity_range[1] > velocity_range[0]))
+        throw std::invalid_argument("SightlineCaster: Invalid velocity bins");
+    VelocityType bin_width = (velocity_range[1] - velocity_range[0]) / num_bins;
+    // (km/s)^2 per K, for the element
+    double thermal_factor  = 2 * kBoltzmannConstantCgs /
+                             (kElementAtomicWeights[element] * kAtomicMassUnitCgs) / 1e10;
+    const MassType *p_mass               = gas_.mass.data();
+    const TemperatureType *p_temperature = gas_.temperature.data();
+    const AbundanceType *p_abundance     = gas_.abundances[element].data();
+    std::array<const VelocityType *,kNDims> p_velocities;
+    for (int idim = 0; idim < kNDims; ++idim)
+        p_velocities[idim] = gas_.velocity[idim].data();
+
+    std::vector<SpectrumType> spectra(sightlines.size(), SpectrumType(num_bins, 0));
+    size_t num_tasks = (sightlines.size() + kSightlinesPerTask - 1) / kSightlinesPerTask;
+    pool.ParallelFor(num_tasks, [&](size_t itask, int) {
+        std::vector<size_t> stack;
+        size_t last = std::min((itask + 1) * kSightlinesPerTask, sightlines.size());
+        for (size_t isightline = itask * kSightlinesPerTask; isightline < last; ++isightline) {
+            const Sightline &sightline = sightlines[isightline];
+            double *p_spectrum         = spectra[isightline].data();
+            LengthType norm            = 0;
+            for (int idim = 0; idim < kNDims; ++idim)
+                norm += sightline.direction[idim] * sightline.direction[idim];
+            norm = std::sqrt(norm);
+            ForEachCrossing_(sightline, stack,
+                             [&](size_t ipart, LengthType distance, double kernel) {
+                size_t index    = tree_.order_[ipart];
+                double column   = p_mass[index] * p_abundance[index] * kernel;
+                double velocity = hubble_rate * distance;
+                for (int idim = 0; idim < kNDims; ++idim)
+                    velocity += p_velocities[idim][index] * sightline.direction[idim] / norm;
+                double doppler = std::sqrt(thermal_factor * std::max(p_temperature[index], 0.f));
+                if (!(doppler > 0)) {
+                    long ibin = std::floor((velocity - velocity_range[0]) / bin_width);
+                    if (ibin >= 0 && ibin < num_bins)
+                        p_spectrum[ibin] += column / bin_width;
+                    return;
+                }
+                // Integrate the Gaussian over each bin from the error function at its edges
+                long first = std::max(long(std::floor((velocity - kMaxThermalWidths * doppler -
+                                                       velocity_range[0]) / bin_width)), 0L);
+                long last  = std::min(long(std::floor((velocity + kMaxThermalWidths * doppler -
+                                                       velocity_range[0]) / bin_width)),
+                                      long(num_bins) - 1);
+                double lower_erf = std::erf((velocity_range[0] + first * bin_width - velocity) /
+                                            doppler);
+                for (long ibin = first; ibin <= last; ++ibin) {
+                    double upper_erf = std::erf((velocity_range[0] + (ibin + 1) * bin_width -
+                                                 velocity) / doppler);
+                    p_spectrum[ibin] += column * (upper_erf - lower_erf) / (2 * bin_width);
+                    lower_erf = upper_erf;
+                }
+            });
+        }
+    });
+    return spectra;
+}
+
+// Calls function(ipart, distance, kernel) for each particle (in tree order) whose nearest point
+// on [sightline] is on it and inside its kernel, with the distance of that point along the
+// sightline and the kernel integrated through the particle, over h^(kNDims - 1).  Nodes are
+// tested with the slab method: the sightline is clipped to the range of distances inside the
+// node's kernels in each dimension in turn.  In a periodic store, the sightline is shifted by each
+// multiple of the box size that brings part of it within the kernels of the box.
+template <typename FunctionType>
+void SightlineCaster::ForEachCrossing_(const Sightline &sightline, std::vector<size_t> &stack,
+                                       FunctionType function) const {
+    if (node_lower_.empty() || !(sightline.length >= 0))
+        return;
+    LengthType norm = 0;
+    for (int idim = 0; idim < kNDims; ++idim)
+        norm += sightline.direction[idim] * sightline.direction[idim];
+    norm = std::sqrt(norm);
+    if (!(norm > 0))
+        throw std::invalid_argument("SightlineCaster: Sightline has no direction");
+    PosCoordsType direction;
+    PosCoordsType inverse_direction;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        direction[idim]         = sightline.direction[idim] / norm;
+        inverse_direction[idim] = 1 / direction[idim];
+    }
+
+    // Range of periodic shifts in each dimension
+    LengthType box_size = tree_.periodic_box_size_;
+    std::array<long,kNDims> first_shift;
+    std::array<long,kNDims> last_shift;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        first_shift[idim] = last_shift[idim] = 0;
+        if (box_size > 0) {
+            LengthType end = sightline.start[idim] + sightline.length * direction[idim];
+            first_shift[idim] = std::ceil((std::min(sightline.start[idim], end) -
+                                           node_upper_[0][idim]) / box_size);
+            last_shift[idim]  = std::floor((std::max(sightline.start[idim], end) -
+                                            node_lower_[0][idim]) / box_size);
+            if (first_shift[idim] > last_shift[idim])
+                return;
+        }
+    }
+    std::array<long,kNDims> shift = first_shift;
+    while (true) {
+        PosCoordsType start;
+        for (int idim = 0; idim < kNDims; ++idim)
+            start[idim] = sightline.start[idim] - shift[idim] * box_size;
+
+        stack.assign(1, 0);
+        while (!stack.empty()) {
+            size_t inode = stack.back();
+            stack.pop_back();
+            LengthType near = 0;
+            LengthType far  = sightline.length;
+            for (int idim = 0; idim < kNDims && near <= far; ++idim) {
+                if (direction[idim] == 0) {
+                    if (start[idim] < node_lower_[inode][idim] ||
+                        start[idim] > node_upper_[inode][idim])
+                        far = -1;
+                    continue;
+                }
+                LengthType distance_a = (node_lower_[inode][idim] - start[idim]) *
+                                        inverse_direction[idim];
+                LengthType distance_b = (node_upper_[inode][idim] - start[idim]) *
+                                        inverse_direction[idim];
+                near = std::max(near, std::min(distance_a, distance_b));
+                far  = std::min(far, std::max(distance_a, distance_b));
+            }
+            if (near > far)
+                continue;
+            const KdTree::NodeType &node = tree_.nodes_[inode];
+            if (node.child != 0) {
+                stack.push_back(node.child + 1);
+                stack.push_back(node.child);
+                continue;
+            }
+            for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart) {
+                LengthType distance           = 0;
+                LengthType separation_squared = 0;
+                for (int idim = 0; idim < kNDims; ++idim) {
+                    LengthType displacement = tree_.positions_[idim][ipart] - start[idim];
+                    distance           += displacement * direction[idim];
+                    separation_squared += displacement * displacement;
+                }
+                LengthType smoothing_length = smoothing_lengths_[ipart];
+                LengthType impact_squared   = separation_squared - distance * distance;
+                if (distance < 0 || distance > sightline.length ||
+                    !(impact_squared < smoothing_length * smoothing_length))
+                    continue;
+                double q_squared = std::max(impact_squared, 0.) /
+                                   (smoothing_length * smoothing_length);
+                double kernel    = LookUpKernel_(q_squared) /
+                                   ((kNDims == 3) ? smoothing_length * smoothing_length :
+                                    smoothing_length);
+                function(ipart, distance, kernel);
+            }
+        }
+
+        // Move on to the next shift
+        int idim = 0;
+        while (idim < kNDims && shift[idim] == last_shift[idim]) {
+            shift[idim] = first_shift[idim];
+            ++idim;
+        }
+        if (idim == kNDims)
+            break;
+        ++shift[idim];
+    }
+}
+
+// Returns the kernel integrated through a particle at [q_squared] < 1, interpolating linearly in
+// the table
+double SightlineCaster::LookUpKernel_(double q_squared) const {
+    double position = q_squared * kSightlineKernelTableSize;
+    size_t itable   = std::min(size_t(position), kSightlineKernelTableSize - 1);
+    double fraction = position - itable;
+    return kernel_table_[itable] + fraction * (kernel_table_[itable + 1] - kernel_table_[itable]);
+}
@@ -0,0 +1,85 @@
+// Interface for the SightlineCaster class
+
+#ifndef sightline_caster_hpp
+#define sightline_caster_hpp
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "baryonic_particle.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "sph_kernel.hpp"
+#include "thread_pool.hpp"
+
+// Number of intervals of q^2 in the table of the kernel integrated through a particle, enough for
+// relative errors of ~1e-4
+const size_t kSightlineKernelTableSize = 8192;
+
+// Number of sightlines cast by each task
+const size_t kSightlinesPerTask = 16;
+
+// Thermal line profiles are cut off at this many Doppler parameters from their centre
+const double kMaxThermalWidths = 6;
+
+// A straight sightline, from [start] for [length] along [direction]
+struct Sightline {
+    PosCoordsType start;
+    PosCoordsType direction;  // Needn't be a unit vector
+    LengthType length;
+};
+
+// Integrals through the gas along a sightline, from SightlineCaster::ComputeColumns().  Column
+// densities are masses per unit area (per unit length in 2D).
+struct SightlineColumns {
+    double mass;                                     // Column density of gas
+    std::array<double,NUM_ELEMENTS> element_masses;  // Column density of each element
+    double temperature;                              // Mass-weighted mean temperature
+    size_t num_particles;                            // Number of particles whose kernels count
+};
+
+// Casts sightlines through the SPH kernels of a store of gas particles, to find column densities
+// (the integral of the density along the sightline) of gas and of each element, and spectra of
+// the column density of an element per unit line-of-sight velocity, from which absorption spectra
+// follow.  Each particle contributes its mass times its kernel integrated along the whole chord
+// through it, if the point of the sightline nearest to the particle lies on the sightline (so
+// that sightlines placed end to end count each particle once).  The crossed particles are found
+// in a bounding volume hierarchy: the nodes of a k-d tree of the store, each bounding the kernels
+// of its particles (the node's box expanded by the particles' smoothing lengths), so a sightline
+// only visits the nodes whose kernels it might cross.  Sightlines are shared out in batches
+// between threads, and the results are identical for any number of threads.  In a periodic store,
+// sightlines pass through the periodic images of the box, and may be longer than it.  The store
+// and tree must outlive the SightlineCaster.
+// Usage: SightlineCaster caster(simulation.gas, tree); caster.ComputeColumns(sightlines)
+class SightlineCaster {
+public:
+    // Column density of an element per unit velocity in each velocity bin of a sightline
+    typedef std::vector<double> SpectrumType;
+    SightlineCaster(const GasStore &gas, const KdTree &tree,
+                    SphKernelType kernel = CUBIC_SPLINE_KERNEL,
+                    ThreadPool &pool = ThreadPool::GetShared());
+    std::vector<SightlineColumns> ComputeColumns(const std::vector<Sightline> &sightlines,
+                                                 ThreadPool &pool = ThreadPool::GetShared()) const;
+    std::vector<SpectrumType> ComputeSpectra(const std::vector<Sightline> &sightlines,
+                                             Element element,
+                                             const std::array<VelocityType,2> &velocity_range,
+                                             int num_bins, double hubble_rate = 0,
+                                             ThreadPool &pool = ThreadPool::GetShared()) const;
+    SphKernelType GetKernel() const { return kernel_; }
+private:
+    SightlineCaster();
+    template <typename FunctionType>
+    void ForEachCrossing_(const Sightline &sightline, std::vector<size_t> &stack,
+                          FunctionType function) const;
+    double LookUpKernel_(double q_squared) const;
+    const GasStore &gas_;
+    SphKernelType kernel_;
+    std::vector<double> kernel_table_;          // See kSightlineKernelTableSize
+    std::vector<PosCoordsType> node_lower_;     // Lower corner of the kernels of each node
+    std::vector<PosCoordsType> node_upper_;     // Upper corner of the kernels of each node
+    std::vector<LengthType> smoothing_lengths_; // In tree order
+    const KdTree &tree_;
+};
+
+#endif // sightline_caster_hpp
@@ -6,10 +6,14 @@
 #include <stdexcept>
 #include <string>
 
+#include "gadget_loader.hpp"
 #include "gas_particle.hpp"
 #include "parameters.hpp"
 #include "particle.hpp"
+#include "particle_store.hpp"
+#include "snapshot_cache.hpp"
 #include "star_particle.hpp"
+#include "synthetic_generator.hpp"
 
 // Attempts to read parameters and data automatically on instantiation, based on supplied parameter
 // filepath.
@@ -23,41 +27,72 @@ parameters_(Parameters(filepath)) {
     }
 }
 
-// Creates particle instances with random properties and pushes them into the three main data
-// vectors.  Stops when their sizes reach the values in the Parameters::n_particles_ array.
+// Fills the three stores with synthetic data, generated in parallel, with sizes given by the
+// Parameters::n_particles_ array.  Particle IDs run on from one type to the next.  The data depend
+// only on the distribution and seed in the parameters, not on the number of threads.
 void Simulation::FillWithDummyData_() {
-    // Fill dark matter particle vector
-    for (int ipart = 0; ipart < parameters_.GetNParticles(DM_TYPE_IDX); ++ipart) {
-        Particle dm_particle;
-        dm_particle.AssignRandomProperties();
-        dark_matter.push_back(dm_particle);
-    }
-    // Fill gas particle vector
-    for (int ipart = 0; ipart < parameters_.GetNParticles(GAS_TYPE_IDX); ++ipart) {
-        GasParticle gas_particle;
-        gas_particle.AssignRandomProperties();
-        gas.push_back(gas_particle);
-    }
-    // Fill star particle vector
-    for (int ipart = 0; ipart < parameters_.GetNParticles(STAR_TYPE_IDX); ++ipart) {
-        StarParticle star_particle;
-        star_particle.AssignRandomProperties();
-        stars.push_back(star_particle);
-    }
+    SyntheticGenerator generator(
+        SyntheticGenerator::ParseDistribution(parameters_.GetSyntheticDistribution()),
+        parameters_.GetBoxSize(), parameters_.GetSyntheticSeed());
+    IdType n_dm  = parameters_.GetNParticles(DM_TYPE_IDX);
+    IdType n_gas = parameters_.GetNParticles(GAS_TYPE_IDX);
+    generator.Fill(dark_matter, 0, n_dm);
+    generator.Fill(gas, n_dm, n_gas);
+    generator.Fill(stars, n_dm + n_gas, parameters_.GetNParticles(STAR_TYPE_IDX));
 }
 
-// Reads data for all particle types.
-// N.B. Removed for brevity: using dummy data, see above.
+// Reads data for all particle types, from the snapshot found by Parameters if there is one.  Cache
+// columns are bound to the mapped file in the same way as Gadget ones.
+// N.B. CART reader removed for brevity: otherwise using dummy data, see above.
 void Simulation::ReadData_() {
-    FillWithDummyData_();
+    switch (parameters_.GetSnapshotFormat()) {
+        case GADGET_SNAPSHOT:
+            ReadGadgetSnapshot_(parameters_.GetSnapshotPath());
+            break;
+        case CACHE_SNAPSHOT:
+            SnapshotCache(parameters_.GetSnapshotPath()).BindStores(dark_matter, gas, stars);
+            break;
+        default:
+            FillWithDummyData_();
+    }
     initialised_ = true;
 }
 
-// Overloads << to output simulation parameters and the sizes of the data vectors.
+// Binds each column of the three stores to the corresponding field of a (possibly multi-file)
+// Gadget snapshot.  No particle data are read here: fields stored in the file in the form the
+// stores use are used in place, and everything else is decoded in parallel when first accessed.
+void Simulation::ReadGadgetSnapshot_(std::string filepath) {
+    gadget_loader_ = GadgetLoader::Open(filepath, parameters_);
+    gadget_loader_->BindStores(dark_matter, gas, stars);
+}
+
+// Reports how much snapshot data has been decoded so far, and how quickly (nothing is reported for
+// dummy data).
+void Simulation::PrintLoadStatistics(std::ostream &out) const {
+    if (gadget_loader_)
+        gadget_loader_->PrintStatistics(out);
+}
+
+// Switches the three stores to (or from) minimum-image distances in the periodic simulation box
+void Simulation::SetPeriodic(bool periodic) {
+    LengthType box_size = periodic ? parameters_.GetBoxSize() : 0;
+    dark_matter.SetPeriodicBoxSize(box_size);
+    gas.SetPeriodicBoxSize(box_size);
+    stars.SetPeriodicBoxSize(box_size);
+}
+
+// Saves the parameters and all particle data as a snapshot cache, compressing the fields named in
+// [compressed_fields] (e.g. "abundance_Fe"; see the stores' ForEachColumn() for the names).
+void Simulation::WriteCache(std::string filepath,
+                            const std::set<std::string> &compressed_fields) const {
+    SnapshotCache::Write(filepath, parameters_, dark_matter, gas, stars, compressed_fields);
+}
+
+// Overloads << to output simulation parameters and the sizes of the data stores.
 std::ostream& operator<< (std::ostream &out, const Simulation &simulation) {
     if (simulation.initialised_) {
         std::cout << simulation.parameters_;
-        std::cout << " Particle vector sizes:" << std::endl;
+        std::cout << " Particle store sizes:" << std::endl;
         std::cout << "  DM    : " <<  simulation.dark_matter.size() << std::endl;
         std::cout << "  Gas   : " <<  simulation.gas.size() << std::endl;
         std::cout << "  Stars : " <<  simulation.stars.size() << std::endl;
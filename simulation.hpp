@@ -2,31 +2,49 @@
 #ifndef simulation_hpp
 #define simulation_hpp
 #include <iostream>
+#include <memory>
+#include <set>
+#include <string>
 #include <vector>
 
+#include "gadget_loader.hpp"
 #include "gas_particle.hpp"
 #include "parameters.hpp"
 #include "particle.hpp"
+#include "particle_store.hpp"
 #include "star_particle.hpp"
 
 // A composition class to bring together all simulation parameters and vector particle data.  It is
 // instantiated as Simulation(path-to-parameter-file), triggering an automatic attempt to read the
 // CART or Gadget format parameter file.  Using the filepaths therein, it locates the simulation
-// outputs and reads the particle data into dark matter, gas and stars vectors.
-// N.B. In this example, the three particle-type arrays are populated with random data according to
-// the values in Parameters::n_particles_[].
+// outputs and reads the particle data into dark matter, gas and stars stores (see
+// particle_store.hpp), which hold each particle property in a separate contiguous array.
+// If the filepath is a Gadget snapshot (or the first file of one), the store columns are bound to
+// the memory-mapped files and only decoded when first used (see GadgetLoader).  WriteCache() saves
+// the data in the project's own columnar format, which later runs can open instead of the original
+// snapshot, paging in only the fields they use (see SnapshotCache).  Otherwise, the
+// three particle-type stores are populated in parallel with reproducible synthetic data according
+// to the values in Parameters::n_particles_[] (see SyntheticGenerator).  SetPeriodic(true) makes
+// the stores measure distances to the nearest periodic image in the simulation box.
 class Simulation {
 public:
     Simulation(std::string filepath);
     ~Simulation() {};
+    const Parameters &GetParameters() const { return parameters_; }
+    void PrintLoadStatistics(std::ostream &out) const;
+    void SetPeriodic(bool periodic);
+    void WriteCache(std::string filepath,
+                    const std::set<std::string> &compressed_fields = std::set<std::string>()) const;
     friend std::ostream& operator<< (std::ostream &out, const Simulation &simulation);
-    ParticleVector dark_matter;
-    GasVector gas;
-    StarVector stars;
+    ParticleStore dark_matter;
+    GasStore gas;
+    StarStore stars;
 private:
     Simulation();
     void FillWithDummyData_();
     void ReadData_();
+    void ReadGadgetSnapshot_(std::string filepath);
+    std::shared_ptr<GadgetLoader> gadget_loader_;
     bool initialised_ = false;
     Parameters parameters_;
 };
@@ -0,0 +1,319 @@
+// Implementation of the SnapshotCache class
+
+#include "snapshot_cache.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "column.hpp"
+#include "globals.hpp"
+#include "lz_codec.hpp"
+#include "mapped_file.hpp"
+#include "parameters.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+const char kCacheMagic[8]        = {'P', 'S', 'I', 'M', 'C', 'A', 'C', 'H'};
+const uint32_t kCacheVersion     = 2;
+const uint32_t kByteOrderMark    = 0x01020304;
+// Blocks start on page boundaries, so a field's pages never contain data of another field
+const size_t kCacheAlignment     = 4096;
+// Compressed blocks are split into chunks of this many elements, which are (de)compressed in
+// parallel
+const size_t kCacheChunkElements = 65536;
+
+static_assert(sizeof(SnapshotCacheHeader) <= kCacheAlignment,
+              "SnapshotCacheHeader must fit before the first block");
+
+// Maps the file and reads its header and block index.  No particle data are read.
+SnapshotCache::SnapshotCache(std::string filepath) : file_(MappedFile::Open(filepath)) {
+    if (file_->GetSize() < kCacheAlignment)
+        throw std::runtime_error("SnapshotCache: " + filepath + " is too small to be a cache");
+    std::memcpy(&header_, file_->GetData(), sizeof(header_));
+    if (std::memcmp(header_.magic, kCacheMagic, sizeof(kCacheMagic)) != 0)
+        throw std::runtime_error("SnapshotCache: " + filepath + " is not a snapshot cache");
+    if (header_.version != kCacheVersion)
+        throw std::runtime_error("SnapshotCache: " + filepath + " has unsupported version " +
+                                 std::to_string(header_.version));
+    if (header_.byte_order_mark != kByteOrderMark)
+        throw std::runtime_error("SnapshotCache: " + filepath + " was written on a machine with " +
+                                 "a different byte order");
+    ReadIndex_();
+}
+
+// Checks the magic number at the start of the file
+bool SnapshotCache::IsSnapshotCache(std::string filepath) {
+    std::ifstream file(filepath, std::ios::binary);
+    char magic[sizeof(kCacheMagic)];
+    return file.read(magic, sizeof(magic)) &&
+           std::memcmp(magic, kCacheMagic, sizeof(kCacheMagic)) == 0;
+}
+
+// Reads the block index from the end of the file and checks that every block lies within it
+void SnapshotCache::ReadIndex_() {
+    size_t index_size = header_.num_blocks * sizeof(SnapshotCacheBlock);
+    if (header_.index_offset + index_size > file_->GetSize())
+        throw std::runtime_error("SnapshotCache: Block index of " + file_->GetFilepath() +
+                                 " is truncated");
+    blocks_.resize(header_.num_blocks);
+    std::memcpy(blocks_.data(), file_->GetData() + header_.index_offset, index_size);
+    for (const SnapshotCacheBlock &block : blocks_) {
+        if (block.offset + block.stored_size > header_.index_offset ||
+            block.field[sizeof(block.field) - 1] != '\0')
+            throw std::runtime_error("SnapshotCache: Corrupt block index in " +
+                                     file_->GetFilepath());
+    }
+}
+
+const SnapshotCacheHeader &SnapshotCache::GetHeader() const {
+    return header_;
+}
+
+bool SnapshotCache::HasField(ParticleTypeIndex type, std::string field) const {
+    for (const SnapshotCacheBlock &block : blocks_)
+        if (block.type_idx == type && field == block.field)
+            return true;
+    return false;
+}
+
+const SnapshotCacheBlock &SnapshotCache::FindBlock_(ParticleTypeIndex type,
+                                                    const std::string &field) const {
+    for (const SnapshotCacheBlock &block : blocks_)
+        if (block.type_idx == type && field == block.field)
+            return block;
+    throw std::runtime_error("SnapshotCache: No '" + field + "' block for particle type " +
+                             std::to_string(type) + " in " + file_->GetFilepath());
+}
+
+// Binds every column of the three stores to its block
+void SnapshotCache::BindStores(ParticleStore &dark_matter, GasStore &gas, StarStore &stars) const {
+    BindStore_(DM_TYPE_IDX, dark_matter, 0, header_.n_particles[DM_TYPE_IDX]);
+    BindStore_(GAS_TYPE_IDX, gas, 0, header_.n_particles[GAS_TYPE_IDX]);
+    BindStore_(STAR_TYPE_IDX, stars, 0, header_.n_particles[STAR_TYPE_IDX]);
+}
+
+void SnapshotCache::BindRange(ParticleStore &dark_matter, size_t first, size_t n) const {
+    BindStore_(DM_TYPE_IDX, dark_matter, first, n);
+}
+
+void SnapshotCache::BindRange(GasStore &gas, size_t first, size_t n) const {
+    BindStore_(GAS_TYPE_IDX, gas, first, n);
+}
+
+void SnapshotCache::BindRange(StarStore &stars, size_t first, size_t n) const {
+    BindStore_(STAR_TYPE_IDX, stars, first, n);
+}
+
+template <typename StoreType>
+void SnapshotCache::BindStore_(ParticleTypeIndex type, StoreType &particles, size_t first,
+                               size_t n) const {
+    particles.ForEachColumn([this, type, first, n](const std::string &field, auto &column) {
+        BindColumn_(type, field, column, first, n);
+    });
+}
+
+// Uncompressed blocks are used in place; compressed blocks get a loader that decompresses the
+// chunks holding the range.  Either way, the column keeps the mapping alive.
+template <typename Type>
+void SnapshotCache::BindColumn_(ParticleTypeIndex type, const std::string &field,
+                                Column<Type> &column, size_t first, size_t n) const {
+    const SnapshotCacheBlock &block = FindBlock_(type, field);
+    if (block.element_size != sizeof(Type))
+        throw std::runtime_error("SnapshotCache: '" + field + "' values in " +
+                                 file_->GetFilepath() + " have a different size to this build's " +
+                                 "(the cache must be rewritten)");
+    if (first + n > block.num_elements)
+        throw std::invalid_argument("SnapshotCache: Particle range is beyond the end of the '" +
+                                    field + "' block");
+    if (block.codec == CACHE_UNCOMPRESSED) {
+        column.SetView(reinterpret_cast<const Type *>(file_->GetData() + block.offset) + first, n,
+                       file_);
+    } else {
+        std::shared_ptr<const MappedFile> file = file_;
+        SnapshotCacheBlock block_copy = block;
+        column.SetLoader(n, [file, block_copy, first, n](std::vector<Type> &values) {
+            values.resize(n);
+            DecompressBlock_(*file, block_copy, first, n,
+                             reinterpret_cast<char *>(values.data()));
+        });
+    }
+}
+
+// A compressed block starts with its number of chunks and the end offset of each chunk's
+// compressed data (relative to the end of this table), followed by the chunks themselves.  Only
+// the chunks holding elements [first, first + n) are decompressed, and those elements written to
+// [values].
+void SnapshotCache::DecompressBlock_(const MappedFile &file, const SnapshotCacheBlock &block,
+                                     size_t first, size_t n, char *values) {
+    const char *block_data = file.GetData() + block.offset;
+    uint64_t num_chunks;
+    std::memcpy(&num_chunks, block_data, sizeof(num_chunks));
+    size_t table_size = sizeof(num_chunks) + num_chunks * sizeof(uint64_t);
+    if (num_chunks != (block.num_elements + kCacheChunkElements - 1) / kCacheChunkElements ||
+        table_size > block.stored_size)
+        throw std::runtime_error("SnapshotCache: Corrupt block '" + std::string(block.field) +
+                                 "' in " + file.GetFilepath());
+    std::vector<uint64_t> chunk_ends(num_chunks);
+    std::memcpy(chunk_ends.data(), block_data + sizeof(num_chunks), num_chunks * sizeof(uint64_t));
+    const char *chunk_data = block_data + table_size;
+
+    if (n == 0)
+        return;
+    size_t first_chunk = first / kCacheChunkElements;
+    size_t last_chunk  = (first + n - 1) / kCacheChunkElements;
+    size_t num_range_chunks = last_chunk + 1 - first_chunk;
+    ThreadPool::GetShared().ParallelFor(num_range_chunks, [&](size_t itask, int) {
+        size_t ichunk        = first_chunk + itask;
+        size_t first_element = ichunk * kCacheChunkElements;
+        size_t num_elements  = std::min<size_t>(kCacheChunkElements,
+                                                block.num_elements - first_element);
+        size_t start         = ichunk == 0 ? 0 : chunk_ends[ichunk - 1];
+        if (chunk_ends[ichunk] < start || table_size + chunk_ends[ichunk] > block.stored_size)
+            throw std::runtime_error("SnapshotCache: Corrupt block '" + std::string(block.field) +
+                                     "' in " + file.GetFilepath());
+        std::vector<char> shuffled(num_elements * block.element_size);
+        LZDecompress(chunk_data + start, chunk_ends[ichunk] - start, shuffled.data(),
+                     shuffled.size());
+        // Chunks wholly inside the range are unshuffled straight into place, the others via a
+        // buffer from which only the part in the range is copied
+        size_t copy_first = std::max(first, first_element);
+        size_t copy_last  = std::min(first + n, first_element + num_elements);
+        char *destination = values + (copy_first - first) * block.element_size;
+        if (copy_first == first_element && copy_last == first_element + num_elements) {
+            UnshuffleBytes(shuffled.data(), num_elements, block.element_size, destination);
+        } else {
+            std::vector<char> unshuffled(shuffled.size());
+            UnshuffleBytes(shuffled.data(), num_elements, block.element_size, unshuffled.data());
+            std::memcpy(destination,
+                        unshuffled.data() + (copy_first - first_element) * block.element_size,
+                        (copy_last - copy_first) * block.element_size);
+        }
+    });
+}
+
+// Writes all three stores to a new cache file.  Lazy columns are loaded in the process.  Fields
+// named in [compressed_fields] (e.g. "temperature", "abundance_Fe") are compressed, unless that
+// doesn't make them smaller.  The file is written under a temporary name and then renamed, since
+// the stores may be views of an existing cache at [filepath].
+void SnapshotCache::Write(std::string filepath, const Parameters &parameters,
+                          const ParticleStore &dark_matter, const GasStore &gas,
+                          const StarStore &stars, const std::set<std::string> &compressed_fields) {
+    std::string temporary_filepath = filepath + ".tmp";
+    std::ofstream out(temporary_filepath, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("SnapshotCache: Can't open " + temporary_filepath +
+                                 " for writing");
+
+    SnapshotCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.version          = kCacheVersion;
+    header.byte_order_mark  = kByteOrderMark;
+    header.box_size         = parameters.box_size_;
+    header.length_unit      = parameters.length_unit_;
+    header.mass_unit        = parameters.mass_unit_;
+    header.omega_0          = parameters.cosmology_.omega_0;
+    header.omega_baryon     = parameters.cosmology_.omega_baryon;
+    header.omega_lambda     = parameters.cosmology_.omega_lambda;
+    header.hubble_parameter = parameters.cosmology_.hubble_parameter;
+    header.output_redshift  = parameters.output_redshift_;
+    header.output_time      = parameters.output_time_;
+    header.comoving         = parameters.comoving_;
+    for (int itype = 0; itype < NUM_PARTICLE_TYPES; ++itype)
+        header.n_particles[itype] = parameters.n_particles_[itype];
+    header.n_particles[DM_TYPE_IDX]   = dark_matter.size();
+    header.n_particles[GAS_TYPE_IDX]  = gas.size();
+    header.n_particles[STAR_TYPE_IDX] = stars.size();
+    std::strncpy(header.label, parameters.label_.c_str(), sizeof(header.label) - 1);
+
+    // The header is rewritten once the index offset is known
+    std::vector<char> header_region(kCacheAlignment, 0);
+    out.write(header_region.data(), header_region.size());
+    std::vector<SnapshotCacheBlock> blocks;
+    WriteStore_(out, DM_TYPE_IDX, dark_matter, compressed_fields, blocks);
+    WriteStore_(out, GAS_TYPE_IDX, gas, compressed_fields, blocks);
+    WriteStore_(out, STAR_TYPE_IDX, stars, compressed_fields, blocks);
+
+    header.index_offset = out.tellp();
+    header.num_blocks   = blocks.size();
+    out.write(reinterpret_cast<const char *>(blocks.data()),
+              blocks.size() * sizeof(SnapshotCacheBlock));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.close();
+    if (!out || std::rename(temporary_filepath.c_str(), filepath.c_str()) != 0)
+        throw std::runtime_error("SnapshotCache: Error writing " + filepath);
+}
+
+template <typename StoreType>
+void SnapshotCache::WriteStore_(std::ofstream &out, ParticleTypeIndex type,
+                                const StoreType &particles,
+                                const std::set<std::string> &compressed_fields,
+                                std::vector<SnapshotCacheBlock> &blocks) {
+    particles.ForEachColumn([&](const std::string &field, const auto &column) {
+        WriteBlock_(out, type, field, reinterpret_cast<const char *>(column.data()),
+                    column.size(), sizeof(*column.data()), compressed_fields.count(field) > 0,
+                    blocks);
+    });
+}
+
+// Pads the file to the next page boundary, writes one block and adds it to the index
+void SnapshotCache::WriteBlock_(std::ofstream &out, ParticleTypeIndex type,
+                                const std::string &field, const char *values, size_t num_elements,
+                                size_t element_size, bool compress,
+                                std::vector<SnapshotCacheBlock> &blocks) {
+    SnapshotCacheBlock block;
+    std::memset(&block, 0, sizeof(block));
+    if (field.size() >= sizeof(block.field))
+        throw std::runtime_error("SnapshotCache: Field name '" + field + "' is too long");
+    std::strncpy(block.field, field.c_str(), sizeof(block.field) - 1);
+    block.type_idx     = type;
+    block.element_size = element_size;
+    block.num_elements = num_elements;
+    block.codec        = CACHE_UNCOMPRESSED;
+    block.stored_size  = num_elements * element_size;
+
+    size_t position = out.tellp();
+    size_t padding  = (kCacheAlignment - position % kCacheAlignment) % kCacheAlignment;
+    std::vector<char> zeros(padding, 0);
+    out.write(zeros.data(), zeros.size());
+    block.offset = position + padding;
+
+    std::vector<std::vector<char>> chunks;
+    if (compress && num_elements > 0) {
+        chunks.resize((num_elements + kCacheChunkElements - 1) / kCacheChunkElements);
+        ThreadPool::GetShared().ParallelFor(chunks.size(), [&](size_t ichunk, int) {
+            size_t first_element = ichunk * kCacheChunkElements;
+            size_t chunk_size    = std::min(kCacheChunkElements, num_elements - first_element);
+            std::vector<char> shuffled(chunk_size * element_size);
+            ShuffleBytes(values + first_element * element_size, chunk_size, element_size,
+                         shuffled.data());
+            chunks[ichunk] = LZCompress(shuffled.data(), shuffled.size());
+        });
+        uint64_t num_chunks = chunks.size();
+        std::vector<uint64_t> chunk_ends;
+        for (const std::vector<char> &chunk : chunks)
+            chunk_ends.push_back((chunk_ends.empty() ? 0 : chunk_ends.back()) + chunk.size());
+        size_t compressed_size = sizeof(num_chunks) + num_chunks * sizeof(uint64_t) +
+                                 chunk_ends.back();
+        if (compressed_size < block.stored_size) {
+            block.codec       = CACHE_SHUFFLE_LZ;
+            block.stored_size = compressed_size;
+            out.write(reinterpret_cast<const char *>(&num_chunks), sizeof(num_chunks));
+            out.write(reinterpret_cast<const char *>(chunk_ends.data()),
+                      num_chunks * sizeof(uint64_t));
+            for (const std::vector<char> &chunk : chunks)
+                out.write(chunk.data(), chunk.size());
+        }
+    }
+    if (block.codec == CACHE_UNCOMPRESSED)
+        out.write(values, block.stored_size);
+    blocks.push_back(block);
+}
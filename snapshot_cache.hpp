@@ -0,0 +1,107 @@
+// Interface for the SnapshotCache class and the structures of the snapshot cache file format
+
+#ifndef snapshot_cache_hpp
+#define snapshot_cache_hpp
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "column.hpp"
+#include "globals.hpp"
+#include "mapped_file.hpp"
+#include "parameters.hpp"
+#include "particle_store.hpp"
+
+// Ways a block's data can be stored
+enum SnapshotCacheCodec {
+    CACHE_UNCOMPRESSED,
+    CACHE_SHUFFLE_LZ // byte-shuffled, then LZ compressed in independent chunks (see lz_codec.hpp)
+};
+
+// Fixed-size header at the start of the file, holding the simulation parameters and the location of
+// the block index
+struct SnapshotCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    double box_size;
+    double length_unit;
+    double mass_unit;
+    double omega_0;
+    double omega_baryon;
+    double omega_lambda;
+    double hubble_parameter;
+    double output_redshift;
+    double output_time;
+    int64_t n_particles[NUM_PARTICLE_TYPES];
+    int32_t comoving;
+    char label[128];
+};
+
+// Index entry describing the block holding one field of one particle type
+struct SnapshotCacheBlock {
+    char field[32];
+    int32_t type_idx;
+    uint32_t element_size;
+    uint32_t codec;
+    uint64_t num_elements;
+    uint64_t offset;
+    uint64_t stored_size;
+};
+
+// Reads and writes the project's own columnar snapshot files, which hold the particle data of a
+// simulation in exactly the form the particle stores use, so analysis runs can skip reading and
+// converting the original snapshot.  A file has a fixed-size header, then one block per (particle
+// type, field), each starting on a page boundary, then an index of the blocks' names and offsets.
+// Opening a cache maps the file and reads only the header and index.  Uncompressed blocks become
+// zero-copy views of the mapping, so the pages of a field are only read from disk if it is used.
+// Compressed blocks are decompressed in parallel, chunk by chunk, on first access.  Compression is
+// chosen per field when writing.  Data are stored in native byte order.  A store can be bound to a
+// range of the particles of its type, so that a file too large for memory can be read a chunk at
+// a time; only the compressed chunks overlapping the range are then decompressed.
+// Usage: SnapshotCache::Write(filepath, parameters, dark_matter, gas, stars, compressed_fields)
+//        SnapshotCache(filepath).BindStores(dark_matter, gas, stars)
+class SnapshotCache {
+public:
+    SnapshotCache(std::string filepath);
+    static bool IsSnapshotCache(std::string filepath);
+    static void Write(std::string filepath, const Parameters &parameters,
+                      const ParticleStore &dark_matter, const GasStore &gas,
+                      const StarStore &stars, const std::set<std::string> &compressed_fields);
+    void BindStores(ParticleStore &dark_matter, GasStore &gas, StarStore &stars) const;
+    // Binds the columns of a store to particles [first, first + n) of its type
+    void BindRange(ParticleStore &dark_matter, size_t first, size_t n) const;
+    void BindRange(GasStore &gas, size_t first, size_t n) const;
+    void BindRange(StarStore &stars, size_t first, size_t n) const;
+    const SnapshotCacheHeader &GetHeader() const;
+    bool HasField(ParticleTypeIndex type, std::string field) const;
+private:
+    SnapshotCache();
+    template <typename Type>
+    void BindColumn_(ParticleTypeIndex type, const std::string &field, Column<Type> &column,
+                     size_t first, size_t n) const;
+    template <typename StoreType>
+    void BindStore_(ParticleTypeIndex type, StoreType &particles, size_t first, size_t n) const;
+    static void DecompressBlock_(const MappedFile &file, const SnapshotCacheBlock &block,
+                                 size_t first, size_t n, char *values);
+    const SnapshotCacheBlock &FindBlock_(ParticleTypeIndex type, const std::string &field) const;
+    void ReadIndex_();
+    static void WriteBlock_(std::ofstream &out, ParticleTypeIndex type, const std::string &field,
+                            const char *values, size_t num_elements, size_t element_size,
+                            bool compress, std::vector<SnapshotCacheBlock> &blocks);
+    template <typename StoreType>
+    static void WriteStore_(std::ofstream &out, ParticleTypeIndex type, const StoreType &particles,
+                            const std::set<std::string> &compressed_fields,
+                            std::vector<SnapshotCacheBlock> &blocks);
+    std::vector<SnapshotCacheBlock> blocks_;
+    std::shared_ptr<const MappedFile> file_;
+    SnapshotCacheHeader header_;
+};
+
+#endif // snapshot_cache_hpp
@@ -0,0 +1,91 @@
+// Implementation of the SnapshotStream class
+
+#include "snapshot_stream.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "gadget_loader.hpp"
+#include "globals.hpp"
+#include "parameters.hpp"
+#include "particle_store.hpp"
+#include "snapshot_cache.hpp"
+#include "synthetic_generator.hpp"
+
+// Reads the parameters and opens the snapshot found by them, as Simulation does, but binds no
+// stores.  Throws if not even one particle of some type fits in [memory_budget].
+SnapshotStream::SnapshotStream(std::string filepath, size_t memory_budget) :
+memory_budget_(memory_budget), parameters_(filepath) {
+    if (!parameters_.IsInitialised())
+        throw std::runtime_error("Error reading parameter file at " + filepath);
+    chunk_sizes_.fill(0);
+    chunk_sizes_[DM_TYPE_IDX]   = memory_budget / GetBytesPerParticle_<ParticleStore>();
+    chunk_sizes_[GAS_TYPE_IDX]  = memory_budget / GetBytesPerParticle_<GasStore>();
+    chunk_sizes_[STAR_TYPE_IDX] = memory_budget / GetBytesPerParticle_<StarStore>();
+    if (chunk_sizes_[DM_TYPE_IDX] == 0 || chunk_sizes_[GAS_TYPE_IDX] == 0 ||
+        chunk_sizes_[STAR_TYPE_IDX] == 0)
+        throw std::invalid_argument("SnapshotStream: Memory budget is too small for one particle");
+
+    switch (parameters_.GetSnapshotFormat()) {
+        case GADGET_SNAPSHOT:
+            gadget_loader_ = GadgetLoader::Open(parameters_.GetSnapshotPath(), parameters_);
+            break;
+        case CACHE_SNAPSHOT:
+            cache_ = std::make_shared<SnapshotCache>(parameters_.GetSnapshotPath());
+            break;
+        default:
+            generator_ = std::make_shared<SyntheticGenerator>(
+                SyntheticGenerator::ParseDistribution(parameters_.GetSyntheticDistribution()),
+                parameters_.GetBoxSize(), parameters_.GetSyntheticSeed());
+    }
+}
+
+size_t SnapshotStream::GetChunkSize(ParticleTypeIndex type) const {
+    return chunk_sizes_.at(type);
+}
+
+// Reports how much snapshot data has been decoded so far, and how quickly (nothing is reported for
+// other snapshots).
+void SnapshotStream::PrintLoadStatistics(std::ostream &out) const {
+    if (gadget_loader_)
+        gadget_loader_->PrintStatistics(out);
+}
+
+void SnapshotStream::SetPeriodic(bool periodic) {
+    periodic_box_size_ = periodic ? parameters_.GetBoxSize() : 0;
+}
+
+// Binds [dark_matter] to particles [first, first + n) of the snapshot, or fills it with those of
+// the synthetic data.  Particle IDs of synthetic data run on from one type to the next, as in
+// Simulation.
+void SnapshotStream::ReadChunk_(ParticleStore &dark_matter, size_t first, size_t n) const {
+    if (gadget_loader_)
+        gadget_loader_->BindRange(dark_matter, first, n);
+    else if (cache_)
+        cache_->BindRange(dark_matter, first, n);
+    else
+        generator_->Fill(dark_matter, 0, n, first);
+}
+
+void SnapshotStream::ReadChunk_(GasStore &gas, size_t first, size_t n) const {
+    if (gadget_loader_)
+        gadget_loader_->BindRange(gas, first, n);
+    else if (cache_)
+        cache_->BindRange(gas, first, n);
+    else
+        generator_->Fill(gas, parameters_.GetNParticles(DM_TYPE_IDX), n, first);
+}
+
+void SnapshotStream::ReadChunk_(StarStore &stars, size_t first, size_t n) const {
+    if (gadget_loader_)
+        gadget_loader_->BindRange(stars, first, n);
+    else if (cache_)
+        cache_->BindRange(stars, first, n);
+    else
+        generator_->Fill(stars, parameters_.GetNParticles(DM_TYPE_IDX) +
+                         parameters_.GetNParticles(GAS_TYPE_IDX), n, first);
+}
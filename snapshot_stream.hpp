@@ -0,0 +1,93 @@
+// Interface for the SnapshotStream class, which reads the particles of a simulation a chunk at a
+// time
+
+#ifndef snapshot_stream_hpp
+#define snapshot_stream_hpp
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "gadget_loader.hpp"
+#include "globals.hpp"
+#include "parameters.hpp"
+#include "particle_store.hpp"
+#include "snapshot_cache.hpp"
+#include "synthetic_generator.hpp"
+
+// Default memory budget for the particle data of one chunk, in bytes
+const size_t kDefaultStreamMemoryBudget = size_t(1) << 30;
+
+// Reads the same snapshots as Simulation (a Gadget snapshot, a snapshot cache or synthetic data,
+// from the same path), but for snapshots too large for memory: the particles of a type are never
+// held all at once.  ForEachXxxChunk() instead binds a store to each consecutive range of the
+// particles of its type in turn, and calls function(chunk, first) with it, where [first] is the
+// index of the chunk's first particle in the snapshot.  Each chunk is released before the next is
+// read.  Chunks hold as many particles as fit in the memory budget with every column of the store
+// loaded, so peak memory is set by the budget (plus what the analyses keep), not by the size of the
+// snapshot, and as with Simulation only the columns a chunk's analyses use are read.  The analyses
+// are accumulated over the chunks: profiles with RadialProfile::Add(), dynamics with
+// AccumulateDynamics() and DynamicsAccumulator::Add() (then SummariseDynamics()), histograms with
+// Histogram::FillAll(), and filters with FilterParticles() on each chunk, whose selections are
+// used by the other analyses of the chunk.  Chunks are read in order, so the results are
+// reproducible, and they differ from those of an in-memory run only by rounding.
+// Usage: SnapshotStream stream(filepath, memory_budget);
+//        stream.ForEachGasChunk([&](const GasStore &gas, size_t first) { ... })
+class SnapshotStream {
+public:
+    SnapshotStream(std::string filepath, size_t memory_budget = kDefaultStreamMemoryBudget);
+    // Returns the number of particles of [type] in each chunk (bar the last)
+    size_t GetChunkSize(ParticleTypeIndex type) const;
+    size_t GetMemoryBudget() const { return memory_budget_; }
+    const Parameters &GetParameters() const { return parameters_; }
+    void PrintLoadStatistics(std::ostream &out) const;
+    // Makes the chunks measure distances to the nearest periodic image in the simulation box
+    void SetPeriodic(bool periodic);
+    template <typename FunctionType>
+    void ForEachDarkMatterChunk(FunctionType function) const {
+        ForEachChunk_<ParticleStore>(DM_TYPE_IDX, function);
+    }
+    template <typename FunctionType>
+    void ForEachGasChunk(FunctionType function) const {
+        ForEachChunk_<GasStore>(GAS_TYPE_IDX, function);
+    }
+    template <typename FunctionType>
+    void ForEachStarChunk(FunctionType function) const {
+        ForEachChunk_<StarStore>(STAR_TYPE_IDX, function);
+    }
+private:
+    SnapshotStream();
+    template <typename StoreType>
+    static size_t GetBytesPerParticle_() {
+        size_t num_bytes = 0;
+        StoreType().ForEachColumn([&num_bytes](const std::string &, const auto &column) {
+            num_bytes += sizeof(*column.data());
+        });
+        return num_bytes;
+    }
+    template <typename StoreType, typename FunctionType>
+    void ForEachChunk_(ParticleTypeIndex type, FunctionType &function) const {
+        size_t num_particles = parameters_.GetNParticles(type);
+        size_t chunk_size    = GetChunkSize(type);
+        for (size_t first = 0; first < num_particles; first += chunk_size) {
+            StoreType chunk;
+            ReadChunk_(chunk, first, std::min(chunk_size, num_particles - first));
+            chunk.SetPeriodicBoxSize(periodic_box_size_);
+            function(static_cast<const StoreType &>(chunk), first);
+        }
+    }
+    void ReadChunk_(ParticleStore &dark_matter, size_t first, size_t n) const;
+    void ReadChunk_(GasStore &gas, size_t first, size_t n) const;
+    void ReadChunk_(StarStore &stars, size_t first, size_t n) const;
+    std::array<size_t,NUM_PARTICLE_TYPES> chunk_sizes_;
+    std::shared_ptr<SnapshotCache> cache_;
+    std::shared_ptr<GadgetLoader> gadget_loader_;
+    std::shared_ptr<SyntheticGenerator> generator_;
+    size_t memory_budget_;
+    Parameters parameters_;
+    LengthType periodic_box_size_ = 0;
+};
+
+#endif // snapshot_stream_hpp
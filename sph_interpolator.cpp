@@ -0,0 +1,274 @@
+// Implementation of the SphInterpolator class
+
+#include "sph_interpolator.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "column.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "sph_kernel.hpp"
+#include "thread_pool.hpp"
+
+// Number of particles (or points) handled by each task
+const size_t kSphBlockSize = 1024;
+
+// Number of leaves whose particles are handled by each task
+const size_t kSphLeavesPerTask = 32;
+
+// Returns h^kNDims, the volume by which the kernel is divided
+static double GetKernelVolume(LengthType smoothing_length) {
+    double volume = smoothing_length * smoothing_length;
+    return (kNDims == 3) ? volume * smoothing_length : volume;
+}
+
+// Returns sum_j weights_j W(r_j, h) over a list of particles, where r_j is the distance of particle
+// j from [position].  As in RadialProfile, squared distances are accumulated a dimension at a time
+// (into [distances_squared]), so those loops vectorise, and the periodic wrapping is compiled in
+// separately so that they have no data-dependent branches otherwise.
+template <bool kPeriodic>
+static double SumKernel(const std::array<const LengthType *,kNDims> &positions,
+                        const double *weights, size_t num_particles,
+                        const PosCoordsType &position, LengthType smoothing_length,
+                        LengthType box_size, SphKernelType kernel,
+                        std::vector<LengthType> &distances_squared) {
+    distances_squared.assign(num_particles, 0);
+    LengthType *p_distances_squared = distances_squared.data();
+    for (int idim = 0; idim < kNDims; ++idim) {
+        const LengthType *p_positions = positions[idim];
+        LengthType centre             = position[idim];
+        for (size_t ipart = 0; ipart < num_particles; ++ipart) {
+            LengthType displacement = p_positions[ipart] - centre;
+            if (kPeriodic)
+                displacement = GetPeriodicDisplacement(displacement, box_size);
+            p_distances_squared[ipart] += displacement * displacement;
+        }
+    }
+    LengthType radius_squared = smoothing_length * smoothing_length;
+    double sum = 0;
+    for (size_t ipart = 0; ipart < num_particles; ++ipart) {
+        if (p_distances_squared[ipart] < radius_squared) {
+            double q = std::sqrt(p_distances_squared[ipart]) / smoothing_length;
+            sum += weights[ipart] * EvaluateSphKernel(kernel, q);
+        }
+    }
+    return sum;
+}
+
+SphInterpolator::SphInterpolator(const GasStore &gas, const KdTree &tree, SphKernelType kernel,
+                                 ThreadPool &pool) :
+kernel_(kernel), tree_(tree) {
+    if (tree.size() != gas.size())
+        throw std::invalid_argument("SphInterpolator: Tree was built from another store");
+    size_t num_particles = gas.size();
+    size_t num_blocks    = (num_particles + kSphBlockSize - 1) / kSphBlockSize;
+    masses_.resize(num_particles);
+    smoothing_lengths_.resize(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kSphBlockSize, num_particles);
+        for (size_t ipart = iblock * kSphBlockSize; ipart < last; ++ipart) {
+            masses_[ipart]            = gas.mass[tree.order_[ipart]];
+            smoothing_lengths_[ipart] = gas.smoothing_length[tree.order_[ipart]];
+        }
+    });
+
+    // Children always come after their parent in the array of nodes
+    const std::vector<KdTree::NodeType> &nodes = tree.nodes_;
+    node_smoothing_lengths_.assign(nodes.size(), 0);
+    for (size_t inode = nodes.size(); inode-- > 0;) {
+        const KdTree::NodeType &node = nodes[inode];
+        LengthType &smoothing_length = node_smoothing_lengths_[inode];
+        if (node.child != 0) {
+            smoothing_length = std::max(node_smoothing_lengths_[node.child],
+                                        node_smoothing_lengths_[node.child + 1]);
+            continue;
+        }
+        for (size_t ipart = node.first; ipart < node.first + node.count; ++ipart)
+            smoothing_length = std::max(smoothing_length, smoothing_lengths_[ipart]);
+    }
+
+    densities_ = GatherAtParticles_(masses_, pool);
+    volumes_.resize(num_particles);
+    for (size_t ipart = 0; ipart < num_particles; ++ipart)
+        volumes_[ipart] = densities_[ipart] > 0 ? masses_[ipart] / densities_[ipart] : 0;
+}
+
+// Returns the density at each particle, indexed like the store
+std::vector<double> SphInterpolator::GetDensities() const {
+    return ToStoreOrder_(densities_, ThreadPool::GetShared());
+}
+
+// Returns the density at each of [points]
+std::vector<double> SphInterpolator::GetDensitiesAt(const std::vector<PosCoordsType> &points,
+                                                    ThreadPool &pool) const {
+    return ScatterAtPoints_(masses_, points, pool);
+}
+
+// Returns the kernel-smoothed value of a column of the store (e.g. temperature) at each particle,
+// indexed like the store
+std::vector<double> SphInterpolator::SmoothField(const Column<float> &field,
+                                                 ThreadPool &pool) const {
+    return ToStoreOrder_(GatherAtParticles_(GetFieldWeights_(field, pool), pool), pool);
+}
+
+// Returns the kernel-smoothed value of a column of the store at each of [points]
+std::vector<double> SphInterpolator::SmoothFieldAt(const Column<float> &field,
+                                                   const std::vector<PosCoordsType> &points,
+                                                   ThreadPool &pool) const {
+    return ScatterAtPoints_(GetFieldWeights_(field, pool), points, pool);
+}
+
+// Returns sum_j weights_j W(r_ij, h_i) for each particle i, in tree order, where [weights] are in
+// tree order.  Rather than walking the tree for each particle, it's walked once for each leaf, to
+// gather the particles within the leaf's largest smoothing length of its bounding box, and then
+// each particle of the leaf sums the kernel over that list in one loop.
+std::vector<double> SphInterpolator::GatherAtParticles_(const std::vector<double> &weights,
+                                                        ThreadPool &pool) const {
+    const std::vector<KdTree::NodeType> &nodes = tree_.nodes_;
+    LengthType box_size  = tree_.periodic_box_size_;
+    SphKernelType kernel = kernel_;
+    std::vector<size_t> leaves;
+    for (size_t inode = 0; inode < nodes.size(); ++inode)
+        if (nodes[inode].child == 0)
+            leaves.push_back(inode);
+    size_t num_tasks = (leaves.size() + kSphLeavesPerTask - 1) / kSphLeavesPerTask;
+    std::vector<double> sums(tree_.size(), 0);
+    pool.ParallelFor(num_tasks, [&](size_t itask, int) {
+        std::vector<size_t> stack;
+        std::array<std::vector<LengthType>,kNDims> neighbour_positions;
+        std::vector<double> neighbour_weights;
+        std::vector<LengthType> distances_squared;
+        size_t last = std::min((itask + 1) * kSphLeavesPerTask, leaves.size());
+        for (size_t ileaf = itask * kSphLeavesPerTask; ileaf < last; ++ileaf) {
+            const KdTree::NodeType &leaf = nodes[leaves[ileaf]];
+            LengthType leaf_smoothing_length = node_smoothing_lengths_[leaves[ileaf]];
+            for (int idim = 0; idim < kNDims; ++idim)
+                neighbour_positions[idim].clear();
+            neighbour_weights.clear();
+            stack.assign(1, 0);
+            while (!stack.empty()) {
+                const KdTree::NodeType &node = nodes[stack.back()];
+                stack.pop_back();
+                if (tree_.GetMinDistanceSquared_(node, leaf) >=
+                    leaf_smoothing_length * leaf_smoothing_length)
+                    continue;
+                if (node.child != 0) {
+                    stack.push_back(node.child + 1);
+                    stack.push_back(node.child);
+                    continue;
+                }
+                for (size_t jpart = node.first; jpart < node.first + node.count; ++jpart) {
+                    for (int idim = 0; idim < kNDims; ++idim)
+                        neighbour_positions[idim].push_back(tree_.positions_[idim][jpart]);
+                    neighbour_weights.push_back(weights[jpart]);
+                }
+            }
+
+            size_t num_neighbours   = neighbour_weights.size();
+            const double *p_weights = neighbour_weights.data();
+            std::array<const LengthType *,kNDims> p_positions;
+            for (int idim = 0; idim < kNDims; ++idim)
+                p_positions[idim] = neighbour_positions[idim].data();
+            for (size_t ipart = leaf.first; ipart < leaf.first + leaf.count; ++ipart) {
+                LengthType smoothing_length = smoothing_lengths_[ipart];
+                if (!(smoothing_length > 0))
+                    continue;
+                PosCoordsType position;
+                for (int idim = 0; idim < kNDims; ++idim)
+                    position[idim] = tree_.positions_[idim][ipart];
+                double sum = (box_size > 0) ?
+                    SumKernel<true>(p_positions, p_weights, num_neighbours, position,
+                                    smoothing_length, box_size, kernel, distances_squared) :
+                    SumKernel<false>(p_positions, p_weights, num_neighbours, position,
+                                     smoothing_length, box_size, kernel, distances_squared);
+                sums[ipart] = sum / GetKernelVolume(smoothing_length);
+            }
+        }
+    });
+    return sums;
+}
+
+// Returns the weights that smooth a column of the store, mass / density * value, in tree order
+std::vector<double> SphInterpolator::GetFieldWeights_(const Column<float> &field,
+                                                      ThreadPool &pool) const {
+    if (field.size() != tree_.size())
+        throw std::invalid_argument("SphInterpolator: Field isn't a column of the store");
+    size_t num_particles = tree_.size();
+    size_t num_blocks    = (num_particles + kSphBlockSize - 1) / kSphBlockSize;
+    const float *p_field = field.data();
+    std::vector<double> weights(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kSphBlockSize, num_particles);
+        for (size_t ipart = iblock * kSphBlockSize; ipart < last; ++ipart)
+            weights[ipart] = volumes_[ipart] * p_field[tree_.order_[ipart]];
+    });
+    return weights;
+}
+
+// Returns sum_j weights_j W(r_j, h_j) at each of [points], where r_j is the distance of particle j
+// from the point and [weights] are in tree order
+std::vector<double> SphInterpolator::ScatterAtPoints_(const std::vector<double> &weights,
+                                                      const std::vector<PosCoordsType> &points,
+                                                      ThreadPool &pool) const {
+    const std::vector<KdTree::NodeType> &nodes = tree_.nodes_;
+    size_t num_points = points.size();
+    size_t num_blocks = (num_points + kSphBlockSize - 1) / kSphBlockSize;
+    std::vector<double> sums(num_points, 0);
+    if (nodes.empty())
+        return sums;
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        std::vector<size_t> stack;
+        size_t last = std::min((iblock + 1) * kSphBlockSize, num_points);
+        for (size_t ipoint = iblock * kSphBlockSize; ipoint < last; ++ipoint) {
+            PosCoordsType point = tree_.WrapCentre_(points[ipoint]);
+            double sum = 0;
+            stack.assign(1, 0);
+            while (!stack.empty()) {
+                size_t inode = stack.back();
+                stack.pop_back();
+                const KdTree::NodeType &node = nodes[inode];
+                LengthType node_smoothing_length = node_smoothing_lengths_[inode];
+                if (tree_.GetMinDistanceSquared_(node, point) >=
+                    node_smoothing_length * node_smoothing_length)
+                    continue;
+                if (node.child != 0) {
+                    stack.push_back(node.child + 1);
+                    stack.push_back(node.child);
+                    continue;
+                }
+                for (size_t jpart = node.first; jpart < node.first + node.count; ++jpart) {
+                    LengthType smoothing_length = smoothing_lengths_[jpart];
+                    LengthType distance_squared = tree_.GetDistanceSquared_(jpart, point);
+                    if (distance_squared >= smoothing_length * smoothing_length)
+                        continue;
+                    double q = std::sqrt(distance_squared) / smoothing_length;
+                    sum += weights[jpart] * EvaluateSphKernel(kernel_, q) /
+                           GetKernelVolume(smoothing_length);
+                }
+            }
+            sums[ipoint] = sum;
+        }
+    });
+    return sums;
+}
+
+// Returns values in tree order rearranged to be indexed like the store
+std::vector<double> SphInterpolator::ToStoreOrder_(const std::vector<double> &values,
+                                                   ThreadPool &pool) const {
+    size_t num_particles = values.size();
+    size_t num_blocks    = (num_particles + kSphBlockSize - 1) / kSphBlockSize;
+    std::vector<double> store_values(num_particles);
+    pool.ParallelFor(num_blocks, [&](size_t iblock, int) {
+        size_t last = std::min((iblock + 1) * kSphBlockSize, num_particles);
+        for (size_t ipart = iblock * kSphBlockSize; ipart < last; ++ipart)
+            store_values[tree_.order_[ipart]] = values[ipart];
+    });
+    return store_values;
+}
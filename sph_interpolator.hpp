@@ -0,0 +1,61 @@
+// Interface for the SphInterpolator class
+
+#ifndef sph_interpolator_hpp
+#define sph_interpolator_hpp
+#include <cstddef>
+#include <vector>
+
+#include "column.hpp"
+#include "globals.hpp"
+#include "kd_tree.hpp"
+#include "particle_store.hpp"
+#include "sph_kernel.hpp"
+#include "thread_pool.hpp"
+
+// SPH estimates of the density of a store of gas particles, and of kernel-smoothed fields such as
+// temperature or metallicity, using each particle's smoothing length.  At the particles themselves
+// the estimates gather from the neighbours within the particle's own smoothing length:
+// density_i = sum_j m_j W(r_ij, h_i) and field_i = sum_j (m_j / density_j) field_j W(r_ij, h_i).
+// At other points they scatter from the particles whose smoothing spheres hold the point, using
+// h_j.  Neighbours are found with a k-d tree of the store, whose nodes are given the largest
+// smoothing length of their particles so that whole nodes are pruned.  The particles of each leaf
+// share one list of candidate neighbours, over which the kernel is summed in a tight loop.  The
+// densities at the particles are computed on construction, since every smoothed field needs them.
+// Leaves (and points) are shared out between threads, and results are returned indexed like the
+// store (or like the list of points), identical for any number of threads.  Particles without a
+// positive smoothing length contribute nothing.  The store and tree must outlive the
+// SphInterpolator.
+// Usage: SphInterpolator sph(simulation.gas, tree); sph.SmoothField(simulation.gas.temperature)
+class SphInterpolator {
+public:
+    SphInterpolator(const GasStore &gas, const KdTree &tree,
+                    SphKernelType kernel = CUBIC_SPLINE_KERNEL,
+                    ThreadPool &pool = ThreadPool::GetShared());
+    std::vector<double> GetDensities() const;
+    std::vector<double> GetDensitiesAt(const std::vector<PosCoordsType> &points,
+                                       ThreadPool &pool = ThreadPool::GetShared()) const;
+    SphKernelType GetKernel() const { return kernel_; }
+    std::vector<double> SmoothField(const Column<float> &field,
+                                    ThreadPool &pool = ThreadPool::GetShared()) const;
+    std::vector<double> SmoothFieldAt(const Column<float> &field,
+                                      const std::vector<PosCoordsType> &points,
+                                      ThreadPool &pool = ThreadPool::GetShared()) const;
+private:
+    SphInterpolator();
+    std::vector<double> GatherAtParticles_(const std::vector<double> &weights,
+                                           ThreadPool &pool) const;
+    std::vector<double> GetFieldWeights_(const Column<float> &field, ThreadPool &pool) const;
+    std::vector<double> ScatterAtPoints_(const std::vector<double> &weights,
+                                         const std::vector<PosCoordsType> &points,
+                                         ThreadPool &pool) const;
+    std::vector<double> ToStoreOrder_(const std::vector<double> &values, ThreadPool &pool) const;
+    std::vector<double> densities_;                   // In tree order
+    SphKernelType kernel_;
+    std::vector<double> masses_;                      // In tree order
+    std::vector<LengthType> node_smoothing_lengths_;  // Largest smoothing length in each node
+    std::vector<LengthType> smoothing_lengths_;       // In tree order
+    const KdTree &tree_;
+    std::vector<double> volumes_;                     // Mass / density, in tree order
+};
+
+#endif // sph_interpolator_hpp
@@ -0,0 +1,53 @@
+// Defines the smoothing kernels used to interpolate gas properties (see SphInterpolator)
+
+#ifndef sph_kernel_hpp
+#define sph_kernel_hpp
+#include <cmath>
+
+#include "globals.hpp"
+
+enum SphKernelType {
+    CUBIC_SPLINE_KERNEL, // M4 cubic spline (Monaghan & Lattanzio 1985), as used by Gadget
+    WENDLAND_C2_KERNEL   // Wendland C2 (Dehnen & Aly 2012), which resists pairing instabilities
+};
+
+// Returns W(r, h) * h^kNDims for q = r / h.  As in Gadget, the smoothing length h is the radius at
+// which the kernel reaches zero, so W is zero for q >= 1, and it's normalised to integrate to 1.
+inline double EvaluateSphKernel(SphKernelType kernel, double q) {
+    if (q >= 1)
+        return 0;
+    double one_minus_q = 1 - q;
+    switch (kernel) {
+        case CUBIC_SPLINE_KERNEL: {
+            const double kNorm = (kNDims == 3) ? 8 / M_PI : 40 / (7 * M_PI);
+            if (q < 0.5)
+                return kNorm * (1 - 6 * q * q * one_minus_q);
+            return kNorm * 2 * one_minus_q * one_minus_q * one_minus_q;
+        }
+        case WENDLAND_C2_KERNEL: {
+            const double kNorm = (kNDims == 3) ? 21 / (2 * M_PI) : 7 / M_PI;
+            double one_minus_q_squared = one_minus_q * one_minus_q;
+            return kNorm * one_minus_q_squared * one_minus_q_squared * (1 + 4 * q);
+        }
+    }
+    return 0;
+}
+
+// Returns the integral of W(r, h) * h^kNDims along a line passing q = b / h from the centre of the
+// kernel (in units of h), i.e. the kernel's column through it times h^(kNDims - 1), by Simpson's
+// rule with [num_steps] (even) intervals over each half of the chord
+inline double IntegrateSphKernelAlongLine(SphKernelType kernel, double q_squared,
+                                          int num_steps = 256) {
+    if (q_squared >= 1)
+        return 0;
+    double step = std::sqrt(1 - q_squared) / num_steps;
+    double sum  = 0;
+    for (int istep = 0; istep <= num_steps; ++istep) {
+        double z      = istep * step;
+        double weight = (istep == 0 || istep == num_steps) ? 1 : (istep % 2 == 1) ? 4 : 2;
+        sum += weight * EvaluateSphKernel(kernel, std::sqrt(q_squared + z * z));
+    }
+    return 2 * sum * step / 3;
+}
+
+#endif // sph_kernel_hpp
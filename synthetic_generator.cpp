@@ -0,0 +1,284 @@
+// Implementation of the SyntheticGenerator class
+
+#include "synthetic_generator.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "counter_rng.hpp"
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Particles are generated in chunks of this size, one chunk per thread pool task
+const size_t kGeneratorChunkSize = 16384;
+
+// Halo and disc properties, with sizes in units of the box size and velocities in km/s
+const double kHostVirialRadius       = 0.3;
+const double kHostConcentration      = 10;
+const double kHostVirialVelocity     = 200;
+const double kDiscScaleLength        = 0.03;
+const double kDiscScaleHeight        = 0.003;
+const double kDiscRotationVelocity   = 200;
+const double kDiscVelocityDispersion = 20;
+const int kNumSubhalos               = 64;
+const double kSubhaloFraction        = 0.2;
+const double kSubhaloConcentration   = 15;
+
+// Enclosed mass of an NFW halo within x scale radii, in units of 4 pi rho_s r_s^3
+static double NfwMass(double x) {
+    return std::log1p(x) - x / (1 + x);
+}
+
+// Principal branch of the Lambert W function, W(z) exp(W(z)) = z, for -1/e <= z < 0 (Halley's
+// method, starting from the series about the branch point)
+static double LambertW0(double z) {
+    double p = std::sqrt(std::max(0.0, 2 * (M_E * z + 1)));
+    double w = -1 + p - p * p / 3 + 11. / 72 * p * p * p;
+    if (p < 1e-6)
+        return w;
+    if (z > -0.25)
+        w = z * (1 - z);
+    for (int iiter = 0; iiter < 20; ++iiter) {
+        double exp_w = std::exp(w);
+        double error = w * exp_w - z;
+        double step  = error / (exp_w * (w + 1) - (w + 2) * error / (2 * (w + 1)));
+        w -= step;
+        if (std::abs(step) < 1e-14 * (1 + std::abs(w)))
+            break;
+    }
+    return w;
+}
+
+// Radius (in scale radii) enclosing a fraction [mass_fraction] of the mass of an NFW halo truncated
+// at [concentration] scale radii: the exact inverse of the enclosed mass (Robotham & Howlett 2018)
+static double SampleNfwRadius(double mass_fraction, double concentration) {
+    double w = LambertW0(-std::exp(-1 - mass_fraction * NfwMass(concentration)));
+    return -1 - 1 / w;
+}
+
+// Unit vector in a random direction
+static std::array<double,3> RandomDirection(CounterRng &rng) {
+    double cos_theta = rng.Uniform(-1, 1);
+    double sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+    double phi       = rng.Uniform(0, 2 * M_PI);
+    return {sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta};
+}
+
+SyntheticGenerator::SyntheticGenerator(SyntheticDistribution distribution, LengthType box_size,
+                                       uint64_t seed) :
+box_size_(box_size), distribution_(distribution), pool_(&ThreadPool::GetShared()), seed_(seed) {
+    host_.centre          = {box_size / 2, box_size / 2, box_size / 2};
+    host_.velocity        = {0, 0, 0};
+    host_.virial_radius   = kHostVirialRadius * box_size;
+    host_.concentration   = kHostConcentration;
+    host_.virial_velocity = kHostVirialVelocity;
+    if (distribution_ == CLUMPY_HALO)
+        SetupSubhalos_();
+}
+
+// Converts a distribution name ("uniform", "nfw", "disc" or "clumpy") to a SyntheticDistribution
+SyntheticDistribution SyntheticGenerator::ParseDistribution(std::string name) {
+    if (name == "uniform")
+        return UNIFORM_BOX;
+    if (name == "nfw")
+        return NFW_HALO;
+    if (name == "disc")
+        return EXPONENTIAL_DISC;
+    if (name == "clumpy")
+        return CLUMPY_HALO;
+    throw std::invalid_argument("SyntheticGenerator: Unknown distribution '" + name + "'");
+}
+
+void SyntheticGenerator::SetThreadPool(ThreadPool &pool) {
+    pool_ = &pool;
+}
+
+// Places the subhaloes within the host halo.  Subhalo k holds a share of the substructure mass
+// proportional to 1 / (k + 1), and its size and velocity scale with the cube root of its mass.
+void SyntheticGenerator::SetupSubhalos_() {
+    double total_weight = 0;
+    for (int isub = 0; isub < kNumSubhalos; ++isub)
+        total_weight += 1. / (isub + 1);
+    double cumulative_weight = 0;
+    for (int isub = 0; isub < kNumSubhalos; ++isub) {
+        double mass_fraction = kSubhaloFraction * (1. / (isub + 1)) / total_weight;
+        double size_scale    = std::cbrt(mass_fraction);
+        CounterRng rng(seed_, isub, (ALL_TYPE_IDX << 8) | SUBHALO_SUBSTREAM);
+        HaloType subhalo;
+        DrawHaloParticle_(rng, host_, subhalo.centre, subhalo.velocity);
+        subhalo.virial_radius   = host_.virial_radius * size_scale;
+        subhalo.concentration   = kSubhaloConcentration;
+        subhalo.virial_velocity = host_.virial_velocity * size_scale;
+        subhalos_.push_back(subhalo);
+        cumulative_weight += 1. / (isub + 1);
+        subhalo_cumulative_weights_.push_back(cumulative_weight / total_weight);
+    }
+}
+
+// Draws a position from the NFW profile of [halo], and a velocity from an isotropic Gaussian with
+// the local circular velocity as its 3D dispersion
+void SyntheticGenerator::DrawHaloParticle_(CounterRng &rng, const HaloType &halo,
+                                           std::array<double,3> &position,
+                                           std::array<double,3> &velocity) const {
+    double scale_radius = halo.virial_radius / halo.concentration;
+    double x            = SampleNfwRadius(rng.Uniform(), halo.concentration);
+    std::array<double,3> direction = RandomDirection(rng);
+    double circular_velocity = 0;
+    if (x > 0) {
+        double mass_ratio = NfwMass(x) / NfwMass(halo.concentration);
+        circular_velocity = halo.virial_velocity * std::sqrt(mass_ratio * halo.concentration / x);
+    }
+    double dispersion = circular_velocity / std::sqrt(3.);
+    for (int idim = 0; idim < 3; ++idim) {
+        position[idim] = halo.centre[idim] + x * scale_radius * direction[idim];
+        velocity[idim] = halo.velocity[idim] + dispersion * rng.Normal();
+    }
+}
+
+// Draws a position from a disc with an exponential radial profile and an isothermal (sech^2)
+// vertical profile, and a velocity from its rotation curve plus an isotropic dispersion
+void SyntheticGenerator::DrawDiscParticle_(CounterRng &rng, std::array<double,3> &position,
+                                           std::array<double,3> &velocity) const {
+    double scale_length = kDiscScaleLength * box_size_;
+    // The radius of a particle in a disc with surface density ~ exp(-R / R_d) has a Gamma(2, R_d)
+    // distribution, i.e. the sum of two exponential deviates
+    double radius   = -scale_length * std::log((1 - rng.Uniform()) * (1 - rng.Uniform()));
+    double phi      = rng.Uniform(0, 2 * M_PI);
+    double height   = kDiscScaleHeight * box_size_ * std::atanh(rng.Uniform(-1, 1));
+    double rotation = kDiscRotationVelocity * (1 - std::exp(-radius / scale_length));
+    position = {host_.centre[0] + radius * std::cos(phi), host_.centre[1] + radius * std::sin(phi),
+                host_.centre[2] + height};
+    velocity = {-rotation * std::sin(phi), rotation * std::cos(phi), 0};
+    for (int idim = 0; idim < 3; ++idim)
+        velocity[idim] += kDiscVelocityDispersion * rng.Normal();
+}
+
+// Draws a 3D position (wrapped into the periodic box) and velocity for a particle of [type]
+void SyntheticGenerator::DrawPhaseSpace_(CounterRng &rng, ParticleTypeIndex type,
+                                         std::array<double,3> &position,
+                                         std::array<double,3> &velocity) const {
+    const VelocityType kVelocityRange[2] = {0.0, 100.0};
+    switch (distribution_) {
+        case UNIFORM_BOX:
+            for (int idim = 0; idim < 3; ++idim) {
+                position[idim] = rng.Uniform(0, box_size_);
+                velocity[idim] = rng.Uniform(kVelocityRange[0], kVelocityRange[1]);
+            }
+            break;
+        case NFW_HALO:
+            DrawHaloParticle_(rng, host_, position, velocity);
+            break;
+        case EXPONENTIAL_DISC:
+            if (type == DM_TYPE_IDX)
+                DrawHaloParticle_(rng, host_, position, velocity);
+            else
+                DrawDiscParticle_(rng, position, velocity);
+            break;
+        case CLUMPY_HALO: {
+            double select = rng.Uniform();
+            if (select < kSubhaloFraction) {
+                size_t isub = std::upper_bound(subhalo_cumulative_weights_.begin(),
+                                               subhalo_cumulative_weights_.end(),
+                                               select / kSubhaloFraction) -
+                              subhalo_cumulative_weights_.begin();
+                DrawHaloParticle_(rng, subhalos_[std::min<size_t>(isub, kNumSubhalos - 1)],
+                                  position, velocity);
+            } else {
+                DrawHaloParticle_(rng, host_, position, velocity);
+            }
+            break;
+        }
+    }
+    for (int idim = 0; idim < 3; ++idim)
+        position[idim] -= box_size_ * std::floor(position[idim] / box_size_);
+}
+
+// Calls function(index, rng) for particles [first, first + n) of [type] in parallel, with index
+// counted from [first] and rng the particle's own stream for [substream]
+template <typename FunctionType>
+void SyntheticGenerator::ForEachParticle_(ParticleTypeIndex type, SubstreamType substream,
+                                          size_t first, size_t n, const FunctionType &function) {
+    size_t num_chunks = (n + kGeneratorChunkSize - 1) / kGeneratorChunkSize;
+    pool_->ParallelFor(num_chunks, [&](size_t ichunk, int) {
+        size_t end = std::min(n, (ichunk + 1) * kGeneratorChunkSize);
+        for (size_t ipart = ichunk * kGeneratorChunkSize; ipart < end; ++ipart) {
+            CounterRng rng(seed_, first + ipart, (type << 8) | substream);
+            function(ipart, rng);
+        }
+    });
+}
+
+// Resizes the store to [n] particles and sets the ID, mass, position and velocity of each
+void SyntheticGenerator::FillParticleFields_(ParticleTypeIndex type, ParticleStore &particles,
+                                             IdType first_id, size_t first, size_t n) {
+    const MassType kMassRange[2] = {0.0, 1.0};
+    particles.resize(n);
+    IdType *ids       = particles.id.data();
+    MassType *masses  = particles.mass.data();
+    std::array<LengthType *,kNDims> positions;
+    std::array<VelocityType *,kNDims> velocities;
+    for (int idim = 0; idim < kNDims; ++idim) {
+        positions[idim]  = particles.position[idim].data();
+        velocities[idim] = particles.velocity[idim].data();
+    }
+    ForEachParticle_(type, PHASE_SPACE_SUBSTREAM, first, n, [&](size_t ipart, CounterRng &rng) {
+        std::array<double,3> position, velocity;
+        ids[ipart]    = first_id + first + ipart;
+        masses[ipart] = rng.Uniform(kMassRange[0], kMassRange[1]);
+        DrawPhaseSpace_(rng, type, position, velocity);
+        for (int idim = 0; idim < kNDims; ++idim) {
+            positions[idim][ipart]  = position[idim];
+            velocities[idim][ipart] = velocity[idim];
+        }
+    });
+}
+
+void SyntheticGenerator::FillBaryonFields_(ParticleTypeIndex type, BaryonicStore &particles,
+                                           size_t first, size_t n) {
+    const MetallicityType kMetallicityRange[2] = {-6.0, 2.0};
+    const AbundanceType kAbundanceRange[2]     = {0.0, 1.0};
+    MetallicityType *metallicities = particles.metallicity.data();
+    std::array<AbundanceType *,NUM_ELEMENTS> abundances;
+    for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+        abundances[ielem] = particles.abundances[ielem].data();
+    ForEachParticle_(type, BARYON_SUBSTREAM, first, n, [&](size_t ipart, CounterRng &rng) {
+        metallicities[ipart] = rng.Uniform(kMetallicityRange[0], kMetallicityRange[1]);
+        for (int ielem = 0; ielem < NUM_ELEMENTS; ++ielem)
+            abundances[ielem][ipart] = rng.Uniform(kAbundanceRange[0], kAbundanceRange[1]);
+    });
+}
+
+// Fills a dark matter store with [n] particles, with IDs starting from [first_id].  Given [first],
+// the store holds particles [first, first + n) of a larger set instead, with the same properties
+// and IDs they have there, so a large set can be generated a part at a time.
+void SyntheticGenerator::Fill(ParticleStore &particles, IdType first_id, size_t n, size_t first) {
+    FillParticleFields_(DM_TYPE_IDX, particles, first_id, first, n);
+}
+
+void SyntheticGenerator::Fill(GasStore &gas, IdType first_id, size_t n, size_t first) {
+    const LengthType kSmoothingLengthRange[2]  = {0.0, 0.1};
+    const TemperatureType kTemperatureRange[2] = {1.0e3, 1.0e9};
+    FillParticleFields_(GAS_TYPE_IDX, gas, first_id, first, n);
+    FillBaryonFields_(GAS_TYPE_IDX, gas, first, n);
+    LengthType *smoothing_lengths = gas.smoothing_length.data();
+    TemperatureType *temperatures = gas.temperature.data();
+    ForEachParticle_(GAS_TYPE_IDX, GAS_SUBSTREAM, first, n, [&](size_t ipart, CounterRng &rng) {
+        smoothing_lengths[ipart] = rng.Uniform(kSmoothingLengthRange[0], kSmoothingLengthRange[1]);
+        temperatures[ipart]      = rng.LogUniform(kTemperatureRange[0], kTemperatureRange[1]);
+    });
+}
+
+void SyntheticGenerator::Fill(StarStore &stars, IdType first_id, size_t n, size_t first) {
+    const AgeType kAgeRange[2] = {0, kAgeOfUniverseInGyr};
+    FillParticleFields_(STAR_TYPE_IDX, stars, first_id, first, n);
+    FillBaryonFields_(STAR_TYPE_IDX, stars, first, n);
+    AgeType *ages = stars.age.data();
+    ForEachParticle_(STAR_TYPE_IDX, STAR_SUBSTREAM, first, n, [&](size_t ipart, CounterRng &rng) {
+        ages[ipart] = rng.Uniform(kAgeRange[0], kAgeRange[1]);
+    });
+}
@@ -0,0 +1,74 @@
+// Interface for the SyntheticGenerator class
+
+#ifndef synthetic_generator_hpp
+#define synthetic_generator_hpp
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "counter_rng.hpp"
+#include "globals.hpp"
+#include "particle_store.hpp"
+#include "thread_pool.hpp"
+
+// Spatial distributions the generator can draw particles from
+enum SyntheticDistribution {
+    UNIFORM_BOX,      // uniform over the box, as in Particle::AssignRandomProperties()
+    NFW_HALO,         // all types in one NFW halo at the centre of the box
+    EXPONENTIAL_DISC, // gas and stars in an exponential disc (in the x-y plane) inside an NFW halo
+    CLUMPY_HALO       // an NFW halo with a fraction of its particles in NFW subhaloes
+};
+
+// Fills particle stores with synthetic data, for testing the analysis code at scale without real
+// snapshots.  Every property of particle i of a type is drawn from its own counter-based random
+// stream (see CounterRng), keyed by the seed, the particle type and i, so stores are filled in
+// parallel and the result is bit-identical whatever the number of threads.  Masses, metallicities,
+// abundances, smoothing lengths, temperatures and ages are drawn from the same ranges as the
+// particle classes' AssignRandomProperties().  Halo and disc sizes scale with the box size.
+// Usage: SyntheticGenerator(NFW_HALO, box_size, seed).Fill(gas, first_id, n_gas)
+class SyntheticGenerator {
+public:
+    SyntheticGenerator(SyntheticDistribution distribution, LengthType box_size, uint64_t seed);
+    static SyntheticDistribution ParseDistribution(std::string name);
+    void Fill(ParticleStore &particles, IdType first_id, size_t n, size_t first = 0);
+    void Fill(GasStore &gas, IdType first_id, size_t n, size_t first = 0);
+    void Fill(StarStore &stars, IdType first_id, size_t n, size_t first = 0);
+    void SetThreadPool(ThreadPool &pool);
+private:
+    // Groups of properties, each drawn from a separate substream
+    enum SubstreamType {PHASE_SPACE_SUBSTREAM, BARYON_SUBSTREAM, GAS_SUBSTREAM, STAR_SUBSTREAM,
+                        SUBHALO_SUBSTREAM};
+    struct HaloType {
+        std::array<double,3> centre;
+        std::array<double,3> velocity;
+        double virial_radius;
+        double concentration;
+        double virial_velocity;
+    };
+    SyntheticGenerator();
+    void DrawDiscParticle_(CounterRng &rng, std::array<double,3> &position,
+                           std::array<double,3> &velocity) const;
+    void DrawHaloParticle_(CounterRng &rng, const HaloType &halo, std::array<double,3> &position,
+                           std::array<double,3> &velocity) const;
+    void DrawPhaseSpace_(CounterRng &rng, ParticleTypeIndex type, std::array<double,3> &position,
+                         std::array<double,3> &velocity) const;
+    void FillBaryonFields_(ParticleTypeIndex type, BaryonicStore &particles, size_t first,
+                           size_t n);
+    void FillParticleFields_(ParticleTypeIndex type, ParticleStore &particles, IdType first_id,
+                             size_t first, size_t n);
+    template <typename FunctionType>
+    void ForEachParticle_(ParticleTypeIndex type, SubstreamType substream, size_t first, size_t n,
+                          const FunctionType &function);
+    void SetupSubhalos_();
+    LengthType box_size_;
+    SyntheticDistribution distribution_;
+    HaloType host_;
+    ThreadPool *pool_;
+    uint64_t seed_;
+    std::vector<HaloType> subhalos_;
+    std::vector<double> subhalo_cumulative_weights_;
+};
+
+#endif // synthetic_generator_hpp
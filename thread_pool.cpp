@@ -0,0 +1,140 @@
+// Implementation of the ThreadPool class
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+// True on threads that are currently running a ParallelFor() task
+static thread_local bool in_parallel_task = false;
+
+ThreadPool::ThreadPool(int num_threads) : num_threads_(1), task_(nullptr), num_tasks_(0),
+                                          next_task_(0), num_busy_workers_(0),
+                                          job_generation_(0), stopping_(false) {
+    StartWorkers_(num_threads);
+}
+
+ThreadPool::~ThreadPool() {
+    StopWorkers_();
+}
+
+// Returns the pool shared by the whole program, created on first use
+ThreadPool &ThreadPool::GetShared() {
+    static ThreadPool shared_pool(GetDefaultNumThreads());
+    return shared_pool;
+}
+
+// Number of threads used by the shared pool: $PARTICLE_SIM_THREADS if set, otherwise the number of
+// hardware threads
+int ThreadPool::GetDefaultNumThreads() {
+    const char *env_threads = std::getenv("PARTICLE_SIM_THREADS");
+    if (env_threads != nullptr && std::atoi(env_threads) > 0)
+        return std::atoi(env_threads);
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+int ThreadPool::GetNumThreads() const {
+    return num_threads_;
+}
+
+// Calls task(itask, ithread) for every itask in [0, num_tasks), where ithread in
+// [0, GetNumThreads()) identifies the thread running it (e.g. to index per-thread accumulators).
+// Returns when all tasks have finished.  If any task throws, the first exception is rethrown here
+// once the others have finished.
+void ThreadPool::ParallelFor(size_t num_tasks, const TaskType &task) {
+    if (num_tasks == 0)
+        return;
+    if (in_parallel_task || num_threads_ == 1 || num_tasks == 1) {
+        for (size_t itask = 0; itask < num_tasks; ++itask)
+            task(itask, 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> submit_lock(submit_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_             = &task;
+        num_tasks_        = num_tasks;
+        next_task_        = 0;
+        num_busy_workers_ = static_cast<int>(workers_.size());
+        first_exception_  = nullptr;
+        ++job_generation_;
+    }
+    job_ready_.notify_all();
+    RunTasks_(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_done_.wait(lock, [this]() { return num_busy_workers_ == 0; });
+    task_ = nullptr;
+    if (first_exception_)
+        std::rethrow_exception(first_exception_);
+}
+
+// Stops the workers and restarts the pool with a different number of threads
+void ThreadPool::SetNumThreads(int num_threads) {
+    std::lock_guard<std::mutex> submit_lock(submit_mutex_);
+    StopWorkers_();
+    StartWorkers_(num_threads);
+}
+
+// Claims and runs tasks of the current job until there are none left
+void ThreadPool::RunTasks_(int ithread) {
+    in_parallel_task = true;
+    for (size_t itask = next_task_++; itask < num_tasks_; itask = next_task_++) {
+        try {
+            (*task_)(itask, ithread);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!first_exception_)
+                first_exception_ = std::current_exception();
+        }
+    }
+    in_parallel_task = false;
+}
+
+void ThreadPool::StartWorkers_(int num_threads) {
+    if (num_threads < 1)
+        throw std::invalid_argument("ThreadPool: Number of threads must be at least 1");
+    stopping_    = false;
+    num_threads_ = num_threads;
+    for (int ithread = 1; ithread < num_threads; ++ithread)
+        workers_.push_back(std::thread(&ThreadPool::WorkerLoop_, this, ithread, job_generation_));
+}
+
+void ThreadPool::StopWorkers_() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    job_ready_.notify_all();
+    for (std::thread &worker : workers_)
+        worker.join();
+    workers_.clear();
+}
+
+// Waits for each new job, helps to run its tasks, then reports back.  [last_generation] is the job
+// generation when the worker was started, so that a job submitted before it first waits isn't
+// missed.
+void ThreadPool::WorkerLoop_(int ithread, unsigned long last_generation) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_ready_.wait(lock, [&]() {
+                return stopping_ || job_generation_ != last_generation;
+            });
+            if (stopping_)
+                return;
+            last_generation = job_generation_;
+        }
+        RunTasks_(ithread);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --num_busy_workers_;
+        }
+        job_done_.notify_all();
+    }
+}
@@ -0,0 +1,55 @@
+// Interface for the ThreadPool class
+
+#ifndef thread_pool_hpp
+#define thread_pool_hpp
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run the tasks of one ParallelFor() call at a time.  The thread
+// calling ParallelFor() takes part as thread 0, so a pool of N threads starts N - 1 workers.  Tasks
+// are handed out dynamically, one index at a time, so uneven tasks (e.g. snapshot files of
+// different sizes) balance themselves.  A ParallelFor() called from inside a task runs serially on
+// the calling thread rather than deadlocking.  Most code uses the process-wide pool returned by
+// GetShared().
+// Usage: ThreadPool(num_threads)
+class ThreadPool {
+public:
+    typedef std::function<void(size_t itask, int ithread)> TaskType;
+    ThreadPool(int num_threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    static ThreadPool &GetShared();
+    static int GetDefaultNumThreads();
+    int GetNumThreads() const;
+    void ParallelFor(size_t num_tasks, const TaskType &task);
+    void SetNumThreads(int num_threads);
+private:
+    ThreadPool();
+    void RunTasks_(int ithread);
+    void StartWorkers_(int num_threads);
+    void StopWorkers_();
+    void WorkerLoop_(int ithread, unsigned long last_generation);
+    std::condition_variable job_done_;
+    std::condition_variable job_ready_;
+    std::mutex mutex_;
+    std::mutex submit_mutex_;
+    std::vector<std::thread> workers_;
+    int num_threads_;
+    // State of the current ParallelFor() call
+    const TaskType *task_;
+    size_t num_tasks_;
+    std::atomic<size_t> next_task_;
+    int num_busy_workers_;
+    unsigned long job_generation_;
+    bool stopping_;
+    std::exception_ptr first_exception_;
+};
+
+#endif // thread_pool_hpp
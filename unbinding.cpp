@@ -0,0 +1,88 @@
+// Implementation of the unbinding functions
+
+#include "unbinding.hpp"
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "dynamics.hpp"
+#include "fof_groups.hpp"
+#include "globals.hpp"
+#include "gravity_tree.hpp"
+#include "kd_tree.hpp"
+#include "particle.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+Selection FindBoundParticles(const ParticleStore &particles, const Selection &members,
+                             LengthType softening, double gravitational_constant,
+                             double opening_angle, size_t min_num_particles, ThreadPool &pool) {
+    if (members.GetUniverseSize() != particles.size())
+        throw std::invalid_argument("FindBoundParticles: Members are of another store");
+    LengthType box_size         = particles.GetPeriodicBoxSize();
+    std::vector<size_t> indices = members.GetIndices();
+    while (!indices.empty() && indices.size() >= min_num_particles) {
+        ParticleStore group = particles.Subset(indices);
+        if (box_size > 0) {
+            for (int idim = 0; idim < kNDims; ++idim) {
+                LengthType *p_position = group.position[idim].data();
+                LengthType reference   = p_position[0];
+                for (size_t ipart = 0; ipart < group.size(); ++ipart)
+                    p_position[ipart] = reference +
+                                        GetPeriodicDisplacement(p_position[ipart] - reference,
+                                                                box_size);
+            }
+            group.SetPeriodicBoxSize(0);
+        }
+        KdTree tree(group, pool);
+        std::vector<double> potentials = GravityTree(group, tree, softening,
+                                                     gravitational_constant, opening_angle,
+                                                     pool).ComputePotentials(pool);
+        VelCoordsType bulk_velocity = ComputeDynamics(group, pool).bulk_velocity;
+
+        std::vector<size_t> bound_indices;
+        for (size_t ipart = 0; ipart < group.size(); ++ipart) {
+            double kinetic_energy = 0;
+            for (int idim = 0; idim < kNDims; ++idim) {
+                VelocityType velocity = group.velocity[idim][ipart] - bulk_velocity[idim];
+                kinetic_energy += velocity * velocity / 2;
+            }
+            if (kinetic_energy + potentials[ipart] < 0)
+                bound_indices.push_back(indices[ipart]);
+        }
+        if (bound_indices.size() == indices.size())
+            return Selection::FromIndices(indices, particles.size());
+        indices.swap(bound_indices);
+    }
+    return Selection::FromIndices(std::vector<size_t>(), particles.size());
+}
+
+std::vector<Selection> FindBoundParticles(const ParticleStore &particles, const FofGroups &groups,
+                                          LengthType softening, double gravitational_constant,
+                                          double opening_angle, size_t min_num_particles,
+                                          ThreadPool &pool) {
+    if (groups.size() != particles.size())
+        throw std::invalid_argument("FindBoundParticles: Groups are of another store");
+
+    // Groups are numbered from the largest, so the large ones come first.  The ParallelFor() calls
+    // made for each small group run serially on the thread unbinding it.
+    size_t num_groups       = groups.GetNumGroups();
+    size_t num_large_groups = 0;
+    while (num_large_groups < num_groups &&
+           groups.GetGroupSize(num_large_groups) >= kMinParallelUnbindSize)
+        ++num_large_groups;
+    std::vector<Selection> bound_particles(num_groups);
+    for (size_t igroup = 0; igroup < num_large_groups; ++igroup)
+        bound_particles[igroup] = FindBoundParticles(particles, groups.SelectGroup(igroup),
+                                                     softening, gravitational_constant,
+                                                     opening_angle, min_num_particles, pool);
+    pool.ParallelFor(num_groups - num_large_groups, [&](size_t itask, int) {
+        size_t igroup           = num_large_groups + itask;
+        bound_particles[igroup] = FindBoundParticles(particles, groups.SelectGroup(igroup),
+                                                     softening, gravitational_constant,
+                                                     opening_angle, min_num_particles, pool);
+    });
+    return bound_particles;
+}
@@ -0,0 +1,43 @@
+// Defines functions to remove the particles of a group (e.g. a friends-of-friends halo) which
+// aren't gravitationally bound to it
+
+#ifndef unbinding_hpp
+#define unbinding_hpp
+#include <cstddef>
+#include <vector>
+
+#include "fof_groups.hpp"
+#include "globals.hpp"
+#include "gravity_tree.hpp"
+#include "particle_store.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+
+// Groups with at least this many members are unbound one at a time, each using all the threads of
+// the pool, and smaller ones are unbound in parallel, one per thread
+const size_t kMinParallelUnbindSize = 16384;
+
+// Returns the [members] of a store which are bound to one another.  The potentials of the members
+// are found with a GravityTree (see there for [softening] and [opening_angle]), and those with a
+// positive energy (specific kinetic energy about the bulk velocity of the members, plus potential)
+// are removed.  This is repeated with the remaining members until none are removed, or fewer than
+// [min_num_particles] remain, in which case nothing is bound.  Positions are unwrapped around the
+// first member in a periodic store, so the group is treated as isolated.  Velocities are taken as
+// peculiar velocities in km/s, without a Hubble flow, so [gravitational_constant] must be in
+// (km/s)^2 times the length unit of the positions (and softening) per mass unit of the store, for
+// physical separations: Parameters::GetGravitationalConstant() gives it for the snapshot's units
+// (e.g. comoving kpc/h and 1e10 Msun/h for Gadget, at the output time's scale factor).
+Selection FindBoundParticles(const ParticleStore &particles, const Selection &members,
+                             LengthType softening, double gravitational_constant,
+                             double opening_angle = kDefaultOpeningAngle,
+                             size_t min_num_particles = kDefaultMinGroupSize,
+                             ThreadPool &pool = ThreadPool::GetShared());
+
+// Returns the bound particles of each of the friends-of-friends [groups] of a store, as above
+std::vector<Selection> FindBoundParticles(const ParticleStore &particles, const FofGroups &groups,
+                                          LengthType softening, double gravitational_constant,
+                                          double opening_angle = kDefaultOpeningAngle,
+                                          size_t min_num_particles = kDefaultMinGroupSize,
+                                          ThreadPool &pool = ThreadPool::GetShared());
+
+#endif // unbinding_hpp